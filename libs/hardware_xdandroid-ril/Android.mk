@@ -27,6 +27,12 @@ LOCAL_SRC_FILES:= \
     htcgeneric-ril.c \
     atchannel.c \
     misc.c \
+    ril_log.c \
+    ifwait.c \
+    rilloop.c \
+    ussd_stk.c \
+    rilstate.c \
+    ril_trace.c \
     at_tok.c \
     sms.c \
     sms_gsm.c \
@@ -67,3 +73,10 @@ else
   #build executable
   include $(BUILD_EXECUTABLE)
 endif
+
+# ril-trace: prints and compares traces recorded with persist.ril.trace.file
+include $(CLEAR_VARS)
+LOCAL_MODULE := ril-trace
+LOCAL_SRC_FILES := ril_trace_tool.c
+LOCAL_MODULE_TAGS := optional
+include $(BUILD_HOST_EXECUTABLE)
@@ -19,6 +19,7 @@
 #include <string.h>
 #include <ctype.h>
 #include <stdlib.h>
+#include <stdarg.h>
 
 /**
  * Starts tokenizing an AT response string
@@ -187,4 +188,240 @@ int at_tok_hasmore(char **p_cur)
     return ! (*p_cur == NULL || **p_cur == '\0');
 }
 
+/**
+ * Starts tokenizing an AT response string without modifying it
+ * returns -1 if this is not a valid response string, 0 on success.
+ * updates *p_cur with current position
+ */
+int at_tok_view_start(const char **p_cur)
+{
+    if (*p_cur == NULL) {
+        return -1;
+    }
+
+    *p_cur = strchr(*p_cur, ':');
+
+    if (*p_cur == NULL) {
+        return -1;
+    }
+
+    (*p_cur)++;
 
+    return 0;
+}
+
+/**
+ * Places a view of the next token in *p_out. Quotes around a string
+ * token are not part of the view.
+ * returns 0 on success and -1 if there are no more tokens
+ * updates *p_cur
+ */
+int at_tok_view_next(const char **p_cur, ATTokView *p_out)
+{
+    const char *p = *p_cur;
+    const char *end;
+
+    if (p == NULL) {
+        return -1;
+    }
+
+    while (*p != '\0' && isspace(*p)) {
+        p++;
+    }
+
+    if (*p == '"') {
+        p++;
+        end = strchr(p, '"');
+        if (end == NULL) {
+            /* unterminated string, take the rest of the line */
+            end = p + strlen(p);
+            *p_cur = NULL;
+        } else {
+            const char *next = strchr(end + 1, ',');
+            *p_cur = (next != NULL) ? next + 1 : end + 1 + strlen(end + 1);
+        }
+    } else {
+        end = strchr(p, ',');
+        if (end == NULL) {
+            end = p + strlen(p);
+            *p_cur = NULL;
+        } else {
+            *p_cur = end + 1;
+        }
+    }
+
+    if (p_out != NULL) {
+        p_out->str = p;
+        p_out->len = end - p;
+    }
+
+    return 0;
+}
+
+/** returns 1 on "has more tokens" and 0 if no */
+int at_tok_view_hasmore(const char **p_cur)
+{
+    return ! (*p_cur == NULL || **p_cur == '\0');
+}
+
+/**
+ * Converts a token view into an integer in the given base (10 or 16).
+ * Leading whitespace and a sign are accepted, parsing stops at the first
+ * character that is not a digit, like strtol does.
+ * returns 0 on success and -1 if the view holds no digits
+ */
+int at_tok_view_toint(const ATTokView *v, int base, int *p_out)
+{
+    const char *p = v->str;
+    const char *end = v->str + v->len;
+    unsigned int l = 0;
+    int neg = 0;
+    int digits = 0;
+
+    while (p < end && isspace(*p)) {
+        p++;
+    }
+
+    if (p < end && (*p == '-' || *p == '+')) {
+        neg = (*p == '-');
+        p++;
+    }
+
+    if (base == 16 && end - p > 2 && p[0] == '0'
+            && (p[1] == 'x' || p[1] == 'X') && isxdigit(p[2])) {
+        p += 2;
+    }
+
+    for ( ; p < end ; p++, digits++) {
+        int d;
+
+        if (*p >= '0' && *p <= '9') {
+            d = *p - '0';
+        } else if (base == 16 && *p >= 'a' && *p <= 'f') {
+            d = *p - 'a' + 10;
+        } else if (base == 16 && *p >= 'A' && *p <= 'F') {
+            d = *p - 'A' + 10;
+        } else {
+            break;
+        }
+
+        l = l * base + d;
+    }
+
+    if (digits == 0) {
+        return -1;
+    }
+
+    *p_out = neg ? -(int)l : (int)l;
+
+    return 0;
+}
+
+/** returns 1 if the view is exactly the string s, 0 otherwise */
+int at_tok_view_eq(const ATTokView *v, const char *s)
+{
+    return (int)strlen(s) == v->len && 0 == memcmp(v->str, s, v->len);
+}
+
+/**
+ * Copies a view into dst as a NUL terminated string, truncating it
+ * to dstlen - 1 bytes.
+ * returns the number of bytes copied (excluding the NUL), or -1 if
+ * the view did not fit
+ */
+int at_tok_view_copy(const ATTokView *v, char *dst, int dstlen)
+{
+    int len = v->len;
+    int ret = len;
+
+    if (dstlen <= 0) {
+        return -1;
+    }
+
+    if (len >= dstlen) {
+        len = dstlen - 1;
+        ret = -1;
+    }
+
+    memcpy(dst, v->str, len);
+    dst[len] = '\0';
+
+    return ret;
+}
+
+int at_tok_scan(const char *line, const char *fmt, ...)
+{
+    va_list ap;
+    const char *cur = line;
+    int optional = 0;
+    int count = 0;
+    int ret = 0;
+
+    if (at_tok_view_start(&cur) < 0) {
+        return -1;
+    }
+
+    va_start(ap, fmt);
+
+    for ( ; *fmt != '\0' ; fmt++) {
+        ATTokView v;
+        int i;
+
+        switch (*fmt) {
+            case ',':
+            case ' ':
+                continue;
+
+            case '[':
+                optional = 1;
+                continue;
+
+            default:
+                break;
+        }
+
+        if (!at_tok_view_hasmore(&cur) || at_tok_view_next(&cur, &v) < 0) {
+            ret = optional ? count : -1;
+            goto done;
+        }
+
+        switch (*fmt) {
+            case 'i':
+            case 'x':
+                if (at_tok_view_toint(&v, *fmt == 'x' ? 16 : 10, &i) < 0) {
+                    ret = -1;
+                    goto done;
+                }
+                *va_arg(ap, int *) = i;
+                break;
+
+            case 'b':
+                if (at_tok_view_toint(&v, 10, &i) < 0 || (i != 0 && i != 1)) {
+                    ret = -1;
+                    goto done;
+                }
+                *va_arg(ap, char *) = (char)i;
+                break;
+
+            case 's':
+                *va_arg(ap, ATTokView *) = v;
+                break;
+
+            case '_':
+                break;
+
+            default:
+                /* unknown conversion */
+                ret = -1;
+                goto done;
+        }
+
+        count++;
+    }
+
+    ret = count;
+
+done:
+    va_end(ap);
+    return ret;
+}
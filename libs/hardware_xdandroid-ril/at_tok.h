@@ -27,4 +27,46 @@ int at_tok_nextstr(char **p_cur, char **out);
 
 int at_tok_hasmore(char **p_cur);
 
+/**
+ * Non-mutating tokenizer
+ *
+ * The functions below never write to the line; string tokens are returned
+ * as views (pointer + length) into the original buffer, so a const line
+ * handed to an unsolicited handler can be parsed without strdup()ing it.
+ * A view is only valid as long as the line it points into.
+ */
+typedef struct {
+    const char *str;    /* start of token, not NUL terminated */
+    int len;            /* length of token in bytes */
+} ATTokView;
+
+int at_tok_view_start(const char **p_cur);
+int at_tok_view_next(const char **p_cur, ATTokView *p_out);
+int at_tok_view_hasmore(const char **p_cur);
+
+int at_tok_view_toint(const ATTokView *v, int base, int *p_out);
+int at_tok_view_eq(const ATTokView *v, const char *s);
+int at_tok_view_copy(const ATTokView *v, char *dst, int dstlen);
+
+/**
+ * Parses a whole response line in one pass.
+ *
+ * "fmt" holds one conversion per field:
+ *   'i'  int *       decimal integer
+ *   'x'  int *       hexadecimal integer
+ *   'b'  char *      boolean (0 or 1)
+ *   's'  ATTokView * string view
+ *   '_'  (none)      field is skipped
+ * ',' and ' ' in fmt are ignored and may be used for readability.
+ * A '[' marks the remaining fields as optional: parsing stops
+ * without error if the line runs out of tokens after that point.
+ *
+ * Like at_tok_start(), everything up to and including the first ':'
+ * is skipped.
+ *
+ * Returns the number of fields converted, or -1 if a mandatory field
+ * is missing or malformed.
+ */
+int at_tok_scan(const char *line, const char *fmt, ...);
+
 #endif /*AT_TOK_H */
@@ -28,8 +28,10 @@
 #include <sys/time.h>
 #include <time.h>
 #include <unistd.h>
+#include <termios.h>
+#include <sys/uio.h>
+#include <poll.h>
 
-#define LOG_NDEBUG 0
 #define LOG_TAG "AT"
 #include <utils/Log.h>
 
@@ -39,6 +41,9 @@
 #endif /*HAVE_ANDROID_OS*/
 
 #include "misc.h"
+#include "ril_log.h"
+#include "ril_trace.h"
+#include "rilloop.h"
 
 #ifdef HAVE_ANDROID_OS
 #define USE_NP 1
@@ -51,7 +56,10 @@
 #define HANDSHAKE_RETRY_COUNT 8
 #define HANDSHAKE_TIMEOUT_MSEC 250
 
-static pthread_t s_tid_reader;
+/* give up on the channel after this many timeouts in a row, even if
+   the handshake keeps answering */
+#define MAX_CONSECUTIVE_TIMEOUTS 3
+
 static int s_fd = -1;    /* fd of the AT channel */
 static ATUnsolHandler s_unsolHandler;
 
@@ -59,6 +67,8 @@ static ATUnsolHandler s_unsolHandler;
 
 static char s_ATBuffer[MAX_AT_RESPONSE+1];
 static char *s_ATBufferCur = s_ATBuffer;
+/* first line of an SMS unsolicited, until its PDU line arrives */
+static char *s_smsLine1;
 
 static int s_ackPowerIoctl; /* true if TTY has android byte-count
                                 handshake for low power*/
@@ -92,9 +102,41 @@ static void (*s_onTimeout)(void) = NULL;
 static void (*s_onReaderClosed)(void) = NULL;
 static int s_readerClosed;
 
+/* watchdog state, only touched on the command thread */
+static ATWatchdogStats s_watchdog;
+static int s_consecutiveTimeouts;
+
+/* Commands sent without an explicit timeout that can hang the modem for a
+   long time get one from this table, first matching prefix wins. Others
+   wait for s_defaultTimeoutMsec, forever unless at_set_default_timeout()
+   was called. */
+static long long s_defaultTimeoutMsec;
+static const struct {
+    const char *prefix;
+    long long timeoutMsec;
+} s_commandTimeouts[] = {
+    { "AT+COPS=?", 180000 },    /* network scan */
+    { "AT+COPS", 120000 },
+    { "ATD", 60000 },
+    { "AT+CMGS", 60000 },
+    { "AT+CMGW", 60000 },
+    { "AT+CUSD", 60000 },
+    { "AT+CGACT", 60000 },
+    { "AT+CFUN", 60000 },
+    { "AT+CLCK", 60000 },
+    { "AT+CCFC", 60000 },
+    { "AT+CCWA", 60000 },
+};
+
+/* protected by s_commandmutex */
+static ATWriteStats s_writeStats;
+static int s_smsSpeculative;
+static int s_smsPromptPending;  /* PDU already sent, "> " still to come */
+
 static void onReaderClosed();
 static int writeCtrlZ (const char *s);
 static int writeline (const char *s);
+static int writeCommandAndPDU (const char *command, const char *pdu);
 
 #ifndef USE_NP
 static void setTimespecRelative(struct timespec *p_ts, long long msec)
@@ -270,6 +312,9 @@ static void processLine(const char *line)
         // Commands like AT+CMGS have a "> " prompt
         writeCtrlZ(s_smsPDU);
         s_smsPDU = NULL;
+    } else if (s_smsPromptPending && 0 == strcmp(line, "> ")) {
+        /* the PDU went out with the command already */
+        s_smsPromptPending = 0;
     } else switch (s_type) {
         case NO_RESULT:
             handleUnsolicited(line);
@@ -334,101 +379,90 @@ static char * findNextEOL(char *cur)
 
 
 /**
- * Reads a line from the AT channel, returns NULL on timeout.
- * Assumes it has exclusive read access to the FD
+ * Returns the next complete line in the input buffer, or NULL if there
+ * is none yet; never reads
+ *
+ * This line is valid only until the next call to readChannel()
+ */
+static const char *nextLine()
+{
+    char *p_eol;
+    char *ret;
+
+    /* skip over leading newlines */
+    while (*s_ATBufferCur == '\r' || *s_ATBufferCur == '\n')
+        s_ATBufferCur++;
+
+    p_eol = findNextEOL(s_ATBufferCur);
+    if (p_eol == NULL) {
+        return NULL;
+    }
+
+    /* a full line in the buffer. Place a \0 over the \r and return */
+
+    ret = s_ATBufferCur;
+    if (*p_eol == '\0') {
+        /* the "> " prompt, which ends at the end of the buffer */
+        s_ATBufferCur = p_eol;
+    } else {
+        *p_eol = '\0';
+        s_ATBufferCur = p_eol + 1;
+    }
+
+    RLOGD(RLOG_AT, "AT< %s", ret);
+    RTRACE(RTRACE_AT_IN, 0, NULL, 0, 0, ret);
+    return ret;
+}
+
+/**
+ * Appends what the AT channel has to the input buffer, without blocking.
+ * Lines returned by nextLine() before are no longer valid.
  *
- * This line is valid only until the next call to readline
+ * returns the number of bytes read, 0 if there was nothing to read or
+ * -1 on EOF or error
  *
  * This function exists because as of writing, android libc does not
  * have buffered stdio.
  */
-
-static const char *readline()
+static int readChannel()
 {
+    size_t len;
     ssize_t count;
 
-    char *p_read = NULL;
-    char *p_eol = NULL;
-    char *ret;
+    /* move a partial line up */
+    len = strlen(s_ATBufferCur);
+    memmove(s_ATBuffer, s_ATBufferCur, len + 1);
+    s_ATBufferCur = s_ATBuffer;
 
-    /* this is a little odd. I use *s_ATBufferCur == 0 to
-     * mean "buffer consumed completely". If it points to a character, than
-     * the buffer continues until a \0
-     */
-    if (*s_ATBufferCur == '\0') {
-        /* empty buffer */
-        s_ATBufferCur = s_ATBuffer;
-        *s_ATBufferCur = '\0';
-        p_read = s_ATBuffer;
-    } else {   /* *s_ATBufferCur != '\0' */
-        /* there's data in the buffer from the last read */
-
-        // skip over leading newlines
-        while (*s_ATBufferCur == '\r' || *s_ATBufferCur == '\n')
-            s_ATBufferCur++;
-
-        p_eol = findNextEOL(s_ATBufferCur);
-
-        if (p_eol == NULL) {
-            /* a partial line. move it up and prepare to read more */
-            size_t len;
-
-            len = strlen(s_ATBufferCur);
-
-            memmove(s_ATBuffer, s_ATBufferCur, len + 1);
-            p_read = s_ATBuffer + len;
-            s_ATBufferCur = s_ATBuffer;
-        }
-        /* Otherwise, (p_eol !- NULL) there is a complete line  */
-        /* that will be returned the while () loop below        */
+    if (len == MAX_AT_RESPONSE) {
+        LOGE("ERROR: Input line exceeded buffer\n");
+        /* ditch buffer and start over again */
+        len = 0;
+        *s_ATBuffer = '\0';
     }
 
-    while (p_eol == NULL) {
-        if (0 == MAX_AT_RESPONSE - (p_read - s_ATBuffer)) {
-            LOGE("ERROR: Input line exceeded buffer\n");
-            /* ditch buffer and start over again */
-            s_ATBufferCur = s_ATBuffer;
-            *s_ATBufferCur = '\0';
-            p_read = s_ATBuffer;
-        }
-
-        do {
-            count = read(s_fd, p_read,
-                            MAX_AT_RESPONSE - (p_read - s_ATBuffer));
-        } while (count < 0 && errno == EINTR);
-
-        if (count > 0) {
-            AT_DUMP( "<< ", p_read, count );
-            s_readCount += count;
-
-            p_read[count] = '\0';
-
-            // skip over leading newlines
-            while (*s_ATBufferCur == '\r' || *s_ATBufferCur == '\n')
-                s_ATBufferCur++;
-
-            p_eol = findNextEOL(s_ATBufferCur);
-            p_read += count;
-        } else if (count <= 0) {
-            /* read error encountered or EOF reached */
-            if(count == 0) {
-                LOGD("atchannel: EOF reached");
-            } else {
-                LOGD("atchannel: read error %s", strerror(errno));
-            }
-            return NULL;
-        }
+    do {
+        count = read(s_fd, s_ATBuffer + len, MAX_AT_RESPONSE - len);
+    } while (count < 0 && errno == EINTR);
+
+    if (count > 0) {
+        AT_DUMP( "<< ", s_ATBuffer + len, count );
+        s_readCount += count;
+        s_ATBuffer[len + count] = '\0';
+        return count;
     }
 
-    /* a full line in the buffer. Place a \0 over the \r and return */
-
-    ret = s_ATBufferCur;
-    *p_eol = '\0';
-    s_ATBufferCur = p_eol + 1; /* this will always be <= p_read,    */
-                              /* and there will be a \0 at *p_read */
+    if (count < 0 && errno == EAGAIN) {
+        return 0;
+    }
 
-    LOGD("AT< %s\n", ret);
-    return ret;
+    /* read error encountered or EOF reached */
+    if(count == 0) {
+        LOGD("atchannel: EOF reached");
+    } else {
+        LOGD("atchannel: read error %s", strerror(errno));
+    }
+    return -1;
 }
 
 
@@ -448,140 +482,191 @@ static void onReaderClosed()
     }
 }
 
-
-static void *readerLoop(void *arg)
+/**
+ * Drops the AT channel fd and whatever was read from it.
+ * Runs on the loop thread; does nothing if the channel is not open.
+ */
+static void closeChannel(void *unused)
 {
-    for (;;) {
-        const char * line;
+    int fd = s_fd;
 
-        line = readline();
+    if (fd < 0) {
+        return;
+    }
 
-        if (line == NULL) {
-            break;
-        }
+    rilloop_del_fd(fd);
 
-        if(isSMSUnsolicited(line)) {
-            char *line1;
-            const char *line2;
+    pthread_mutex_lock(&s_commandmutex);
+    s_fd = -1;
+    pthread_mutex_unlock(&s_commandmutex);
 
-            // The scope of string returned by 'readline()' is valid only
-            // till next call to 'readline()' hence making a copy of line
-            // before calling readline again.
-            line1 = strdup(line);
-            line2 = readline();
+    close(fd);
 
-            if (line2 == NULL) {
-                break;
-            }
+    free(s_smsLine1);
+    s_smsLine1 = NULL;
+    s_ATBufferCur = s_ATBuffer;
+    *s_ATBufferCur = '\0';
+}
 
+/**
+ * Called on the loop thread when the AT channel is readable or hung up
+ */
+static void onChannelReadable(int fd, unsigned int events, void *arg)
+{
+    const char *line;
+    int count;
+
+    count = readChannel();
+
+    /* complete lines are handled even if the channel just closed */
+    while ((line = nextLine()) != NULL) {
+        if (s_smsLine1 != NULL) {
+            /* the PDU line of a TS 27.005 SMS unsolicited */
             if (s_unsolHandler != NULL) {
-                s_unsolHandler (line1, line2);
+                s_unsolHandler (s_smsLine1, line);
             }
-            free(line1);
+            free(s_smsLine1);
+            s_smsLine1 = NULL;
+        } else if (isSMSUnsolicited(line)) {
+            /* the line is only valid until the next read, which may
+             * come before its PDU does */
+            s_smsLine1 = strdup(line);
         } else {
             processLine(line);
         }
+    }
 
 #ifdef HAVE_ANDROID_OS
-        if (s_ackPowerIoctl > 0) {
-            /* acknowledge that bytes have been read and processed */
-            ioctl(s_fd, OMAP_CSMI_TTY_ACK, &s_readCount);
-            s_readCount = 0;
-        }
-#endif /*HAVE_ANDROID_OS*/
+    if (count > 0 && s_ackPowerIoctl > 0) {
+        /* acknowledge that bytes have been read and processed */
+        ioctl(s_fd, OMAP_CSMI_TTY_ACK, &s_readCount);
+        s_readCount = 0;
     }
+#endif /*HAVE_ANDROID_OS*/
 
-    onReaderClosed();
-
-    return NULL;
+    if (count < 0) {
+        closeChannel(NULL);
+        onReaderClosed();
+    }
 }
 
 /**
- * Sends string s to the radio with a \r appended.
+ * Writes the buffers in iov to the radio with a single writev(),
+ * looping only on partial writes.
  * Returns AT_ERROR_* on error, 0 on success
- *
- * This function exists because as of writing, android libc does not
- * have buffered stdio.
+ * assumes s_commandmutex is held
  */
-static int writeline (const char *s)
+static int writeIov (struct iovec *iov, int iovcnt)
 {
-    size_t cur = 0;
-    size_t len = strlen(s);
     ssize_t written;
-    char *w;
-    int ret = 0;
 
     if (s_fd < 0 || s_readerClosed > 0) {
         return AT_ERROR_CHANNEL_CLOSED;
     }
 
-    LOGD("AT> %s\n", s);
-
-    AT_DUMP( ">> ", s, len );
-
-    w = malloc(len+1);
-    if (!w)
-        return AT_ERROR_GENERIC;
-    strcpy(w, s);
-    w[len] = '\r';
-    len++;
-
-    /* the main string */
-    while (cur < len) {
+    while (iovcnt > 0) {
         do {
-            written = write (s_fd, w + cur, len - cur);
+            written = writev (s_fd, iov, iovcnt);
+            s_writeStats.syscalls++;
         } while (written < 0 && errno == EINTR);
 
+        if (written < 0 && errno == EAGAIN) {
+            /* the fd is non-blocking for the event loop */
+            struct pollfd pfd;
+
+            pfd.fd = s_fd;
+            pfd.events = POLLOUT;
+            poll(&pfd, 1, -1);
+            continue;
+        }
+
         if (written < 0) {
-            ret = AT_ERROR_GENERIC;
-            break;
+            return AT_ERROR_GENERIC;
         }
 
-        cur += written;
+        s_writeStats.bytes += written;
+
+        /* skip what went out, there normally is nothing left */
+        while (iovcnt > 0 && (size_t)written >= iov->iov_len) {
+            written -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + written;
+            iov->iov_len -= written;
+        }
     }
-    free(w);
 
-    return ret;
+    return 0;
 }
-static int writeCtrlZ (const char *s)
+
+/**
+ * Sends string s to the radio with a \r appended.
+ * Returns AT_ERROR_* on error, 0 on success
+ */
+static int writeline (const char *s)
 {
-    size_t cur = 0;
-    size_t len = strlen(s);
-    ssize_t written;
-    char *w;
-    int ret = 0;
+    struct iovec iov[2];
 
-    if (s_fd < 0 || s_readerClosed > 0) {
-        return AT_ERROR_CHANNEL_CLOSED;
-    }
+    RLOGD(RLOG_AT, "AT> %s", s);
+    RTRACE(RTRACE_AT_OUT, 0, NULL, 0, 0, s);
 
-    LOGD("AT> %s^Z\n", s);
+    AT_DUMP( ">> ", s, strlen(s) );
 
-    AT_DUMP( ">* ", s, len );
+    iov[0].iov_base = (void *)s;
+    iov[0].iov_len = strlen(s);
+    iov[1].iov_base = "\r";
+    iov[1].iov_len = 1;
 
-    w = malloc(len+1);
-    if (!w)
-        return AT_ERROR_GENERIC;
-    strcpy(w, s);
-    w[len] = '\032';
-    len++;
+    return writeIov(iov, 2);
+}
 
-    /* the main string */
-    while (cur < len) {
-        do {
-            written = write (s_fd, w + cur, len - cur);
-        } while (written < 0 && errno == EINTR);
+/**
+ * Sends SMS PDU s to the radio with a Ctrl-Z appended.
+ * Returns AT_ERROR_* on error, 0 on success
+ */
+static int writeCtrlZ (const char *s)
+{
+    struct iovec iov[2];
 
-        if (written < 0) {
-            ret = AT_ERROR_GENERIC;
-            break;
-        }
+    RLOGD(RLOG_AT, "AT> %s^Z", s);
+    RTRACE(RTRACE_AT_PDU, 0, NULL, 0, strlen(s), NULL);
 
-        cur += written;
-    }
-    free(w);
+    AT_DUMP( ">* ", s, strlen(s) );
 
-    return ret;
+    iov[0].iov_base = (void *)s;
+    iov[0].iov_len = strlen(s);
+    iov[1].iov_base = "\032";
+    iov[1].iov_len = 1;
+
+    return writeIov(iov, 2);
+}
+
+/**
+ * Sends command and its SMS PDU in one go, without waiting for the
+ * "> " prompt. Only for modems that buffer the PDU, see
+ * at_set_sms_speculative().
+ */
+static int writeCommandAndPDU (const char *command, const char *pdu)
+{
+    struct iovec iov[4];
+
+    RLOGD(RLOG_AT, "AT> %s", command);
+    RLOGD(RLOG_AT, "AT> %s^Z", pdu);
+    RTRACE(RTRACE_AT_OUT, 0, NULL, 0, 0, command);
+    RTRACE(RTRACE_AT_PDU, 0, NULL, 0, strlen(pdu), NULL);
+
+    iov[0].iov_base = (void *)command;
+    iov[0].iov_len = strlen(command);
+    iov[1].iov_base = "\r";
+    iov[1].iov_len = 1;
+    iov[2].iov_base = (void *)pdu;
+    iov[2].iov_len = strlen(pdu);
+    iov[3].iov_base = "\032";
+    iov[3].iov_len = 1;
+
+    return writeIov(iov, 4);
 }
 
 static void clearPendingCommand()
@@ -593,18 +678,20 @@ static void clearPendingCommand()
     sp_response = NULL;
     s_responsePrefix = NULL;
     s_smsPDU = NULL;
+    s_smsPromptPending = 0;
 }
 
 
 /**
- * Starts AT handler on stream "fd'
+ * Starts AT handler on stream "fd', on the event loop thread
  * returns 0 on success, -1 on error
  */
 int at_open(int fd, ATUnsolHandler h)
 {
     int ret;
-    pthread_t tid;
-    pthread_attr_t attr;
+
+    /* a close posted by at_close() may not have run yet */
+    closeChannel(NULL);
 
     s_fd = fd;
     s_unsolHandler = h;
@@ -648,28 +735,20 @@ int at_open(int fd, ATUnsolHandler h)
 #endif // OMAP_CSMI_POWER_CONTROL
 #endif /*HAVE_ANDROID_OS*/
 
-    pthread_attr_init (&attr);
-    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
-
-    ret = pthread_create(&s_tid_reader, &attr, readerLoop, &attr);
-
-    if (ret < 0) {
-        perror ("pthread_create");
+    ret = fcntl(fd, F_GETFL, 0);
+    if (ret < 0 || fcntl(fd, F_SETFL, ret | O_NONBLOCK) < 0
+            || rilloop_add_fd(fd, onChannelReadable, NULL) < 0) {
+        LOGE("atchannel: cannot watch fd %d", fd);
+        s_fd = -1;
         return -1;
     }
 
-
     return 0;
 }
 
-/* FIXME is it ok to call this from the reader and the command thread? */
+/* May be called on the loop thread or any other */
 void at_close()
 {
-    if (s_fd >= 0) {
-        close(s_fd);
-    }
-    s_fd = -1;
-
     pthread_mutex_lock(&s_commandmutex);
 
     s_readerClosed = 1;
@@ -678,7 +757,12 @@ void at_close()
 
     pthread_mutex_unlock(&s_commandmutex);
 
-    /* the reader thread should eventually die */
+    /* the loop owns the fd and the input buffer */
+    if (rilloop_on_loop_thread()) {
+        closeChannel(NULL);
+    } else if (rilloop_post(closeChannel, NULL) < 0) {
+        LOGE("atchannel: cannot post close");
+    }
 }
 
 static ATResponse * at_response_new()
@@ -751,12 +835,19 @@ static int at_send_command_full_nolock (const char *command, ATCommandType type,
     if (!strncmp(command, "ATD", 3))
         s_last_cme_error = CME_NO_ERROR;
 
-    err = writeline (command);
+    if (smspdu != NULL && s_smsSpeculative) {
+        err = writeCommandAndPDU (command, smspdu);
+        s_smsPromptPending = 1;
+        smspdu = NULL;
+    } else {
+        err = writeline (command);
+    }
 
     if (err < 0) {
         goto error;
     }
 
+    s_writeStats.commands++;
     s_type = type;
     s_responsePrefix = responsePrefix;
     s_smsPDU = smspdu;
@@ -805,7 +896,7 @@ error:
     clearPendingCommand();
 
     /* Have to save the error message right away */
-    if (pp_outResponse && !(*pp_outResponse)->success && !err && !strncmp(command, "ATD", 3)) {
+    if (!err && pp_outResponse && !(*pp_outResponse)->success && !strncmp(command, "ATD", 3)) {
         ATResponse *err_resp;
         err = at_send_command_full_nolock("AT+CEER", SINGLELINE, "+CEER:", NULL,
             timeoutMsec, &err_resp);
@@ -827,10 +918,94 @@ char *at_get_last_error()
     return res;
 }
 
+static long long commandTimeout(const char *command)
+{
+    size_t i;
+
+    for (i = 0 ; i < NUM_ELEMS(s_commandTimeouts) ; i++) {
+        if (strStartsWith(command, s_commandTimeouts[i].prefix)) {
+            return s_commandTimeouts[i].timeoutMsec;
+        }
+    }
+
+    return s_defaultTimeoutMsec;
+}
+
+void at_set_default_timeout(long long timeoutMsec)
+{
+    s_defaultTimeoutMsec = timeoutMsec;
+}
+
+/**
+ * Called on the command thread after a command timed out.
+ *
+ * The late final response of that command would otherwise be matched
+ * to the next one, so the stream is resynchronised in place: pending
+ * input is flushed and at_handshake() probes the modem and swallows
+ * whatever it still sends. Only if the modem doesn't answer, or keeps
+ * timing out, is the channel given up on through s_onTimeout.
+ */
+static void onCommandTimeout(const char *command)
+{
+    long long start = getMonotonicMsec();
+    long long elapsed;
+    int err;
+
+    s_watchdog.timeouts++;
+    s_consecutiveTimeouts++;
+    RLOGE(RLOG_AT, "AT> %s timed out", command);
+
+    if (s_consecutiveTimeouts < MAX_CONSECUTIVE_TIMEOUTS) {
+        if (s_fd >= 0) {
+            tcflush(s_fd, TCIFLUSH);
+        }
+
+        err = at_handshake();
+        elapsed = getMonotonicMsec() - start;
+
+        if (err == 0) {
+            s_watchdog.resyncs++;
+            s_watchdog.lastRecoveryMsec = elapsed;
+            if (elapsed > s_watchdog.maxRecoveryMsec) {
+                s_watchdog.maxRecoveryMsec = elapsed;
+            }
+            LOGI("AT channel resynced in %lld ms", elapsed);
+            return;
+        }
+    }
+
+    s_watchdog.escalations++;
+    LOGE("AT channel not responding (%d timeouts in a row)",
+            s_consecutiveTimeouts);
+    s_consecutiveTimeouts = 0;
+
+    if (s_onTimeout != NULL) {
+        s_onTimeout();
+    }
+}
+
+void at_get_watchdog_stats(ATWatchdogStats *p_out)
+{
+    *p_out = s_watchdog;
+}
+
+void at_get_write_stats(ATWriteStats *p_out)
+{
+    pthread_mutex_lock(&s_commandmutex);
+    *p_out = s_writeStats;
+    pthread_mutex_unlock(&s_commandmutex);
+}
+
+void at_set_sms_speculative(int enable)
+{
+    s_smsSpeculative = enable;
+}
+
 /**
  * Internal send_command implementation
  *
- * timeoutMsec == 0 means infinite timeout
+ * timeoutMsec == 0 means the default timeout for the command, see
+ * commandTimeout(); that may still be 0, an infinite timeout
  */
 static int at_send_command_full (const char *command, ATCommandType type,
                     const char *responsePrefix, const char *smspdu,
@@ -838,11 +1013,15 @@ static int at_send_command_full (const char *command, ATCommandType type,
 {
     int err;
 
-    if (0 != pthread_equal(s_tid_reader, pthread_self())) {
+    if (rilloop_on_loop_thread()) {
         /* cannot be called from reader thread */
         return AT_ERROR_INVALID_THREAD;
     }
 
+    if (timeoutMsec == 0) {
+        timeoutMsec = commandTimeout(command);
+    }
+
     pthread_mutex_lock(&s_commandmutex);
 
     err = at_send_command_full_nolock(command, type,
@@ -851,8 +1030,10 @@ static int at_send_command_full (const char *command, ATCommandType type,
 
     pthread_mutex_unlock(&s_commandmutex);
 
-    if (err == AT_ERROR_TIMEOUT && s_onTimeout != NULL) {
-        s_onTimeout();
+    if (err == AT_ERROR_TIMEOUT) {
+        onCommandTimeout(command);
+    } else if (err == 0) {
+        s_consecutiveTimeouts = 0;
     }
 
     return err;
@@ -1001,7 +1182,7 @@ int at_handshake()
     int i;
     int err = 0;
 
-    if (0 != pthread_equal(s_tid_reader, pthread_self())) {
+    if (rilloop_on_loop_thread()) {
         /* cannot be called from reader thread */
         return AT_ERROR_INVALID_THREAD;
     }
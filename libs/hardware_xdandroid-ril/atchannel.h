@@ -73,11 +73,15 @@ typedef struct {
  */
 typedef void (*ATUnsolHandler)(const char *s, const char *sms_pdu);
 
+/* The reader thread is the event loop thread (see rilloop.h): at_open()
+   must be called there, and makes fd non-blocking. at_close() may be
+   called on any thread, the fd is closed on the loop thread. */
 int at_open(int fd, ATUnsolHandler h);
 void at_close();
 
-/* This callback is invoked on the command thread.
-   You should reset or handshake here to avoid getting out of sync */
+/* This callback is invoked on the command thread when a command timed
+   out and the channel could not be resynchronised in place (see
+   onCommandTimeout() in atchannel.c). You should close and reopen it. */
 void at_set_on_timeout(void (*onTimeout)(void));
 /* This callback is invoked on the reader thread (like ATUnsolHandler)
    when the input stream closes before you call at_close
@@ -177,6 +181,35 @@ typedef enum {
 
 AT_CME_Error at_get_cme_error();
 
+/** AT channel watchdog counters, see at_get_watchdog_stats() */
+typedef struct {
+    unsigned int timeouts;      /* commands that timed out */
+    unsigned int resyncs;       /* timeouts recovered without reopening */
+    unsigned int escalations;   /* times on_timeout was invoked */
+    long long lastRecoveryMsec; /* duration of the last resync */
+    long long maxRecoveryMsec;
+} ATWatchdogStats;
+
+void at_get_watchdog_stats(ATWatchdogStats *p_out);
+
+/** AT channel write counters, see at_get_write_stats() */
+typedef struct {
+    unsigned int commands;      /* commands sent */
+    unsigned int syscalls;      /* writev() calls, PDUs included */
+    unsigned long long bytes;   /* bytes written */
+} ATWriteStats;
+
+void at_get_write_stats(ATWriteStats *p_out);
+
+/* Send the PDU of at_send_command_sms() together with the command
+   instead of waiting for the "> " prompt. Only for modems that buffer
+   input while they prepare the prompt. Off by default. */
+void at_set_sms_speculative(int enable);
+
+/* Timeout for commands sent with timeout 0 that have no entry of their
+   own in atchannel.c, 0 (the default) to wait forever */
+void at_set_default_timeout(long long timeoutMsec);
+
 #ifdef __cplusplus
 }
 #endif
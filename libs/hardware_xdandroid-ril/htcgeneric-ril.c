@@ -25,6 +25,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <fcntl.h>
 #include <pthread.h>
 #include <alloca.h>
@@ -32,13 +33,18 @@
 #include "at_tok.h"
 #include "misc.h"
 #include "gsm.h"
+#include "ril_log.h"
+#include "ifwait.h"
+#include "rilloop.h"
+#include "ussd_stk.h"
+#include "rilstate.h"
+#include "ril_trace.h"
 #include <getopt.h>
 #include <sys/socket.h>
 #include <cutils/sockets.h>
 #include <cutils/properties.h>
 #include <termios.h>
 
-#define LOG_NDEBUG 0
 #define LOG_TAG "RIL"
 #include <utils/Log.h>
 
@@ -127,16 +133,26 @@ static const RIL_RadioFunctions s_callbacks = {
 #ifdef RIL_SHLIB
 static const struct RIL_Env *s_rilenv;
 
-#define RIL_onRequestComplete(t, e, response, responselen) s_rilenv->OnRequestComplete(t,e, response, responselen)
-#define RIL_onUnsolicitedResponse(a,b,c) s_rilenv->OnUnsolicitedResponse(a,b,c)
+/* functions rather than macros, so the arguments are evaluated once */
+static inline void RIL_onRequestComplete(RIL_Token t, RIL_Errno e,
+		void *response, size_t responselen)
+{
+	RTRACE(RTRACE_COMPLETE, 0, t, e, responselen, NULL);
+	s_rilenv->OnRequestComplete(t, e, response, responselen);
+}
+
+static inline void RIL_onUnsolicitedResponse(int unsolResponse,
+		const void *data, size_t datalen)
+{
+	RTRACE(RTRACE_UNSOL, unsolResponse, NULL, 0, datalen, NULL);
+	s_rilenv->OnUnsolicitedResponse(unsolResponse, data, datalen);
+}
 #define RIL_requestTimedCallback(a,b,c) s_rilenv->RequestTimedCallback(a,b,c)
 #endif
 
-static RIL_RadioState sState = RADIO_STATE_UNAVAILABLE;
-
+/* Radio, SIM and data state live in rilstate.c; this only serializes
+ * setRadioState() */
 static pthread_mutex_t s_state_mutex = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t s_state_cond = PTHREAD_COND_INITIALIZER;
-static pthread_mutex_t s_data_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 static int slow_sim=0;
 static int s_port = -1;
@@ -144,8 +160,18 @@ static const char * s_device_path = NULL;
 static int          s_device_socket = 0;
 static const char *smd7 = "";
 
-/* trigger change to this with s_state_cond */
-static int s_closed = 0;
+/* close and reopen the AT channel when it stops answering */
+static int s_reopenOnTimeout;
+/* AT channel reopen backoff, doubled after every failed open */
+#define REOPEN_BACKOFF_MIN_MS	250
+#define REOPEN_BACKOFF_MAX_MS	30000
+/* fires openChannel() again after a failed open, loop thread only */
+static RilLoopTimer *s_reopenTimer;
+static long long s_reopenBackoff = REOPEN_BACKOFF_MIN_MS;
+
+static long long s_channelClosedAt;	/* monotonic ms, 0 if open */
+static unsigned int s_channelReopens;
+static long long s_lastReopenMsec;
 
 static int sFD;     /* file desc of AT channel */
 static char sATBuffer[MAX_AT_RESPONSE+1];
@@ -209,30 +235,23 @@ typedef enum {
 	Data_Connected,
 } Data_State;
 
-static Data_State data_state=Data_Off;
-
 static RIL_RadioState Radio_READY = RADIO_STATE_SIM_READY;
 static RIL_RadioState Radio_NOT_READY = RADIO_STATE_SIM_NOT_READY;
 
 static void handle_cdma_ccwa (const char *s)
 {
-	int err;
-	char *line, *tmp;
-
-	line = tmp = strdup(s);
+	ATTokView number;
+	char numbuf[64];
 	RIL_CDMA_CallWaiting resp;
-	err = at_tok_start(&tmp);
-	if (err)
-		goto out;
-	err = at_tok_nextstr(&tmp, &resp.number);
-	if (err)
-		goto out;
+
+	if (at_tok_scan(s, "s", &number) < 1)
+		return;
+	at_tok_view_copy(&number, numbuf, sizeof(numbuf));
+	resp.number = numbuf;
 	resp.numberPresentation = strcspn(resp.number, "+0123456789") != 0;
 	resp.name = NULL;
 	RIL_onUnsolicitedResponse ( RIL_UNSOL_CDMA_CALL_WAITING,
 			&resp, sizeof(resp));
-out:
-	free(line);
 }
 
 extern char** cdma_to_gsmpdu(const char *);
@@ -241,30 +260,6 @@ extern int hex2int(const char);
 extern void decode_cdma_sms_to_ril(char *pdu, RIL_CDMA_SMS_Message *msg);
 extern int encode_cdma_sms_from_ril(RIL_CDMA_SMS_Message *msg, char *buf, int buflen);
 
-static void HexStr_to_DecInt(char *strings, unsigned int *ints)
-{
-	int i = 0;
-	int j = strlen(strings);
-	int k = 0;
-	for(i = 0, k = 0; i < j; i += 2, k++)
-	{
-		printf("%d, %d\n", i, k);
-		if(strings[i] <= 57){
-			*(ints + k) += (unsigned int)((strings[i] - 48) * 16);
-		}
-		else{
-			*(ints+k) += (unsigned int)(((strings[i] - 97) + 10) * 16);
-		}
-
-		if(strings[i+1] <= 57){
-			*(ints+k) += (unsigned int)(strings[i+1] - 48);
-		}
-		else{
-			*(ints+k) += (unsigned int)((strings[i+1] - 97) + 10);
-		}
-	}
-}
-
 static int clccStateToRILState(int state, RIL_CallState *p_state)
 
 {
@@ -522,14 +517,14 @@ static void requestRadioPower(void *data, size_t datalen, RIL_Token t)
 	assert (datalen >= sizeof(int *));
 	onOff = ((int *)data)[0];
 
-	if (onOff == 0 && sState != RADIO_STATE_OFF) {
+	if (onOff == 0 && currentState() != RADIO_STATE_OFF) {
 		if((phone_has & MODE_GSM) || world_phone)
 			err = at_send_command("AT+CFUN=0", &p_response);
 		else
 			err = at_send_command("AT+CFUN=66", &p_response);
 		if (err < 0 || p_response->success == 0) goto error;
 		setRadioState(RADIO_STATE_OFF);
-	} else if (onOff > 0 && sState == RADIO_STATE_OFF) {
+	} else if (onOff > 0 && currentState() == RADIO_STATE_OFF) {
 		char value[PROPERTY_VALUE_MAX];
 		err = at_send_command("AT+CFUN=1", &p_response);
 		if (err < 0|| p_response->success == 0) {
@@ -567,78 +562,157 @@ error:
 	RIL_onRequestComplete(t, RIL_E_GENERIC_FAILURE, NULL, 0);
 }
 
-static void requestOrSendDataCallList(RIL_Token *t);
-
-static void onDataCallListChanged(void *param)
+/* Data context table. +CGEV events and the setup/teardown handlers
+ * update it in place; only events it can't account for make the next
+ * refresh query AT+CGACT?/AT+CGDCONT? again. Refreshes run on the
+ * request thread and are debounced, so a burst of events costs one
+ * query and at most one RIL_UNSOL_DATA_CALL_LIST_CHANGED.
+ */
+#define MAX_DATA_CALLS		4
+#define DATA_LIST_DEBOUNCE_MS	300
+
+typedef struct {
+	int cid;
+	int active;
+	char type[8];
+	char apn[64];
+	char address[40];
+} DataCallEntry;
+
+static struct {
+	int valid;		/* entries reflect the modem */
+	int stale;		/* an event needs a full query */
+	int scheduled;		/* a refresh is pending */
+	int count;
+	DataCallEntry entries[MAX_DATA_CALLS];
+	int reportedCount;	/* last list given to the framework */
+	DataCallEntry reported[MAX_DATA_CALLS];
+} s_dataCalls;
+static pthread_mutex_t s_datacalls_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned int s_dataListEvents;
+static unsigned int s_dataListQueries;
+static unsigned int s_dataListSent;
+
+static Data_State check_data();
+
+/* returns the entry for cid, adding it if create is set; lock held */
+static DataCallEntry *dataCallFind(int cid, int create)
 {
-	requestOrSendDataCallList(NULL);
-}
+	DataCallEntry *e;
+	int i;
 
-static void requestDataCallList(void *data, size_t datalen, RIL_Token t)
-{
-	requestOrSendDataCallList(&t);
+	for (i = 0; i < s_dataCalls.count; i++) {
+		if (s_dataCalls.entries[i].cid == cid)
+			return &s_dataCalls.entries[i];
+	}
+	if (!create || s_dataCalls.count >= MAX_DATA_CALLS)
+		return NULL;
+	e = &s_dataCalls.entries[s_dataCalls.count++];
+	memset(e, 0, sizeof(*e));
+	e->cid = cid;
+	return e;
 }
 
-static void requestOrSendDataCallList(RIL_Token *t)
+/* Runs the full query into entries, returns the number found or -1 */
+static int dataCallQuery(DataCallEntry *entries)
 {
-	ATResponse *p_response;
+	ATResponse *p_response = NULL;
 	ATLine *p_cur;
-	RIL_Data_Call_Response *responses;
-	int err;
-	char status[1];
-	int n = 0;
-	char *out;
+	DataCallEntry *e;
+	char *line, *out;
+	int err, cid, i, n = 0;
 
-	if (phone_is == MODE_GSM) {
-		err = at_send_command_multiline ("AT+CGACT?", "+CGACT:", &p_response);
-		if (err != 0 || p_response->success == 0) {
-			if (t != NULL)
-				RIL_onRequestComplete(*t, RIL_E_GENERIC_FAILURE, NULL, 0);
-			else
-				RIL_onUnsolicitedResponse(RIL_UNSOL_DATA_CALL_LIST_CHANGED,
-						NULL, 0);
-			return;
-		}
+	memset(entries, 0, MAX_DATA_CALLS * sizeof(DataCallEntry));
 
-		for (p_cur = p_response->p_intermediates; p_cur != NULL;
-				p_cur = p_cur->p_next)
-			n++;
+	if (phone_is != MODE_GSM) {
+		entries[0].cid = 1;
+		entries[0].active = dataCallNum() >= 0;
+		strcpy(entries[0].type, "IP");
+		strcpy(entries[0].apn, "internet");
+		return 1;
+	}
 
-		responses = alloca(n * sizeof(RIL_Data_Call_Response));
+	err = at_send_command_multiline ("AT+CGACT?", "+CGACT:", &p_response);
+	if (err != 0 || p_response->success == 0)
+		goto error;
 
-		int i;
-		for (i = 0; i < n; i++) {
-			responses[i].cid = -1;
-			responses[i].active = -1;
-			responses[i].type = "";
-			responses[i].apn = "";
-			responses[i].address = "";
-		}
+	for (p_cur = p_response->p_intermediates; p_cur != NULL
+			&& n < MAX_DATA_CALLS; p_cur = p_cur->p_next) {
+		line = p_cur->line;
+		e = &entries[n];
 
-		RIL_Data_Call_Response *response = responses;
-		for (p_cur = p_response->p_intermediates; p_cur != NULL;
-				p_cur = p_cur->p_next) {
-			char *line = p_cur->line;
+		if (at_tok_start(&line) < 0
+				|| at_tok_nextint(&line, &e->cid) < 0
+				|| at_tok_nextint(&line, &e->active) < 0)
+			goto error;
+		n++;
+	}
+	at_response_free(p_response);
 
-			err = at_tok_start(&line);
-			if (err < 0)
-				goto error;
+	err = at_send_command_multiline ("AT+CGDCONT?", "+CGDCONT:", &p_response);
+	if (err != 0 || p_response->success == 0)
+		goto error;
 
-			err = at_tok_nextint(&line, &response->cid);
-			if (err < 0)
-				goto error;
+	for (p_cur = p_response->p_intermediates; p_cur != NULL;
+			p_cur = p_cur->p_next) {
+		line = p_cur->line;
 
-			err = at_tok_nextint(&line, &response->active);
-			if (err < 0)
-				goto error;
+		if (at_tok_start(&line) < 0 || at_tok_nextint(&line, &cid) < 0)
+			goto error;
 
-			response++;
+		for (i = 0; i < n; i++) {
+			if (entries[i].cid == cid)
+				break;
+		}
+		if (i >= n) {
+			/* details for a context we didn't hear about in the last request */
+			continue;
 		}
 
-		at_response_free(p_response);
+		if (at_tok_nextstr(&line, &out) < 0)
+			goto error;
+		snprintf(entries[i].type, sizeof(entries[i].type), "%s", out);
+		if (at_tok_nextstr(&line, &out) < 0)
+			goto error;
+		snprintf(entries[i].apn, sizeof(entries[i].apn), "%s", out);
+		if (at_tok_nextstr(&line, &out) < 0)
+			goto error;
+		snprintf(entries[i].address, sizeof(entries[i].address), "%s", out);
+	}
+	at_response_free(p_response);
+	return n;
+
+error:
+	at_response_free(p_response);
+	return -1;
+}
+
+static void requestOrSendDataCallList(RIL_Token *t)
+{
+	DataCallEntry entries[MAX_DATA_CALLS];
+	RIL_Data_Call_Response responses[MAX_DATA_CALLS];
+	int query, n, i;
+
+	pthread_mutex_lock(&s_datacalls_mutex);
+	query = !s_dataCalls.valid || s_dataCalls.stale;
+	/* events arriving during the query mark it stale again */
+	s_dataCalls.stale = 0;
+	pthread_mutex_unlock(&s_datacalls_mutex);
+
+	if (query) {
+		n = dataCallQuery(entries);
+		s_dataListQueries++;
+
+		pthread_mutex_lock(&s_datacalls_mutex);
+		s_dataCalls.valid = n >= 0;
+		if (n >= 0) {
+			s_dataCalls.count = n;
+			memcpy(s_dataCalls.entries, entries, sizeof(entries));
+		}
+		pthread_mutex_unlock(&s_datacalls_mutex);
 
-		err = at_send_command_multiline ("AT+CGDCONT?", "+CGDCONT:", &p_response);
-		if (err != 0 || p_response->success == 0) {
+		if (n < 0) {
 			if (t != NULL)
 				RIL_onRequestComplete(*t, RIL_E_GENERIC_FAILURE, NULL, 0);
 			else
@@ -646,96 +720,152 @@ static void requestOrSendDataCallList(RIL_Token *t)
 						NULL, 0);
 			return;
 		}
+	}
 
-		for (p_cur = p_response->p_intermediates; p_cur != NULL;
-				p_cur = p_cur->p_next) {
-			char *line = p_cur->line;
-			int cid;
-			char *type;
-			char *apn;
-			char *address;
-
+	pthread_mutex_lock(&s_datacalls_mutex);
+	n = s_dataCalls.count;
+	memcpy(entries, s_dataCalls.entries, sizeof(entries));
+	pthread_mutex_unlock(&s_datacalls_mutex);
 
-			err = at_tok_start(&line);
-			if (err < 0)
-				goto error;
+	for (i = 0; i < n; i++) {
+		// make sure pppd is still running, invalidate datacall if it isn't
+		if (entries[i].cid == 1
+				&& (access(PPP_SYS_PATH, F_OK) || check_data() < Data_Connected))
+			entries[i].active = 0;
 
-			err = at_tok_nextint(&line, &cid);
-			if (err < 0)
-				goto error;
-
-			for (i = 0; i < n; i++) {
-				if (responses[i].cid == cid)
-					break;
-			}
+		responses[i].cid = entries[i].cid;
+		responses[i].active = entries[i].active;
+		responses[i].type = entries[i].type;
+		responses[i].apn = entries[i].apn;
+		responses[i].address = entries[i].address;
+	}
 
-			if (i >= n) {
-				/* details for a context we didn't hear about in the last request */
-				continue;
-			}
+	pthread_mutex_lock(&s_datacalls_mutex);
+	if (t == NULL && n == s_dataCalls.reportedCount
+			&& !memcmp(entries, s_dataCalls.reported, n * sizeof(DataCallEntry))) {
+		/* nothing the framework doesn't know already */
+		pthread_mutex_unlock(&s_datacalls_mutex);
+		return;
+	}
+	s_dataCalls.reportedCount = n;
+	memcpy(s_dataCalls.reported, entries, sizeof(entries));
+	pthread_mutex_unlock(&s_datacalls_mutex);
 
-			err = at_tok_nextstr(&line, &out);
-			if (err < 0)
-				goto error;
+	if (t != NULL) {
+		RIL_onRequestComplete(*t, RIL_E_SUCCESS, responses,
+				n * sizeof(RIL_Data_Call_Response));
+	} else {
+		s_dataListSent++;
+		RIL_onUnsolicitedResponse(RIL_UNSOL_DATA_CALL_LIST_CHANGED,
+				responses,
+				n * sizeof(RIL_Data_Call_Response));
+	}
+}
 
-			responses[i].type = alloca(strlen(out) + 1);
-			strcpy(responses[i].type, out);
+static void onDataCallListChanged(void *param)
+{
+	pthread_mutex_lock(&s_datacalls_mutex);
+	s_dataCalls.scheduled = 0;
+	pthread_mutex_unlock(&s_datacalls_mutex);
 
-			err = at_tok_nextstr(&line, &out);
-			if (err < 0)
-				goto error;
+	requestOrSendDataCallList(NULL);
+}
 
-			responses[i].apn = alloca(strlen(out) + 1);
-			strcpy(responses[i].apn, out);
+static void requestDataCallList(void *data, size_t datalen, RIL_Token t)
+{
+	requestOrSendDataCallList(&t);
+}
 
-			err = at_tok_nextstr(&line, &out);
-			if (err < 0)
-				goto error;
+/**
+ * Schedules a refresh of the data call list, folding it into one that
+ * is already pending. needQuery makes it re-read the modem's contexts.
+ * Called on any thread.
+ */
+static void scheduleDataCallListRefresh(int needQuery)
+{
+	static const struct timeval debounce = {0, DATA_LIST_DEBOUNCE_MS * 1000};
+	int scheduled;
+
+	pthread_mutex_lock(&s_datacalls_mutex);
+	s_dataListEvents++;
+	if (needQuery)
+		s_dataCalls.stale = 1;
+	scheduled = s_dataCalls.scheduled;
+	s_dataCalls.scheduled = 1;
+	pthread_mutex_unlock(&s_datacalls_mutex);
+
+	if (!scheduled)
+		RIL_requestTimedCallback (onDataCallListChanged, NULL, &debounce);
+}
 
-			responses[i].address = alloca(strlen(out) + 1);
-			strcpy(responses[i].address, out);
+/* Records the context set up or torn down by a request, request thread */
+static void dataCallUpdate(int cid, int active, const char *apn,
+		const char *address)
+{
+	DataCallEntry *e;
+
+	pthread_mutex_lock(&s_datacalls_mutex);
+	e = dataCallFind(cid, active && s_dataCalls.valid);
+	if (e != NULL) {
+		e->active = active;
+		if (active) {
+			/* keep the unused tails zeroed, the lists are memcmp()ed */
+			memset(e->type, 0, sizeof(e->type));
+			memset(e->apn, 0, sizeof(e->apn));
+			memset(e->address, 0, sizeof(e->address));
+			strcpy(e->type, "IP");
+			snprintf(e->apn, sizeof(e->apn), "%s", apn ? apn : "");
+			snprintf(e->address, sizeof(e->address), "%s", address);
 		}
-
-		at_response_free(p_response);
-
-	} else {
-		//CDMA
-		n = 1;
-		responses = alloca(sizeof(RIL_Data_Call_Response));
-
-		responses[0].cid = 1;
-		if (dataCallNum() >= 0)
-			responses[0].active = 1;
-		else
-			responses[0].active = 0;
-		responses[0].type = "IP";
-		responses[0].apn = "internet";
-		responses[0].address = "";
-	}
-
-	// make sure pppd is still running, invalidate datacall if it isn't
-	if (access(PPP_SYS_PATH, F_OK) || data_state < Data_Connected)
-	{
-		responses[0].active = 0;
 	}
+	pthread_mutex_unlock(&s_datacalls_mutex);
+}
 
-	if (t != NULL)
-		RIL_onRequestComplete(*t, RIL_E_SUCCESS, responses,
-				n * sizeof(RIL_Data_Call_Response));
-	else
-		RIL_onUnsolicitedResponse(RIL_UNSOL_DATA_CALL_LIST_CHANGED,
-				responses,
-				n * sizeof(RIL_Data_Call_Response));
+/**
+ * Applies a +CGEV: event to the table, reader thread
+ *
+ * +CGEV: NW DEACT "IP","10.1.2.3",1
+ * +CGEV: ME DETACH
+ */
+static void unsolicitedCGEV(const char *s)
+{
+	const char *p = s + sizeof("+CGEV:") - 1;
+	ATTokView type, addr, cidv;
+	int cid = -1, i, needQuery = 1;
 
-	return;
+	while (*p == ' ')
+		p++;
 
-error:
-	at_response_free(p_response);
-	if (t != NULL)
-		RIL_onRequestComplete(*t, RIL_E_GENERIC_FAILURE, NULL, 0);
-	else
-		RIL_onUnsolicitedResponse(RIL_UNSOL_DATA_CALL_LIST_CHANGED,
-				NULL, 0);
+	if (strStartsWith(p, "NW CLASS") || strStartsWith(p, "ME CLASS")) {
+		/* doesn't change the contexts */
+		return;
+	} else if (strStartsWith(p, "NW DETACH") || strStartsWith(p, "ME DETACH")) {
+		pthread_mutex_lock(&s_datacalls_mutex);
+		for (i = 0; i < s_dataCalls.count; i++)
+			s_dataCalls.entries[i].active = 0;
+		needQuery = !s_dataCalls.valid;
+		pthread_mutex_unlock(&s_datacalls_mutex);
+	} else if (strStartsWith(p, "NW DEACT ") || strStartsWith(p, "ME DEACT ")) {
+		p += sizeof("NW DEACT ") - 1;
+		if (at_tok_view_next(&p, &type) == 0
+				&& at_tok_view_next(&p, &addr) == 0) {
+			if (at_tok_view_next(&p, &cidv) == 0)
+				at_tok_view_toint(&cidv, 10, &cid);
+
+			pthread_mutex_lock(&s_datacalls_mutex);
+			for (i = 0; s_dataCalls.valid && i < s_dataCalls.count; i++) {
+				DataCallEntry *e = &s_dataCalls.entries[i];
+
+				if (cid >= 0 ? e->cid == cid : at_tok_view_eq(&addr, e->address)) {
+					e->active = 0;
+					needQuery = 0;
+					break;
+				}
+			}
+			pthread_mutex_unlock(&s_datacalls_mutex);
+		}
+	}
+	scheduleDataCallListRefresh(needQuery);
 }
 
 static void requestBasebandVersion(void *data, size_t datalen, RIL_Token t)
@@ -1111,8 +1241,171 @@ error:
 
 static int resentCallState;
 
+/* The framework never has more than 7 calls (3GPP 22.030 6.5.5) */
+#define MAX_CALLS 8
+#define MAX_CALL_NUMBER 32
+
+/* A parsed +CLCC snapshot. Numbers are copied into the table so that
+ * it stays valid after the ATResponse it was parsed from is freed.
+ */
+typedef struct {
+	int count;
+	int needRepoll;
+	RIL_Call calls[MAX_CALLS];
+	RIL_Call *pp_calls[MAX_CALLS];
+	char numbers[MAX_CALLS][MAX_CALL_NUMBER];
+} CallTable;
+
+/* last call list reported to the framework */
+static CallTable s_lastCalls;
+/* scratch tables, so nothing is allocated per poll */
+static CallTable s_curCalls;
+static CallTable s_pollCalls;
+/* number of RIL_UNSOL_RESPONSE_CALL_STATE_CHANGED we didn't send
+ * because the call list hadn't changed */
+static unsigned int s_callStateSuppressed;
+
+/**
+ * Parses the +CLCC lines of p_response into *p_table, voice calls only.
+ * Modifies the response lines.
+ */
+static void callTableFromCLCC(ATResponse *p_response, CallTable *p_table)
+{
+	ATLine *p_cur;
+	RIL_Call *p_call;
+
+	p_table->count = 0;
+	p_table->needRepoll = 0;
+
+	for (p_cur = p_response->p_intermediates
+			; p_cur != NULL && p_table->count < MAX_CALLS
+			; p_cur = p_cur->p_next
+	    ) {
+		p_call = &p_table->calls[p_table->count];
+		memset(p_call, 0, sizeof(RIL_Call));
+
+		if (callFromCLCCLine(p_cur->line, p_call) != 0) {
+			continue;
+		}
+
+		if (p_call->state != RIL_CALL_ACTIVE
+				&& p_call->state != RIL_CALL_HOLDING
+		   ) {
+			p_table->needRepoll = 1;
+		}
+
+		if (!p_call->isVoice) // only count voice calls
+			continue;
+
+		if (p_call->number != NULL) {
+			strncpy(p_table->numbers[p_table->count], p_call->number,
+					MAX_CALL_NUMBER - 1);
+			p_table->numbers[p_table->count][MAX_CALL_NUMBER - 1] = '\0';
+			p_call->number = p_table->numbers[p_table->count];
+		}
+		p_table->pp_calls[p_table->count] = p_call;
+		p_table->count++;
+	}
+}
+
+static void callTableCopy(CallTable *dst, const CallTable *src)
+{
+	int i;
+
+	memcpy(dst, src, sizeof(CallTable));
+	for (i = 0; i < dst->count; i++) {
+		if (dst->calls[i].number != NULL)
+			dst->calls[i].number = dst->numbers[i];
+		dst->pp_calls[i] = &dst->calls[i];
+	}
+}
+
+/** strcmp() that also takes NULL, which only equals NULL */
+static int callStrEqual(const char *a, const char *b)
+{
+	if (a == NULL || b == NULL)
+		return a == b;
+	return !strcmp(a, b);
+}
+
+/** returns 1 if the framework would see the same call list in a and b */
+static int callTableEqual(const CallTable *a, const CallTable *b)
+{
+	int i;
+
+	if (a->count != b->count)
+		return 0;
+
+	for (i = 0; i < a->count; i++) {
+		const RIL_Call *ca = &a->calls[i];
+		const RIL_Call *cb = &b->calls[i];
+
+		if (ca->index != cb->index || ca->state != cb->state
+				|| ca->isMT != cb->isMT || ca->isMpty != cb->isMpty
+				|| ca->toa != cb->toa || ca->als != cb->als
+				|| ca->isVoice != cb->isVoice
+				|| ca->isVoicePrivacy != cb->isVoicePrivacy
+				|| ca->numberPresentation != cb->numberPresentation
+				|| ca->namePresentation != cb->namePresentation
+				|| ca->uusInfo != cb->uusInfo)
+			return 0;
+		if (!callStrEqual(ca->number, cb->number)
+				|| !callStrEqual(ca->name, cb->name))
+			return 0;
+	}
+
+	return 1;
+}
+
+/** returns 1 if t holds a call that is ringing or waiting */
+static int callTableHasIncoming(const CallTable *t)
+{
+	int i;
+
+	for (i = 0; i < t->count; i++) {
+		if (t->calls[i].state == RIL_CALL_INCOMING
+				|| t->calls[i].state == RIL_CALL_WAITING)
+			return 1;
+	}
+	return 0;
+}
+
+/**
+ * Polls AT+CLCC and only reports RIL_UNSOL_RESPONSE_CALL_STATE_CHANGED
+ * if the call list differs from the one last handed to the framework.
+ * Called on the request thread.
+ */
 static void sendCallStateChanged(void *param)
 {
+	int err;
+	ATResponse *p_response = NULL;
+
+	if (currentState() == Radio_READY) {
+		err = at_send_command_multiline ("AT+CLCC", "+CLCC:", &p_response);
+
+		if (err == 0 && p_response->success) {
+			callTableFromCLCC(p_response, &s_pollCalls);
+			at_response_free(p_response);
+
+			if (callTableEqual(&s_pollCalls, &s_lastCalls)) {
+				s_callStateSuppressed++;
+#ifdef POLL_CALL_STATE
+				if (s_pollCalls.count) {
+#else
+				if (s_pollCalls.needRepoll) {
+#endif
+					resentCallState = 1;	/* notification is queued */
+					RIL_requestTimedCallback (sendCallStateChanged, NULL, &TIMEVAL_CALLSTATEPOLL);
+				} else {
+					resentCallState = 0;
+				}
+				return;
+			}
+		} else {
+			at_response_free(p_response);
+		}
+	}
+
 	RIL_onUnsolicitedResponse (
 			RIL_UNSOL_RESPONSE_CALL_STATE_CHANGED,
 			NULL, 0);
@@ -1121,18 +1414,12 @@ static void sendCallStateChanged(void *param)
 
 static void requestGetCurrentCalls(void *data, size_t datalen, RIL_Token t)
 {
-	int err,fd;
+	int err;
 	ATResponse *p_response;
-	ATLine *p_cur;
-	int countCalls;
-	RIL_Call *p_calls;
-	RIL_Call **pp_calls;
-	int i;
-	char status[1];
-	int needRepoll = 0;
-	char fake_clcc[64];
+	CallTable *calls = &s_curCalls;
 
 #ifdef WORKAROUND_ERRONEOUS_ANSWER
+	int i;
 	int prevIncomingOrWaitingLine;
 
 	prevIncomingOrWaitingLine = s_incomingOrWaitingLine;
@@ -1148,58 +1435,21 @@ static void requestGetCurrentCalls(void *data, size_t datalen, RIL_Token t)
 
 	err = at_send_command_multiline ("AT+CLCC", "+CLCC:", &p_response);
 
-	if (err != 0 || p_response->success == 0) {
-		RIL_onRequestComplete(t, RIL_E_GENERIC_FAILURE, NULL, 0);
-		return;
-	}
-
-	/* count the calls */
-	for (countCalls = 0, p_cur = p_response->p_intermediates
-			; p_cur != NULL
-			; p_cur = p_cur->p_next
-	    ) {
-		countCalls++;
-	}
-
-	/* yes, there's an array of pointers and then an array of structures */
-
-	pp_calls = (RIL_Call **)alloca(countCalls * sizeof(RIL_Call *));
-	p_calls = (RIL_Call *)alloca(countCalls * sizeof(RIL_Call));
-	memset (p_calls, 0, countCalls * sizeof(RIL_Call));
-
-	/* init the pointer array */
-	for(i = 0; i < countCalls ; i++) {
-		pp_calls[i] = &(p_calls[i]);
-	}
-
-	for (countValidCalls = 0, p_cur = p_response->p_intermediates
-			; p_cur != NULL
-			; p_cur = p_cur->p_next
-	    ) {
-		err = callFromCLCCLine(p_cur->line, p_calls + countValidCalls);
+	if (err != 0 || p_response->success == 0)
+		goto error;
 
-		if (err != 0) {
-			continue;
-		}
+	callTableFromCLCC(p_response, calls);
+	countValidCalls = calls->count;
 
 #ifdef WORKAROUND_ERRONEOUS_ANSWER
-		if (p_calls[countValidCalls].state == RIL_CALL_INCOMING
-				|| p_calls[countValidCalls].state == RIL_CALL_WAITING
+	for (i = 0; i < countValidCalls ; i++) {
+		if (calls->calls[i].state == RIL_CALL_INCOMING
+				|| calls->calls[i].state == RIL_CALL_WAITING
 		   ) {
-			s_incomingOrWaitingLine = p_calls[countValidCalls].index;
+			s_incomingOrWaitingLine = calls->calls[i].index;
 		}
-#endif /*WORKAROUND_ERRONEOUS_ANSWER*/
-
-		if (p_calls[countValidCalls].state != RIL_CALL_ACTIVE
-				&& p_calls[countValidCalls].state != RIL_CALL_HOLDING
-		   ) {
-			needRepoll = 1;
-		}
-		if(p_calls[countValidCalls].isVoice) // only count voice calls
-			countValidCalls++;
 	}
 
-#ifdef WORKAROUND_ERRONEOUS_ANSWER
 	// Basically:
 	// A call was incoming or waiting
 	// Now it's marked as active
@@ -1213,11 +1463,11 @@ static void requestGetCurrentCalls(void *data, size_t datalen, RIL_Token t)
 	   ) {
 		for (i = 0; i < countValidCalls ; i++) {
 
-			if (p_calls[i].index == prevIncomingOrWaitingLine
-					&& p_calls[i].state == RIL_CALL_ACTIVE
+			if (calls->calls[i].index == prevIncomingOrWaitingLine
+					&& calls->calls[i].state == RIL_CALL_ACTIVE
 					&& s_repollCallsCount < REPOLL_CALLS_COUNT_MAX
 			   ) {
-				LOGI(
+				RLOGI(RLOG_CALL,
 						"Hit WORKAROUND_ERRONOUS_ANSWER case."
 						" Repoll count: %d\n", s_repollCallsCount);
 				s_repollCallsCount++;
@@ -1229,14 +1479,16 @@ static void requestGetCurrentCalls(void *data, size_t datalen, RIL_Token t)
 	s_expectAnswer = 0;
 	s_repollCallsCount = 0;
 #endif /*WORKAROUND_ERRONEOUS_ANSWER*/
-	LOGI("Calls=%d,Valid=%d\n",countCalls,countValidCalls);
+	RLOGD(RLOG_CALL, "Valid=%d", countValidCalls);
 	if(countValidCalls==0 && audio_on) { // close audio if no voice calls.
-		LOGI("Audio Close\n");
+		RLOGI(RLOG_CALL, "Audio Close");
 		writesys("audio","5");
 		audio_on = 0;
 	}
 
-	RIL_onRequestComplete(t, RIL_E_SUCCESS, pp_calls,
+	callTableCopy(&s_lastCalls, calls);
+
+	RIL_onRequestComplete(t, RIL_E_SUCCESS, calls->pp_calls,
 			countValidCalls * sizeof (RIL_Call *));
 
 	at_response_free(p_response);
@@ -1245,7 +1497,7 @@ static void requestGetCurrentCalls(void *data, size_t datalen, RIL_Token t)
 	if (countValidCalls)  // We don't seem to get a "NO CARRIER" message from
 		// smd, so we're forced to poll until the call ends.
 #else
-	if (needRepoll)
+	if (calls->needRepoll)
 #endif
 	{
 		if (!resentCallState) {
@@ -1396,7 +1648,7 @@ static void requestSignalStrength(void *data, size_t datalen, RIL_Token t)
 
 		at_response_free(p_response);
 	} else {
-		LOGD("Sending stored RSSI values to RIL");
+		RLOGV(RLOG_NET, "Sending stored RSSI values to RIL");
 		response[0] = signalStrength[0];
 		response[1] = signalStrength[1];
 		signalStrength[0] = 0;
@@ -1669,6 +1921,223 @@ error:
 	RIL_onRequestComplete(t, RIL_E_GENERIC_FAILURE, NULL, 0);
 }
 
+/* Network state cache. The +CREG/+CGREG/$HTC_SYSTYPE unsolicited
+ * responses keep it current from the reader thread, so the framework's
+ * registration and operator polls only go to the modem once it is stale.
+ */
+#define NETCACHE_REG_MAX_AGE_MS	30000
+#define NETCACHE_OPS_MAX_AGE_MS	120000
+
+typedef struct {
+	int valid;
+	int regstate;
+	char lac[8];
+	char cid[12];
+	long long updated;
+} NetRegEntry;
+
+static struct {
+	NetRegEntry creg;
+	NetRegEntry cgreg;
+	int rtype;		/* last GSM access technology (+COPS/+CGREG), -1 if unknown */
+	int systype;		/* last CDMA $HTC_SYSTYPE, -1 if unknown */
+	long long systypeUpdated;
+	int opsValid;
+	int opsSelmode;
+	char ops[3][50];	/* long, short, numeric; "" if not reported */
+	long long opsUpdated;
+} s_netCache = { .rtype = -1, .systype = -1 };
+static pthread_mutex_t s_netcache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static unsigned int s_netCacheHits;
+static unsigned int s_netCacheMisses;
+
+static int isRegistered(int state)
+{
+	return state == REG_HOME || state == REG_ROAM;
+}
+
+static void netCacheCopyStr(char *dst, size_t dstlen, const char *src)
+{
+	if (src == NULL)
+		src = "";
+	strncpy(dst, src, dstlen - 1);
+	dst[dstlen - 1] = '\0';
+}
+
+/* Called with s_netcache_mutex held */
+static void netCacheSetReg(NetRegEntry *entry, int state)
+{
+	/* A new registration or location area may mean a new PLMN */
+	if (entry->regstate != state)
+		s_netCache.opsValid = 0;
+	entry->regstate = state;
+	entry->updated = getMonotonicMsec();
+	entry->valid = 1;
+}
+
+/**
+ * Updates the cache from an unsolicited +CREG:, +CGREG: or $HTC_SYSTYPE:
+ * line. Runs on the reader thread.
+ *
+ * The unsolicited forms are
+ *   +CREG: <stat>[,<lac>,<cid>]
+ *   +CGREG: <stat>[,<lac>,<cid>[,<act>]]
+ * <lac> and <cid> are only reported with +CREG=2/+CGREG=2, so a
+ * registered entry without them is left for the next poll to fill in.
+ */
+static void netCacheUnsolicited(const char *s)
+{
+	NetRegEntry *entry;
+	ATTokView lac, cid;
+	int state, act, count;
+
+	if (strStartsWith(s, "$HTC_SYSTYPE:")) {
+		if (at_tok_scan(s, "i", &state) < 1)
+			return;
+		pthread_mutex_lock(&s_netcache_mutex);
+		s_netCache.systype = state;
+		s_netCache.systypeUpdated = getMonotonicMsec();
+		pthread_mutex_unlock(&s_netcache_mutex);
+		return;
+	}
+
+	entry = strStartsWith(s, "+CGREG:") ? &s_netCache.cgreg : &s_netCache.creg;
+	count = at_tok_scan(s, "i[s,s,i", &state, &lac, &cid, &act);
+	if (count < 1)
+		return;
+
+	pthread_mutex_lock(&s_netcache_mutex);
+	if (count >= 3) {
+		if (!at_tok_view_eq(&lac, entry->lac))
+			s_netCache.opsValid = 0;
+		at_tok_view_copy(&lac, entry->lac, sizeof(entry->lac));
+		at_tok_view_copy(&cid, entry->cid, sizeof(entry->cid));
+	} else if (!isRegistered(state) || entry->regstate != state) {
+		entry->lac[0] = '\0';
+		entry->cid[0] = '\0';
+	}
+	if (count >= 4)
+		s_netCache.rtype = act;
+	netCacheSetReg(entry, state);
+	if (isRegistered(state) && !entry->lac[0])
+		entry->valid = 0;
+	pthread_mutex_unlock(&s_netcache_mutex);
+}
+
+/* Stores the result of a solicited registration query */
+static void netCacheStoreReg(NetRegEntry *entry, int state,
+		const char *lac, const char *cid, int radiotype)
+{
+	pthread_mutex_lock(&s_netcache_mutex);
+	netCacheCopyStr(entry->lac, sizeof(entry->lac), lac);
+	netCacheCopyStr(entry->cid, sizeof(entry->cid), cid);
+	netCacheSetReg(entry, state);
+	if (radiotype != -1) {
+		if (phone_is == MODE_GSM) {
+			s_netCache.rtype = radiotype;
+		} else {
+			s_netCache.systype = radiotype;
+			s_netCache.systypeUpdated = entry->updated;
+		}
+	}
+	pthread_mutex_unlock(&s_netcache_mutex);
+}
+
+/**
+ * Copies a fresh entry into *p_out and the raw radio technology
+ * into *p_radiotype. Returns 0 if the entry is missing or stale and
+ * the modem has to be asked.
+ */
+static int netCacheLookupReg(const NetRegEntry *entry, NetRegEntry *p_out,
+		int *p_radiotype)
+{
+	long long now = getMonotonicMsec();
+	int radiotype;
+	int fresh;
+
+	pthread_mutex_lock(&s_netcache_mutex);
+	*p_out = *entry;
+	if (phone_is == MODE_GSM) {
+		radiotype = s_netCache.rtype;
+		fresh = 1;
+	} else {
+		radiotype = s_netCache.systype;
+		fresh = now - s_netCache.systypeUpdated < NETCACHE_REG_MAX_AGE_MS;
+	}
+	pthread_mutex_unlock(&s_netcache_mutex);
+
+	if (!p_out->valid || now - p_out->updated >= NETCACHE_REG_MAX_AGE_MS)
+		return 0;
+	/* the radio tech is needed while registered */
+	if (isRegistered(p_out->regstate)) {
+		if (radiotype == -1 || !fresh)
+			return 0;
+	} else if (phone_is == MODE_GSM) {
+		radiotype = -1;
+	}
+	*p_radiotype = radiotype;
+	return 1;
+}
+
+/* Stores the names of a successful +COPS query */
+static void netCacheStoreOperator(char *response[3])
+{
+	int i;
+
+	pthread_mutex_lock(&s_netcache_mutex);
+	for (i = 0; i < 3; i++)
+		netCacheCopyStr(s_netCache.ops[i], sizeof(s_netCache.ops[i]), response[i]);
+	s_netCache.opsSelmode = gsm_selmode;
+	if (gsm_rtype != -1)
+		s_netCache.rtype = gsm_rtype;
+	s_netCache.opsUpdated = getMonotonicMsec();
+	s_netCache.opsValid = 1;
+	pthread_mutex_unlock(&s_netcache_mutex);
+}
+
+/**
+ * Fills response[0..2] from the cache, pointing into ops.
+ * Returns 0 if the operator names are stale.
+ */
+static int netCacheLookupOperator(char ops[3][50], char *response[3])
+{
+	long long now = getMonotonicMsec();
+	int i, fresh;
+
+	pthread_mutex_lock(&s_netcache_mutex);
+	fresh = s_netCache.opsValid
+		&& now - s_netCache.opsUpdated < NETCACHE_OPS_MAX_AGE_MS;
+	if (fresh) {
+		memcpy(ops, s_netCache.ops, sizeof(s_netCache.ops));
+		gsm_selmode = s_netCache.opsSelmode;
+	}
+	pthread_mutex_unlock(&s_netcache_mutex);
+
+	if (!fresh)
+		return 0;
+	for (i = 0; i < 3; i++)
+		response[i] = ops[i][0] ? ops[i] : NULL;
+	return 1;
+}
+
+static void netCacheInvalidateOperator(void)
+{
+	pthread_mutex_lock(&s_netcache_mutex);
+	s_netCache.opsValid = 0;
+	pthread_mutex_unlock(&s_netcache_mutex);
+}
+
+static void netCacheReset(void)
+{
+	pthread_mutex_lock(&s_netcache_mutex);
+	s_netCache.creg.valid = 0;
+	s_netCache.cgreg.valid = 0;
+	s_netCache.rtype = -1;
+	s_netCache.systype = -1;
+	s_netCache.opsValid = 0;
+	pthread_mutex_unlock(&s_netcache_mutex);
+}
+
 static void requestRegistrationState(int request, void *data,
 		size_t datalen, RIL_Token t)
 {
@@ -1686,9 +2155,28 @@ static void requestRegistrationState(int request, void *data,
 	char sstate[3];
 	char sradiotype[3];
 	char *responseStr[14] = {sstate, NULL, NULL, sradiotype};
+	NetRegEntry *entry, cached;
 
 	got_state_change = 0;
 
+	if (phone_is == MODE_GSM && request == RIL_REQUEST_GPRS_REGISTRATION_STATE)
+		entry = &s_netCache.cgreg;
+	else
+		entry = &s_netCache.creg;
+
+	if (netCacheLookupReg(entry, &cached, &radiotype)) {
+		s_netCacheHits++;
+		regstate = cached.regstate;
+		if (cached.lac[0]) {
+			responseStr[1] = cached.lac;
+			responseStr[2] = cached.cid;
+		}
+		if (phone_is == MODE_GSM)
+			gsm_rtype = radiotype;
+		goto translate;
+	}
+	s_netCacheMisses++;
+
 	if(phone_is == MODE_GSM) {
 		if (request == RIL_REQUEST_REGISTRATION_STATE) {
 			cmd = "AT+CREG?";
@@ -1863,6 +2351,10 @@ static void requestRegistrationState(int request, void *data,
 			goto error;
 	}
 
+	netCacheStoreReg(entry, regstate, responseStr[1], responseStr[2],
+			(radiotype == -1 && phone_is == MODE_GSM) ? gsm_rtype : radiotype);
+
+translate:
 	if (phone_is == MODE_GSM) {
 		/* Now translate to 'Broken Android Speak' - can't follow the GSM spec */
 		if (radiotype == -1 && (regstate == REG_HOME || regstate == REG_ROAM))
@@ -1926,7 +2418,7 @@ static void requestRegistrationState(int request, void *data,
 				at_send_command("AT+HTC_SRV_STATUS?", NULL);
 
 			err = at_send_command_singleline("AT+HTC_BSINFO?", "+HTC_BSINFO:", &p_response_bs);
-			if (err < 0 || !p_response->success)
+			if (err < 0 || !p_response_bs->success)
 				goto done;
 			line_bs = p_response_bs->p_intermediates->line;
 			err = at_tok_start(&line_bs);
@@ -1977,6 +2469,7 @@ static void requestOperator(void *data, size_t datalen, RIL_Token t)
 	ATLine *p_cur;
 	ATResponse *p_response = NULL;
 	char *response[4];
+	char ops[3][50];
 
 	memset(response, 0, sizeof(response));
 
@@ -1986,6 +2479,12 @@ static void requestOperator(void *data, size_t datalen, RIL_Token t)
 	}
 
 	if(phone_is == MODE_GSM) {
+		if (netCacheLookupOperator(ops, response)) {
+			s_netCacheHits++;
+			goto done;
+		}
+		s_netCacheMisses++;
+
 		err = at_send_command_multiline(
 				"AT+COPS=3,0;+COPS?;+COPS=3,1;+COPS?;+COPS=3,2;+COPS?",
 				"+COPS:", &p_response);
@@ -2040,6 +2539,7 @@ static void requestOperator(void *data, size_t datalen, RIL_Token t)
 		if (i == 3) {
 			response[3] = '\0';
 		}
+		netCacheStoreOperator(response);
 	}
 	else {
 		response[0]=erisystem;
@@ -2077,6 +2577,7 @@ static void requestOperator(void *data, size_t datalen, RIL_Token t)
 		response[2] = operid;
 	}
 
+done:
 	RIL_onRequestComplete(t, RIL_E_SUCCESS, response, sizeof(response));
 	at_response_free(p_response);
 	return;
@@ -2124,21 +2625,111 @@ error:
 	RIL_onRequestComplete(t, RIL_E_GENERIC_FAILURE, NULL, 0);
 }
 
+/* Default SMSC in PDU form, from the first AT+CSCA? after radio on */
+static char s_smscPdu[30];
+
+/* "more messages to send" burst, see requestSendSMSExpectMore() */
+#define SMS_BURST_TIMEOUT_MS	5000
+
+static int s_smsBurst;		/* AT+CMMS=2 is in effect */
+static int s_smsBurstGen;	/* bumped by every segment, stales old timeouts */
+static int s_cmmsUnsupported;
+static unsigned int s_smsSent;
+static unsigned int s_smsBurstSegments;
+static long long s_smsSendMsecTotal;
+
+/**
+ * Copies the default SMSC, formatted as the PDU prefix +CMGS expects,
+ * into smsc. The modem is only asked the first time.
+ * Returns 0 on success.
+ */
+static int getDefaultSmsc(char *smsc)
+{
+	int err;
+	int length,i,plus = 0;
+	int tosca,curChar=0;
+	char *line, *temp;
+	ATResponse *p_response = NULL;
+
+	if (s_smscPdu[0]) {
+		strcpy(smsc, s_smscPdu);
+		return 0;
+	}
+
+	err = at_send_command_singleline("AT+CSCA?", "+CSCA:", &p_response);
+
+	if (err < 0 || p_response->success == 0) {
+		goto error;
+	}
+
+	line = p_response->p_intermediates->line;
+
+	err = at_tok_start(&line);
+	if (err < 0) goto error;
+
+	err = at_tok_nextstr(&line, &temp);
+	if (err < 0) goto error;
+
+	err = at_tok_nextint(&line, &tosca);
+	if (err < 0) goto error;
+
+	if(temp[0]=='+') {
+		++temp;
+		//plus = 1;
+	}
+
+	length = strlen(temp) - plus;
+	if (length > (int)sizeof(s_smscPdu) - 6) goto error;
+	sprintf(smsc,"%.2x%.2x",(length + 1) / 2 + 1, tosca);
+
+	for (i = 0; curChar < length - 1; i+=2 ) {
+		smsc[5+i] = temp[plus+curChar++];
+		smsc[4+i] = temp[plus+curChar++];
+	}
+
+	if ( length % 2) {//One extra number
+		smsc[4+length] = temp[curChar];
+		smsc[3+length]='F';
+		smsc[5+length]='\0';
+	} else {
+		smsc[4+length] = '\0';
+	}
+
+	strcpy(s_smscPdu, smsc);
+	at_response_free(p_response);
+	return 0;
+
+error:
+	at_response_free(p_response);
+	return -1;
+}
+
+static void smsBurstEnd(void)
+{
+	if (!s_smsBurst)
+		return;
+	s_smsBurst = 0;
+	at_send_command("AT+CMMS=0", NULL);
+}
+
+/* Releases the link if no further segment followed in time */
+static void smsBurstTimeout(void *param)
+{
+	if ((long)param == s_smsBurstGen)
+		smsBurstEnd();
+}
+
 static void requestSendSMS(void *data, size_t datalen, RIL_Token t, int request)
 {
 	int err;
 	char smsc[30];
 	const char *pdu;
 	const char *testSmsc;
-	int tpLayerLength,length,i,plus = 0;
-	char *cmd1, *cmd2, *line, *temp;
-//	bytes_t first;
-	int tosca,curChar=0;
+	int tpLayerLength;
+	char *cmd1, *cmd2, *line;
 	RIL_SMS_Response response;
 	ATResponse *p_response = NULL;
-	ATResponse *p2_response = NULL;
-	char * cdma=0;
-	char sendstr[512];
+	long long start = getMonotonicMsec();
 	struct {
 		RIL_SMS_Response resp;
 		int result;
@@ -2148,54 +2739,18 @@ static void requestSendSMS(void *data, size_t datalen, RIL_Token t, int request)
 	pdu = ((const char **)data)[1];
 
 	tpLayerLength = strlen(pdu)/2;
-	LOGI("SMSC=%s  PDU=%s",testSmsc,pdu);
 	// "NULL for default SMSC"
 	if (testSmsc == NULL) {
-		err = at_send_command_singleline("AT+CSCA?", "+CSCA:", &p2_response);
-
-		if (err < 0 || p2_response->success == 0) {
+		if (getDefaultSmsc(smsc) < 0)
 			goto error;
-		}
-
-		line = p2_response->p_intermediates->line;
-
-		err = at_tok_start(&line);
-		if (err < 0) goto error;
-
-		err = at_tok_nextstr(&line, &temp);
-		if (err < 0) goto error;
-
-		err = at_tok_nextint(&line, &tosca);
-		if (err < 0) goto error;
-
-		if(temp[0]=='+') {
-			++temp;
-			//plus = 1;
-		}
-
-		length = strlen(temp) - plus;
-		sprintf(smsc,"%.2x%.2x",(length + 1) / 2 + 1, tosca);
-
-		for (i = 0; curChar < length - 1; i+=2 ) {
-			smsc[5+i] = temp[plus+curChar++];
-			smsc[4+i] = temp[plus+curChar++];
-		}
-
-		if ( length % 2) {//One extra number
-			smsc[4+length] = temp[curChar];
-			smsc[3+length]='F';
-			smsc[5+length]='\0';
-		} else {
-			smsc[4+length] = '\0';
-		}
-		//first = malloc(30*sizeof(byte_t));
-		//length = 2 + (gsm_bcdnum_from_ascii(temp,strlen(temp),&first)) / 2;
-		//sprintf(smsc,"%.2x%.2x%s",length,tosca,first);
-		//free(first);
 	}
-	else
-		strcpy(smsc,testSmsc);
-	LOGI("SMSC=%s  PDU=%s",smsc,pdu);
+	else {
+		/* a truncated SMSC would send the message somewhere else */
+		if (strlen(testSmsc) >= sizeof(smsc))
+			goto error;
+		strcpy(smsc, testSmsc);
+	}
+	RLOGD(RLOG_SMS, "SMSC=%s  PDU=%s", smsc, pdu);
 
 	asprintf(&cmd1, "AT+CMGS=%d", tpLayerLength);
 	asprintf(&cmd2, "%s%s", smsc, pdu);
@@ -2219,6 +2774,9 @@ static void requestSendSMS(void *data, size_t datalen, RIL_Token t, int request)
 	
 	response.ackPDU = NULL;
 
+	s_smsSent++;
+	s_smsSendMsecTotal += getMonotonicMsec() - start;
+
 	if (request == RIL_REQUEST_SEND_SMS_EXTENDED)
 	{
 		extendedResponse.resp = response;
@@ -2230,13 +2788,51 @@ static void requestSendSMS(void *data, size_t datalen, RIL_Token t, int request)
 		RIL_onRequestComplete(t, RIL_E_SUCCESS, &response, sizeof(response));
 	}
 	at_response_free(p_response);
-	at_response_free(p2_response);
-	return;
+	goto done;
 
 error:
 	at_response_free(p_response);
-	at_response_free(p2_response);
 	RIL_onRequestComplete(t, RIL_E_GENERIC_FAILURE, NULL, 0);
+
+done:
+	if (request == RIL_REQUEST_SEND_SMS_EXPECT_MORE) {
+		struct timeval tv = {SMS_BURST_TIMEOUT_MS / 1000, 0};
+
+		/* the next segment keeps the link, its absence releases it */
+		s_smsBurstGen++;
+		RIL_requestTimedCallback(smsBurstTimeout, (void *)(long)s_smsBurstGen, &tv);
+	} else {
+		/* last segment of the burst */
+		smsBurstEnd();
+	}
+}
+
+/* ifwait conditions for the ppp link, run on the request thread */
+
+/* 1 once ip-up published an address into arg, -1 if the call was dropped */
+static int pppHasAddress(void *arg)
+{
+	char *ipbuf = arg;
+	char value[PROPERTY_VALUE_MAX];
+	int dialing;
+
+	dialing = (check_data() == Data_Dialing);
+	if (!dialing)
+		return -1;
+
+	/* Return the IP address too */
+	property_get("net.gprs.local-ip", value, "0.0.0.0");
+	strncpy(ipbuf, value, sizeof("255.255.255.255") - 1);
+	ipbuf[sizeof("255.255.255.255") - 1] = '\0';
+	if (strcmp(value, "0.0.0.0"))
+		return 1;
+	property_get("net.ppp0.local-ip", value, "0.0.0.0");
+	return strcmp(value, "0.0.0.0") != 0;
+}
+
+static int pppIsGone(void *arg)
+{
+	return access(PPP_SYS_PATH, F_OK) != 0;
 }
 
 static void requestSetupDataCall(char **data, size_t datalen, RIL_Token t)
@@ -2255,7 +2851,6 @@ static void requestSetupDataCall(char **data, size_t datalen, RIL_Token t)
 	char *buffer;
 	long buffSize, len;
 	char ipbuf[sizeof("255.255.255.255")];
-	char ipbuf2[sizeof("255.255.255.255")];
 	char *response[3] = { "1", PPP_TTY_PATH, ipbuf };
 	int mypppstatus;
 
@@ -2303,9 +2898,7 @@ static void requestSetupDataCall(char **data, size_t datalen, RIL_Token t)
 		// packet-domain event reporting
 		err = at_send_command("AT+CGEREP=1,0", NULL);
 		// Hangup anything that's happening there now
-		pthread_mutex_lock(&s_data_mutex);
-		data_state = Data_Dialing;
-		pthread_mutex_unlock(&s_data_mutex);
+		rilstate_set(RILSTATE_DATA, Data_Dialing);
 		err = at_send_command("AT+CGACT=0,1", NULL);
 		// Start data on PDP context 1
 		err = at_send_command("ATD*99***1#", &p_response);
@@ -2316,9 +2909,7 @@ static void requestSetupDataCall(char **data, size_t datalen, RIL_Token t)
 		at_response_free(p_response);
 	} else {
 		//CDMA
-		pthread_mutex_lock(&s_data_mutex);
-		data_state = Data_Dialing;
-		pthread_mutex_unlock(&s_data_mutex);
+		rilstate_set(RILSTATE_DATA, Data_Dialing);
 		err = at_send_command("AT+HTC_DUN=0", NULL);
 		err = at_send_command("ATH", NULL);
 		err = at_send_command("ATDT#777", &p_response);
@@ -2333,45 +2924,31 @@ static void requestSetupDataCall(char **data, size_t datalen, RIL_Token t)
 	property_set("net.ppp0.local-ip", "0.0.0.0");
 	ppp_set_state(1);
 
-	for (i=0; i<PPP_RETRY_COUNT; i++) {
-		int ok;
-		sleep(1); // allow time for ip-up to run
-		pthread_mutex_lock(&s_data_mutex);
-		ok = (data_state == Data_Dialing);
-		pthread_mutex_unlock(&s_data_mutex);
-		if (!ok)
-			goto error;
-		/* Return the IP address too */
-		property_get("net.gprs.local-ip", ipbuf, "0.0.0.0");
-		property_get("net.ppp0.local-ip", ipbuf2, "0.0.0.0");
-		if (strcmp(ipbuf, "0.0.0.0") || strcmp(ipbuf2, "0.0.0.0"))
-			break;
-	}
+	/* allow time for ip-up to run */
+	i = ifwait(pppHasAddress, ipbuf, PPP_RETRY_COUNT * 1000);
+	if (i < 0)
+		goto error;
 	/* pppd started, but didn't get an IP address */
-	if (i == PPP_RETRY_COUNT) {
+	if (i == 0) {
 		ppp_set_state(0);
 		goto error;
 	}
 
-	pthread_mutex_lock(&s_data_mutex);
-	i = (data_state == Data_Dialing);
-	if (i)
-		data_state = Data_Connected;
-	pthread_mutex_unlock(&s_data_mutex);
+	i = (rilstate_cmpxchg(RILSTATE_DATA, Data_Dialing, Data_Connected)
+			== Data_Dialing);
 
 	/* We started pppd successfully, but lost the connection */
 	if (!i) {
 		ppp_set_state(0);
 		goto error;
 	}
+	dataCallUpdate(1, 1, apn, ipbuf);
 	RIL_onRequestComplete(t, RIL_E_SUCCESS, response, sizeof(response));
 	return;
 
 error:
 	RIL_onRequestComplete(t, RIL_E_GENERIC_FAILURE, NULL, 0);
-	pthread_mutex_lock(&s_data_mutex);
-	data_state = Data_Off;
-	pthread_mutex_unlock(&s_data_mutex);
+	rilstate_set(RILSTATE_DATA, Data_Off);
 }
 
 static int killConn(char *cid)
@@ -2383,21 +2960,13 @@ static int killConn(char *cid)
 
 	if (access(PPP_SYS_PATH, F_OK) == 0) {
 		/* Did we already send a kill? */
-		pthread_mutex_lock(&s_data_mutex);
-		if (data_state > Data_Terminated) {
-			i = 1;
-			data_state = Data_Terminated;
-		}
-		pthread_mutex_unlock(&s_data_mutex);
+		i = check_data();
+		i = (i > Data_Terminated
+				&& rilstate_cmpxchg(RILSTATE_DATA, i, Data_Terminated) == i);
 		if (i) {
 			ppp_set_state(0);
 		}
-		for (i=0; i<PPP_RETRY_COUNT; i++) {
-			sleep(1);
-			if (access(PPP_SYS_PATH, F_OK))
-				break;
-		}
-		if (i == PPP_RETRY_COUNT)
+		if (!ifwait(pppIsGone, NULL, PPP_RETRY_COUNT * 1000))
 			goto error;
 	}
 	if (phone_is == MODE_GSM) {
@@ -2421,9 +2990,8 @@ static int killConn(char *cid)
 	at_response_free(p_response);
 	if (err)
 		goto error;
-	pthread_mutex_lock(&s_data_mutex);
-	data_state = Data_Off;
-	pthread_mutex_unlock(&s_data_mutex);
+	rilstate_set(RILSTATE_DATA, Data_Off);
+	dataCallUpdate(atoi(cid), 0, NULL, NULL);
 	return 0;
 
 error:
@@ -2585,12 +3153,9 @@ error:
 
 static void unsolicitedNitzTime(const char * s)
 {
-	int err;
-	char * response = NULL;
-	char * line, *origline;
-	char * p = NULL;
-	char * tz = NULL; /* Timezone */
-	origline = line = strdup(s);
+	ATTokView response;
+	ATTokView tz; /* Timezone */
+	char nitz[sizeof(sNITZtime)+8];
 
 	/* Higher layers expect a NITZ string in this format:
 	 *  08/10/28,19:08:37-20,1 (yy/mm/dd,hh:mm:ss(+/-)tz,dst)
@@ -2601,40 +3166,29 @@ static void unsolicitedNitzTime(const char * s)
 		/* Get Time and Timezone data and store in static variable.
 		 * Wait until DST is received to send response to upper layers
 		 */
-		at_tok_start(&line);
-
-		err = at_tok_nextstr(&line, &tz);
-		if (err < 0) goto error;
-
-		err = at_tok_nextstr(&line, &response);
-		if (err < 0) goto error;
+		if (at_tok_scan(s, "s,s", &tz, &response) < 0) goto error;
 
-		snprintf(sNITZtime, sizeof(sNITZtime), "%s%s", response, tz);
+		snprintf(sNITZtime, sizeof(sNITZtime), "%.*s%.*s",
+				response.len, response.str, tz.len, tz.str);
 
 	}
 	else if(strStartsWith(s,"+CTZDST:")){
 
 		/* We got DST, now assemble the response and send to upper layers */
-		at_tok_start(&line);
-
-		err = at_tok_nextstr(&line, &tz);
-		if (err < 0) goto error;
+		if (at_tok_scan(s, "s", &tz) < 0) goto error;
 
-		asprintf(&response, "%s,%s", sNITZtime, tz);
+		snprintf(nitz, sizeof(nitz), "%s,%.*s", sNITZtime, tz.len, tz.str);
 
-		RIL_onUnsolicitedResponse(RIL_UNSOL_NITZ_TIME_RECEIVED, response, strlen(response));
-		free(response);
+		RIL_onUnsolicitedResponse(RIL_UNSOL_NITZ_TIME_RECEIVED, nitz, strlen(nitz));
 
 	}
 	else if(strStartsWith(s, "+HTCCTZV:")){
-		at_tok_start(&line);
+		if (at_tok_scan(s, "s", &response) < 0) goto error;
 
-		err = at_tok_nextstr(&line, &response);
-		if (err < 0) goto error;
-		RIL_onUnsolicitedResponse(RIL_UNSOL_NITZ_TIME_RECEIVED, response, strlen(response));
+		at_tok_view_copy(&response, nitz, sizeof(nitz));
+		RIL_onUnsolicitedResponse(RIL_UNSOL_NITZ_TIME_RECEIVED, nitz, strlen(nitz));
 
 	}
-	free(origline);
 	return;
 
 error:
@@ -2643,25 +3197,13 @@ error:
 
 static void unsolicitedRSSI(const char * s)
 {
-	int err;
-	int response[2];
+	int response[2] = {0, 0};
 	const unsigned char asu_table[6]={0,3,5,8,12,19};
-	char * line = NULL, *origline;
 	RIL_SignalStrength rs = {{99,99},{-1,-1},{-1,-1,-1}};
 
-	origline = strdup(s);
-	line = origline;
-
-	err = at_tok_start(&line);
-	if (err < 0) goto error;
-
-	err = at_tok_nextint(&line, &(response[0]));
-	if (err < 0) goto error;
+	if (at_tok_scan(s, "i[i", &response[0], &response[1]) < 0)
+		goto error;
 
-	if (at_tok_hasmore(&line)) {
-		err = at_tok_nextint(&line, &(response[1]));
-		if (err < 0) goto error;
-	}
 	if (phone_is == MODE_GSM) {
 		if (s[0] == '@')
 			response[0]=asu_table[response[0]%6];
@@ -2669,7 +3211,6 @@ static void unsolicitedRSSI(const char * s)
 
 	signalStrength[0]=response[0];
 	signalStrength[1]=response[1];
-	free(origline);
 
 	resp2Strength(response, &rs);
 
@@ -2682,12 +3223,7 @@ error:
 }
 
 static Data_State check_data() {
-	Data_State ret;
-
-	pthread_mutex_lock(&s_data_mutex);
-	ret = data_state;
-	pthread_mutex_unlock(&s_data_mutex);
-	return ret;
+	return rilstate_get(RILSTATE_DATA);
 }
 
 static void unsolicitedCREG(const char * s)
@@ -2713,7 +3249,7 @@ static void unsolicitedCREG(const char * s)
 	if (regstate != REG_HOME && regstate != REG_ROAM) {
 		i = check_data();
 		if (i == Data_Connected)
-			RIL_requestTimedCallback (onDataCallListChanged, NULL, NULL);
+			scheduleDataCallListRefresh(1);
 	}
 }
 
@@ -2950,13 +3486,29 @@ static void requestSetCLIR(void *data, size_t datalen, RIL_Token t)
 		RIL_onRequestComplete(t, RIL_E_SUCCESS, NULL, 0);
 }
 
+/**
+ * Sends one segment of a multipart SMS or bulk send. The first segment
+ * puts the modem into AT+CMMS=2 so the radio link stays up between
+ * the +CMGS transactions; the final plain SEND_SMS, or no further
+ * segment within SMS_BURST_TIMEOUT_MS, releases it with AT+CMMS=0.
+ */
 static void requestSendSMSExpectMore(void *data, size_t datalen, RIL_Token t)
 {
-	char *cmd = NULL;
-	asprintf(&cmd, "AT+CMMS=1");
-	at_send_command(cmd, NULL);
-	free(cmd);
-	requestSendSMS(data, datalen, t, 0);
+	ATResponse *p_response = NULL;
+	int err;
+
+	if (!s_smsBurst && !s_cmmsUnsupported) {
+		err = at_send_command("AT+CMMS=2", &p_response);
+		if (err == 0 && p_response->success)
+			s_smsBurst = 1;
+		else if (err == 0)
+			s_cmmsUnsupported = 1;
+		at_response_free(p_response);
+	}
+	if (s_smsBurst)
+		s_smsBurstSegments++;
+
+	requestSendSMS(data, datalen, t, RIL_REQUEST_SEND_SMS_EXPECT_MORE);
 }
 
 static void requestSendUSSD(void *data, size_t datalen, RIL_Token t)
@@ -2994,98 +3546,63 @@ error:
 
 static void  unsolicitedUSSD(const char *s)
 {
-	char *line, *linestart;
-	int typeCode, count, err, len, encoding = 0;
-	char *message;
-	char *outputmessage, typecode[8];
+	int typeCode, count, encoding = 0;
+	ATTokView message;
+	char typecode[8], text[DCS_MAX_UTF8];
 	char *responseStr[2] = {typecode,NULL};
 
-	LOGD("unsolicitedUSSD %s\n",s);
+	RLOGD(RLOG_UNSOL, "unsolicitedUSSD %s", s);
 
-	linestart=line=strdup(s);
-	err = at_tok_start(&line);
-	if(err < 0) goto error;
-
-	err = at_tok_nextint(&line, &typeCode);
-	if(err < 0) goto error;
-
-	if(at_tok_hasmore(&line)) {
-		err = at_tok_nextstr(&line, &message);
-		if(err < 0) goto error;
-
-		if(at_tok_hasmore(&line)) {
-			err = at_tok_nextint(&line, &encoding);
-			if(err < 0) goto error;
-		}
+	count = at_tok_scan(s, "i[s,i", &typeCode, &message, &encoding);
+	if(count < 0) goto error;
 
-		len = strlen(message);
-		outputmessage = malloc(len/2+1);
-		gsm_hex_to_bytes((cbytes_t)message,len,(bytes_t)outputmessage);
-		responseStr[1] = malloc(len+1);
-		if ((encoding & 0xec) == 0x48) {
-			len = ucs2_to_utf8((cbytes_t)outputmessage,len/4,(bytes_t)responseStr[1]);
-		} else {
-			len = utf8_from_gsm8((cbytes_t)outputmessage,len/2,(bytes_t)responseStr[1]);
-		}
-		responseStr[1][len]='\0';
-		free(outputmessage);
+	if(count > 1 && ussd_decode(message.str, message.len, encoding,
+				text, sizeof(text)) >= 0) {
+		responseStr[1] = text;
 		count = 2;
 	} else {
-		responseStr[1]=NULL;
+		if (count > 1)
+			LOGE("USSD string of %d hex digits with dcs %d not decoded",
+					message.len, encoding);
 		count = 1;
 	}
-	free(linestart);
-	sprintf(responseStr[0], "%d", typeCode & 7);
-	
+	snprintf(typecode, sizeof(typecode), "%d", typeCode & 7);
+
 	RIL_onUnsolicitedResponse (RIL_UNSOL_ON_USSD, responseStr, count*sizeof(char*));
-	free(responseStr[1]);
 	return;
 
 error:
-	free(linestart);
 	LOGE("unexpectedUSSD error\n");
 }
 
 static void  unsolicitedERI(const char *s) {
-	char *line, *origline;
-	int temp;
-	char *newEri;
+	int eri;
+	ATTokView newEri;
+	const char *space;
 	char olderi[50];
 
-	origline = strdup(s);
-	line = origline;
-	at_tok_start(&line);
-
 	/* 3,1,1,0,0,0,0,Sprint,1
 	 * carrier ID, eri ID, icon_img ID,
 	 * 4 unused int params
 	 * operator name
 	 * data support
 	 */
-	at_tok_nextint(&line, &temp);
-	at_tok_nextint(&line, &temp);
-	snprintf(eriPRL, sizeof(eriPRL), "%d", temp);
-	at_tok_nextint(&line, &temp);
-	at_tok_nextint(&line, &temp);
-	at_tok_nextint(&line, &temp);
-	at_tok_nextint(&line, &temp);
-	at_tok_nextint(&line, &temp);
-	at_tok_nextstr(&line, &newEri);
+	if (at_tok_scan(s, "_i_____s", &eri, &newEri) < 0)
+		return;
+	snprintf(eriPRL, sizeof(eriPRL), "%d", eri);
 
 	strcpy(olderi, erisystem);
-	if(strlen(newEri)<50)
-		strcpy(erisystem,newEri);
-	line = strchr(newEri, ' ');
-	if (line && line - newEri < 50) {
-		*line = '\0';
-		strcpy(erishort,newEri);
+	if(newEri.len < (int)sizeof(erisystem))
+		at_tok_view_copy(&newEri, erisystem, sizeof(erisystem));
+	space = memchr(newEri.str, ' ', newEri.len);
+	if (space && space - newEri.str < (int)sizeof(erishort)) {
+		ATTokView first = { newEri.str, space - newEri.str };
+		at_tok_view_copy(&first, erishort, sizeof(erishort));
 	} else {
 		strcpy(erishort, erisystem);
 	}
 	if (strcmp(olderi, erisystem))
 		operid[0] = '\0';
-
-	free(origline);
 }
 
 static void requestSetFacilityLock(void *data, size_t datalen, RIL_Token t)
@@ -3156,6 +3673,7 @@ static void requestSetNetworkSelectionManual(void *data, size_t datalen, RIL_Tok
 	ATResponse *p_response = NULL;
 
 	operator = (char *)data;
+	netCacheInvalidateOperator();
 	asprintf(&cmd, "AT+COPS=1,2,\"%s\"", operator);
 	err = at_send_command(cmd, &p_response);
 	if (err < 0 || p_response->success == 0){
@@ -3666,6 +4184,7 @@ static void requestSetNetworkSelectionAutomatic(RIL_Token t)
 {
 	int err = 0;
 
+	netCacheInvalidateOperator();
 	err = at_send_command("AT+COPS=0", NULL);
 	if(err < 0)
 		RIL_onRequestComplete(t, RIL_E_GENERIC_FAILURE, NULL, 0);
@@ -3675,6 +4194,17 @@ static void requestSetNetworkSelectionAutomatic(RIL_Token t)
 	return;
 }
 
+/* OEM_HOOK_STRINGS request that is answered with internal counters
+ * as "name=value" strings instead of being sent to the modem */
+#define OEM_HOOK_RIL_STATS "RIL_STATS"
+/* "RIL_LOG at=3,sms=0" changes log levels, see ril_log.h */
+#define OEM_HOOK_RIL_LOG "RIL_LOG "
+/* "RIL_TRACE /data/ril.trace" records a trace, "RIL_TRACE off" stops */
+#define OEM_HOOK_RIL_TRACE "RIL_TRACE "
+#define MAX_RIL_STATS 32
+
+static void requestRilStats(RIL_Token t);
+
 static void requestOEMHookStrings(void * data, size_t datalen, RIL_Token t)
 {
 	int i;
@@ -3686,6 +4216,32 @@ static void requestOEMHookStrings(void * data, size_t datalen, RIL_Token t)
 
 	if(datalen==sizeof (char *)) {
 		send=(char *)*cur;
+		if (!strcmp(send, OEM_HOOK_RIL_STATS)) {
+			requestRilStats(t);
+			return;
+		}
+		if (strStartsWith(send, OEM_HOOK_RIL_LOG)) {
+			if (rlog_configure(send + strlen(OEM_HOOK_RIL_LOG)) < 0)
+				RIL_onRequestComplete(t, RIL_E_GENERIC_FAILURE, NULL, 0);
+			else
+				RIL_onRequestComplete(t, RIL_E_SUCCESS, NULL, 0);
+			return;
+		}
+		if (strStartsWith(send, OEM_HOOK_RIL_TRACE)) {
+			send += strlen(OEM_HOOK_RIL_TRACE);
+			if (!strcmp(send, "off"))
+				rtrace_stop();
+			else if (rtrace_start(send) < 0) {
+				RIL_onRequestComplete(t, RIL_E_GENERIC_FAILURE, NULL, 0);
+				return;
+			}
+			RIL_onRequestComplete(t, RIL_E_SUCCESS, NULL, 0);
+			return;
+		}
+		/* the SMSC may change under getDefaultSmsc()'s cache, even
+		 * if the command fails part way */
+		if (strcasestr(send, "+CSCA="))
+			s_smscPdu[0] = '\0';
 		startswith=send+2;
 		err = at_send_command_singleline(send, startswith, &p_response);
 		if(err<0 || p_response->success == 0)
@@ -3724,168 +4280,133 @@ static void requestDeleteSMSOnSIM(void * data, size_t datalen, RIL_Token t)
 }
 
 static void requestSTKSendEnvelopeCommand(void * data, size_t datalen, RIL_Token t) {
-	int err = 0;
-	int len = 0;
-	int envcmd = 0;
-	int itemid = 0;
-	int helpreq = 0;
-	int eventlst = 0;
-	int lang_cause = 0;
-	char *hexdata = (char *)data;
-	char *cmd = NULL;
-	unsigned int *intdata = NULL;
+	HexBuf buf;
+	StkTlv env, tlv;
+	StkTlvIter it;
+	char cmd[64];
+	int arg1 = -1, arg2 = 0;
+	int ret;
 
-	len = strlen(data);
+	if (data == NULL || hex_decode(data, strlen(data), &buf) < 0
+			|| stk_ber_open(buf.data, buf.len, &env) < 0)
+		goto error;
 
-	intdata = (unsigned int*)(alloca((len / 2) * sizeof(unsigned int)));
+	switch (env.tag) {
+		case STK_ENVELOPE_MENU_SELECTION:
+			if (stk_tlv_find(env.value, env.len, STK_TAG_ITEM_IDENTIFIER, &tlv) <= 0
+					|| tlv.len < 1)
+				goto error;
+			arg1 = tlv.value[0];
+			/* the modem has always been sent the help request's
+			 * tag octet here, not a flag */
+			if (stk_tlv_find(env.value, env.len, STK_TAG_HELP_REQUEST, &tlv) > 0)
+				arg2 = tlv.raw;
+			break;
 
-	HexStr_to_DecInt(data, intdata);
+		case STK_ENVELOPE_EVENT_DOWNLOAD:
+			/* the event, then the tag octet (not the value) of the
+			 * TLV that follows, eg. language or browser termination
+			 * cause, as the modem has always been sent */
+			stk_tlv_begin(&it, env.value, env.len);
+			while ((ret = stk_tlv_next(&it, &tlv)) > 0) {
+				if (tlv.tag == STK_TAG_EVENT_LIST && tlv.len > 0)
+					arg1 = tlv.value[0];
+				else if (tlv.tag != STK_TAG_DEVICE_IDENTITIES && arg2 == 0)
+					arg2 = tlv.raw;
+			}
+			if (ret < 0 || arg1 < 0)
+				goto error;
+			break;
 
-	envcmd = intdata[0];
-	if(envcmd == 211){
-		itemid = intdata[8];
-		helpreq = intdata[9];
-		asprintf(&cmd, "AT+STKENV=%d, %d, %d", envcmd, itemid, helpreq);
-		err = at_send_command(cmd, NULL);
-		if(err < 0)
-			goto error;
+		default:
+			RIL_onRequestComplete(t, RIL_E_REQUEST_NOT_SUPPORTED, NULL, 0);
+			return;
 	}
-	else if(envcmd == 214){
-		len = intdata[1];
-		eventlst = intdata[4];
-		if(len > 7) lang_cause = intdata[9];
-		asprintf(&cmd, "AT+STKENV=%d, %d, %d", envcmd, eventlst, lang_cause);
-		err = at_send_command(cmd, NULL);
-		if(err < 0)
-			goto error;
 
-	}
-	else{
-		goto notsupported;
-	}
+	snprintf(cmd, sizeof(cmd), "AT+STKENV=%d, %d, %d", env.tag, arg1, arg2);
+	if (at_send_command(cmd, NULL) < 0)
+		goto error;
 
-	free(cmd);
-	free(intdata);
 	RIL_onRequestComplete(t, RIL_E_SUCCESS, NULL, 0);
 	return;
 
-notsupported:
-	free(cmd);
-	free(intdata);
-	RIL_onRequestComplete(t, RIL_E_REQUEST_NOT_SUPPORTED, NULL, 0);
-	return;
-
 error:
-	free(cmd);
-	free(intdata);
 	RIL_onRequestComplete(t, RIL_E_GENERIC_FAILURE, NULL, 0);
-	return;
 }
 
 static void requestSTKSendTerminalResponse(void * data, size_t datalen, RIL_Token t) {
-	int err = 0;
-	int len = 0;
-	int command = 0;
-	int result = 0;
-	int additionalInfo = 0;
-	int dcs = 0;
-	int offset = 0;
-	int optInfoLen = 0;
-	char *optInfo = NULL;
-	int i = 0;
-	char *hexdata = (char *)data;
-	char *cmd = NULL;
-	unsigned int *intdata = NULL;
-
-	len = strlen(data);
-	intdata = (unsigned int*)(alloca((len / 2) * sizeof(unsigned int)));
-	HexStr_to_DecInt(data, intdata);
-	command = intdata[2];
+	const char *hexdata = (const char *)data;
+	HexBuf buf;
+	StkTlv details, result;
+	char cmd[64 + 2 * HEX_MAX_BYTES];
+	int command, additionalInfo = 0;
+	int offset = 0, dcs = 0, textLen = 0;
+
+	if (hexdata == NULL || hex_decode(hexdata, strlen(hexdata), &buf) < 0
+			|| stk_tlv_find(buf.data, buf.len, STK_TAG_COMMAND_DETAILS, &details) <= 0
+			|| details.len < 3
+			|| stk_tlv_find(buf.data, buf.len, STK_TAG_RESULT, &result) <= 0
+			|| result.len < 1)
+		goto error;
 
-	switch(command){
-		case 21:
-			command = 33;
-			break;
-		case 20:
-			command = 32;
-			break;
-		case 15:
-			command = 21;
-			break;
-		case 22:
-			command = 34;
-			break;
-		case 23:
-			command = 35;
-			break;
-		case 24:
-			command = 36;
-			break;
+	/* the modem numbers a proactive command with its type of command
+	 * read as decimal digits, AT+STKTR takes the type itself */
+	switch (details.value[0]) {
+		case 20:	command = 0x20;	break;	/* PLAY TONE */
+		case 21:	command = 0x21;	break;	/* DISPLAY TEXT */
+		case 15:	command = 0x15;	break;	/* LAUNCH BROWSER */
+		case 22:	command = 0x22;	break;	/* GET INKEY */
+		case 23:	command = 0x23;	break;	/* GET INPUT */
+		case 24:	command = 0x24;	break;	/* SELECT ITEM */
 		default:
-			goto notsupported;
-			break;
+			RIL_onRequestComplete(t, RIL_E_REQUEST_NOT_SUPPORTED, NULL, 0);
+			return;
+	}
+	if (result.len > 1) {
+		additionalInfo = result.value[1];
+		offset = 1;
 	}
 
-	switch(command){
-		case 32:
-		case 33:{
-				result = intdata[11];
-				if(intdata[10] > 1)
-					additionalInfo = intdata[12];
-				asprintf(&cmd, "AT+STKTR=%d, %d, %d", command, result, additionalInfo);
-				err = at_send_command(cmd, NULL);
-				if(err < 0)
-					goto error;
-				break;
-			}
-		case 21:{
-				result = intdata[11];
-				asprintf(&cmd, "AT+STKTR=%d, %d", command, result);
-				err = at_send_command(cmd, NULL);
-				if(err < 0)
-					goto error;
-				break;
-			}
-		case 34:
-		case 35:
-		case 36:{
-				result = intdata[11];
-				if(intdata[10] > 1){
-					additionalInfo = intdata[12];
-					offset = 1;
-				}
-				optInfoLen = (intdata[13] + offset) * 2;
-				optInfo = alloca(optInfoLen * sizeof(char));
-				for(i = 0; i < optInfoLen; i++)
-					optInfo[i] = hexdata[15 + offset + i];
-
-				asprintf(&cmd, "AT+STKTR=%d, %d, %d, 0, %d,\"%s\"", command, result, additionalInfo, intdata[14+offset], optInfo);
+	switch (command) {
+		case 0x20:
+		case 0x21:
+			snprintf(cmd, sizeof(cmd), "AT+STKTR=%d, %d, %d",
+					command, result.value[0], additionalInfo);
+			break;
 
-				err = at_send_command(cmd, NULL);
-				if(err < 0)
-					goto error;
+		case 0x15:
+			snprintf(cmd, sizeof(cmd), "AT+STKTR=%d, %d",
+					command, result.value[0]);
+			break;
 
-				break;
-			}
+		case 0x22:
+		case 0x23:
+		case 0x24:
+			/* the text string (or item identifier) follows the result:
+			 * its length at byte 13, the coding scheme (or item) at 14
+			 * and the text from 15, one later with additional info.
+			 * The text is passed on as hex straight out of the request. */
+			if (buf.len < 15 + offset)
+				goto error;
+			dcs = buf.data[14 + offset];
+			textLen = buf.data[13 + offset] - 1;
+			if (textLen > buf.len - (15 + offset))
+				textLen = buf.len - (15 + offset);
+			if (textLen < 0)
+				textLen = 0;
+			snprintf(cmd, sizeof(cmd), "AT+STKTR=%d, %d, %d, 0, %d,\"%.*s\"",
+					command, result.value[0], additionalInfo, dcs,
+					2 * textLen, hexdata + 2 * (15 + offset));
+			break;
 	}
 
-	free(cmd);
-	free(intdata);
-	free(optInfo);
-	RIL_onRequestComplete(t, RIL_E_SUCCESS, NULL, 0);
-	return;
+	if (at_send_command(cmd, NULL) < 0)
+		goto error;
 
-notsupported:
-	free(cmd);
-	free(intdata);
-	free(optInfo);
-	RIL_onRequestComplete(t, RIL_E_REQUEST_NOT_SUPPORTED, NULL, 0);
+	RIL_onRequestComplete(t, RIL_E_SUCCESS, NULL, 0);
 	return;
 
 error:
-	free(cmd);
-	free(intdata);
-	free(optInfo);
 	RIL_onRequestComplete(t, RIL_E_GENERIC_FAILURE, NULL, 0);
 }
 
@@ -4201,21 +4722,56 @@ static void neighborRSSI(void *s) {
 	free(s);
 }
 
-static void requestNeighboringCellIds(void * data, size_t datalen, RIL_Token t) {
-	int err=1;
-	int response[2];
+/* Neighbor cell service. Location services ask for the neighbor list
+ * often, so a background poll keeps a snapshot that the request is
+ * answered from right away. The poll runs fast while the serving cell
+ * keeps changing, backs off while we stand still and stops as soon as
+ * a poll interval went by without a request. A snapshot older than
+ * NCELL_MAX_AGE_MS is not served, the request queries the modem.
+ */
+#define MAX_NEIGHBORS		16
+#define NCELL_POLL_MIN_SEC	5
+#define NCELL_POLL_MAX_SEC	60
+#define NCELL_MAX_AGE_MS	(3 * 1000)
+
+typedef struct {
+	int valid;
+	int is_2g;
+	int rssi;		/* serving cell, CSQ units on 2G */
+	int count;
+	long long updated;
+	char servingCid[16];
+	RIL_NeighboringCell cells[MAX_NEIGHBORS];
+	RIL_NeighboringCell *pp_cells[MAX_NEIGHBORS];
+	char cids[MAX_NEIGHBORS][12];
+} NeighborSnapshot;
+
+/* Requests are answered from s_ncell[s_ncellFront]; the poll fills the
+ * other buffer and flips s_ncellFront under s_ncell_mutex. */
+static NeighborSnapshot s_ncell[2];
+static int s_ncellFront;
+static pthread_mutex_t s_ncell_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int s_ncellPolling;
+static int s_ncellIntervalSec = NCELL_POLL_MIN_SEC;
+static long long s_ncellLastRequest;
+static int s_ncellLastRssi = -1;
+static unsigned int s_ncellPolls;
+static unsigned int s_ncellHits;
+
+/**
+ * Sends AT+Q2GNCELL or AT+Q3GNCELL, depending on the current radio
+ * technology, and parses the answer into *p_snap.
+ * Returns 0 on success.
+ */
+static int neighborCellsQuery(NeighborSnapshot *p_snap)
+{
 	ATResponse *p_response = NULL;
-	char *line, *p;
-	int commas;
-	int skip;
-	int i;
-	int count = 0, len;
-	int cur_cid;
+	ATTokView tok;
+	const char *line;
 	int is_2g = (gsm_rtype == 0 || gsm_rtype == 1 || gsm_rtype == 3);
 	char cmd[] = "AT+Q3GNCELL";
 	char prefix[] = "+Q3GNCELL:";
-
-	RIL_NeighboringCell **pp_cellIds, *pp_dummy;
+	int err, count, cid, rssi, i;
 
 	if (is_2g) {
 		cmd[4] = '2';
@@ -4229,133 +4785,258 @@ static void requestNeighboringCellIds(void * data, size_t datalen, RIL_Token t)
 	/* my cid, my rssi, # of neighbors [[,neighbor, rssi] ...] */
 	line = p_response->p_intermediates->line;
 
-	err = at_tok_start(&line);
-	if (err < 0) goto error;
+	if (at_tok_view_start(&line) < 0
+			|| at_tok_view_next(&line, &tok) < 0)
+		goto error;
+	at_tok_view_copy(&tok, p_snap->servingCid, sizeof(p_snap->servingCid));
+	if (at_tok_view_next(&line, &tok) < 0
+			|| at_tok_view_toint(&tok, 10, &p_snap->rssi) < 0)
+		goto error;
+	if (at_tok_view_next(&line, &tok) < 0
+			|| at_tok_view_toint(&tok, 10, &count) < 0)
+		goto error;
 
-	/* CID,rssi */
-	err = at_tok_nextstr(&line, &p);
-	if (err < 0) goto error;
-	err = at_tok_nextint(&line, &response[0]);
-	if (err < 0) goto error;
+	if (count > MAX_NEIGHBORS)
+		count = MAX_NEIGHBORS;
+	if (count < 0)
+		count = 0;
+	for (i = 0; i < count; i++) {
+		if (at_tok_view_next(&line, &tok) < 0
+				|| at_tok_view_toint(&tok, is_2g ? 16 : 10, &cid) < 0)
+			goto error;
+		if (at_tok_view_next(&line, &tok) < 0
+				|| at_tok_view_toint(&tok, 10, &rssi) < 0)
+			goto error;
+		snprintf(p_snap->cids[i], sizeof(p_snap->cids[i]), "%x", cid);
+		p_snap->cells[i].cid = p_snap->cids[i];
+		p_snap->cells[i].rssi = rssi;
+		p_snap->pp_cells[i] = &p_snap->cells[i];
+	}
+
+	p_snap->count = count;
+	p_snap->is_2g = is_2g;
+	p_snap->updated = getMonotonicMsec();
+	p_snap->valid = 1;
+	at_response_free(p_response);
+	return 0;
+
+error:
+	at_response_free(p_response);
+	return -1;
+}
+
+/**
+ * Refreshes the back buffer and makes it current. *p_moved is set if
+ * the serving cell changed since the previous snapshot.
+ * Must run on the request thread. Returns 0 on success.
+ */
+static int neighborCellsRefresh(int *p_moved)
+{
+	NeighborSnapshot *front, *back;
+	int moved;
+
+	back = &s_ncell[!s_ncellFront];
+	s_ncellPolls++;
+	if (neighborCellsQuery(back) < 0)
+		return -1;
+
+	pthread_mutex_lock(&s_ncell_mutex);
+	front = &s_ncell[s_ncellFront];
+	moved = front->valid && strcmp(front->servingCid, back->servingCid);
+	s_ncellFront = !s_ncellFront;
+	pthread_mutex_unlock(&s_ncell_mutex);
+
+	if (p_moved)
+		*p_moved = moved;
 
 	/* Dunno how the 3G units map to CSQ */
-	if (is_2g) {
+	if (phone_is == MODE_GSM && back->is_2g && back->rssi != s_ncellLastRssi) {
+		int response[2] = {back->rssi, 99};
+		RIL_SignalStrength rs = {{99,99},{-1,-1},{-1,-1,-1}};
+
+		s_ncellLastRssi = back->rssi;
 		signalStrength[0] = response[0];
-		signalStrength[1] = 99;
+		signalStrength[1] = response[1];
+		resp2Strength(response, &rs);
+		RIL_onUnsolicitedResponse(RIL_UNSOL_SIGNAL_STRENGTH, &rs, sizeof(rs));
 	}
+	return 0;
+}
 
-	err = at_tok_nextint(&line, &count);
-	if (err < 0) goto error;
-
-	/* No neighbors found */
-	if (count < 1) {
-		len = 0;
-		pp_cellIds = &pp_dummy;
-		pp_dummy = NULL;
-		goto done;
+static void pollNeighborCells(void *param)
+{
+	struct timeval tv = {0, 0};
+	RIL_RadioState radio;
+	int moved = 0;
+
+	/* s_ncellIntervalSec is still the wait that just ended */
+	radio = currentState();
+	if (radio == RADIO_STATE_OFF || radio == RADIO_STATE_UNAVAILABLE
+			|| getMonotonicMsec() - s_ncellLastRequest > s_ncellIntervalSec * 1000LL) {
+		s_ncellPolling = 0;
+		return;
 	}
 
-	pp_cellIds = (RIL_NeighboringCell **)alloca(count * sizeof(RIL_NeighboringCell *));
+	if (neighborCellsRefresh(&moved) == 0 && moved)
+		s_ncellIntervalSec = NCELL_POLL_MIN_SEC;
+	else if (s_ncellIntervalSec < NCELL_POLL_MAX_SEC)
+		s_ncellIntervalSec *= 2;
+	if (s_ncellIntervalSec > NCELL_POLL_MAX_SEC)
+		s_ncellIntervalSec = NCELL_POLL_MAX_SEC;
 
-	for (i=0; i<count; i++) {
-		int cid;
-		pp_cellIds[i] = (RIL_NeighboringCell *)alloca(sizeof(RIL_NeighboringCell)+10);
-		pp_cellIds[i]->cid = (char *)(pp_cellIds[i] + 1);
-		if (is_2g)
-			err = at_tok_nexthexint(&line, &cid);
-		else
-			err = at_tok_nextint(&line, &cid);
-		if (err < 0) goto error;
-		sprintf(pp_cellIds[i]->cid, "%x", cid);
-		err = at_tok_nextint(&line, &pp_cellIds[i]->rssi);
-		if (err < 0) goto error;
-	}
-	len = count * sizeof(*pp_cellIds);
-#if 0
-	/* Ok you have to be careful here
-	 * The solicited version of the CREG response is
-	 * +CREG: n, stat, [lac, cid]
-	 * and the unsolicited version is
-	 * +CREG: stat, [lac, cid]
-	 * The <n> parameter is basically "is unsolicited creg on?"
-	 * which it should always be
-	 *
-	 * Now we should normally get the solicited version here,
-	 * but the unsolicited version could have snuck in
-	 * so we have to handle both
-	 *
-	 * Also since the LAC and CID are only reported when registered,
-	 * we can have 1, 2, 3, or 4 arguments here
-	 * 
-	 * finally, a +CGREG: answer may have a fifth value that corresponds
-	 * to the network type, as in;
-	 *
-	 *   +CGREG: n, stat [,lac, cid [,networkType]]
-	 */
+	tv.tv_sec = s_ncellIntervalSec;
+	RIL_requestTimedCallback(pollNeighborCells, NULL, &tv);
+}
 
-	/* count number of commas */
-	commas = 0;
-	for (p = line ; *p != '\0' ;p++) {
-		if (*p == ',') commas++;
-	}
-	switch (commas) {
-		case 0: /* +CREG: <stat> */
-		case 1: /* +CREG: <n>, <stat> */
-			goto error;
-			break;
+static void requestNeighboringCellIds(void * data, size_t datalen, RIL_Token t)
+{
+	NeighborSnapshot *snap;
+	long long now = getMonotonicMsec();
+	int fresh;
 
-		case 2: /* +CREG: <stat>, <lac>, <cid> */
-			err = at_tok_nextint(&line, &response[0]);
-			if (err < 0) goto error;
-			err = at_tok_nexthexint(&line, &response[1]);
-			if (err < 0) goto error;
-			p = line;
-			err = at_tok_nexthexint(&line, &cur_cid);
-			if (err < 0) goto error;
-			err = at_tok_nextstr(&p, &p_cellIds[0].cid);
-			break;
-		case 3: /* +CREG: <n>, <stat>, <lac>, <cid> */
-			err = at_tok_nextint(&line, &skip);
-			if (err < 0) goto error;
-			err = at_tok_nextint(&line, &response[0]);
-			if (err < 0) goto error;
-			err = at_tok_nexthexint(&line, &response[1]);
-			if (err < 0) goto error;
-			p = line;
-			err = at_tok_nexthexint(&line, &cur_cid);
-			if (err < 0) goto error;
-			p_cellIds[0].rssi=2;
-			err = at_tok_nextstr(&p, &p_cellIds[0].cid);
-			break;
-		case 4: /* +CGREG: <n>, <stat>, <lac>, <cid>, <networkType> */
-			err = at_tok_nextint(&line, &skip);
-			if (err < 0) goto error;
-			err = at_tok_nextint(&line, &response[0]);
-			if (err < 0) goto error;
-			err = at_tok_nexthexint(&line, &response[1]);
-			if (err < 0) goto error;
-			p = line;
-			err = at_tok_nexthexint(&line, &cur_cid);
-			if (err < 0) goto error;
-			err = at_tok_nextstr(&p, &p_cellIds[0].cid);
-			err = at_tok_nexthexint(&line, &response[3]);
-			if (err < 0) goto error;
-			count = 4;
-			break;
-		default:
-			goto error;
+	s_ncellLastRequest = now;
+
+	pthread_mutex_lock(&s_ncell_mutex);
+	snap = &s_ncell[s_ncellFront];
+	fresh = snap->valid && now - snap->updated < NCELL_MAX_AGE_MS;
+	pthread_mutex_unlock(&s_ncell_mutex);
+
+	if (fresh)
+		s_ncellHits++;
+	else if (neighborCellsRefresh(NULL) < 0)
+		goto error;
+
+	if (!s_ncellPolling) {
+		struct timeval tv = {NCELL_POLL_MIN_SEC, 0};
+
+		s_ncellPolling = 1;
+		s_ncellIntervalSec = NCELL_POLL_MIN_SEC;
+		RIL_requestTimedCallback(pollNeighborCells, NULL, &tv);
 	}
-	len = sizeof(*pp_cellIds);
-#endif
 
-done:
-	RIL_onRequestComplete(t, RIL_E_SUCCESS, pp_cellIds, len);
-	at_response_free(p_response);
+	pthread_mutex_lock(&s_ncell_mutex);
+	snap = &s_ncell[s_ncellFront];
+	RIL_onRequestComplete(t, RIL_E_SUCCESS, snap->pp_cells,
+			snap->count * sizeof(RIL_NeighboringCell *));
+	pthread_mutex_unlock(&s_ncell_mutex);
 	return;
 
 error:
 	RIL_onRequestComplete(t, RIL_E_GENERIC_FAILURE, NULL, 0);
-	at_response_free(p_response);
+}
+
+static void requestRilStats(RIL_Token t)
+{
+	char lines[MAX_RIL_STATS][64];
+	char *response[MAX_RIL_STATS];
+	ATWatchdogStats wd;
+	ATWriteStats ws;
+	RilState st;
+	unsigned int traced, untraced;
+	int n = 0;
+
+	at_get_watchdog_stats(&wd);
+	at_get_write_stats(&ws);
+
+	snprintf(lines[n], sizeof(lines[n]), "call_state_suppressed=%u",
+			s_callStateSuppressed);
+	response[n] = lines[n];
+	n++;
+	snprintf(lines[n], sizeof(lines[n]), "netcache_hits=%u", s_netCacheHits);
+	response[n] = lines[n];
+	n++;
+	snprintf(lines[n], sizeof(lines[n]), "netcache_misses=%u", s_netCacheMisses);
+	response[n] = lines[n];
+	n++;
+	snprintf(lines[n], sizeof(lines[n]), "ncell_polls=%u", s_ncellPolls);
+	response[n] = lines[n];
+	n++;
+	snprintf(lines[n], sizeof(lines[n]), "ncell_hits=%u", s_ncellHits);
+	response[n] = lines[n];
+	n++;
+	snprintf(lines[n], sizeof(lines[n]), "log_dropped=%u", rlog_dropped());
+	response[n] = lines[n];
+	n++;
+	snprintf(lines[n], sizeof(lines[n]), "at_timeouts=%u", wd.timeouts);
+	response[n] = lines[n];
+	n++;
+	snprintf(lines[n], sizeof(lines[n]), "at_resyncs=%u", wd.resyncs);
+	response[n] = lines[n];
+	n++;
+	snprintf(lines[n], sizeof(lines[n]), "at_escalations=%u", wd.escalations);
+	response[n] = lines[n];
+	n++;
+	snprintf(lines[n], sizeof(lines[n]), "at_last_resync_ms=%lld",
+			wd.lastRecoveryMsec);
+	response[n] = lines[n];
+	n++;
+	snprintf(lines[n], sizeof(lines[n]), "at_max_resync_ms=%lld",
+			wd.maxRecoveryMsec);
+	response[n] = lines[n];
+	n++;
+	snprintf(lines[n], sizeof(lines[n]), "at_reopens=%u", s_channelReopens);
+	response[n] = lines[n];
+	n++;
+	snprintf(lines[n], sizeof(lines[n]), "at_last_reopen_ms=%lld",
+			s_lastReopenMsec);
+	response[n] = lines[n];
+	n++;
+	snprintf(lines[n], sizeof(lines[n]), "at_commands=%u", ws.commands);
+	response[n] = lines[n];
+	n++;
+	snprintf(lines[n], sizeof(lines[n]), "at_write_syscalls=%u", ws.syscalls);
+	response[n] = lines[n];
+	n++;
+	snprintf(lines[n], sizeof(lines[n]), "at_write_bytes=%llu", ws.bytes);
+	response[n] = lines[n];
+	n++;
+	snprintf(lines[n], sizeof(lines[n]), "sms_sent=%u", s_smsSent);
+	response[n] = lines[n];
+	n++;
+	snprintf(lines[n], sizeof(lines[n]), "sms_burst_segments=%u",
+			s_smsBurstSegments);
+	response[n] = lines[n];
+	n++;
+	rtrace_counts(&traced, &untraced);
+	snprintf(lines[n], sizeof(lines[n]), "trace_records=%u", traced);
+	response[n] = lines[n];
+	n++;
+	snprintf(lines[n], sizeof(lines[n]), "trace_dropped=%u", untraced);
+	response[n] = lines[n];
+	n++;
+	rilstate_read(&st);
+	snprintf(lines[n], sizeof(lines[n]), "state=radio %d sim %d data %d v%u",
+			st.v[RILSTATE_RADIO], st.v[RILSTATE_SIM], st.v[RILSTATE_DATA],
+			st.version);
+	response[n] = lines[n];
+	n++;
+	snprintf(lines[n], sizeof(lines[n]), "data_list_events=%u",
+			s_dataListEvents);
+	response[n] = lines[n];
+	n++;
+	snprintf(lines[n], sizeof(lines[n]), "data_list_queries=%u",
+			s_dataListQueries);
+	response[n] = lines[n];
+	n++;
+	snprintf(lines[n], sizeof(lines[n]), "data_list_sent=%u", s_dataListSent);
+	response[n] = lines[n];
+	n++;
+	if (s_smsSent) {
+		snprintf(lines[n], sizeof(lines[n]), "sms_avg_send_ms=%lld",
+				s_smsSendMsecTotal / s_smsSent);
+		response[n] = lines[n];
+		n++;
+	}
+	if (ws.commands) {
+		snprintf(lines[n], sizeof(lines[n]),
+				"at_write_per_command=%.2f syscalls, %.1f bytes",
+				(double)ws.syscalls / ws.commands,
+				(double)ws.bytes / ws.commands);
+		response[n] = lines[n];
+		n++;
+	}
+
+	RIL_onRequestComplete(t, RIL_E_SUCCESS, response, n * sizeof(char *));
 }
 
 
@@ -4377,9 +5058,11 @@ error:
 onRequest (int request, void *data, size_t datalen, RIL_Token t)
 {
 	ATResponse *p_response;
+	RIL_RadioState radio;
 	int err;
 
-	LOGD("onRequest: %s (%d)", requestToString(request), request);
+	RLOGD(RLOG_REQ, "onRequest: %s (%d)", requestToString(request), request);
+	RTRACE(RTRACE_REQUEST, request, t, 0, datalen, requestToString(request));
 
 	/* These requests are always valid */
 	if (request == RIL_REQUEST_BASEBAND_VERSION ||
@@ -4389,7 +5072,8 @@ onRequest (int request, void *data, size_t datalen, RIL_Token t)
 	/* Ignore all requests except RIL_REQUEST_GET_SIM_STATUS
 	 * when RADIO_STATE_UNAVAILABLE.
 	 */
-	if (sState == RADIO_STATE_UNAVAILABLE
+	radio = currentState();
+	if (radio == RADIO_STATE_UNAVAILABLE
 			&& !(request == RIL_REQUEST_GET_SIM_STATUS
 				|| request == RIL_REQUEST_GET_IMEI
 				|| request == RIL_REQUEST_GET_IMEISV
@@ -4402,7 +5086,7 @@ onRequest (int request, void *data, size_t datalen, RIL_Token t)
 	/* Ignore all non-power requests when RADIO_STATE_OFF
 	 * (except RIL_REQUEST_GET_SIM_STATUS)
 	 */
-	if (sState == RADIO_STATE_OFF
+	if (radio == RADIO_STATE_OFF
 			&& !(request == RIL_REQUEST_RADIO_POWER
 				|| request == RIL_REQUEST_GET_SIM_STATUS
 				|| request == RIL_REQUEST_GET_IMEI
@@ -4805,7 +5489,7 @@ ok:
 	static RIL_RadioState
 currentState()
 {
-	return sState;
+	return rilstate_get(RILSTATE_RADIO);
 }
 /**
  * Call from RIL to us to find out whether a specific request code
@@ -4839,12 +5523,14 @@ static const char * getVersion(void)
 setRadioState(RIL_RadioState newState)
 {
 	RIL_RadioState oldState;
+	int closed;
 
 	pthread_mutex_lock(&s_state_mutex);
 
-	oldState = sState;
+	oldState = currentState();
+	closed = rilstate_get(RILSTATE_CLOSED);
 
-	if (s_closed > 0) {
+	if (closed > 0) {
 		// If we're closed, the only reasonable state is
 		// RADIO_STATE_UNAVAILABLE
 		// This is here because things on the main thread
@@ -4853,16 +5539,23 @@ setRadioState(RIL_RadioState newState)
 		newState = RADIO_STATE_UNAVAILABLE;
 	}
 
-	if (sState != newState || s_closed > 0) {
-		sState = newState;
-
-		pthread_cond_broadcast (&s_state_cond);
+	if (oldState != newState || closed > 0) {
+		rilstate_set(RILSTATE_RADIO, newState);
+		/* the framework drops its call list on radio state changes */
+		s_lastCalls.count = 0;
+		netCacheReset();
+		pthread_mutex_lock(&s_datacalls_mutex);
+		s_dataCalls.valid = 0;
+		pthread_mutex_unlock(&s_datacalls_mutex);
+		/* the SIM may have changed, and CMMS doesn't survive a reset */
+		s_smscPdu[0] = '\0';
+		s_smsBurst = 0;
 	}
 
 	pthread_mutex_unlock(&s_state_mutex);
 
 	/* do these outside of the mutex */
-	if (sState != oldState) {
+	if (newState != oldState) {
 		RIL_onUnsolicitedResponse (RIL_UNSOL_RESPONSE_RADIO_STATE_CHANGED,
 				NULL, 0);
 
@@ -4871,9 +5564,9 @@ setRadioState(RIL_RadioState newState)
 		 * Currently, this doesn't happen, but if that changes then these
 		 * will need to be dispatched on the request thread
 		 */
-		if (sState == Radio_READY) {
+		if (newState == Radio_READY) {
 			onRadioReady();
-		} else if (sState == Radio_NOT_READY) {
+		} else if (newState == Radio_NOT_READY) {
 			onRadioPowerOn();
 		}
 	}
@@ -4884,12 +5577,14 @@ setRadioState(RIL_RadioState newState)
 getSIMStatus()
 {
 	ATResponse *p_response = NULL;
+	RIL_RadioState radio;
 	int err;
 	int ret;
 	char *cpinLine;
 	char *cpinResult;
 
-	if (sState == RADIO_STATE_OFF || sState == RADIO_STATE_UNAVAILABLE) {
+	radio = currentState();
+	if (radio == RADIO_STATE_OFF || radio == RADIO_STATE_UNAVAILABLE) {
 		ret = SIM_NOT_READY;
 		goto done;
 	}
@@ -4937,27 +5632,23 @@ getSIMStatus()
 		ret = SIM_PUK;
 		goto done;
 	} else if (0 == strcmp (cpinResult, "PH-NET PIN")) {
-		return SIM_NETWORK_PERSONALIZATION;
+		ret = SIM_NETWORK_PERSONALIZATION;
+		goto done;
 	} else if (0 != strcmp (cpinResult, "READY"))  {
 		/* we're treating unsupported lock types as "sim absent" */
 		ret = SIM_ABSENT;
 		goto done;
 	} else {
 		/* Is it really ready? Not until it can tell us what
-		 * its IMSI is
+		 * its IMSI is. If not, pollSIMState asks again on its
+		 * timer rather than this blocking the request thread.
 		 */
 		ATResponse *resp2 = NULL;
-		int i;
-		for (i=0; i<10; i++) {
-			err = at_send_command_numeric("AT+CIMI", &resp2);
-			if (err < 0 || !resp2->success)
-				err = -1;
-			at_response_free(resp2);
-			if (err >= 0)
-				break;
-			sleep(2);
-		}
-		if (i == 10) {
+		err = at_send_command_numeric("AT+CIMI", &resp2);
+		if (err < 0 || !resp2->success)
+			err = -1;
+		at_response_free(resp2);
+		if (err < 0) {
 			ret = SIM_NOT_READY;
 			goto done;
 		}
@@ -4972,6 +5663,7 @@ getSIMStatus()
 
 done:
 	at_response_free(p_response);
+	rilstate_set(RILSTATE_SIM, ret);
 	return ret;
 }
 
@@ -5061,7 +5753,7 @@ static void pollSIMState (void *param)
 	ATResponse *p_response;
 	int ret;
 
-	if (sState != RADIO_STATE_SIM_NOT_READY) {
+	if (currentState() != RADIO_STATE_SIM_NOT_READY) {
 		// no longer valid to poll
 		return;
 	}
@@ -5303,17 +5995,6 @@ no_gsm:
 #endif
 }
 
-static void waitForClose()
-{
-	pthread_mutex_lock(&s_state_mutex);
-
-	while (s_closed == 0) {
-		pthread_cond_wait(&s_state_cond, &s_state_mutex);
-	}
-
-	pthread_mutex_unlock(&s_state_mutex);
-}
-
 /**
  * Called by atchannel when an unsolicited line appears
  * This is called on atchannel's reader thread. AT commands may
@@ -5327,7 +6008,7 @@ static void onUnsolicited (const char *s, const char *sms_pdu)
 	/* Ignore unsolicited responses until we're initialized.
 	 * This is OK because the RIL library will poll for initial state
 	 */
-	if (sState == RADIO_STATE_UNAVAILABLE) {
+	if (currentState() == RADIO_STATE_UNAVAILABLE) {
 		return;
 	}
 
@@ -5367,14 +6048,26 @@ static void onUnsolicited (const char *s, const char *sms_pdu)
 			}
 		}
 		if (err < 2) {
-			if (!resentCallState) {
-				resentCallState = 1;
+			/* A RING for a call the framework doesn't know about yet is
+			 * always a change, report it without the AT+CLCC round trip.
+			 * Later RINGs of the same call go through the diff below.
+			 */
+			if ((s[0] == '2' || strStartsWith(s, "+CRING:"))
+					&& !callTableHasIncoming(&s_lastCalls)
+					&& resentCallState != 2) {
 				RIL_onUnsolicitedResponse (
 					RIL_UNSOL_RESPONSE_CALL_STATE_CHANGED,
 					NULL, 0);
+				resentCallState = 2;	/* notification needs ack */
+			} else if (!resentCallState) {
+				/* can't issue AT commands here -- let sendCallStateChanged
+				 * check on the request thread whether the call list changed
+				 */
+				resentCallState = 1;
+				RIL_requestTimedCallback (sendCallStateChanged, NULL, NULL);
 			}
 			if (err == 1)
-				RIL_requestTimedCallback (onDataCallListChanged, NULL, NULL);
+				scheduleDataCallListRefresh(1);
 		}
 	} else if (strStartsWith(s,"+XCIEV:")
 			|| strStartsWith(s,"$HTC_CSQ:")
@@ -5384,6 +6077,7 @@ static void onUnsolicited (const char *s, const char *sms_pdu)
 	} else if (strStartsWith(s,"+CREG:")
 			|| strStartsWith(s,"+CGREG:")
 			|| strStartsWith(s,"$HTC_SYSTYPE:")) {
+		netCacheUnsolicited(s);
 		if (!got_state_change) {
 			got_state_change=1;
 			if (s[0] == '+')
@@ -5394,7 +6088,7 @@ static void onUnsolicited (const char *s, const char *sms_pdu)
 		}
 /*		RIL_requestTimedCallback (onDataCallListChanged, NULL, NULL); */
 	} else if (strStartsWith(s, "+CMT:")) {
-		LOGD("GSM_PDU=%s\n",sms_pdu);
+		RLOGD(RLOG_SMS, "GSM_PDU=%s", sms_pdu);
 		if(phone_is == MODE_CDMA) {
 			RIL_CDMA_SMS_Message msg;
 
@@ -5425,11 +6119,10 @@ static void onUnsolicited (const char *s, const char *sms_pdu)
 		 * but right now we don't since extranous
 		 * RIL_UNSOL_DATA_CALL_LIST_CHANGED calls are tolerated
 		 */
-		/* can't issue AT commands here -- call on main thread */
-		RIL_requestTimedCallback (onDataCallListChanged, NULL, NULL);
+		unsolicitedCGEV(s);
 #ifdef WORKAROUND_FAKE_CGEV
 	} else if (strStartsWith(s, "+CME ERROR: 150")) {
-		RIL_requestTimedCallback (onDataCallListChanged, NULL, NULL);
+		scheduleDataCallListRefresh(1);
 #endif /* WORKAROUND_FAKE_CGEV */
 	} else if (strStartsWith(s, "$HTC_ERIIND:")) {
 		unsolicitedERI(s);
@@ -5438,30 +6131,34 @@ static void onUnsolicited (const char *s, const char *sms_pdu)
 	}
 }
 
+static void openChannel(void *param);
+
 /* Called on command or reader thread */
 static void onATReaderClosed()
 {
 	LOGI("AT channel closed\n");
+	if (!s_channelClosedAt)
+		s_channelClosedAt = getMonotonicMsec();
 	at_close();
-	s_closed = 1;
+	rilstate_set(RILSTATE_CLOSED, 1);
 
 	setRadioState (RADIO_STATE_UNAVAILABLE);
+	rilloop_post(openChannel, NULL);
 }
 
-#if 0
-/* Called on command thread */
+/* Called on command thread, once atchannel failed to resync in place */
 static void onATTimeout()
 {
 	LOGI("AT channel timeout; closing\n");
+	if (!s_channelClosedAt)
+		s_channelClosedAt = getMonotonicMsec();
 	at_close();
 
-	s_closed = 1;
-
-	/* FIXME cause a radio reset here */
+	rilstate_set(RILSTATE_CLOSED, 1);
 
 	setRadioState (RADIO_STATE_UNAVAILABLE);
+	rilloop_post(openChannel, NULL);
 }
-#endif
 
 static void usage(char *s)
 {
@@ -5473,64 +6170,90 @@ static void usage(char *s)
 #endif
 }
 
-	static void *
-mainLoop(void *param)
+/**
+ * Opens the AT channel, on the event loop thread. Posted at startup and
+ * whenever the channel closed; retries on s_reopenTimer with a backoff.
+ */
+static void openChannel(void *param)
 {
-	int fd;
-	int ret;
+	int fd = -1;
 
-	AT_DUMP("== ", "entering mainLoop()", -1 );
-	at_set_on_reader_closed(onATReaderClosed);
-#if 0
-	/* /dev/smd0 doesn't survive a close, can't be re-opened */
-	at_set_on_timeout(onATTimeout);
-#endif
+	if (rilstate_get(RILSTATE_CLOSED) == 0) {
+		/* both close paths raced to post this */
+		return;
+	}
+
+	if (s_port > 0) {
+		fd = socket_loopback_client(s_port, SOCK_STREAM);
+	} else if (s_device_socket) {
+		fd = socket_local_client( s_device_path,
+				ANDROID_SOCKET_NAMESPACE_FILESYSTEM,
+				SOCK_STREAM );
+	} else if (s_device_path != NULL) {
+		fd = open (s_device_path, O_RDWR);
+		if ( fd >= 0 && !memcmp( s_device_path, "/dev/ttyS", 9 ) ) {
+
+			/* disable echo on serial ports */
+			struct termios  ios;
+			tcgetattr( fd, &ios );
+			ios.c_lflag = 0;  /* disable ECHO, ICANON, etc... */
+			tcsetattr( fd, TCSANOW, &ios );
+		}
+	}
 
-	for (;;) {
+	if (fd >= 0 && at_open(fd, onUnsolicited) < 0) {
+		LOGE ("AT error on at_open\n");
+		close(fd);
 		fd = -1;
-		while  (fd < 0) {
-			if (s_port > 0) {
-				fd = socket_loopback_client(s_port, SOCK_STREAM);
-			} else if (s_device_socket) {
-				fd = socket_local_client( s_device_path,
-						ANDROID_SOCKET_NAMESPACE_FILESYSTEM,
-						SOCK_STREAM );
-			} else if (s_device_path != NULL) {
-				fd = open (s_device_path, O_RDWR);
-				if ( fd >= 0 && !memcmp( s_device_path, "/dev/ttyS", 9 ) ) {
-
-					/* disable echo on serial ports */
-					struct termios  ios;
-					tcgetattr( fd, &ios );
-					ios.c_lflag = 0;  /* disable ECHO, ICANON, etc... */
-					tcsetattr( fd, TCSANOW, &ios );
-				}
-			}
+	} else if (fd < 0) {
+		LOGE("opening AT interface: %s, retrying in %lld ms",
+				strerror(errno), s_reopenBackoff);
+	}
 
-			if (fd < 0) {
-				perror ("opening AT interface. retrying...");
-				sleep(10);
-				/* never returns */
-			}
-		}
+	if (fd < 0) {
+		if (s_reopenTimer != NULL)
+			rilloop_timer_set(s_reopenTimer, s_reopenBackoff);
+		s_reopenBackoff *= 2;
+		if (s_reopenBackoff > REOPEN_BACKOFF_MAX_MS)
+			s_reopenBackoff = REOPEN_BACKOFF_MAX_MS;
+		return;
+	}
+	s_reopenBackoff = REOPEN_BACKOFF_MIN_MS;
 
-		s_closed = 0;
-		ret = at_open(fd, onUnsolicited);
+	if (s_channelClosedAt) {
+		s_lastReopenMsec = getMonotonicMsec() - s_channelClosedAt;
+		s_channelReopens++;
+		s_channelClosedAt = 0;
+		LOGI("AT channel reopened after %lld ms", s_lastReopenMsec);
+	}
 
-		if (ret < 0) {
-			LOGE ("AT error %d on at_open\n", ret);
-			return 0;
-		}
+	rilstate_set(RILSTATE_CLOSED, 0);
 
-		RIL_requestTimedCallback(initializeCallback, NULL, &TIMEVAL_0);
+	RIL_requestTimedCallback(initializeCallback, NULL, &TIMEVAL_0);
+}
+
+/**
+ * Sets up the event loop and queues the first open of the AT channel.
+ * The caller then runs rilloop_run().
+ * returns 0 on success, -1 on error
+ */
+static int startEventLoop()
+{
+	AT_DUMP("== ", "starting event loop", -1 );
+	at_set_on_reader_closed(onATReaderClosed);
+	/* atchannel resyncs in place first, closing is the last resort.
+	 * /dev/smd0 is not known to survive a close on every device, so
+	 * it is only done where persist.ril.at.reopen says it does. */
+	if (s_reopenOnTimeout)
+		at_set_on_timeout(onATTimeout);
 
-		// Give initializeCallback a chance to dispatched, since
-		// we don't presently have a cancellation mechanism
-		sleep(1);
+	if (rilloop_init() < 0)
+		return -1;
+	ifwait_init();
+	s_reopenTimer = rilloop_timer_new(openChannel, NULL);
 
-		waitForClose();
-		LOGI("Re-opening after close");
-	}
+	rilstate_set(RILSTATE_CLOSED, 1);
+	return rilloop_post(openChannel, NULL);
 }
 
 #ifdef RIL_SHLIB
@@ -5581,8 +6304,20 @@ const RIL_RadioFunctions *RIL_Init(const struct RIL_Env *env, int argc, char **a
 	int opt;
 	pthread_attr_t attr;
 	char buffer[32];
+	char value[PROPERTY_VALUE_MAX];
 
 	s_rilenv = env;
+	rlog_init();
+	rtrace_init();
+	rilstate_set(RILSTATE_RADIO, RADIO_STATE_UNAVAILABLE);
+	rilstate_set(RILSTATE_SIM, SIM_NOT_READY);
+
+	property_get("persist.ril.sms_speculative", value, "0");
+	at_set_sms_speculative(atoi(value));
+	property_get("persist.ril.at.timeout_ms", value, "0");
+	at_set_default_timeout(atoll(value));
+	property_get("persist.ril.at.reopen", value, "0");
+	s_reopenOnTimeout = atoi(value);
 
 	fd=open("/sys/class/htc_hw/radio", O_RDONLY);
 	read(fd, buffer, 32);
@@ -5635,9 +6370,14 @@ const RIL_RadioFunctions *RIL_Init(const struct RIL_Env *env, int argc, char **a
 		LOGI("Opening tty device %s\n", s_device_path);
 	}
 
+	if (startEventLoop() < 0) {
+		LOGE("cannot start the event loop");
+		return NULL;
+	}
+
 	pthread_attr_init (&attr);
 	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
-	ret = pthread_create(&s_tid_mainloop, &attr, mainLoop, NULL);
+	ret = pthread_create(&s_tid_mainloop, &attr, rilloop_run, NULL);
 
 	return &s_callbacks;
 }
@@ -5678,9 +6418,15 @@ int main (int argc, char **argv)
 		usage(argv[0]);
 	}
 
+	rilstate_set(RILSTATE_RADIO, RADIO_STATE_UNAVAILABLE);
+	rilstate_set(RILSTATE_SIM, SIM_NOT_READY);
 	RIL_register(&s_callbacks);
 
-	mainLoop(NULL);
+	if (startEventLoop() < 0) {
+		LOGE("cannot start the event loop");
+		return -1;
+	}
+	rilloop_run(NULL);
 
 	return 0;
 }
@@ -0,0 +1,112 @@
+/*
+ * Event driven waits on network interface state, see ifwait.h
+ */
+
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include "ifwait.h"
+#include "misc.h"
+#include "rilloop.h"
+#include "rilstate.h"
+
+#define LOG_TAG "RIL"
+#include <utils/Log.h>
+
+/* longest sleep without an event */
+#define IFWAIT_IDLE_MSEC	1000
+/* recheck interval, and for how long, after an event */
+#define IFWAIT_SETTLE_MSEC	50
+#define IFWAIT_SETTLE_SPAN_MSEC	2000
+
+static int openRtnetlink(void)
+{
+	struct sockaddr_nl addr;
+	int fd;
+
+	fd = socket(AF_NETLINK, SOCK_DGRAM, NETLINK_ROUTE);
+	if (fd < 0)
+		return -1;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.nl_family = AF_NETLINK;
+	addr.nl_groups = RTMGRP_LINK | RTMGRP_IPV4_IFADDR;
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0
+			|| fcntl(fd, F_SETFL, O_NONBLOCK) < 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/* We only care that something changed, not what */
+static void drain(int fd)
+{
+	char buf[4096];
+	ssize_t len;
+
+	do {
+		len = recv(fd, buf, sizeof(buf), 0);
+	} while (len > 0 || (len < 0 && errno == EINTR));
+}
+
+/* On the loop thread: publish that something changed */
+static void onRtnetlink(int fd, unsigned int events, void *arg)
+{
+	drain(fd);
+	rilstate_set(RILSTATE_IFCHANGES, rilstate_get(RILSTATE_IFCHANGES) + 1);
+}
+
+int ifwait_init(void)
+{
+	int fd;
+
+	fd = openRtnetlink();
+	if (fd < 0 || rilloop_add_fd(fd, onRtnetlink, NULL) < 0) {
+		LOGW("ifwait: no rtnetlink (%s), polling", strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+	return 0;
+}
+
+int ifwait(IfWaitCond cond, void *arg, long long timeoutMsec)
+{
+	long long now = getMonotonicMsec();
+	long long deadline = now + timeoutMsec;
+	long long settleUntil = 0;
+	long long slice;
+	unsigned int version;
+	int changes = rilstate_get(RILSTATE_IFCHANGES);
+	int ret;
+
+	for (;;) {
+		/* take the version before the check so no event is missed */
+		version = rilstate_version();
+		if ((ret = cond(arg)) != 0)
+			break;
+
+		now = getMonotonicMsec();
+		if (now >= deadline)
+			break;
+
+		slice = now < settleUntil ? IFWAIT_SETTLE_MSEC : IFWAIT_IDLE_MSEC;
+		if (slice > deadline - now)
+			slice = deadline - now;
+
+		/* also wakes up on unrelated state changes, which only
+		 * costs an extra check */
+		rilstate_wait(version, slice);
+		if (rilstate_get(RILSTATE_IFCHANGES) != changes) {
+			changes = rilstate_get(RILSTATE_IFCHANGES);
+			settleUntil = getMonotonicMsec() + IFWAIT_SETTLE_SPAN_MSEC;
+		}
+	}
+
+	return ret;
+}
@@ -0,0 +1,35 @@
+/*
+ * Event driven waits on network interface state.
+ */
+
+#ifndef IFWAIT_H
+#define IFWAIT_H 1
+
+/**
+ * Returns nonzero once the awaited condition holds (or the wait should
+ * be abandoned), 0 to keep waiting.
+ */
+typedef int (*IfWaitCond)(void *arg);
+
+/**
+ * Subscribes to rtnetlink link and IPv4 address events on the event
+ * loop (see rilloop.h). Without it ifwait() falls back to polling.
+ * returns 0 on success, -1 on error
+ */
+int ifwait_init(void);
+
+/**
+ * Waits up to timeoutMsec for cond(arg) to become nonzero.
+ *
+ * cond is re-evaluated whenever the event loop hears of a link or
+ * IPv4 address change over rtnetlink, so a ppp interface coming up or
+ * going away is noticed right away rather than on the next poll.
+ * Conditions that lag the kernel event (eg. properties set by ip-up)
+ * are rechecked a few times shortly after each event, and at least
+ * once a second.
+ *
+ * Returns the nonzero value of cond, or 0 on timeout.
+ */
+int ifwait(IfWaitCond cond, void *arg, long long timeoutMsec);
+
+#endif /*IFWAIT_H*/
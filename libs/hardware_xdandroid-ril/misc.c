@@ -15,6 +15,8 @@
 ** limitations under the License.
 */
 
+#include <time.h>
+
 /** returns 1 if line starts with prefix, 0 if it does not */
 int strStartsWith(const char *line, const char *prefix)
 {
@@ -27,3 +29,11 @@ int strStartsWith(const char *line, const char *prefix)
     return *prefix == '\0';
 }
 
+/** returns CLOCK_MONOTONIC in milliseconds, for measuring ages and timeouts */
+long long getMonotonicMsec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
@@ -17,3 +17,6 @@
 
 /** returns 1 if line starts with prefix, 0 if it does not */
 int strStartsWith(const char *line, const char *prefix);
+
+/** returns CLOCK_MONOTONIC in milliseconds, for measuring ages and timeouts */
+long long getMonotonicMsec(void);
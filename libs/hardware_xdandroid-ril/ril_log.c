@@ -0,0 +1,394 @@
+/*
+ * Asynchronous RIL logging, see ril_log.h
+ *
+ * Every thread that logs claims one single-producer/single-consumer
+ * ring. The owner only advances head and the flusher only advances
+ * tail, so neither side takes a lock. A full ring drops the message
+ * and counts it rather than stalling the reader or request thread.
+ * A thread hands its ring back when it exits, so that the reader
+ * threads of later channel reopens can claim it.
+ *
+ * The flusher sleeps until a message is queued, then waits
+ * RLOG_FLUSH_MS to drain it with the ones that follow. Only the first
+ * message after a flush takes the wake mutex.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/time.h>
+#include <cutils/properties.h>
+#include "ril_log.h"
+
+#define LOG_TAG "RIL"
+#include <utils/Log.h>
+
+#define RLOG_MAX_THREADS	6
+#define RLOG_RING_SIZE		64	/* entries, power of two */
+#define RLOG_MSG_LEN		232
+#define RLOG_FLUSH_MS		100
+#define RLOG_DEFAULT_LEVEL	RLOG_LEVEL_INFO
+
+typedef struct {
+	long long time;		/* wall clock, ms */
+	unsigned char subsys;
+	unsigned char level;
+	char msg[RLOG_MSG_LEN];
+} RLogEntry;
+
+typedef struct {
+	volatile unsigned int head;	/* advanced by the owner thread */
+	volatile unsigned int tail;	/* advanced by the flusher */
+	volatile unsigned int dropped;
+	unsigned int reportedDropped;
+	volatile int owned;		/* claimed by a live thread */
+	int tid;
+	RLogEntry entries[RLOG_RING_SIZE];
+} RLogRing;
+
+volatile unsigned char rlog_levels[RLOG_NUM_SUBSYS] = {
+	RLOG_DEFAULT_LEVEL, RLOG_DEFAULT_LEVEL, RLOG_DEFAULT_LEVEL,
+	RLOG_DEFAULT_LEVEL, RLOG_DEFAULT_LEVEL, RLOG_DEFAULT_LEVEL,
+	RLOG_DEFAULT_LEVEL,
+};
+
+static const char *s_subsysNames[RLOG_NUM_SUBSYS] = {
+	"at", "req", "unsol", "call", "sms", "net", "data",
+};
+
+static RLogRing s_rings[RLOG_MAX_THREADS];
+static volatile int s_ringCount;	/* rings ever claimed, never shrinks */
+static pthread_key_t s_ringKey;
+static pthread_once_t s_ringKeyOnce = PTHREAD_ONCE_INIT;
+/* serializes consumers; producers never take it */
+static pthread_mutex_t s_flushMutex = PTHREAD_MUTEX_INITIALIZER;
+/* wakes the flusher, set by the first message queued after a flush */
+static volatile int s_wakePending;
+static pthread_mutex_t s_wakeMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t s_wakeCond = PTHREAD_COND_INITIALIZER;
+static FILE *s_logFile;
+static int s_logPii;
+static int s_started;
+
+/* Key destructor, runs as the owner thread exits. Entries still
+ * queued stay for the flusher, the next owner appends after them. */
+static void releaseRing(void *arg)
+{
+	RLogRing *ring = arg;
+
+	/* the last entries are published before the ring is */
+	__sync_synchronize();
+	ring->owned = 0;
+}
+
+static void makeRingKey(void)
+{
+	pthread_key_create(&s_ringKey, releaseRing);
+}
+
+/* Returns the calling thread's ring, claiming a released one or a
+ * new one on first use, or NULL while all rings are taken. */
+static RLogRing *getRing(void)
+{
+	RLogRing *ring;
+	int i, count;
+
+	pthread_once(&s_ringKeyOnce, makeRingKey);
+	ring = pthread_getspecific(s_ringKey);
+	if (ring)
+		return ring;
+
+	count = s_ringCount;
+	for (i = 0; i < count; i++) {
+		if (__sync_bool_compare_and_swap(&s_rings[i].owned, 0, 1)) {
+			ring = &s_rings[i];
+			break;
+		}
+	}
+	if (ring == NULL) {
+		i = __sync_fetch_and_add(&s_ringCount, 1);
+		if (i >= RLOG_MAX_THREADS) {
+			__sync_fetch_and_sub(&s_ringCount, 1);
+			return NULL;
+		}
+		ring = &s_rings[i];
+		ring->owned = 1;
+	}
+	ring->tid = gettid();
+	pthread_setspecific(s_ringKey, ring);
+	return ring;
+}
+
+static void emit(int tid, const RLogEntry *e);
+
+static long long nowMsec(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (long long)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+void rlog_write(int subsys, int level, const char *fmt, ...)
+{
+	RLogRing *ring = getRing();
+	RLogEntry *e;
+	unsigned int head;
+	va_list ap;
+
+	if (ring == NULL) {
+		/* more live threads than rings: log synchronously */
+		RLogEntry entry;
+
+		entry.time = nowMsec();
+		entry.subsys = subsys;
+		entry.level = level;
+		va_start(ap, fmt);
+		vsnprintf(entry.msg, sizeof(entry.msg), fmt, ap);
+		va_end(ap);
+		emit(gettid(), &entry);
+		return;
+	}
+
+	head = ring->head;
+	if (head - ring->tail >= RLOG_RING_SIZE) {
+		ring->dropped++;
+		return;
+	}
+
+	e = &ring->entries[head & (RLOG_RING_SIZE - 1)];
+	e->time = nowMsec();
+	e->subsys = subsys;
+	e->level = level;
+	va_start(ap, fmt);
+	vsnprintf(e->msg, sizeof(e->msg), fmt, ap);
+	va_end(ap);
+
+	/* publish the entry before the new head */
+	__sync_synchronize();
+	ring->head = head + 1;
+
+	if (__sync_bool_compare_and_swap(&s_wakePending, 0, 1)) {
+		pthread_mutex_lock(&s_wakeMutex);
+		pthread_cond_signal(&s_wakeCond);
+		pthread_mutex_unlock(&s_wakeMutex);
+	}
+}
+
+void rlog_redact(const char *in, char *out, size_t outlen)
+{
+	size_t o = 0;
+	int run, digits, i;
+
+	while (*in && o + 1 < outlen) {
+		for (run = 0, digits = 1; isxdigit((unsigned char)in[run]); run++)
+			digits &= isdigit((unsigned char)in[run]) != 0;
+
+		if (run >= 16) {
+			o += snprintf(out + o, outlen - o, "<%d hex>", run);
+			in += run;
+		} else if (run >= 7 && digits) {
+			for (i = 0; i < run && o + 1 < outlen; i++)
+				out[o++] = i < run - 2 ? '*' : in[i];
+			in += run;
+		} else if (run > 0) {
+			for (i = 0; i < run && o + 1 < outlen; i++)
+				out[o++] = in[i];
+			in += run;
+		} else {
+			out[o++] = *in++;
+		}
+		if (o >= outlen)
+			o = outlen - 1;
+	}
+	out[o] = '\0';
+}
+
+static void emit(int tid, const RLogEntry *e)
+{
+	static const char levelChars[] = "-EIDV";
+	static const int prios[] = {
+		ANDROID_LOG_SILENT, ANDROID_LOG_ERROR, ANDROID_LOG_INFO,
+		ANDROID_LOG_DEBUG, ANDROID_LOG_VERBOSE,
+	};
+	char buf[RLOG_MSG_LEN + 64];
+	const char *msg = e->msg;
+
+	if (!s_logPii) {
+		rlog_redact(e->msg, buf, sizeof(buf));
+		msg = buf;
+	}
+
+	if (s_logFile) {
+		time_t sec = e->time / 1000;
+		struct tm tm;
+
+		localtime_r(&sec, &tm);
+		fprintf(s_logFile, "%02d-%02d %02d:%02d:%02d.%03d %5d %c %-5s %s\n",
+				tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min,
+				tm.tm_sec, (int)(e->time % 1000), tid,
+				levelChars[e->level], s_subsysNames[e->subsys], msg);
+	} else {
+		LOG_PRI(prios[e->level], LOG_TAG, "%s", msg);
+	}
+}
+
+void rlog_flush(void)
+{
+	unsigned int tails[RLOG_MAX_THREADS], heads[RLOG_MAX_THREADS];
+	int count, i, next;
+
+	pthread_mutex_lock(&s_flushMutex);
+	count = s_ringCount;
+	if (count > RLOG_MAX_THREADS)
+		count = RLOG_MAX_THREADS;
+	for (i = 0; i < count; i++) {
+		tails[i] = s_rings[i].tail;
+		heads[i] = s_rings[i].head;
+	}
+	/* don't read entries older than the heads we just saw */
+	__sync_synchronize();
+
+	/* merge the rings by timestamp so AT> and AT< stay in order */
+	for (;;) {
+		next = -1;
+		for (i = 0; i < count; i++) {
+			if (tails[i] == heads[i])
+				continue;
+			if (next < 0 || s_rings[i].entries[tails[i] & (RLOG_RING_SIZE - 1)].time
+					< s_rings[next].entries[tails[next] & (RLOG_RING_SIZE - 1)].time)
+				next = i;
+		}
+		if (next < 0)
+			break;
+		emit(s_rings[next].tid,
+				&s_rings[next].entries[tails[next] & (RLOG_RING_SIZE - 1)]);
+		tails[next]++;
+	}
+
+	/* done with the entries before handing them back */
+	__sync_synchronize();
+	for (i = 0; i < count; i++) {
+		RLogRing *ring = &s_rings[i];
+		unsigned int dropped = ring->dropped;
+
+		ring->tail = tails[i];
+		if (dropped != ring->reportedDropped) {
+			LOGW("log ring of thread %d full, %u messages dropped",
+					ring->tid, dropped - ring->reportedDropped);
+			ring->reportedDropped = dropped;
+		}
+	}
+	if (s_logFile)
+		fflush(s_logFile);
+	pthread_mutex_unlock(&s_flushMutex);
+}
+
+int rlog_pii(void)
+{
+	return s_logPii;
+}
+
+unsigned int rlog_dropped(void)
+{
+	unsigned int total = 0;
+	int i;
+
+	for (i = 0; i < s_ringCount && i < RLOG_MAX_THREADS; i++)
+		total += s_rings[i].dropped;
+	return total;
+}
+
+static int subsysFromName(const char *name, int len)
+{
+	int i;
+
+	for (i = 0; i < RLOG_NUM_SUBSYS; i++) {
+		if ((int)strlen(s_subsysNames[i]) == len
+				&& !strncmp(s_subsysNames[i], name, len))
+			return i;
+	}
+	return -1;
+}
+
+int rlog_configure(const char *spec)
+{
+	const char *p = spec, *eq, *end;
+	int ret = 0, level, sub, i;
+
+	while (*p) {
+		end = strchr(p, ',');
+		if (end == NULL)
+			end = p + strlen(p);
+		eq = memchr(p, '=', end - p);
+		if (eq == NULL || !isdigit((unsigned char)eq[1])) {
+			ret = -1;
+		} else {
+			level = atoi(eq + 1);
+			if (level > RLOG_LEVEL_VERBOSE)
+				level = RLOG_LEVEL_VERBOSE;
+			if (eq - p == 1 && *p == '*') {
+				for (i = 0; i < RLOG_NUM_SUBSYS; i++)
+					rlog_levels[i] = level;
+			} else if ((sub = subsysFromName(p, eq - p)) >= 0) {
+				rlog_levels[sub] = level;
+			} else {
+				ret = -1;
+			}
+		}
+		p = *end ? end + 1 : end;
+	}
+	return ret;
+}
+
+static void *flusherLoop(void *arg)
+{
+	for (;;) {
+		pthread_mutex_lock(&s_wakeMutex);
+		while (!s_wakePending)
+			pthread_cond_wait(&s_wakeCond, &s_wakeMutex);
+		pthread_mutex_unlock(&s_wakeMutex);
+
+		/* batch what follows, then rearm before reading the heads so
+		 * a message queued during the flush wakes us again */
+		usleep(RLOG_FLUSH_MS * 1000);
+		__sync_lock_release(&s_wakePending);
+		__sync_synchronize();
+		rlog_flush();
+	}
+	return NULL;
+}
+
+void rlog_init(void)
+{
+	char value[PROPERTY_VALUE_MAX];
+	pthread_attr_t attr;
+	pthread_t tid;
+
+	if (s_started)
+		return;
+	s_started = 1;
+
+	if (property_get("persist.ril.log", value, "") > 0
+			&& rlog_configure(value) < 0)
+		LOGW("persist.ril.log: could not parse '%s'", value);
+
+	property_get("persist.ril.log.pii", value, "0");
+	s_logPii = atoi(value);
+
+	if (property_get("persist.ril.log.file", value, "") > 0) {
+		s_logFile = fopen(value, "a");
+		if (s_logFile == NULL)
+			LOGW("cannot open RIL log file %s", value);
+	}
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	if (pthread_create(&tid, &attr, flusherLoop, NULL) != 0)
+		LOGE("cannot start log flusher");
+}
@@ -0,0 +1,80 @@
+/*
+ * Asynchronous RIL logging.
+ *
+ * Each thread formats its messages into its own lock-free ring; a
+ * background thread drains the rings to logcat or to a file. When a
+ * subsystem's level is below the message level, RLOG() costs a single
+ * byte compare and the arguments are not evaluated.
+ *
+ * Levels are read from system properties at rlog_init() and can be
+ * changed at runtime with rlog_configure():
+ *   persist.ril.log       "at=3,req=2,*=1"  (subsystem=level, * for all)
+ *   persist.ril.log.file  path to append to instead of logcat
+ *   persist.ril.log.pii   1 to log numbers and PDUs unredacted
+ */
+
+#ifndef RIL_LOG_H
+#define RIL_LOG_H 1
+
+#include <stddef.h>
+
+typedef enum {
+	RLOG_AT = 0,	/* AT channel traffic */
+	RLOG_REQ,	/* framework requests */
+	RLOG_UNSOL,	/* unsolicited responses */
+	RLOG_CALL,
+	RLOG_SMS,
+	RLOG_NET,
+	RLOG_DATA,
+	RLOG_NUM_SUBSYS
+} RLogSubsys;
+
+#define RLOG_LEVEL_OFF		0
+#define RLOG_LEVEL_ERROR	1
+#define RLOG_LEVEL_INFO		2
+#define RLOG_LEVEL_DEBUG	3
+#define RLOG_LEVEL_VERBOSE	4
+
+extern volatile unsigned char rlog_levels[RLOG_NUM_SUBSYS];
+
+#define RLOG(sub, level, ...) \
+	do { \
+		if (rlog_levels[sub] >= (level)) \
+			rlog_write((sub), (level), __VA_ARGS__); \
+	} while (0)
+
+#define RLOGE(sub, ...) RLOG(sub, RLOG_LEVEL_ERROR, __VA_ARGS__)
+#define RLOGI(sub, ...) RLOG(sub, RLOG_LEVEL_INFO, __VA_ARGS__)
+#define RLOGD(sub, ...) RLOG(sub, RLOG_LEVEL_DEBUG, __VA_ARGS__)
+#define RLOGV(sub, ...) RLOG(sub, RLOG_LEVEL_VERBOSE, __VA_ARGS__)
+
+/** reads the persist.ril.log* properties and starts the flusher thread */
+void rlog_init(void);
+
+/** formats a message into the calling thread's ring; never blocks */
+void rlog_write(int subsys, int level, const char *fmt, ...)
+	__attribute__((format(printf, 3, 4)));
+
+/**
+ * applies a "name=level,..." spec, "*" meaning every subsystem
+ * returns 0 on success, -1 if any entry was not understood
+ */
+int rlog_configure(const char *spec);
+
+/** drains all rings now; safe to call from any thread */
+void rlog_flush(void);
+
+/**
+ * copies in to out, masking what looks like a phone number or a PDU:
+ * runs of 7 or more digits keep only their last two, runs of 16 or
+ * more hex digits are replaced by their length
+ */
+void rlog_redact(const char *in, char *out, size_t outlen);
+
+/** nonzero if persist.ril.log.pii asks for unredacted output */
+int rlog_pii(void);
+
+/** number of messages lost because a ring was full */
+unsigned int rlog_dropped(void);
+
+#endif /*RIL_LOG_H*/
@@ -0,0 +1,209 @@
+/*
+ * Binary trace of RIL traffic, see ril_trace.h
+ *
+ * Records are appended to one of two buffers under a mutex held only
+ * for the copy. Every RTRACE_FLUSH_MS the flusher swaps the buffers and
+ * writes the full one out, so no thread ever waits on the file. A full
+ * buffer drops records and counts them.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <cutils/properties.h>
+#include "ril_trace.h"
+#include "ril_log.h"
+
+#define LOG_TAG "RIL"
+#include <utils/Log.h>
+
+#define RTRACE_BUF_SIZE		(64 * 1024)
+#define RTRACE_FLUSH_MS		500
+
+volatile int rtrace_enabled;
+
+static char s_bufs[2][RTRACE_BUF_SIZE];
+static int s_active;
+static unsigned int s_used;
+static unsigned int s_records;
+static unsigned int s_dropped;
+/* guards the buffers above, held only to copy a record in */
+static pthread_mutex_t s_bufMutex = PTHREAD_MUTEX_INITIALIZER;
+
+static int s_fd = -1;
+static int s_flusherStarted;
+/* serializes flushes with start and stop */
+static pthread_mutex_t s_flushMutex = PTHREAD_MUTEX_INITIALIZER;
+
+static int64_t nowUsec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void rtrace_write(int type, int id, const void *token, int value,
+		unsigned int size, const char *text)
+{
+	char redacted[RTRACE_MAX_TEXT + 1];
+	RTraceRecord rec;
+	size_t len = 0;
+
+	rec.usec = nowUsec();
+	rec.type = type;
+	rec.reserved = 0;
+	rec.id = id;
+	rec.token = (uint32_t)(uintptr_t)token;
+	rec.value = value;
+	rec.size = size;
+
+	if (text != NULL) {
+		if (!rlog_pii()) {
+			rlog_redact(text, redacted, sizeof(redacted));
+			text = redacted;
+		}
+		len = strlen(text);
+		if (len > RTRACE_MAX_TEXT)
+			len = RTRACE_MAX_TEXT;
+	}
+	rec.len = len;
+
+	pthread_mutex_lock(&s_bufMutex);
+	if (s_used + sizeof(rec) + len > RTRACE_BUF_SIZE) {
+		s_dropped++;
+	} else {
+		memcpy(s_bufs[s_active] + s_used, &rec, sizeof(rec));
+		memcpy(s_bufs[s_active] + s_used + sizeof(rec), text, len);
+		s_used += sizeof(rec) + len;
+		s_records++;
+	}
+	pthread_mutex_unlock(&s_bufMutex);
+}
+
+static void writeAll(int fd, const char *buf, size_t len)
+{
+	ssize_t written;
+
+	while (len > 0) {
+		written = write(fd, buf, len);
+		if (written < 0 && errno == EINTR)
+			continue;
+		if (written <= 0) {
+			LOGE("RIL trace write failed: %s", strerror(errno));
+			return;
+		}
+		buf += written;
+		len -= written;
+	}
+}
+
+/* Called with s_flushMutex held */
+static void flush(void)
+{
+	unsigned int used;
+	int full;
+
+	pthread_mutex_lock(&s_bufMutex);
+	full = s_active;
+	used = s_used;
+	s_active ^= 1;
+	s_used = 0;
+	pthread_mutex_unlock(&s_bufMutex);
+
+	if (used > 0 && s_fd >= 0)
+		writeAll(s_fd, s_bufs[full], used);
+}
+
+static void *flusherLoop(void *arg)
+{
+	for (;;) {
+		usleep(RTRACE_FLUSH_MS * 1000);
+		pthread_mutex_lock(&s_flushMutex);
+		if (s_fd >= 0)
+			flush();
+		pthread_mutex_unlock(&s_flushMutex);
+	}
+	return NULL;
+}
+
+/* Called with s_flushMutex held */
+static void stopLocked(void)
+{
+	rtrace_enabled = 0;
+	if (s_fd < 0)
+		return;
+	flush();
+	close(s_fd);
+	s_fd = -1;
+}
+
+int rtrace_start(const char *path)
+{
+	RTraceFileHeader hdr = { RTRACE_MAGIC, RTRACE_VERSION };
+	pthread_attr_t attr;
+	pthread_t tid;
+	int fd;
+
+	/* the trace in progress may be to the same file, so it is
+	 * written out and closed before that is truncated */
+	pthread_mutex_lock(&s_flushMutex);
+	stopLocked();
+
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0) {
+		pthread_mutex_unlock(&s_flushMutex);
+		LOGE("cannot create RIL trace %s: %s", path, strerror(errno));
+		return -1;
+	}
+	writeAll(fd, (const char *)&hdr, sizeof(hdr));
+
+	pthread_mutex_lock(&s_bufMutex);
+	s_used = 0;
+	s_records = 0;
+	s_dropped = 0;
+	pthread_mutex_unlock(&s_bufMutex);
+
+	s_fd = fd;
+	rtrace_enabled = 1;
+
+	if (!s_flusherStarted) {
+		pthread_attr_init(&attr);
+		pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+		if (pthread_create(&tid, &attr, flusherLoop, NULL) == 0)
+			s_flusherStarted = 1;
+		else
+			LOGE("cannot start RIL trace flusher");
+	}
+	pthread_mutex_unlock(&s_flushMutex);
+
+	LOGI("recording RIL trace to %s", path);
+	return 0;
+}
+
+void rtrace_stop(void)
+{
+	pthread_mutex_lock(&s_flushMutex);
+	stopLocked();
+	pthread_mutex_unlock(&s_flushMutex);
+}
+
+void rtrace_counts(unsigned int *p_records, unsigned int *p_dropped)
+{
+	pthread_mutex_lock(&s_bufMutex);
+	*p_records = s_records;
+	*p_dropped = s_dropped;
+	pthread_mutex_unlock(&s_bufMutex);
+}
+
+void rtrace_init(void)
+{
+	char value[PROPERTY_VALUE_MAX];
+
+	if (property_get("persist.ril.trace.file", value, "") > 0)
+		rtrace_start(value);
+}
@@ -0,0 +1,81 @@
+/*
+ * Binary trace of RIL traffic.
+ *
+ * When enabled, every framework request and its completion, every
+ * unsolicited response and every AT line in either direction is
+ * appended to a file as a fixed size record with a monotonic
+ * timestamp. Recording only copies the record into a memory buffer;
+ * a background thread writes the buffers out. ril-trace (see
+ * ril_trace_tool.c) prints a trace or compares two of them.
+ *
+ * Recording is started at boot by persist.ril.trace.file, or at
+ * runtime with the "RIL_TRACE <path>" and "RIL_TRACE off" OEM hook
+ * strings. AT text is redacted like the log unless persist.ril.log.pii
+ * is set; SMS PDUs are only recorded by length.
+ */
+
+#ifndef RIL_TRACE_H
+#define RIL_TRACE_H 1
+
+#include <stdint.h>
+
+#define RTRACE_MAGIC	0x54524c52	/* "RLRT" */
+#define RTRACE_VERSION	1
+
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+} RTraceFileHeader;
+
+typedef enum {
+	RTRACE_REQUEST = 1,	/* id: request, size: data length, text: name */
+	RTRACE_COMPLETE,	/* value: RIL_Errno, size: response length */
+	RTRACE_UNSOL,		/* id: response, size: data length */
+	RTRACE_AT_OUT,		/* text: command line */
+	RTRACE_AT_IN,		/* text: response line */
+	RTRACE_AT_PDU,		/* size: PDU length */
+} RTraceType;
+
+/* each record is followed by len bytes of text, not NUL terminated */
+typedef struct {
+	int64_t usec;		/* CLOCK_MONOTONIC */
+	uint8_t type;
+	uint8_t reserved;
+	uint16_t len;
+	int32_t id;
+	uint32_t token;		/* pairs a request with its completion */
+	int32_t value;
+	uint32_t size;
+} __attribute__((packed)) RTraceRecord;
+
+#define RTRACE_MAX_TEXT		256
+
+extern volatile int rtrace_enabled;
+
+#define RTRACE(type, id, token, value, size, text) \
+	do { \
+		if (rtrace_enabled) \
+			rtrace_write((type), (id), (token), (value), (size), (text)); \
+	} while (0)
+
+/** starts recording to persist.ril.trace.file, if set */
+void rtrace_init(void);
+
+/**
+ * starts recording to path, replacing any trace in progress; that one
+ * is stopped first, even if path then can't be created
+ * returns 0 on success, -1 if the file can't be created
+ */
+int rtrace_start(const char *path);
+
+/** writes out what was recorded so far and stops */
+void rtrace_stop(void);
+
+/** appends one record; text may be NULL */
+void rtrace_write(int type, int id, const void *token, int value,
+		unsigned int size, const char *text);
+
+/** records written and lost to a full buffer since the last start */
+void rtrace_counts(unsigned int *p_records, unsigned int *p_dropped);
+
+#endif /*RIL_TRACE_H*/
@@ -0,0 +1,407 @@
+/*
+ * ril-trace: prints or compares traces recorded by ril_trace.c
+ *
+ *   ril-trace dump TRACE        one line per record
+ *   ril-trace stats TRACE       request latencies and AT traffic
+ *   ril-trace diff OLD NEW      the same for two runs side by side
+ *
+ * To compare two builds, record the same scenario with each and diff
+ * the traces: per-request latency deltas show where time went, and
+ * the AT command counts show which commands were added or saved.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include "ril_trace.h"
+
+#define MAX_REQUESTS		256
+#define MAX_UNSOL		256
+#define UNSOL_BASE		1000
+#define MAX_PENDING		16
+#define MAX_AT_PREFIXES		256
+
+typedef struct {
+	char name[48];
+	unsigned int count;
+	unsigned int errors;
+	unsigned int atCommands;	/* sent while the request ran */
+	long long *lat;			/* usec */
+	int nlat, maxlat;
+} ReqStats;
+
+typedef struct {
+	char prefix[24];
+	unsigned int count;
+} AtStats;
+
+typedef struct {
+	uint32_t token;
+	int request;
+	int64_t usec;
+	unsigned int atOut;
+} Pending;
+
+typedef struct {
+	ReqStats req[MAX_REQUESTS];
+	unsigned int unsol[MAX_UNSOL];
+	AtStats at[MAX_AT_PREFIXES];
+	int nat;
+	Pending pending[MAX_PENDING];
+	int npending;
+	unsigned int records;
+	unsigned int atOut, atIn, pdus;
+	unsigned long long atBytes;
+	int64_t first, last;
+} TraceStats;
+
+typedef void (*RecordFn)(const RTraceRecord *rec, const char *text,
+		void *arg);
+
+static const char *typeName(int type)
+{
+	static const char *names[] = {
+		"?", "REQ", "DONE", "UNSOL", "AT>", "AT<", "PDU>",
+	};
+
+	return type > 0 && type <= RTRACE_AT_PDU ? names[type] : names[0];
+}
+
+/* calls fn for each record of path, returns -1 if it isn't a trace */
+static int readTrace(const char *path, RecordFn fn, void *arg)
+{
+	RTraceFileHeader hdr;
+	RTraceRecord rec;
+	char text[RTRACE_MAX_TEXT + 1];
+	FILE *f;
+
+	f = fopen(path, "rb");
+	if (f == NULL) {
+		perror(path);
+		return -1;
+	}
+	if (fread(&hdr, sizeof(hdr), 1, f) != 1 || hdr.magic != RTRACE_MAGIC) {
+		fprintf(stderr, "%s: not a RIL trace\n", path);
+		fclose(f);
+		return -1;
+	}
+	if (hdr.version != RTRACE_VERSION) {
+		fprintf(stderr, "%s: trace version %u, expected %u\n", path,
+				hdr.version, RTRACE_VERSION);
+		fclose(f);
+		return -1;
+	}
+
+	while (fread(&rec, sizeof(rec), 1, f) == 1) {
+		if (rec.len > RTRACE_MAX_TEXT
+				|| fread(text, 1, rec.len, f) != rec.len) {
+			fprintf(stderr, "%s: truncated record\n", path);
+			break;
+		}
+		text[rec.len] = '\0';
+		fn(&rec, text, arg);
+	}
+	fclose(f);
+	return 0;
+}
+
+static void dumpRecord(const RTraceRecord *rec, const char *text, void *arg)
+{
+	int64_t *first = arg;
+
+	if (*first < 0)
+		*first = rec->usec;
+	printf("%12.3f %-5s", (rec->usec - *first) / 1000.0, typeName(rec->type));
+	switch (rec->type) {
+		case RTRACE_REQUEST:
+			printf(" %08x %s (%d) %u bytes\n", rec->token, text, rec->id,
+					rec->size);
+			break;
+		case RTRACE_COMPLETE:
+			printf(" %08x error %d, %u bytes\n", rec->token, rec->value,
+					rec->size);
+			break;
+		case RTRACE_UNSOL:
+			printf(" %d, %u bytes\n", rec->id, rec->size);
+			break;
+		case RTRACE_AT_PDU:
+			printf(" %u bytes\n", rec->size);
+			break;
+		default:
+			printf(" %s\n", text);
+			break;
+	}
+}
+
+/* the command name of an AT line, eg. "AT+CGACT" for "AT+CGACT?" */
+static void atPrefix(const char *line, char *out, size_t outlen)
+{
+	size_t n = 0;
+
+	while (line[n] && n + 1 < outlen
+			&& (isalpha((unsigned char)line[n]) || strchr("+$@%&_", line[n])))
+		n++;
+	memcpy(out, line, n);
+	out[n] = '\0';
+}
+
+static void countAt(TraceStats *st, const char *line)
+{
+	char prefix[sizeof(st->at[0].prefix)];
+	int i;
+
+	atPrefix(line, prefix, sizeof(prefix));
+	for (i = 0; i < st->nat; i++) {
+		if (!strcmp(st->at[i].prefix, prefix)) {
+			st->at[i].count++;
+			return;
+		}
+	}
+	if (st->nat < MAX_AT_PREFIXES) {
+		strcpy(st->at[st->nat].prefix, prefix);
+		st->at[st->nat++].count = 1;
+	}
+}
+
+static void addLatency(ReqStats *r, long long usec)
+{
+	if (r->nlat == r->maxlat) {
+		r->maxlat = r->maxlat ? r->maxlat * 2 : 64;
+		r->lat = realloc(r->lat, r->maxlat * sizeof(*r->lat));
+		if (r->lat == NULL) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+	r->lat[r->nlat++] = usec;
+}
+
+static void statsRecord(const RTraceRecord *rec, const char *text, void *arg)
+{
+	TraceStats *st = arg;
+	ReqStats *r;
+	int i;
+
+	if (st->records++ == 0)
+		st->first = rec->usec;
+	st->last = rec->usec;
+
+	switch (rec->type) {
+		case RTRACE_REQUEST:
+			if (rec->id < 0 || rec->id >= MAX_REQUESTS)
+				break;
+			r = &st->req[rec->id];
+			if (!r->name[0])
+				snprintf(r->name, sizeof(r->name), "%s", text);
+			r->count++;
+			if (st->npending == MAX_PENDING) {
+				/* never completed; forget the oldest */
+				memmove(st->pending, st->pending + 1,
+						(MAX_PENDING - 1) * sizeof(Pending));
+				st->npending--;
+			}
+			st->pending[st->npending].token = rec->token;
+			st->pending[st->npending].request = rec->id;
+			st->pending[st->npending].usec = rec->usec;
+			st->pending[st->npending].atOut = st->atOut;
+			st->npending++;
+			break;
+
+		case RTRACE_COMPLETE:
+			for (i = st->npending - 1; i >= 0; i--) {
+				if (st->pending[i].token == rec->token)
+					break;
+			}
+			if (i < 0)
+				break;
+			r = &st->req[st->pending[i].request];
+			addLatency(r, rec->usec - st->pending[i].usec);
+			r->atCommands += st->atOut - st->pending[i].atOut;
+			if (rec->value != 0)
+				r->errors++;
+			memmove(st->pending + i, st->pending + i + 1,
+					(st->npending - i - 1) * sizeof(Pending));
+			st->npending--;
+			break;
+
+		case RTRACE_UNSOL:
+			if (rec->id >= UNSOL_BASE && rec->id < UNSOL_BASE + MAX_UNSOL)
+				st->unsol[rec->id - UNSOL_BASE]++;
+			break;
+
+		case RTRACE_AT_OUT:
+			st->atOut++;
+			st->atBytes += rec->len + 1;
+			countAt(st, text);
+			break;
+
+		case RTRACE_AT_IN:
+			st->atIn++;
+			break;
+
+		case RTRACE_AT_PDU:
+			st->pdus++;
+			st->atBytes += rec->size + 1;
+			break;
+	}
+}
+
+static int cmpLatency(const void *a, const void *b)
+{
+	long long x = *(const long long *)a, y = *(const long long *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* sorts the samples; returns the mean, and p95 in *p95 (msec) */
+static double latencies(ReqStats *r, double *p95)
+{
+	long long sum = 0;
+	int i;
+
+	*p95 = 0;
+	if (r->nlat == 0)
+		return 0;
+	qsort(r->lat, r->nlat, sizeof(*r->lat), cmpLatency);
+	for (i = 0; i < r->nlat; i++)
+		sum += r->lat[i];
+	*p95 = r->lat[(r->nlat * 95 - 1) / 100] / 1000.0;
+	return (double)sum / r->nlat / 1000.0;
+}
+
+static int loadStats(const char *path, TraceStats **p_st)
+{
+	TraceStats *st = calloc(1, sizeof(*st));
+
+	if (st == NULL) {
+		perror("calloc");
+		exit(1);
+	}
+	*p_st = st;
+	return readTrace(path, statsRecord, st);
+}
+
+static unsigned int atCount(const TraceStats *st, const char *prefix)
+{
+	int i;
+
+	for (i = 0; i < st->nat; i++) {
+		if (!strcmp(st->at[i].prefix, prefix))
+			return st->at[i].count;
+	}
+	return 0;
+}
+
+static void printTotals(const char *label, const TraceStats *st)
+{
+	printf("%s: %u records over %.1f s, %u AT commands, %u responses, "
+			"%u PDUs, %llu bytes written\n", label, st->records,
+			(st->last - st->first) / 1000000.0, st->atOut, st->atIn,
+			st->pdus, st->atBytes);
+}
+
+static int cmdStats(const char *path)
+{
+	TraceStats *st;
+	double mean, p95;
+	int i;
+
+	if (loadStats(path, &st) < 0)
+		return 1;
+
+	printTotals(path, st);
+	printf("\n%-36s %7s %6s %9s %9s %9s %7s\n", "request", "count",
+			"errors", "mean ms", "p95 ms", "max ms", "AT/req");
+	for (i = 0; i < MAX_REQUESTS; i++) {
+		ReqStats *r = &st->req[i];
+
+		if (r->count == 0)
+			continue;
+		mean = latencies(r, &p95);
+		printf("%-36s %7u %6u %9.1f %9.1f %9.1f %7.1f\n", r->name, r->count,
+				r->errors, mean, p95,
+				r->nlat ? r->lat[r->nlat - 1] / 1000.0 : 0.0,
+				r->nlat ? (double)r->atCommands / r->nlat : 0.0);
+	}
+
+	printf("\n%-24s %7s\n", "AT command", "count");
+	for (i = 0; i < st->nat; i++)
+		printf("%-24s %7u\n", st->at[i].prefix, st->at[i].count);
+
+	printf("\n%-24s %7s\n", "unsolicited", "count");
+	for (i = 0; i < MAX_UNSOL; i++) {
+		if (st->unsol[i])
+			printf("%-24d %7u\n", UNSOL_BASE + i, st->unsol[i]);
+	}
+	return 0;
+}
+
+static int cmdDiff(const char *oldPath, const char *newPath)
+{
+	TraceStats *a, *b;
+	double meanA, meanB, p95A, p95B;
+	int i;
+
+	if (loadStats(oldPath, &a) < 0 || loadStats(newPath, &b) < 0)
+		return 1;
+
+	printTotals("old", a);
+	printTotals("new", b);
+
+	printf("\n%-36s %7s %7s %9s %9s %8s %9s %9s %6s %6s\n", "request",
+			"old n", "new n", "old mean", "new mean", "delta",
+			"old p95", "new p95", "old AT", "new AT");
+	for (i = 0; i < MAX_REQUESTS; i++) {
+		ReqStats *ra = &a->req[i], *rb = &b->req[i];
+
+		if (ra->count == 0 && rb->count == 0)
+			continue;
+		meanA = latencies(ra, &p95A);
+		meanB = latencies(rb, &p95B);
+		printf("%-36s %7u %7u %9.1f %9.1f %+7.0f%% %9.1f %9.1f %6.1f %6.1f\n",
+				ra->name[0] ? ra->name : rb->name, ra->count, rb->count,
+				meanA, meanB,
+				meanA > 0 ? (meanB - meanA) * 100 / meanA : 0.0,
+				p95A, p95B,
+				ra->nlat ? (double)ra->atCommands / ra->nlat : 0.0,
+				rb->nlat ? (double)rb->atCommands / rb->nlat : 0.0);
+	}
+
+	printf("\n%-24s %7s %7s %7s\n", "AT command", "old", "new", "delta");
+	for (i = 0; i < a->nat; i++) {
+		unsigned int nb = atCount(b, a->at[i].prefix);
+
+		if (nb != a->at[i].count)
+			printf("%-24s %7u %7u %+7d\n", a->at[i].prefix,
+					a->at[i].count, nb, (int)(nb - a->at[i].count));
+	}
+	for (i = 0; i < b->nat; i++) {
+		if (atCount(a, b->at[i].prefix) == 0)
+			printf("%-24s %7u %7u %+7d\n", b->at[i].prefix, 0,
+					b->at[i].count, (int)b->at[i].count);
+	}
+	return 0;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "usage: %s dump TRACE\n"
+			"       %s stats TRACE\n"
+			"       %s diff OLD NEW\n", name, name, name);
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	int64_t first = -1;
+
+	if (argc == 3 && !strcmp(argv[1], "dump"))
+		return readTrace(argv[2], dumpRecord, &first) < 0;
+	if (argc == 3 && !strcmp(argv[1], "stats"))
+		return cmdStats(argv[2]);
+	if (argc == 4 && !strcmp(argv[1], "diff"))
+		return cmdDiff(argv[2], argv[3]);
+	usage(argv[0]);
+	return 2;
+}
@@ -0,0 +1,316 @@
+/*
+ * The RIL's own event loop, see rilloop.h
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+#include "rilloop.h"
+
+#define LOG_TAG "RIL"
+#include <utils/Log.h>
+
+/* the AT channel, its timers, rtnetlink and the wakeup eventfd */
+#define RILLOOP_MAX_FDS		8
+#define RILLOOP_MAX_EVENTS	8
+
+typedef struct {
+	int fd;			/* -1 if the slot is free */
+	unsigned int gen;	/* tells stale events from a reused slot */
+	RilLoopFdFunc fn;
+	void *arg;
+} FdSlot;
+
+typedef struct Post {
+	struct Post *next;
+	RilLoopFunc fn;
+	void *arg;
+} Post;
+
+struct RilLoopTimer {
+	int fd;
+	RilLoopFunc fn;
+	void *arg;
+};
+
+/* protects s_slots and the post queue */
+static pthread_mutex_t s_mutex = PTHREAD_MUTEX_INITIALIZER;
+static FdSlot s_slots[RILLOOP_MAX_FDS];
+static Post *s_postHead;
+static Post *s_postTail;
+
+static int s_epfd = -1;
+static int s_wakefd = -1;
+static pthread_t s_tid;
+static volatile int s_running;
+
+/* bionic has no wrappers for eventfd and timerfd */
+static int setNonblock(int fd)
+{
+	int flags = fcntl(fd, F_GETFL, 0);
+
+	if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
+		return -1;
+	return 0;
+}
+
+static int eventfdCreate(void)
+{
+	int fd = syscall(__NR_eventfd, 0);
+
+	if (fd >= 0 && setNonblock(fd) < 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static int timerfdCreate(void)
+{
+	int fd = syscall(__NR_timerfd_create, CLOCK_MONOTONIC, 0);
+
+	if (fd >= 0 && setNonblock(fd) < 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static void drainCounter(int fd)
+{
+	uint64_t count;
+	ssize_t len;
+
+	do {
+		len = read(fd, &count, sizeof(count));
+	} while (len < 0 && errno == EINTR);
+}
+
+/* Runs everything posted so far, on the loop thread */
+static void onWakeup(int fd, unsigned int events, void *arg)
+{
+	Post *p;
+
+	drainCounter(fd);
+
+	for (;;) {
+		pthread_mutex_lock(&s_mutex);
+		p = s_postHead;
+		if (p != NULL) {
+			s_postHead = p->next;
+			if (s_postHead == NULL)
+				s_postTail = NULL;
+		}
+		pthread_mutex_unlock(&s_mutex);
+
+		if (p == NULL)
+			break;
+		p->fn(p->arg);
+		free(p);
+	}
+}
+
+static void onTimer(int fd, unsigned int events, void *arg)
+{
+	RilLoopTimer *t = (RilLoopTimer *)arg;
+
+	drainCounter(fd);
+	t->fn(t->arg);
+}
+
+int rilloop_init(void)
+{
+	int i;
+
+	if (s_epfd >= 0)
+		return 0;
+
+	for (i = 0; i < RILLOOP_MAX_FDS; i++)
+		s_slots[i].fd = -1;
+
+	s_epfd = epoll_create(RILLOOP_MAX_FDS);
+	if (s_epfd < 0) {
+		LOGE("rilloop: epoll_create: %s", strerror(errno));
+		return -1;
+	}
+
+	s_wakefd = eventfdCreate();
+	if (s_wakefd < 0 || rilloop_add_fd(s_wakefd, onWakeup, NULL) < 0) {
+		LOGE("rilloop: no wakeup eventfd: %s", strerror(errno));
+		if (s_wakefd >= 0)
+			close(s_wakefd);
+		close(s_epfd);
+		s_wakefd = -1;
+		s_epfd = -1;
+		return -1;
+	}
+
+	return 0;
+}
+
+void *rilloop_run(void *unused)
+{
+	struct epoll_event events[RILLOOP_MAX_EVENTS];
+	FdSlot slot;
+	unsigned int idx;
+	int n;
+	int i;
+
+	s_tid = pthread_self();
+	s_running = 1;
+
+	for (;;) {
+		n = epoll_wait(s_epfd, events, RILLOOP_MAX_EVENTS, -1);
+		if (n < 0) {
+			if (errno != EINTR)
+				LOGE("rilloop: epoll_wait: %s", strerror(errno));
+			continue;
+		}
+
+		for (i = 0; i < n; i++) {
+			idx = events[i].data.u64 & 0xffffffff;
+
+			/* a handler earlier in this round may have removed
+			 * or replaced the slot */
+			pthread_mutex_lock(&s_mutex);
+			slot = s_slots[idx];
+			pthread_mutex_unlock(&s_mutex);
+			if (slot.fd < 0 || slot.gen != events[i].data.u64 >> 32)
+				continue;
+
+			slot.fn(slot.fd, events[i].events, slot.arg);
+		}
+	}
+
+	return NULL;
+}
+
+int rilloop_on_loop_thread(void)
+{
+	return s_running && pthread_equal(s_tid, pthread_self());
+}
+
+int rilloop_add_fd(int fd, RilLoopFdFunc fn, void *arg)
+{
+	struct epoll_event ev;
+	int i;
+
+	pthread_mutex_lock(&s_mutex);
+
+	for (i = 0; i < RILLOOP_MAX_FDS; i++)
+		if (s_slots[i].fd < 0)
+			break;
+
+	if (i == RILLOOP_MAX_FDS) {
+		pthread_mutex_unlock(&s_mutex);
+		LOGE("rilloop: out of fd slots");
+		return -1;
+	}
+
+	s_slots[i].gen++;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.u64 = ((uint64_t)s_slots[i].gen << 32) | i;
+	if (epoll_ctl(s_epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+		pthread_mutex_unlock(&s_mutex);
+		LOGE("rilloop: watching fd %d: %s", fd, strerror(errno));
+		return -1;
+	}
+
+	s_slots[i].fd = fd;
+	s_slots[i].fn = fn;
+	s_slots[i].arg = arg;
+
+	pthread_mutex_unlock(&s_mutex);
+	return 0;
+}
+
+void rilloop_del_fd(int fd)
+{
+	int i;
+
+	pthread_mutex_lock(&s_mutex);
+
+	for (i = 0; i < RILLOOP_MAX_FDS; i++) {
+		if (s_slots[i].fd == fd) {
+			epoll_ctl(s_epfd, EPOLL_CTL_DEL, fd, NULL);
+			s_slots[i].fd = -1;
+			break;
+		}
+	}
+
+	pthread_mutex_unlock(&s_mutex);
+}
+
+int rilloop_post(RilLoopFunc fn, void *arg)
+{
+	static const uint64_t one = 1;
+	Post *p;
+	ssize_t len;
+
+	p = (Post *)malloc(sizeof(Post));
+	if (p == NULL)
+		return -1;
+	p->next = NULL;
+	p->fn = fn;
+	p->arg = arg;
+
+	pthread_mutex_lock(&s_mutex);
+	if (s_postTail != NULL)
+		s_postTail->next = p;
+	else
+		s_postHead = p;
+	s_postTail = p;
+	pthread_mutex_unlock(&s_mutex);
+
+	do {
+		len = write(s_wakefd, &one, sizeof(one));
+	} while (len < 0 && errno == EINTR);
+
+	return 0;
+}
+
+RilLoopTimer *rilloop_timer_new(RilLoopFunc fn, void *arg)
+{
+	RilLoopTimer *t;
+
+	t = (RilLoopTimer *)calloc(1, sizeof(RilLoopTimer));
+	if (t == NULL)
+		return NULL;
+
+	t->fn = fn;
+	t->arg = arg;
+	t->fd = timerfdCreate();
+	if (t->fd < 0 || rilloop_add_fd(t->fd, onTimer, t) < 0) {
+		LOGE("rilloop: no timerfd: %s", strerror(errno));
+		if (t->fd >= 0)
+			close(t->fd);
+		free(t);
+		return NULL;
+	}
+
+	return t;
+}
+
+void rilloop_timer_set(RilLoopTimer *t, long long msec)
+{
+	struct itimerspec its;
+
+	memset(&its, 0, sizeof(its));
+	if (msec >= 0) {
+		/* an all-zero it_value disarms, so round 0 up to 1ns */
+		its.it_value.tv_sec = msec / 1000;
+		its.it_value.tv_nsec = (msec % 1000) * 1000000;
+		if (msec == 0)
+			its.it_value.tv_nsec = 1;
+	}
+
+	syscall(__NR_timerfd_settime, t->fd, 0, &its, NULL);
+}
@@ -0,0 +1,61 @@
+/*
+ * The RIL's own event loop.
+ *
+ * One thread multiplexes the AT channel, timers, rtnetlink and work
+ * posted from other threads over a single epoll set. It is atchannel's
+ * reader thread: everything run on it must not block, and in
+ * particular must not send AT commands. Requests and
+ * RIL_requestTimedCallback() work still run on libril's threads.
+ */
+
+#ifndef RILLOOP_H
+#define RILLOOP_H 1
+
+typedef void (*RilLoopFunc)(void *arg);
+
+/** events is a mask of EPOLLIN, EPOLLHUP and EPOLLERR */
+typedef void (*RilLoopFdFunc)(int fd, unsigned int events, void *arg);
+
+typedef struct RilLoopTimer RilLoopTimer;
+
+/** sets up the loop; returns 0 on success, -1 on error */
+int rilloop_init(void);
+
+/**
+ * runs the loop on the calling thread and never returns
+ * the signature lets it be passed to pthread_create() directly
+ */
+void *rilloop_run(void *unused);
+
+/** returns nonzero if called on the loop thread */
+int rilloop_on_loop_thread(void);
+
+/**
+ * watches fd for input; fn(fd, events, arg) runs on the loop thread
+ * returns 0 on success, -1 on error
+ */
+int rilloop_add_fd(int fd, RilLoopFdFunc fn, void *arg);
+
+/**
+ * stops watching fd, before it is closed
+ * events for it that are already pending are dropped
+ */
+void rilloop_del_fd(int fd);
+
+/**
+ * queues fn(arg) to run on the loop thread, in order of posting
+ * may be called from any thread; returns 0 on success, -1 on error
+ */
+int rilloop_post(RilLoopFunc fn, void *arg);
+
+/**
+ * creates a one-shot timer backed by a timerfd, fn(arg) runs on the
+ * loop thread when it fires; returns NULL on error
+ */
+RilLoopTimer *rilloop_timer_new(RilLoopFunc fn, void *arg);
+
+/** arms the timer to fire in msec, replacing any pending expiry,
+    or disarms it if msec is negative */
+void rilloop_timer_set(RilLoopTimer *t, long long msec);
+
+#endif /*RILLOOP_H*/
@@ -0,0 +1,107 @@
+/*
+ * Lock-free publication of the RIL state, see rilstate.h
+ */
+
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include "rilstate.h"
+
+/* odd while a writer is updating s_fields */
+static volatile unsigned int s_seq;
+static volatile int s_fields[RILSTATE_NUM_FIELDS];
+/* futex word */
+static volatile int s_version;
+static volatile int s_waiters;
+/* serializes writers; readers never take it */
+static pthread_mutex_t s_writeMutex = PTHREAD_MUTEX_INITIALIZER;
+
+int rilstate_get(RilStateField field)
+{
+	return s_fields[field];
+}
+
+void rilstate_read(RilState *out)
+{
+	unsigned int seq;
+	int i;
+
+	for (;;) {
+		seq = s_seq;
+		if (seq & 1) {
+			/* a writer was preempted mid-update, let it finish */
+			sched_yield();
+			continue;
+		}
+		__sync_synchronize();
+		for (i = 0; i < RILSTATE_NUM_FIELDS; i++)
+			out->v[i] = s_fields[i];
+		out->version = s_version;
+		__sync_synchronize();
+		if (seq == s_seq)
+			return;
+	}
+}
+
+/* Called with s_writeMutex held */
+static void publish(RilStateField field, int value)
+{
+	s_seq++;
+	__sync_synchronize();
+	s_fields[field] = value;
+	__sync_synchronize();
+	s_seq++;
+
+	/* the barrier orders the new version before the waiter count */
+	__sync_fetch_and_add(&s_version, 1);
+	if (s_waiters)
+		syscall(__NR_futex, &s_version, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+int rilstate_set(RilStateField field, int value)
+{
+	int old;
+
+	pthread_mutex_lock(&s_writeMutex);
+	old = s_fields[field];
+	if (old != value)
+		publish(field, value);
+	pthread_mutex_unlock(&s_writeMutex);
+	return old;
+}
+
+int rilstate_cmpxchg(RilStateField field, int expected, int value)
+{
+	int old;
+
+	pthread_mutex_lock(&s_writeMutex);
+	old = s_fields[field];
+	if (old == expected && old != value)
+		publish(field, value);
+	pthread_mutex_unlock(&s_writeMutex);
+	return old;
+}
+
+unsigned int rilstate_version(void)
+{
+	return s_version;
+}
+
+unsigned int rilstate_wait(unsigned int version, long long timeoutMsec)
+{
+	struct timespec ts;
+
+	ts.tv_sec = timeoutMsec / 1000;
+	ts.tv_nsec = (timeoutMsec % 1000) * 1000000;
+
+	__sync_fetch_and_add(&s_waiters, 1);
+	/* returns right away if the version already moved on */
+	syscall(__NR_futex, &s_version, FUTEX_WAIT, (int)version,
+			timeoutMsec < 0 ? NULL : &ts, NULL, 0);
+	__sync_fetch_and_sub(&s_waiters, 1);
+	return s_version;
+}
@@ -0,0 +1,57 @@
+/*
+ * Radio, SIM and data state shared between the RIL threads.
+ *
+ * Reads never take a lock: a single field is one load, and
+ * rilstate_read() takes a consistent snapshot of all of them under a
+ * sequence counter, retrying if a writer got in between. Writers are
+ * serialized among themselves and bump a version number on every
+ * change, which waiters can sleep on with rilstate_wait() instead of
+ * polling or sharing a condition variable.
+ */
+
+#ifndef RILSTATE_H
+#define RILSTATE_H 1
+
+typedef enum {
+	RILSTATE_RADIO = 0,	/* RIL_RadioState */
+	RILSTATE_SIM,		/* last SIM_Status reported by AT+CPIN? */
+	RILSTATE_DATA,		/* Data_State */
+	RILSTATE_CLOSED,	/* AT channel closed, openChannel to reopen it */
+	RILSTATE_IFCHANGES,	/* count of rtnetlink events, see ifwait.h */
+	RILSTATE_NUM_FIELDS
+} RilStateField;
+
+typedef struct {
+	int v[RILSTATE_NUM_FIELDS];
+	unsigned int version;	/* pass to rilstate_wait() */
+} RilState;
+
+/** returns the current value of one field */
+int rilstate_get(RilStateField field);
+
+/** takes a consistent snapshot of all fields */
+void rilstate_read(RilState *out);
+
+/**
+ * sets a field, waking up waiters if its value changed
+ * returns the previous value
+ */
+int rilstate_set(RilStateField field, int value);
+
+/**
+ * sets a field to value only if it currently holds expected
+ * returns the previous value, which equals expected on success
+ */
+int rilstate_cmpxchg(RilStateField field, int expected, int value);
+
+/** bumped on every change of any field */
+unsigned int rilstate_version(void);
+
+/**
+ * sleeps until the version is no longer version, or for timeoutMsec
+ * (forever if negative); may return early
+ * returns the current version
+ */
+unsigned int rilstate_wait(unsigned int version, long long timeoutMsec);
+
+#endif /*RILSTATE_H*/
@@ -10,10 +10,12 @@
 #ifndef nodroid
 #define LOG_TAG "SMS_RIL"
 #include <utils/Log.h>
+#include "ril_log.h"
 #else
 #define LOGD printf
 #define LOGE printf
 #define LOGI printf
+#define RLOGD(sub, ...) printf(__VA_ARGS__)
 #endif
 
 int hex2int(char c) {
@@ -212,7 +214,7 @@ char **cdma_to_gsmpdu(char *msg) {
         int is_vm=0;
 	decode_cdma_sms(msg,from,message,&is_vm);
 //	if(strlen(message)>=160) message[159]=0;
-	LOGD("CDMA Message:%s From:%s\n",message,from);
+	RLOGD(RLOG_SMS, "CDMA Message: %d chars From:%s", (int)strlen(message), from);
 	SmsAddressRec smsaddr;
 	SmsTimeStampRec smstime;
         if (is_vm) {
@@ -268,7 +270,7 @@ char *gsm_to_cdmapdu(char *msg) {
 	int length=smspdu_get_text_message(pdu, (unsigned char *)message, 256);
 	message[length]=0;
 	smspdu_free(pdu);
-	LOGD("GSM Message:%s To:%s\n",message,to);
+	RLOGD(RLOG_SMS, "GSM Message: %d chars To:%s", (int)strlen(message), to);
 	encode_cdma_sms(hexpdu,to,message);
 	return hexpdu;
 }
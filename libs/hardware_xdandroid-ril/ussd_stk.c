@@ -0,0 +1,251 @@
+/*
+ * USSD string and SIM toolkit TLV decoding, see ussd_stk.h
+ */
+
+#include <string.h>
+#include "ussd_stk.h"
+#include "gsm.h"
+
+/* hex digit value plus one, 0 for anything else */
+static const unsigned char s_hexValue[256] = {
+	['0'] = 1, ['1'] = 2, ['2'] = 3, ['3'] = 4, ['4'] = 5,
+	['5'] = 6, ['6'] = 7, ['7'] = 8, ['8'] = 9, ['9'] = 10,
+	['a'] = 11, ['b'] = 12, ['c'] = 13, ['d'] = 14, ['e'] = 15, ['f'] = 16,
+	['A'] = 11, ['B'] = 12, ['C'] = 13, ['D'] = 14, ['E'] = 15, ['F'] = 16,
+};
+
+int hex_decode(const char *hex, int hexlen, HexBuf *out)
+{
+	const unsigned char *p = (const unsigned char *)hex;
+	int i, hi, lo;
+
+	out->len = 0;
+	if (hexlen < 0 || (hexlen & 1) || hexlen / 2 > HEX_MAX_BYTES)
+		return -1;
+
+	for (i = 0; i < hexlen / 2; i++) {
+		hi = s_hexValue[p[2 * i]];
+		lo = s_hexValue[p[2 * i + 1]];
+		if (!hi || !lo)
+			return -1;
+		out->data[i] = ((hi - 1) << 4) | (lo - 1);
+	}
+	out->len = i;
+	return i;
+}
+
+enum {
+	GROUP_GSM7,	/* language groups and reserved ones */
+	GROUP_LANG,	/* 0001xxxx: text preceded by its language */
+	GROUP_GENERAL,	/* 01xxxxxx and 1001xxxx: alphabet in bits 3..2 */
+	GROUP_8BIT,	/* 1110xxxx: WAP */
+	GROUP_DATA,	/* 1111xxxx: bit 2 selects 8 bit data */
+};
+
+/* coding groups, indexed by the high nibble of the DCS */
+static const unsigned char s_dcsGroups[16] = {
+	GROUP_GSM7, GROUP_LANG, GROUP_GSM7, GROUP_GSM7,
+	GROUP_GENERAL, GROUP_GENERAL, GROUP_GENERAL, GROUP_GENERAL,
+	GROUP_GSM7, GROUP_GENERAL, GROUP_GSM7, GROUP_GSM7,
+	GROUP_GSM7, GROUP_GSM7, GROUP_8BIT, GROUP_DATA,
+};
+
+/* bits 3..2 of the general data coding groups; 11 is reserved */
+static const unsigned char s_dcsAlphabets[4] = {
+	DCS_GSM7, DCS_8BIT, DCS_UCS2, DCS_GSM7,
+};
+
+void dcs_classify(int dcs, DcsInfo *out)
+{
+	dcs &= 0xff;
+	out->alphabet = DCS_GSM7;
+	out->skip = 0;
+	out->compressed = 0;
+
+	switch (s_dcsGroups[dcs >> 4]) {
+		case GROUP_LANG:
+			/* 0x10: "xx" and CR in GSM 7 bit ahead of the text,
+			 * 0x11: two packed GSM 7 bit characters ahead of UCS2 */
+			if (dcs == 0x10) {
+				out->skip = 3;
+			} else if (dcs == 0x11) {
+				out->alphabet = DCS_UCS2;
+				out->skip = 2;
+			}
+			break;
+		case GROUP_GENERAL:
+			out->alphabet = s_dcsAlphabets[(dcs >> 2) & 3];
+			out->compressed = (dcs & 0xe0) == 0x60;
+			break;
+		case GROUP_8BIT:
+			out->alphabet = DCS_8BIT;
+			break;
+		case GROUP_DATA:
+			out->alphabet = dcs & 0x04 ? DCS_8BIT : DCS_GSM7;
+			break;
+	}
+}
+
+/*
+ * Text kernels. Each converts len octets, less skip leading characters,
+ * to UTF-8 and returns its length; a NULL utf8 only measures it.
+ */
+typedef int (*DcsKernel)(cbytes_t src, int len, int skip, bytes_t utf8);
+
+static int kernelGsm7Packed(cbytes_t src, int len, int skip, bytes_t utf8)
+{
+	int septets = len * 8 / 7;
+
+	/* a spare septet at the end is filled with CR, not text */
+	if (septets > 0 && (len * 8) % 7 == 0) {
+		int last = (septets - 1) * 7;
+		int c = src[last >> 3] >> (last & 7);
+
+		if ((last & 7) > 1)
+			c |= src[(last >> 3) + 1] << (8 - (last & 7));
+		if ((c & 0x7f) == '\r')
+			septets--;
+	}
+	if (skip > septets)
+		skip = septets;
+	return utf8_from_gsm7(src, skip * 7, septets - skip, utf8);
+}
+
+static int kernelGsm8(cbytes_t src, int len, int skip, bytes_t utf8)
+{
+	if (skip > len)
+		skip = len;
+	return utf8_from_gsm8(src + skip, len - skip, utf8);
+}
+
+static int kernelUcs2(cbytes_t src, int len, int skip, bytes_t utf8)
+{
+	if (skip > len)
+		skip = len;
+	return ucs2_to_utf8(src + skip, (len - skip) / 2, utf8);
+}
+
+/* indexed by alphabet, then by packed */
+static const DcsKernel s_kernels[DCS_NUM_ALPHABETS][2] = {
+	[DCS_GSM7] = { kernelGsm8, kernelGsm7Packed },
+	[DCS_8BIT] = { kernelGsm8, kernelGsm8 },
+	[DCS_UCS2] = { kernelUcs2, kernelUcs2 },
+};
+
+int dcs_to_utf8(const DcsInfo *dcs, int packed, const unsigned char *src,
+		int len, char *utf8, int utf8size)
+{
+	DcsKernel kernel = s_kernels[dcs->alphabet][packed != 0];
+	int n;
+
+	/* measure first so nothing is written past utf8size */
+	n = kernel(src, len, dcs->skip, NULL);
+	if (n < 0 || n >= utf8size)
+		return -1;
+	n = kernel(src, len, dcs->skip, (bytes_t)utf8);
+	utf8[n] = '\0';
+	return n;
+}
+
+int ussd_decode(const char *hex, int hexlen, int dcs, char *utf8,
+		int utf8size)
+{
+	HexBuf buf;
+	DcsInfo info;
+
+	dcs_classify(dcs, &info);
+	if (info.compressed || hex_decode(hex, hexlen, &buf) < 0)
+		return -1;
+	/* GSM 7 bit text comes as the network sent it, in packed septets */
+	return dcs_to_utf8(&info, 1, buf.data, buf.len, utf8, utf8size);
+}
+
+/* reads a BER/COMPREHENSION-TLV length, returns -1 if malformed */
+static int readLength(const unsigned char **pp, const unsigned char *end)
+{
+	const unsigned char *p = *pp;
+	int len;
+
+	if (p >= end)
+		return -1;
+	if (*p < 0x80) {
+		len = *p++;
+	} else if (*p == 0x81 && p + 1 < end) {
+		len = p[1];
+		p += 2;
+	} else {
+		return -1;
+	}
+	if (len > end - p)
+		return -1;
+	*pp = p;
+	return len;
+}
+
+void stk_tlv_begin(StkTlvIter *it, const unsigned char *data, int len)
+{
+	it->p = data;
+	it->end = data + (len > 0 ? len : 0);
+}
+
+int stk_tlv_next(StkTlvIter *it, StkTlv *tlv)
+{
+	const unsigned char *p = it->p;
+	int tag, len;
+
+	if (p >= it->end || *p == 0xff || *p == 0x00)
+		return 0;
+
+	tlv->raw = *p;
+	if (*p == 0x7f) {
+		/* three byte tag, comprehension bit in the second byte */
+		if (it->end - p < 3)
+			return -1;
+		tag = ((p[1] & 0x7f) << 8) | p[2];
+		p += 3;
+	} else {
+		tag = *p++ & 0x7f;
+	}
+
+	len = readLength(&p, it->end);
+	if (len < 0)
+		return -1;
+
+	tlv->tag = tag;
+	tlv->len = len;
+	tlv->value = p;
+	it->p = p + len;
+	return 1;
+}
+
+int stk_tlv_find(const unsigned char *data, int len, int tag, StkTlv *out)
+{
+	StkTlvIter it;
+	int ret;
+
+	stk_tlv_begin(&it, data, len);
+	while ((ret = stk_tlv_next(&it, out)) > 0) {
+		if (out->tag == tag)
+			return 1;
+	}
+	return ret;
+}
+
+int stk_ber_open(const unsigned char *data, int len, StkTlv *out)
+{
+	const unsigned char *p = data;
+	int vlen;
+
+	if (len < 2)
+		return -1;
+	p++;
+	vlen = readLength(&p, data + len);
+	if (vlen < 0)
+		return -1;
+
+	out->tag = data[0];
+	out->raw = data[0];
+	out->len = vlen;
+	out->value = p;
+	return 0;
+}
@@ -0,0 +1,114 @@
+/*
+ * USSD string and SIM toolkit TLV decoding.
+ *
+ * Everything here works on caller-provided, fixed size buffers: the hex
+ * string from the modem or the framework is decoded once into a HexBuf
+ * on the stack, TLVs are walked in place over it and text is converted
+ * straight into the caller's UTF-8 buffer. Input that would not fit is
+ * rejected rather than truncated.
+ */
+
+#ifndef USSD_STK_H
+#define USSD_STK_H 1
+
+/* largest payload accepted: a short APDU, or a 160 octet USSD string */
+#define HEX_MAX_BYTES		255
+
+/* enough UTF-8 for HEX_MAX_BYTES octets in any alphabet, plus the NUL */
+#define DCS_MAX_UTF8		(3 * (HEX_MAX_BYTES * 8 / 7) + 1)
+
+typedef struct {
+	unsigned char data[HEX_MAX_BYTES];
+	int len;
+} HexBuf;
+
+/**
+ * decodes hexlen hex digits into out
+ * returns the number of bytes, or -1 if the string is odd sized,
+ * contains a non hex digit or is longer than HEX_MAX_BYTES
+ */
+int hex_decode(const char *hex, int hexlen, HexBuf *out);
+
+typedef enum {
+	DCS_GSM7 = 0,	/* GSM default alphabet */
+	DCS_8BIT,	/* GSM default alphabet, one septet per octet */
+	DCS_UCS2,
+	DCS_NUM_ALPHABETS
+} DcsAlphabet;
+
+typedef struct {
+	DcsAlphabet alphabet;
+	int skip;	/* leading language indication, in characters */
+	int compressed;
+} DcsInfo;
+
+/** classifies a CBS/USSD data coding scheme (TS 23.038 chapter 5) */
+void dcs_classify(int dcs, DcsInfo *out);
+
+/**
+ * converts len octets of text to NUL terminated UTF-8
+ * packed selects packed septets for DCS_GSM7; unpacked GSM 7 bit text
+ * is handled like DCS_8BIT.
+ * returns the UTF-8 length, or -1 if it would not fit in utf8size
+ */
+int dcs_to_utf8(const DcsInfo *dcs, int packed, const unsigned char *src,
+		int len, char *utf8, int utf8size);
+
+/**
+ * decodes the string of a +CUSD: indication into utf8
+ * With AT+CSCS="HEX" the modem reports the octets the network sent:
+ * GSM 7 bit text as packed septets, 8 bit and UCS2 text as is.
+ * returns the UTF-8 length, or -1 on malformed, oversized or
+ * compressed input
+ */
+int ussd_decode(const char *hex, int hexlen, int dcs, char *utf8,
+		int utf8size);
+
+/* SIM toolkit tags (TS 102 223 chapter 9.3), comprehension bit clear */
+#define STK_TAG_COMMAND_DETAILS		0x01
+#define STK_TAG_DEVICE_IDENTITIES	0x02
+#define STK_TAG_RESULT			0x03
+#define STK_TAG_TEXT_STRING		0x0d
+#define STK_TAG_ITEM_IDENTIFIER		0x10
+#define STK_TAG_HELP_REQUEST		0x15
+#define STK_TAG_EVENT_LIST		0x19
+
+/* BER-TLV envelope tags */
+#define STK_ENVELOPE_MENU_SELECTION	0xd3
+#define STK_ENVELOPE_EVENT_DOWNLOAD	0xd6
+
+typedef struct {
+	int tag;
+	int raw;	/* first tag octet as sent, comprehension bit included */
+	int len;
+	const unsigned char *value;	/* points into the walked buffer */
+} StkTlv;
+
+typedef struct {
+	const unsigned char *p;
+	const unsigned char *end;
+} StkTlvIter;
+
+/** starts walking the COMPREHENSION-TLVs in data[0..len) */
+void stk_tlv_begin(StkTlvIter *it, const unsigned char *data, int len);
+
+/**
+ * returns 1 and fills tlv with the next TLV, 0 at the end of the data
+ * or at 0xff padding, -1 if a tag or length runs past the end
+ */
+int stk_tlv_next(StkTlvIter *it, StkTlv *tlv);
+
+/**
+ * finds the first TLV with tag in data[0..len)
+ * returns 1 if found, 0 if not, -1 if the data is malformed
+ */
+int stk_tlv_find(const unsigned char *data, int len, int tag, StkTlv *out);
+
+/**
+ * opens the BER-TLV (envelope or proactive command) at the start of
+ * data: fills out with its tag and the span of its value
+ * returns 0, or -1 if the length does not match
+ */
+int stk_ber_open(const unsigned char *data, int len, StkTlv *out);
+
+#endif /*USSD_STK_H*/
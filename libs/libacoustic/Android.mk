@@ -3,7 +3,7 @@ ifeq ($(BUILD_LIB_HTC_ACOUSTIC_WINCE),true)
 LOCAL_PATH := $(call my-dir)
 include $(CLEAR_VARS)
 
-LOCAL_SRC_FILES := libacoustic.c
+LOCAL_SRC_FILES := libacoustic.c audiodev.c
 
 LOCAL_MODULE_TAGS := optional
 LOCAL_MODULE := libhtc_acoustic
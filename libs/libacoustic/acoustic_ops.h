@@ -0,0 +1,62 @@
+/*
+ * Description : table of the libhtc_acoustic entry points used by the
+ * audio HAL, so that it resolves the library once at load instead of
+ * looking up each function when it is needed.
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#ifndef ANDROID_HARDWARE_LIB_HTC_ACOUSTIC_OPS_H
+#define ANDROID_HARDWARE_LIB_HTC_ACOUSTIC_OPS_H
+
+#include <stdint.h>
+
+#if __cplusplus
+extern "C" {
+#endif
+
+struct msm_snd_endpoint;
+
+/* Bump when fields are added. Fields are only ever appended, so a caller
+ * built against an older table can use the first size bytes of a newer one.
+ */
+#define HTC_ACOUSTIC_OPS_VERSION    1
+
+struct htc_acoustic_ops {
+    uint32_t version;
+    uint32_t size;      /* sizeof(struct htc_acoustic_ops) in the library */
+
+    int (*init)(void);
+    int (*deinit)(void);
+    int (*get_num_endpoints)(void);
+    int (*get_endpoint)(int cnt, struct msm_snd_endpoint *ept);
+
+    int (*enable_audpp)(int enable_mask);
+    int (*set_audpre_params)(int audpre_index, int tx_iir_index);
+    int (*enable_audpre)(int acoustic_flags, int audpre_index, int tx_iir_index);
+
+    int (*start_acoustic_setting)(void);
+    int (*set_acoustic_table)(int device, int volume);
+    int (*set_acoustic_done)(void);
+    int (*set_audio_path)(bool bEnableMic, bool bEnableDualMic,
+                          int device_out, bool bEnableOut);
+    int (*update_audio_method)(int method);
+    int (*get_bluetooth_hs_id)(const char* BT_Name);
+};
+
+/* Returns the entry points of this library */
+const struct htc_acoustic_ops* htc_acoustic_get_ops(void);
+
+#if __cplusplus
+} // extern "C"
+#endif
+
+#endif
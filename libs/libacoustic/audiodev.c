@@ -0,0 +1,260 @@
+/*
+ * Description : audio device manager shared by libhtc_acoustic and the
+ * audio HAL, see audiodev.h
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#define LOG_TAG "Libacoustic-wince"
+#include <cutils/log.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+#include "libacoustic.h"
+#include "audiodev.h"
+
+#define AUDIODEV_MAX_SLOTS  24
+#define AUDIODEV_RETRY_US   (1000 * 1000)   /* before opening a failed device again */
+
+/* One per (device, request) pair seen so far */
+struct audiodev_slot {
+    struct audiodev_stats stats;
+    size_t  last_size;      /* 0 if the driver state is unknown */
+    unsigned issued;        /* ioctls started, to spot one overtaking another */
+    uint8_t last[AUDIODEV_MAX_ARG];
+};
+
+static const struct {
+    const char* name;
+    const char* path;
+} devices[AUDIODEV_NUM] = {
+    [AUDIODEV_SND]      = { "snd",      "/dev/msm_snd" },
+    [AUDIODEV_ACOUSTIC] = { "acoustic", MSM_HTC_ACOUSTIC_WINCE },
+    [AUDIODEV_TPA2016]  = { "tpa2016",  MSM_TPA2016D2_DEV },
+    [AUDIODEV_PCM_CTL]  = { "pcm_ctl",  "/dev/msm_pcm_ctl" },
+    [AUDIODEV_A1010]    = { "a1010",    "/dev/audience_A1010" },
+};
+
+static int fds[AUDIODEV_NUM] = { -1, -1, -1, -1, -1 };
+static uint64_t retry_at[AUDIODEV_NUM];     /* 0 unless the last open failed */
+static struct audiodev_slot slots[AUDIODEV_MAX_SLOTS];
+static int num_slots;
+/* Guards all of the above, but is not held across the ioctls themselves */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Called with lock held */
+static int get_fd_l(int dev)
+{
+    if ( (dev < 0) || (dev >= AUDIODEV_NUM) ) {
+        return -1;
+    }
+    if ( (fds[dev] < 0) && (now_us() >= retry_at[dev]) ) {
+        fds[dev] = open(devices[dev].path, O_RDWR);
+        if ( fds[dev] < 0 ) {
+            if ( retry_at[dev] == 0 ) {
+                LOGE("Error opening dev %s. Error %s (%d)", devices[dev].path, strerror(errno), errno);
+            }
+            retry_at[dev] = now_us() + AUDIODEV_RETRY_US;
+        } else {
+            retry_at[dev] = 0;
+        }
+    }
+    return fds[dev];
+}
+
+/* Called with lock held, returns NULL once the table is full */
+static struct audiodev_slot* get_slot_l(int dev, unsigned request)
+{
+    int i;
+
+    for (i = 0; i < num_slots; i++) {
+        if ( (slots[i].stats.dev == dev) && (slots[i].stats.request == request) ) {
+            return &slots[i];
+        }
+    }
+    if ( num_slots == AUDIODEV_MAX_SLOTS ) {
+        return NULL;
+    }
+    memset(&slots[num_slots], 0, sizeof(slots[num_slots]));
+    slots[num_slots].stats.dev = dev;
+    slots[num_slots].stats.request = request;
+    return &slots[num_slots++];
+}
+
+/* Called with lock held, drops it for the ioctl itself: a driver call can
+ * take milliseconds and must not hold up the other devices.
+ */
+static int timed_ioctl_l(int dev, unsigned request, void* arg, struct audiodev_slot* slot)
+{
+    uint64_t start;
+    uint32_t elapsed;
+    int fd, rc, err;
+
+    fd = get_fd_l(dev);
+    if ( fd < 0 ) {
+        errno = ENODEV;
+        return -1;
+    }
+    if ( slot != NULL ) {
+        /* what the driver holds is unknown until this returns */
+        slot->issued++;
+        slot->last_size = 0;
+    }
+
+    pthread_mutex_unlock(&lock);
+    start = now_us();
+    rc = ioctl(fd, request, arg);
+    err = errno;
+    elapsed = (uint32_t) (now_us() - start);
+    pthread_mutex_lock(&lock);
+    errno = err;
+
+    if ( slot != NULL ) {
+        slot->stats.calls++;
+        slot->stats.total_us += elapsed;
+        if ( elapsed > slot->stats.max_us ) {
+            slot->stats.max_us = elapsed;
+        }
+        if ( rc < 0 ) {
+            slot->stats.errors++;
+        }
+    }
+    return rc;
+}
+
+int audiodev_fd(int dev)
+{
+    int fd;
+
+    pthread_mutex_lock(&lock);
+    fd = get_fd_l(dev);
+    pthread_mutex_unlock(&lock);
+    return fd;
+}
+
+int audiodev_ioctl(int dev, unsigned request, void* arg)
+{
+    int rc;
+
+    pthread_mutex_lock(&lock);
+    rc = timed_ioctl_l(dev, request, arg, get_slot_l(dev, request));
+    pthread_mutex_unlock(&lock);
+    return rc;
+}
+
+int audiodev_ioctl_dedup(int dev, unsigned request, const void* arg, size_t size)
+{
+    struct audiodev_slot* slot;
+    unsigned issued;
+    int rc;
+
+    pthread_mutex_lock(&lock);
+    slot = get_slot_l(dev, request);
+    if ( (slot != NULL) && (size <= AUDIODEV_MAX_ARG) &&
+         (slot->last_size == size) && !memcmp(slot->last, arg, size) ) {
+        slot->stats.skipped++;
+        pthread_mutex_unlock(&lock);
+        return AUDIODEV_SKIPPED;
+    }
+
+    /* The driver only reads arg, the cast is for the ioctl prototype */
+    issued = (slot != NULL) ? slot->issued + 1 : 0;
+    rc = timed_ioctl_l(dev, request, (void*) arg, slot);
+    if ( slot != NULL ) {
+        /* if another call of request went out meanwhile, the driver
+         * holds whichever it took last: leave it unknown */
+        if ( (rc >= 0) && (size <= AUDIODEV_MAX_ARG) && (slot->issued == issued) ) {
+            memcpy(slot->last, arg, size);
+            slot->last_size = size;
+        } else {
+            slot->last_size = 0;
+        }
+    }
+    pthread_mutex_unlock(&lock);
+    return (rc < 0) ? rc : 0;
+}
+
+void audiodev_forget(int dev, unsigned request)
+{
+    int i;
+
+    pthread_mutex_lock(&lock);
+    for (i = 0; i < num_slots; i++) {
+        if ( (slots[i].stats.dev == dev) && (slots[i].stats.request == request) ) {
+            slots[i].last_size = 0;
+        }
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+void audiodev_forget_all(int dev)
+{
+    int i;
+
+    pthread_mutex_lock(&lock);
+    for (i = 0; i < num_slots; i++) {
+        if ( slots[i].stats.dev == dev ) {
+            slots[i].last_size = 0;
+        }
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+int audiodev_get_stats(struct audiodev_stats* stats, int max)
+{
+    int i;
+
+    pthread_mutex_lock(&lock);
+    for (i = 0; (i < num_slots) && (i < max); i++) {
+        stats[i] = slots[i].stats;
+    }
+    pthread_mutex_unlock(&lock);
+    return i;
+}
+
+const char* audiodev_name(int dev)
+{
+    if ( (dev < 0) || (dev >= AUDIODEV_NUM) ) {
+        return "?";
+    }
+    return devices[dev].name;
+}
+
+void audiodev_close_all(void)
+{
+    int dev;
+
+    pthread_mutex_lock(&lock);
+    for (dev = 0; dev < AUDIODEV_NUM; dev++) {
+        if ( fds[dev] >= 0 ) {
+            close(fds[dev]);
+            fds[dev] = -1;
+        }
+        retry_at[dev] = 0;
+    }
+    num_slots = 0;
+    pthread_mutex_unlock(&lock);
+}
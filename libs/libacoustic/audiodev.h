@@ -0,0 +1,88 @@
+/*
+ * Description : audio device manager shared by libhtc_acoustic and the
+ * audio HAL. Keeps the audio control devices open for the lifetime of
+ * the HAL, skips ioctls that would repeat the last settings sent, and
+ * times every ioctl it issues.
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#ifndef ANDROID_HARDWARE_LIB_HTC_AUDIODEV_H
+#define ANDROID_HARDWARE_LIB_HTC_AUDIODEV_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if __cplusplus
+extern "C" {
+#endif
+
+enum audiodev_id {
+    AUDIODEV_SND = 0,       /* /dev/msm_snd */
+    AUDIODEV_ACOUSTIC,      /* /dev/htc_acoustic_wince */
+    AUDIODEV_TPA2016,       /* /dev/tpa2016d2 */
+    AUDIODEV_PCM_CTL,       /* /dev/msm_pcm_ctl */
+    AUDIODEV_A1010,         /* /dev/audience_A1010 */
+    AUDIODEV_NUM
+};
+
+/* Returned by audiodev_ioctl_dedup when the ioctl was not needed */
+#define AUDIODEV_SKIPPED    1
+
+/* Largest argument audiodev_ioctl_dedup can compare */
+#define AUDIODEV_MAX_ARG    32
+
+struct audiodev_stats {
+    int      dev;
+    unsigned request;
+    unsigned calls;         /* ioctls issued */
+    unsigned skipped;       /* ioctls found redundant */
+    unsigned errors;
+    uint64_t total_us;
+    uint32_t max_us;
+};
+
+/* Returns the fd of dev, opening it on first use, or -1 if it can't be opened.
+ * A device that failed to open is tried again a second later at the soonest.
+ */
+int audiodev_fd(int dev);
+
+/* Timed ioctl on dev */
+int audiodev_ioctl(int dev, unsigned request, void* arg);
+
+/* Like audiodev_ioctl, but returns AUDIODEV_SKIPPED without calling the driver
+ * if the last successful call of request on dev had the same size bytes of arg.
+ * Calls racing on the same request are all sent, and the next one is too.
+ */
+int audiodev_ioctl_dedup(int dev, unsigned request, const void* arg, size_t size);
+
+/* Makes the next audiodev_ioctl_dedup of request on dev reach the driver,
+ * e.g. after something else reset the state it set.
+ */
+void audiodev_forget(int dev, unsigned request);
+
+/* Same for every request on dev */
+void audiodev_forget_all(int dev);
+
+/* Copies up to max ioctl statistics into stats, returns how many */
+int audiodev_get_stats(struct audiodev_stats* stats, int max);
+
+/* Short name of dev, for logs and dumps */
+const char* audiodev_name(int dev);
+
+/* Closes every device and forgets all state, with no ioctl in flight */
+void audiodev_close_all(void);
+
+#if __cplusplus
+} // extern "C"
+#endif
+
+#endif
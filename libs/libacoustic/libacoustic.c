@@ -41,6 +41,7 @@
 #include <linux/msm_audio.h>
 
 #include "libacoustic.h"
+#include "audiodev.h"
 
 #define AUDIO_PARA_CUSTOM_FILENAME        "/sdcard/AudioPara3.csv"
 #define AUDIO_PARA_DEFAULT_FILENAME       "/system/etc/AudioPara3.csv"
@@ -51,9 +52,13 @@
 #define AUDIO_PREPROCESS_CUSTOM_FILENAME  "/sdcard/AudioPreProcessTable.csv"
 #define AUDIO_PREPROCESS_DEFAULT_FILENAME "/system/etc/AudioPreProcessTable.csv"
 
+/* Compiled form of the three tables above, see load_acoustic_cache() */
+#define ACOUSTIC_CACHE_FILENAME           "/data/misc/audio/acoustic_tables.bin"
+#define ACOUSTIC_CACHE_MAGIC              0x41434254    /* "TBCA" */
+#define ACOUSTIC_CACHE_VERSION            2
+
 #define PCM_OUT_DEVICE      "/dev/msm_pcm_out"
 #define PCM_IN_DEVICE       "/dev/msm_pcm_in"
-#define PCM_CTL_DEVICE      "/dev/msm_pcm_ctl"
 #define PREPROC_CTL_DEVICE  "/dev/msm_audpre"
 
 struct au_table_s {
@@ -87,15 +92,74 @@ struct fg_table_s {
 struct c_table_s {
     union {
         struct fg_table_st table;
-        uint16_t array[0x50];  
+        uint16_t array[0x50];
     };
 };
 
+/* Every table read from the csv files, in one block so that it can be
+ * written to and mapped back from the cache file as is */
+struct acoustic_tables {
+    /* AudioPara3.csv */
+    struct au_table_s   a_table[32];
+    struct au_table_s   u_table[32];
+    struct fg_table_s   f_table[100];
+    struct fg_table_s   g_table[100];
+    char                g_names[100][MAX_MODE_NAME_LENGTH];    /* BT headset of each g_table */
+    struct d_table_s    d_table[32];
+    struct c_table_s    c_table[15];
+    uint8_t APT_max_index;
+    uint8_t APUT_max_index;
+    uint8_t PAT_max_index;
+    uint8_t BTPAT_max_index;
+    uint8_t HVCCT_max_index;
+    uint8_t CEAT_max_index;
+
+    /* AudioFilterTable.csv */
+    uint8_t audpp_filter_inited;
+    struct rx_iir_filter iir_cfg[1];
+    struct adrc_filter adrc_cfg[1];
+    struct eqalizer eqalizer[1];
+    uint16_t adrc_flag[1];
+    uint16_t eq_flag[1];
+    uint16_t rx_iir_flag[1];
+    bool adrc_filter_exists[1];
+
+    /* AudioPreProcessTable.csv */
+    uint8_t audpre_filter_inited;
+    uint8_t audpre_ns_cfg_exist;
+    uint8_t audpre_tx_agc_cfg_exist;
+    struct tx_iir tx_iir_cfg[18];
+    struct ns ns_cfg[9];
+    struct tx_agc tx_agc_cfg[9];
+    uint16_t tx_agc_overrun;    /* the AGC parser writes one param past the last entry */
+};
+
+/* Identifies the csv file a cache was compiled from */
+struct acoustic_source {
+    int32_t  custom;            /* 1 for /sdcard, 0 for /system, -1 if missing */
+    int32_t  reserved;
+    int64_t  mtime;
+    int64_t  size;
+};
+
+struct acoustic_cache {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t size;              /* sizeof(struct acoustic_cache) */
+    uint32_t checksum;          /* of tables */
+    struct acoustic_source sources[3];
+    struct acoustic_tables tables;
+};
+
 /***********************************************************************************
  *
  *  Global variables
  *
  ***********************************************************************************/
+/* Either mapped read-only from the cache file or allocated to be parsed into */
+static struct acoustic_cache* acoustic_cache = NULL;
+static bool acoustic_cache_mapped = false;
+
 static struct au_table_s*    Audio_Path_Table = NULL;              /* a_table ('A') */
 static uint8_t APT_max_index   = 0;
 static struct au_table_s*    Audio_Path_Uplink_Table = NULL;       /* u_table ('U') */
@@ -103,6 +167,7 @@ static uint8_t APUT_max_index  = 0;
 static struct fg_table_s*    Phone_Acoustic_Table = NULL;          /* f_table ('F' + 'B') */
 static uint8_t PAT_max_index   = 0;
 static struct fg_table_s*    BT_Phone_Acoustic_Table = NULL;       /* g_table ('E' + 'G') */
+static char (*BT_Phone_Acoustic_Names)[MAX_MODE_NAME_LENGTH] = NULL;
 static uint8_t BTPAT_max_index = 0;
 static struct d_table_s*     HTC_VOC_CAL_CODEC_TABLE_Table = NULL; /* d_table ('D') */
 static uint8_t HVCCT_max_index = 0;
@@ -110,28 +175,29 @@ static struct c_table_s*     CE_Acoustic_Table = NULL;             /* c_table ('
 static uint8_t CEAT_max_index  = 0;
 
 /* Communication with kernel */
-static int acousticfd = 0;
+static int acousticfd = -1;
 static int mNumSndEndpoints;
 static struct msm_snd_endpoint *mSndEndpoints;
 static struct msm_acoustic_capabilities device_capabilities;
-static int TPA2016fd;
+static int TPA2016fd = -1;
 
 static bool mInit = false;
 
-static struct rx_iir_filter iir_cfg[1];
-static struct adrc_filter adrc_cfg[1];
-static struct eqalizer eqalizer[1];
-static uint16_t adrc_flag[1];
-static uint16_t eq_flag[1];
-static uint16_t rx_iir_flag[1];
+/* Filter tables, pointing into acoustic_cache */
+static struct rx_iir_filter* iir_cfg;
+static struct adrc_filter* adrc_cfg;
+static struct eqalizer* eqalizer;
+static uint16_t* adrc_flag;
+static uint16_t* eq_flag;
+static uint16_t* rx_iir_flag;
 static bool audpp_filter_inited = false;
 static bool audpre_filter_inited = false;
-static bool adrc_filter_exists[1];
+static bool* adrc_filter_exists;
 
-static struct tx_iir tx_iir_cfg[18];    // Normal + Full DUplex
-static struct ns ns_cfg[9];
+static struct tx_iir* tx_iir_cfg;       // Normal + Full DUplex
+static struct ns* ns_cfg;
 static bool audpre_ns_cfg_exist = false;
-static struct tx_agc tx_agc_cfg[9];
+static struct tx_agc* tx_agc_cfg;
 static bool audpre_tx_agc_cfg_exist = false;
 
 // Current TPA2016 registers value initialized with default values
@@ -169,9 +235,30 @@ static int mCurrentVolume = 0;
 static int mCurrent_Adie_PGA_Gain = 1;
 
 
-static bool bCurrentAudioUplinkState = 0;
-static bool bCurrentEnableHSSDState = 0;
-static bool bCurrentAUXBypassReqState = 0;
+/* ADIE tables for every state UpdateAudioAdieTable can be asked for, built at load time */
+#define ADIE_VARIANT_UPLINK         0x1
+#define ADIE_VARIANT_R1             0x2
+#define ADIE_VARIANT_HSSD           0x4
+#define ADIE_VARIANT_AUX_BYPASS     0x8
+#define ADIE_NUM_VARIANTS           0x10
+
+static char adie_variants[ADIE_NUM_VARIANTS][32][0x80];
+static int adie_variants_pga_gain = -1;     /* FM PGA gain the AUX bypass variants were built for */
+static const char* adie_sent[32];           /* last table sent to the kernel, NULL if unknown */
+static int mCurrentAdieVariant = -1;
+
+#define SND_METHOD_AUDIO 1
+#define SND_METHOD_NONE  -1
+
+/* Acoustic profile resolution, see build_acoustic_profiles() */
+#define MAX_SND_DEVICE_ID               BT_CUSTOM_DEVICES_ID_OFFSET
+#define MAX_ACOUSTIC_VOLUME             5
+#define BT_NAME_HASH_SIZE               256     // power of 2, at least twice the g_table size
+
+static int8_t snd_device_profile[MAX_SND_DEVICE_ID];     /* SND device id -> CE_audio_devices, -1 if none */
+static struct fg_table_s* profile_volume_table[SYS][MAX_ACOUSTIC_VOLUME + 1];
+static int profile_method[SYS];
+static uint8_t bt_name_hash[BT_NAME_HASH_SIZE];         /* BT_Phone_Acoustic_Table index + 1, 0 if free */
 
 /***********************************************************************************
  *
@@ -180,19 +267,30 @@ static bool bCurrentAUXBypassReqState = 0;
  ***********************************************************************************/
 static int openacousticfd(void)
 {
-    acousticfd = open(MSM_HTC_ACOUSTIC_WINCE, O_RDWR);
+    /* Stays open until htc_acoustic_deinit */
+    acousticfd = audiodev_fd(AUDIODEV_ACOUSTIC);
     if ( acousticfd < 0 ) {
-        LOGE("Error opening dev %s (fd = %d). Error %s (%d)", MSM_HTC_ACOUSTIC_WINCE, acousticfd,
-                    strerror(errno), errno);
         return -1;
-    } 
+    }
     return 0;
 }
 
+/* Registers are lost while the amplifier is off, so a config set before
+ * a power cycle must not be taken as already sent
+ */
+static int set_tpa2016_power(int bOn)
+{
+    int rc = audiodev_ioctl_dedup(AUDIODEV_TPA2016, TPA2016_SET_POWER, &bOn, sizeof(bOn));
+    if ( rc == 0 ) {
+        audiodev_forget(AUDIODEV_TPA2016, TPA2016_SET_CONFIG);
+    }
+    return rc;
+}
+
 static int get_device_capabilities(void)
 {
     int bOn;
-    if ( ioctl(acousticfd, ACOUSTIC_GET_CAPABILITIES, &device_capabilities) < 0) {
+    if ( audiodev_ioctl(AUDIODEV_ACOUSTIC, ACOUSTIC_GET_CAPABILITIES, &device_capabilities) < 0) {
         LOGE("ACOUSTIC_GET_CAPABILITIES error.");
         return -EIO;
     } 
@@ -201,27 +299,24 @@ static int get_device_capabilities(void)
     LOGV("- Dual mic supported : %s", (device_capabilities.bDualMicSupported)?"true":"false");
 
     /* Test for TPA2016 */
-    TPA2016fd = open(MSM_TPA2016D2_DEV, O_RDWR);
-    if ( TPA2016fd < 0 ) {
-        LOGE("Error opening dev %s (fd = %d). Error %s (%d)", MSM_TPA2016D2_DEV, acousticfd,
-                    strerror(errno), errno);
-    } else {
+    TPA2016fd = audiodev_fd(AUDIODEV_TPA2016);
+    if ( TPA2016fd >= 0 ) {
         /* Power on amplifier */
         bOn = 1;
-        if (ioctl(TPA2016fd, TPA2016_SET_POWER, &bOn ) < 0) {
+        if ( set_tpa2016_power(bOn) < 0 ) {
             LOGE("TPA2016_SET_POWER error.");
             return -EIO;
         }
 
         /* Read current device configuration */
-        if (ioctl(TPA2016fd, TPA2016_READ_CONFIG, &tpa2016d2_regs ) < 0) {
+        if (audiodev_ioctl(AUDIODEV_TPA2016, TPA2016_READ_CONFIG, &tpa2016d2_regs ) < 0) {
             LOGE("TPA2016_READ_CONFIG error.");
             return -EIO;
         }  
 
         /* Power off amplifier */
         bOn = 0;
-        if (ioctl(TPA2016fd, TPA2016_SET_POWER, &bOn ) < 0) {
+        if ( set_tpa2016_power(bOn) < 0 ) {
             LOGE("TPA2016_SET_POWER error.");
             return -EIO;
         }
@@ -236,9 +331,9 @@ static int get_sound_endpoints(void)
     int m7xsnddriverfd;
     struct msm_snd_endpoint *ept;
 
-    m7xsnddriverfd = open("/dev/msm_snd", O_RDWR);
+    m7xsnddriverfd = audiodev_fd(AUDIODEV_SND);
     if (m7xsnddriverfd >= 0) {
-        rc = ioctl(m7xsnddriverfd, SND_GET_NUM_ENDPOINTS, &mNumSndEndpoints);
+        rc = audiodev_ioctl(AUDIODEV_SND, SND_GET_NUM_ENDPOINTS, &mNumSndEndpoints);
         if (rc >= 0) {
             mSndEndpoints = malloc(mNumSndEndpoints * sizeof(struct msm_snd_endpoint));
             mInit = true;
@@ -246,7 +341,7 @@ static int get_sound_endpoints(void)
             struct msm_snd_endpoint *ept = mSndEndpoints;
             for (cnt = 0; cnt < mNumSndEndpoints; cnt++, ept++) {
                 ept->id = cnt;
-                ioctl(m7xsnddriverfd, SND_GET_ENDPOINT, ept);
+                audiodev_ioctl(AUDIODEV_SND, SND_GET_ENDPOINT, ept);
                 LOGV("cnt = %d ept->name = %s ept->id = %d\n", cnt, ept->name, ept->id);
 #define CHECK_FOR(desc) if (!strcmp(ept->name, #desc)) SND_DEVICE_##desc = ept->id;
                 CHECK_FOR(CURRENT)
@@ -269,9 +364,6 @@ static int get_sound_endpoints(void)
             }
         }
         else LOGE("Could not retrieve number of MSM SND endpoints.");
-
-        // Close snd
-        close(m7xsnddriverfd);
     }
 	else LOGE("Could not open MSM SND driver.");
 
@@ -298,86 +390,112 @@ static int get_pga_gain_for_fm_profile(int profile, int current_pga_gain)
     return 0;
 }
 
+/* Fills adie_variants with every table for every combination of ADIE_VARIANT_* flags */
+static void BuildAudioAdieVariants(void)
+{
+    int variant, table_num, tab_byte_idx;
+    char* temp_table;
+
+    for (variant = 0; variant < ADIE_NUM_VARIANTS; variant++) {
+        for (table_num = 0; table_num < APT_max_index; table_num++) {
+            temp_table = adie_variants[variant][table_num];
+            memset(temp_table, 0, 0x80);
+
+            for (tab_byte_idx = 0; tab_byte_idx < 0x80; tab_byte_idx += 2) {
+                temp_table[tab_byte_idx] = Audio_Path_Table[table_num].array[tab_byte_idx];
+                temp_table[tab_byte_idx + 1] = Audio_Path_Table[table_num].array[tab_byte_idx + 1];
+
+                if ( (!(table_num & 1)) && (variant & ADIE_VARIANT_UPLINK) ) {
+                    temp_table[tab_byte_idx + 1] = (Audio_Path_Uplink_Table[table_num].array[tab_byte_idx + 1]
+                                                         | Audio_Path_Table[table_num].array[tab_byte_idx + 1]);
+                }
+
+                if ( !(variant & ADIE_VARIANT_R1) ) {
+                    if ( variant & ADIE_VARIANT_HSSD ) {
+                        if ( Audio_Path_Table[table_num].array[tab_byte_idx] == 0x37 ) {
+                            temp_table[tab_byte_idx + 1] |= 0x80;
+                        }
+                        if ( Audio_Path_Table[table_num].array[tab_byte_idx] == 0x48 ) {
+                            temp_table[tab_byte_idx + 1] |= 0xC0;
+                        }
+                    }
+                } else {
+                    if ( Audio_Path_Table[table_num].array[tab_byte_idx] == 0x3E ) {
+                        temp_table[tab_byte_idx + 1] = (temp_table[tab_byte_idx + 1] & 0xE7) | 0x10;
+                    }
+                }
+
+                if ( (variant & ADIE_VARIANT_AUX_BYPASS) && (Audio_Path_Table[table_num].array[tab_byte_idx] == 0x42) ) {
+                    temp_table[tab_byte_idx + 1] = get_pga_gain_for_fm_profile(table_num, mCurrent_Adie_PGA_Gain);
+                }
+            }
+        }
+    }
+
+    adie_variants_pga_gain = mCurrent_Adie_PGA_Gain;
+    memset(adie_sent, 0, sizeof(adie_sent));
+}
+
 static int UpdateAudioAdieTable(bool bAudioUplinkReq, int paramR1, bool bEnableHSSD, bool bAUXBypassReq, bool bForceUpdate)
 {
     struct adie_table table;
-    int table_num = 0;
-    int tab_byte_idx;
-
-    char temp_table[0x80];
-    uint16_t pcom_update[1];
+    int table_num;
+    int variant;
+    int sent = 0;
 
     LOGV("UpdateAudioAdieTable(bAudioUplinkReq %d,bAUXBypassReq %d, bEnableHSSD=%d, bForceUpdate = %d)\n",
             bAudioUplinkReq, bEnableHSSD, bAUXBypassReq, bForceUpdate);
 
-    if ( (bCurrentAudioUplinkState  == bAudioUplinkReq) && 
-         (bCurrentEnableHSSDState   == bEnableHSSD ) &&
-         (bCurrentAUXBypassReqState == bAUXBypassReq) && 
-         (bForceUpdate == false) ) {
+    variant = (bAudioUplinkReq ? ADIE_VARIANT_UPLINK : 0) |
+              (paramR1 ? ADIE_VARIANT_R1 : 0) |
+              (bEnableHSSD ? ADIE_VARIANT_HSSD : 0) |
+              (bAUXBypassReq ? ADIE_VARIANT_AUX_BYPASS : 0);
+
+    if ( (mCurrentAdieVariant == variant) && (bForceUpdate == false) ) {
         LOGV("Update not required");
         return 0;
     }
 
-    do 
-    {
-        memset(temp_table, 0, 0x80);
-        tab_byte_idx = 0;
-        
-        do
-        {
-            temp_table[tab_byte_idx] = Audio_Path_Table[table_num].array[tab_byte_idx];
-            temp_table[tab_byte_idx + 1] = (temp_table[tab_byte_idx + 1] | Audio_Path_Table[table_num].array[tab_byte_idx + 1]);
-
-            if ( (!(table_num & 1)) && ( bAudioUplinkReq != 0 ) ) {
-                temp_table[tab_byte_idx + 1] = (Audio_Path_Uplink_Table[table_num].array[tab_byte_idx + 1] 
-                                                     | Audio_Path_Table[table_num].array[tab_byte_idx + 1]);
-            }
-
-            if ( paramR1 == 0 ) {
-                if ( bEnableHSSD != 0 ) {
-                    if ( Audio_Path_Table[table_num].array[tab_byte_idx] == 0x37 ) {
-                        temp_table[tab_byte_idx + 1] |= 0x80;
-                    }
-                    if ( Audio_Path_Table[table_num].array[tab_byte_idx] == 0x48 ) {
-                        temp_table[tab_byte_idx + 1] |= 0xC0;
-                    }
-                }
-            } else {
-                if ( Audio_Path_Table[table_num].array[tab_byte_idx] == 0x3E ) {
-                    temp_table[tab_byte_idx + 1] = (temp_table[tab_byte_idx + 1] & 0xE7) | 0x10;           
-                }
-            }
+    if ( adie_variants_pga_gain != mCurrent_Adie_PGA_Gain ) {
+        BuildAudioAdieVariants();
+    }
+    if ( bForceUpdate ) {
+        memset(adie_sent, 0, sizeof(adie_sent));
+    }
 
-            if ( (bAUXBypassReq != 0) && (Audio_Path_Table[table_num].array[tab_byte_idx] == 0x42) ) {
-                temp_table[tab_byte_idx + 1] = get_pga_gain_for_fm_profile(table_num, mCurrent_Adie_PGA_Gain);
-            }
+    /* Only send the tables that differ from what the kernel already has */
+    for (table_num = 0; table_num < APT_max_index; table_num++) {
+        const char* temp_table = adie_variants[variant][table_num];
 
-            tab_byte_idx += 2;
+        if ( (adie_sent[table_num] == temp_table) ||
+             ((adie_sent[table_num] != NULL) && !memcmp(adie_sent[table_num], temp_table, 0x80)) ) {
+            adie_sent[table_num] = temp_table;
+            continue;
         }
-        while( tab_byte_idx < 0x80);
-        
+
         /* Send table to kernel for update */
         table.table_num = table_num;
-        table.pcArray = temp_table;
-        if ( ioctl(acousticfd, ACOUSTIC_UPDATE_ADIE_TABLE, &table) < 0) {
+        table.pcArray = (char*) temp_table;
+        if ( audiodev_ioctl(AUDIODEV_ACOUSTIC, ACOUSTIC_UPDATE_ADIE_TABLE, &table) < 0) {
             LOGE("ACOUSTIC_UPDATE_ADIE_TABLE error.");
+            adie_sent[table_num] = NULL;
             return -EIO;
-        }    
-
-        table_num += 1;
+        }
+        adie_sent[table_num] = temp_table;
+        sent++;
     }
-    while ( table_num < APT_max_index );
+    LOGV("%d of %d ADIE tables updated", sent, APT_max_index);
 
-    /* Generate PCOM_UPDATE_AUDIO 0x1 */
-    struct audio_update_req req = {.type = PCOM_UPDATE_REQ, .value = 0x1};
-    if ( ioctl(acousticfd, ACOUSTIC_UPDATE_AUDIO_SETTINGS, &req) < 0) {
-        LOGE("ACOUSTIC_UPDATE_AUDIO_SETTINGS error.");
-        return -EIO;
-    }     
+    if ( sent ) {
+        /* Generate PCOM_UPDATE_AUDIO 0x1 */
+        struct audio_update_req req = {.type = PCOM_UPDATE_REQ, .value = 0x1};
+        if ( audiodev_ioctl(AUDIODEV_ACOUSTIC, ACOUSTIC_UPDATE_AUDIO_SETTINGS, &req) < 0) {
+            LOGE("ACOUSTIC_UPDATE_AUDIO_SETTINGS error.");
+            return -EIO;
+        }
+    }
 
-    bCurrentAudioUplinkState  = bAudioUplinkReq;
-    bCurrentEnableHSSDState   = bEnableHSSD;
-    bCurrentAUXBypassReqState = bAUXBypassReq;
+    mCurrentAdieVariant = variant;
 
     return 0;
 }
@@ -466,9 +584,10 @@ static int ParseAudioParaLine(char* line, int len)
 #endif
             /* Skip the table number field */
             token = strtok(NULL, ",");
-            if ( BTPAT_max_index < 100 ) {  
-                strncpy(BT_Phone_Acoustic_Table[BTPAT_max_index].table.name, token, MAX_MODE_NAME_LENGTH);          
-                LOGV("BT Phone Acoustic Table: %s\n", BT_Phone_Acoustic_Table[BTPAT_max_index].table.name);
+            if ( BTPAT_max_index < 100 ) {
+                /* Kept apart, the fields below are written over table.name */
+                strncpy(BT_Phone_Acoustic_Names[BTPAT_max_index], token, MAX_MODE_NAME_LENGTH - 1);
+                LOGV("BT Phone Acoustic Table: %s\n", BT_Phone_Acoustic_Names[BTPAT_max_index]);
                 while ( (token = strtok(NULL, ",")) ) {
                     BT_Phone_Acoustic_Table[BTPAT_max_index].array[field_count++] = strtol(token, &ps, 16);
                 };
@@ -509,8 +628,6 @@ static int ReadAudioParaFromFile(void)
     char *read_buf;
     char *next_str, *current_str;
     int csvfd;
-    struct htc_voc_cal_table htc_voc_cal_tbl;
-    uint16_t* htc_voc_cal_tbl_conv = NULL;
 
     static const char *path =
         AUDIO_PARA_CUSTOM_FILENAME;
@@ -553,54 +670,6 @@ static int ReadAudioParaFromFile(void)
     }
    
 
-    if ( Audio_Path_Table == NULL ) {
-        Audio_Path_Table = (struct au_table_s*) malloc(32 * sizeof(struct au_table_s) );  // 0x1000
-        if (Audio_Path_Table == NULL) {
-            LOGE("Failed to malloc Audio_Path_Table\n");
-            return -1;
-        }
-    }
-
-    if ( Audio_Path_Uplink_Table == NULL ) {
-        Audio_Path_Uplink_Table = (struct au_table_s*) malloc(32 * sizeof(struct au_table_s) ); // 0x1000
-        if (Audio_Path_Uplink_Table == NULL) {
-            LOGE("Failed to malloc Audio_Path_Uplink_Table\n");
-            return -1;
-        }
-    }
-
-    if ( Phone_Acoustic_Table == NULL ) {
-        Phone_Acoustic_Table = (struct fg_table_s*) malloc(100 * sizeof(struct fg_table_s) ); // 0x3C00
-        if (Phone_Acoustic_Table == NULL) {
-            LOGE("Failed to malloc Phone_Acoustic_Table\n");
-            return -1;
-        }
-    }
-
-    if ( BT_Phone_Acoustic_Table == NULL ) {
-        BT_Phone_Acoustic_Table = (struct fg_table_s*) malloc(100 * sizeof(struct fg_table_s) );  // 0x7800
-        if (BT_Phone_Acoustic_Table == NULL) {
-            LOGE("Failed to malloc BT_Phone_Acoustic_Table\n");
-            return -1;
-        }
-    }
-
-    if ( HTC_VOC_CAL_CODEC_TABLE_Table == NULL ) {
-        HTC_VOC_CAL_CODEC_TABLE_Table = (struct d_table_s*) malloc(32 * sizeof(struct d_table_s));
-        if (HTC_VOC_CAL_CODEC_TABLE_Table == NULL) {
-            LOGE("Failed to malloc HTC_VOC_CAL_CODEC_TABLE_Table\n");
-            return -1;
-        }
-    }
-
-    if ( CE_Acoustic_Table == NULL ) {
-        CE_Acoustic_Table = (struct c_table_s*) malloc(15 * sizeof(struct c_table_s) );   // 0x960
-        if (CE_Acoustic_Table == NULL) {
-            LOGE("Failed to malloc CE_Acoustic_Table\n");
-            return -1;
-        }
-    }
-
     current_str = read_buf;
 
     while (1) {
@@ -620,7 +689,16 @@ static int ReadAudioParaFromFile(void)
     munmap(read_buf, st.st_size);
     close(csvfd);
 
-    LOGI("Readed :");
+    return 0;
+}
+
+/* Pushes the tables that are only sent once to the kernel */
+static int SendAudioParaTables(void)
+{
+    struct htc_voc_cal_table htc_voc_cal_tbl;
+    uint16_t htc_voc_cal_tbl_conv[32 * 0xB];
+
+    LOGI("Loaded :");
     LOGI("%d Audio_Path_Table entries", APT_max_index);
     LOGI("%d Audio_Path_Uplink_Table entries", APUT_max_index);
     LOGI("%d Phone_Acoustic_Table entries", PAT_max_index);
@@ -629,6 +707,7 @@ static int ReadAudioParaFromFile(void)
     LOGI("%d CE_Acoustic_Table entries", CEAT_max_index);
 
     // initialise audio table with uplink off
+    BuildAudioAdieVariants();
     UpdateAudioAdieTable(0, 0, 0, 0, true);
 
     /* Table might need to be converted (on some devices, 1 setting is 8 params long,
@@ -640,11 +719,6 @@ static int ReadAudioParaFromFile(void)
         int field;
         uint16_t* htc_voc_cal_tbl_conv_field;
         /* Convert table to required field size */
-        htc_voc_cal_tbl_conv = (uint16_t*) malloc(HVCCT_max_index * device_capabilities.htc_voc_cal_fields_per_param * sizeof(uint16_t));
-        if ( htc_voc_cal_tbl_conv == NULL ) {
-            goto exit;
-        }
-
         for (field=0; field<HVCCT_max_index; field++) {
             htc_voc_cal_tbl_conv_field = &htc_voc_cal_tbl_conv[field * device_capabilities.htc_voc_cal_fields_per_param];
             memcpy((void*) htc_voc_cal_tbl_conv_field,
@@ -660,17 +734,12 @@ static int ReadAudioParaFromFile(void)
         htc_voc_cal_tbl.pArray = HTC_VOC_CAL_CODEC_TABLE_Table->array;
     }
 
-    if (ioctl(acousticfd, ACOUSTIC_UPDATE_HTC_VOC_CAL_CODEC_TABLE,
+    if (audiodev_ioctl(AUDIODEV_ACOUSTIC, ACOUSTIC_UPDATE_HTC_VOC_CAL_CODEC_TABLE,
                          &htc_voc_cal_tbl ) < 0) {
         LOGE("ACOUSTIC_UPDATE_HTC_VOC_CAL_CODEC_TABLE error.");
         return -EIO;
     }
 
-    if ( htc_voc_cal_tbl_conv ) {
-        free(htc_voc_cal_tbl_conv);
-    }
-
-exit:
 /*
     if ( BT_Phone_Acoustic_Table[0] == 0 ) {
         memcpy(&BT_Phone_Acoustic_Table[0x40], &f_table[0x1680], 0x140);
@@ -1002,7 +1071,7 @@ static int check_and_set_audpp_parameters(char *buf, int size)
             return -1;
         }
         eq_cal = (void *(*) (int32_t, int32_t, int32_t, uint16_t, int32_t, int32_t *, int32_t *, uint16_t *)) dlsym(audioeq, "audioeq_calccoefs");
-        memset(&eqalizer[0], 0, sizeof(eqalizer));
+        memset(&eqalizer[0], 0, sizeof(eqalizer[0]));
 
         /* Temp add the bands here */
         eqalizer[0].bands = 8;
@@ -1115,6 +1184,313 @@ static int get_audpp_filter(void)
     return 0;
 }
 
+/* FNV-1a, enough to catch a truncated or corrupted cache file */
+static uint32_t acoustic_checksum(const void *data, size_t len)
+{
+    const uint8_t *p = (const uint8_t *) data;
+    uint32_t hash = 2166136261u;
+
+    while (len--) {
+        hash ^= *p++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/* Stamps the csv file the parser would pick, custom first */
+static void stat_acoustic_source(const char *custom_path, const char *default_path,
+                                 struct acoustic_source *src)
+{
+    struct stat st;
+
+    memset(src, 0, sizeof(*src));
+    if ( stat(custom_path, &st) == 0 ) {
+        src->custom = 1;
+    } else if ( stat(default_path, &st) == 0 ) {
+        src->custom = 0;
+    } else {
+        src->custom = -1;
+        return;
+    }
+    src->mtime = st.st_mtime;
+    src->size = st.st_size;
+}
+
+static void stat_acoustic_sources(struct acoustic_source sources[3])
+{
+    stat_acoustic_source(AUDIO_PARA_CUSTOM_FILENAME, AUDIO_PARA_DEFAULT_FILENAME, &sources[0]);
+    stat_acoustic_source(AUDIO_FILTER_CUSTOM_FILENAME, AUDIO_FILTER_DEFAULT_FILENAME, &sources[1]);
+    stat_acoustic_source(AUDIO_PREPROCESS_CUSTOM_FILENAME, AUDIO_PREPROCESS_DEFAULT_FILENAME, &sources[2]);
+}
+
+/* Points the table globals into t and loads its counts and flags */
+static void bind_acoustic_tables(struct acoustic_tables *t)
+{
+    Audio_Path_Table = t->a_table;
+    Audio_Path_Uplink_Table = t->u_table;
+    Phone_Acoustic_Table = t->f_table;
+    BT_Phone_Acoustic_Table = t->g_table;
+    BT_Phone_Acoustic_Names = t->g_names;
+    HTC_VOC_CAL_CODEC_TABLE_Table = t->d_table;
+    CE_Acoustic_Table = t->c_table;
+    APT_max_index = t->APT_max_index;
+    APUT_max_index = t->APUT_max_index;
+    PAT_max_index = t->PAT_max_index;
+    BTPAT_max_index = t->BTPAT_max_index;
+    HVCCT_max_index = t->HVCCT_max_index;
+    CEAT_max_index = t->CEAT_max_index;
+
+    iir_cfg = t->iir_cfg;
+    adrc_cfg = t->adrc_cfg;
+    eqalizer = t->eqalizer;
+    adrc_flag = t->adrc_flag;
+    eq_flag = t->eq_flag;
+    rx_iir_flag = t->rx_iir_flag;
+    adrc_filter_exists = t->adrc_filter_exists;
+    audpp_filter_inited = t->audpp_filter_inited;
+
+    tx_iir_cfg = t->tx_iir_cfg;
+    ns_cfg = t->ns_cfg;
+    tx_agc_cfg = t->tx_agc_cfg;
+    audpre_filter_inited = t->audpre_filter_inited;
+    audpre_ns_cfg_exist = t->audpre_ns_cfg_exist;
+    audpre_tx_agc_cfg_exist = t->audpre_tx_agc_cfg_exist;
+}
+
+/* Stores the counts and flags left by the parsers back into t */
+static void store_acoustic_counts(struct acoustic_tables *t)
+{
+    t->APT_max_index = APT_max_index;
+    t->APUT_max_index = APUT_max_index;
+    t->PAT_max_index = PAT_max_index;
+    t->BTPAT_max_index = BTPAT_max_index;
+    t->HVCCT_max_index = HVCCT_max_index;
+    t->CEAT_max_index = CEAT_max_index;
+    t->audpp_filter_inited = audpp_filter_inited;
+    t->audpre_filter_inited = audpre_filter_inited;
+    t->audpre_ns_cfg_exist = audpre_ns_cfg_exist;
+    t->audpre_tx_agc_cfg_exist = audpre_tx_agc_cfg_exist;
+}
+
+/* Maps the cache file read-only if it was compiled from the current csv files */
+static int load_acoustic_cache(void)
+{
+    struct acoustic_source sources[3];
+    struct acoustic_cache* cache;
+    struct stat st;
+    int fd;
+
+    fd = open(ACOUSTIC_CACHE_FILENAME, O_RDONLY);
+    if ( fd < 0 ) {
+        LOGI("No acoustic cache %s", ACOUSTIC_CACHE_FILENAME);
+        return -1;
+    }
+
+    if ( (fstat(fd, &st) < 0) || (st.st_size != sizeof(struct acoustic_cache)) ) {
+        LOGI("Acoustic cache has a different layout, ignoring it");
+        close(fd);
+        return -1;
+    }
+
+    cache = (struct acoustic_cache*) mmap(0, sizeof(struct acoustic_cache),
+                    PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if ( cache == MAP_FAILED ) {
+        LOGE("Failed to mmap acoustic cache: %s (%d)", strerror(errno), errno);
+        return -1;
+    }
+
+    stat_acoustic_sources(sources);
+    if ( (cache->magic != ACOUSTIC_CACHE_MAGIC) ||
+         (cache->version != ACOUSTIC_CACHE_VERSION) ||
+         (cache->size != sizeof(struct acoustic_cache)) ||
+         memcmp(cache->sources, sources, sizeof(sources)) ||
+         (cache->checksum != acoustic_checksum(&cache->tables, sizeof(cache->tables))) ) {
+        LOGI("Acoustic cache is out of date");
+        munmap(cache, sizeof(struct acoustic_cache));
+        return -1;
+    }
+
+    acoustic_cache = cache;
+    acoustic_cache_mapped = true;
+    bind_acoustic_tables(&cache->tables);
+    LOGI("Using acoustic cache %s", ACOUSTIC_CACHE_FILENAME);
+    return 0;
+}
+
+/* Writes the parsed tables out for the next start, replacing the old cache atomically */
+static void save_acoustic_cache(struct acoustic_cache* cache)
+{
+    static const char *tmp_path = ACOUSTIC_CACHE_FILENAME ".tmp";
+    ssize_t written;
+    int fd;
+
+    cache->magic = ACOUSTIC_CACHE_MAGIC;
+    cache->version = ACOUSTIC_CACHE_VERSION;
+    cache->size = sizeof(struct acoustic_cache);
+    cache->checksum = acoustic_checksum(&cache->tables, sizeof(cache->tables));
+
+    fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0660);
+    if ( fd < 0 ) {
+        LOGE("Failed to create %s. Error %s (%d)", tmp_path, strerror(errno), errno);
+        return;
+    }
+
+    written = write(fd, cache, sizeof(struct acoustic_cache));
+    if ( (written != sizeof(struct acoustic_cache)) || (fsync(fd) < 0) ) {
+        LOGE("Failed to write %s. Error %s (%d)", tmp_path, strerror(errno), errno);
+        close(fd);
+        unlink(tmp_path);
+        return;
+    }
+    close(fd);
+
+    if ( rename(tmp_path, ACOUSTIC_CACHE_FILENAME) < 0 ) {
+        LOGE("Failed to rename %s. Error %s (%d)", tmp_path, strerror(errno), errno);
+        unlink(tmp_path);
+        return;
+    }
+    LOGI("Saved acoustic cache %s", ACOUSTIC_CACHE_FILENAME);
+}
+
+/* Parses the csv files into a fresh block and caches the result */
+static int parse_acoustic_tables(void)
+{
+    struct acoustic_cache* cache;
+    int rc;
+
+    cache = (struct acoustic_cache*) calloc(1, sizeof(struct acoustic_cache));
+    if ( cache == NULL ) {
+        LOGE("Failed to malloc acoustic tables\n");
+        return -1;
+    }
+    /* Stamp the sources before reading them so an edit during the parse invalidates the cache */
+    stat_acoustic_sources(cache->sources);
+
+    acoustic_cache = cache;
+    acoustic_cache_mapped = false;
+    bind_acoustic_tables(&cache->tables);
+
+    /* Read parameters from csv file */
+    rc = ReadAudioParaFromFile();
+    if ( rc < 0 ) {
+        return rc;
+    }
+
+    /* Read filter tables */
+    audpp_filter_inited = (get_audpp_filter() == 0);
+    audpre_filter_inited = (get_audpre_table() == 0);
+
+    store_acoustic_counts(&cache->tables);
+    save_acoustic_cache(cache);
+    return 0;
+}
+
+static const char* const acoustic_profile_names[SYS] = {
+    "HEADSET", "HANDSFREE", "EARCUPLE", "BTHEADSET", "CARKIT", "TTY_FULL", "TTY_VCO",
+    "TTY_HCO", "REC_INC_MIC", "REC_EXT_MIC", "PLAYBACK_HEADSET", "PLAYBACK_HANDSFREE",
+    "CUSTOM_BTHEADSET",
+};
+
+/* Case insensitive FNV-1a of a BT headset name */
+static uint32_t bt_name_hash_of(const char* name)
+{
+    uint32_t hash = 2166136261u;
+
+    while (*name) {
+        hash ^= (uint8_t) tolower((unsigned char) *name++);
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/* Resolves every SND device and volume to its Phone_Acoustic_Table entry once,
+ * so that msm72xx_set_acoustic_table does not have to on each route change.
+ * Needs the tables loaded and the SND device ids read from the kernel.
+ */
+static void build_acoustic_profiles(void)
+{
+    /* Same order as the former if/else chain, the first match wins */
+    const struct {
+        int device;
+        int profile;
+    } devices[] = {
+        { SND_DEVICE_HANDSET,            EARCUPLE },
+        { SND_DEVICE_SPEAKER,            HANDSFREE },
+        { SND_DEVICE_SPEAKER_MIC,        HANDSFREE },
+        { SND_DEVICE_HEADSET,            HEADSET },
+        { SND_DEVICE_BT,                 BTHEADSET },
+        { SND_DEVICE_BT_EC_OFF,          BTHEADSET },
+        { SND_DEVICE_CARKIT,             CARKIT },
+        { SND_DEVICE_TTY_FULL,           TTY_FULL },
+        { SND_DEVICE_TTY_VCO,            TTY_VCO },
+        { SND_DEVICE_TTY_HCO,            TTY_HCO },
+        { SND_DEVICE_PLAYBACK_HEADSET,   PLAYBACK_HEADSET },
+        { SND_DEVICE_PLAYBACK_HANDSFREE, PLAYBACK_HANDSFREE },
+        { SND_DEVICE_REC_INC_MIC,        REC_INC_MIC },
+        { SND_DEVICE_IDLE,               EARCUPLE },
+    };
+    /* Phone_Acoustic_Table entry of each profile, 6 volume levels from there for voice profiles.
+     * TODO : See UpdateVolumeTable from CE for device = 3
+     */
+    static const struct {
+        int8_t index;
+        bool   per_volume;
+        int8_t method;
+    } profiles[SYS] = {
+        [HEADSET]            = { HEADSET * 6,   true,  SND_METHOD_VOICE },
+        [HANDSFREE]          = { HANDSFREE * 6, true,  SND_METHOD_VOICE },
+        [EARCUPLE]           = { EARCUPLE * 6,  true,  SND_METHOD_VOICE },
+        [BTHEADSET]          = { 18, false, SND_METHOD_VOICE },
+        [CARKIT]             = { 19, false, SND_METHOD_VOICE },
+        [TTY_FULL]           = { 20, false, SND_METHOD_NONE },
+        [TTY_VCO]            = { 21, false, SND_METHOD_NONE },
+        [TTY_HCO]            = { 22, false, SND_METHOD_NONE },
+        [REC_INC_MIC]        = { 23, false, SND_METHOD_AUDIO },
+        [REC_EXT_MIC]        = { 24, false, SND_METHOD_AUDIO },
+        [PLAYBACK_HEADSET]   = { 25, false, SND_METHOD_AUDIO },
+        [PLAYBACK_HANDSFREE] = { 26, false, SND_METHOD_AUDIO },
+        [CUSTOM_BTHEADSET]   = { -1, false, SND_METHOD_VOICE },  /* indexed by device, see msm72xx_set_acoustic_table */
+    };
+    int i, volume;
+    uint32_t slot;
+
+    /* Unmatched ids below SYS have always been taken as profile numbers */
+    for (i = 0; i < MAX_SND_DEVICE_ID; i++) {
+        snd_device_profile[i] = ( (i < SYS) && (i != CUSTOM_BTHEADSET) ) ? i : -1;
+    }
+    for (i = (int)(sizeof(devices) / sizeof(devices[0])) - 1; i >= 0; i--) {
+        if ( (devices[i].device >= 0) && (devices[i].device < MAX_SND_DEVICE_ID) ) {
+            snd_device_profile[devices[i].device] = devices[i].profile;
+        }
+    }
+
+    for (i = 0; i < SYS; i++) {
+        profile_method[i] = profiles[i].method;
+        for (volume = 0; volume <= MAX_ACOUSTIC_VOLUME; volume++) {
+            if ( profiles[i].index < 0 ) {
+                profile_volume_table[i][volume] = NULL;
+            } else {
+                profile_volume_table[i][volume] = &Phone_Acoustic_Table[profiles[i].index +
+                                                      (profiles[i].per_volume ? volume : 0)];
+            }
+        }
+    }
+
+    /* Open addressing with linear probing, a name listed twice keeps its first entry */
+    memset(bt_name_hash, 0, sizeof(bt_name_hash));
+    for (i = 0; i < BTPAT_max_index; i++) {
+        slot = bt_name_hash_of(BT_Phone_Acoustic_Names[i]) & (BT_NAME_HASH_SIZE - 1);
+        while ( bt_name_hash[slot] &&
+                strcasecmp(BT_Phone_Acoustic_Names[bt_name_hash[slot] - 1], BT_Phone_Acoustic_Names[i]) ) {
+            slot = (slot + 1) & (BT_NAME_HASH_SIZE - 1);
+        }
+        if ( !bt_name_hash[slot] ) {
+            bt_name_hash[slot] = i + 1;
+        }
+    }
+}
+
 /***********************************************************************************
  *
  *  Interfaces
@@ -1138,20 +1514,17 @@ int htc_acoustic_init(void)
         return rc;
     }
 
-    /* Read parameters from csv file */
-    rc = ReadAudioParaFromFile();
-    if ( rc < 0 ) {
-        return rc;
+    /* Map the compiled tables, or parse the csv files if they changed */
+    if ( load_acoustic_cache() < 0 ) {
+        rc = parse_acoustic_tables();
+        if ( rc < 0 ) {
+            return rc;
+        }
     }
 
-    /* Read filter tables */
-    rc = get_audpp_filter();
-    if ( rc == 0 ) {
-        audpp_filter_inited = true;
-    }
-    rc = get_audpre_table();
-    if ( rc == 0 ) {
-        audpre_filter_inited = true;
+    rc = SendAudioParaTables();
+    if ( rc < 0 ) {
+        return rc;
     }
     /* TODO : AGC for TI A2026 from csv file ? 
      * Values are almost all the same, except for voice call.
@@ -1160,7 +1533,9 @@ int htc_acoustic_init(void)
 
     /* Retrieve available sound endpoints IDs from kernel */
     rc = get_sound_endpoints();
-    
+
+    build_acoustic_profiles();
+
     return rc;
 }
 
@@ -1183,25 +1558,19 @@ int htc_acoustic_deinit(void)
 {
     int rc = 0;
 
-    /* Close the acoustic driver */
-    close(acousticfd);
-
-    /* Close TPA2016 */
-    if ( TPA2016fd >= 0 ) {
-        close(TPA2016fd);
-    }
+    /* Close the acoustic driver, TPA2016 and every other device opened through audiodev */
+    audiodev_close_all();
+    acousticfd = -1;
+    TPA2016fd = -1;
 
     /* Free the memory */
-    if ( Audio_Path_Table != NULL )
-        free(Audio_Path_Table);
-    if ( Audio_Path_Uplink_Table != NULL )
-        free(Audio_Path_Uplink_Table);
-    if ( Phone_Acoustic_Table != NULL )
-        free(Phone_Acoustic_Table);
-    if ( BT_Phone_Acoustic_Table != NULL )
-        free(BT_Phone_Acoustic_Table);
-    if ( HTC_VOC_CAL_CODEC_TABLE_Table != NULL )
-        free(HTC_VOC_CAL_CODEC_TABLE_Table);
+    if ( acoustic_cache != NULL ) {
+        if ( acoustic_cache_mapped )
+            munmap(acoustic_cache, sizeof(struct acoustic_cache));
+        else
+            free(acoustic_cache);
+        acoustic_cache = NULL;
+    }
     if ( mSndEndpoints != NULL )
         free(mSndEndpoints);
 
@@ -1216,7 +1585,8 @@ int msm72xx_enable_audpp(int enable_mask)
 
     if (!audpp_filter_inited) return -EINVAL;
 
-    fd = open(PCM_CTL_DEVICE, O_RDWR);
+    /* Kept open by audiodev for the next call */
+    fd = audiodev_fd(AUDIODEV_PCM_CTL);
     if (fd < 0) {
         LOGE("Cannot open PCM Ctl device");
         return -EPERM;
@@ -1237,7 +1607,7 @@ int msm72xx_enable_audpp(int enable_mask)
             LOGI("ADRC Filter COMP RELEASE[0] = %02x.", adrc_cfg[device_id].adrc_params[5]);
             LOGI("ADRC Filter COMP RELEASE[1] = %02x.", adrc_cfg[device_id].adrc_params[6]);
             LOGI("ADRC Filter COMP DELAY = %02x.", adrc_cfg[device_id].adrc_params[7]);
-            if (ioctl(fd, AUDIO_SET_ADRC, &adrc_cfg[device_id]) < 0)
+            if (audiodev_ioctl(AUDIODEV_PCM_CTL, AUDIO_SET_ADRC, &adrc_cfg[device_id]) < 0)
             {
                 LOGE("set adrc filter error.");
             }
@@ -1249,7 +1619,7 @@ int msm72xx_enable_audpp(int enable_mask)
     else if (enable_mask & EQ_ENABLE)
     {
 	    LOGI("Setting EQ Filter");
-        if (ioctl(fd, AUDIO_SET_EQ, &eqalizer[device_id]) < 0) {
+        if (audiodev_ioctl(AUDIODEV_PCM_CTL, AUDIO_SET_EQ, &eqalizer[device_id]) < 0) {
             LOGE("set Equalizer error.");
         }
     }
@@ -1270,20 +1640,18 @@ int msm72xx_enable_audpp(int enable_mask)
         LOGI("IIR FILTER M4 = %02x.",  iir_cfg[device_id].iir_params[27]);
         LOGI("IIR FILTER M16 = %02x.",  iir_cfg[device_id].iir_params[39]);
         LOGI("IIR FILTER SF1 = %02x.",  iir_cfg[device_id].iir_params[40]);
-        if (ioctl(fd, AUDIO_SET_RX_IIR, &iir_cfg[device_id]) < 0)
+        if (audiodev_ioctl(AUDIODEV_PCM_CTL, AUDIO_SET_RX_IIR, &iir_cfg[device_id]) < 0)
         {
             LOGE("set rx iir filter error.");
         }
     }
 
     LOGE("msm72xx_enable_audpp: 0x%04x", enable_mask);
-    if (ioctl(fd, AUDIO_ENABLE_AUDPP, &enable_mask) < 0) {
+    if (audiodev_ioctl(AUDIODEV_PCM_CTL, AUDIO_ENABLE_AUDPP, &enable_mask) < 0) {
         LOGE("enable audpp error");
-        close(fd);
         return -EPERM;
     }
 
-    close(fd);
     return 0;
 }
 
@@ -1380,21 +1748,18 @@ int msm72xx_update_audio_method(int method)
     LOGV("msm72xx_update_audio_method %d", method);
 
     struct audio_update_req req = {.type = ADIE_UPDATE_AUDIO_METHOD, .value = method};
-    if ( ioctl(acousticfd, ACOUSTIC_UPDATE_AUDIO_SETTINGS, &req) < 0) {
+    if ( audiodev_ioctl(AUDIODEV_ACOUSTIC, ACOUSTIC_UPDATE_AUDIO_SETTINGS, &req) < 0) {
         LOGE("ACOUSTIC_UPDATE_AUDIO_SETTINGS error.");
         return -EIO;
     }  
     return 0;
 }
 
-#define SND_METHOD_AUDIO 1
-#define SND_METHOD_NONE  -1
-
 int msm72xx_set_acoustic_table(int device, int volume)
 {
     struct fg_table_s* table = NULL;
     struct c_table_s*  ce_table = NULL;
-    int out_path = device;
+    int out_path;
     int out_path_method = SND_METHOD_VOICE;
 
     LOGV("msm72xx_set_acoustic_table %d %d", device, volume);
@@ -1405,7 +1770,7 @@ int msm72xx_set_acoustic_table(int device, int volume)
         return 0;
     }
 
-    if ( volume > 5 ) {
+    if ( (volume < 0) || (volume > MAX_ACOUSTIC_VOLUME) ) {
         return -EIO;
     }
 
@@ -1414,111 +1779,28 @@ int msm72xx_set_acoustic_table(int device, int volume)
        LOGV("Use current device %d", device);
     }
 
-    if( device == SND_DEVICE_HANDSET ) {
-        LOGV("Acoustic profile : EARCUPLE");
-        out_path = EARCUPLE;
-    } else if( (device == SND_DEVICE_SPEAKER) || (device == SND_DEVICE_SPEAKER_MIC) ) {
-        LOGV("Acoustic profile : HANDSFREE");
-        out_path = HANDSFREE;
-    } else if( device == SND_DEVICE_HEADSET ) {
-        LOGV("Acoustic profile : HEADSET");
-        out_path = HEADSET;
-    } else if( (device == SND_DEVICE_BT) || (device == SND_DEVICE_BT_EC_OFF) ) {
-        LOGV("Acoustic profile : BTHEADSET");
-        out_path = BTHEADSET;
-    } else if( device == SND_DEVICE_CARKIT ) {
-        LOGV("Acoustic profile : CARKIT");
-        out_path = CARKIT;
-    } else if( device == SND_DEVICE_TTY_FULL ) {
-        LOGV("Acoustic profile : TTY_FULL");
-        out_path = TTY_FULL;
-    } else if( device == SND_DEVICE_TTY_VCO ) {
-        LOGV("Acoustic profile : TTY_VCO");
-        out_path = TTY_VCO;
-    } else if( device == SND_DEVICE_TTY_HCO ) {
-        LOGV("Acoustic profile : TTY_HCO");
-        out_path = TTY_HCO;
-    } else if( device == SND_DEVICE_PLAYBACK_HEADSET ) {
-        LOGV("Acoustic profile : PLAYBACK_HEADSET");
-        out_path = PLAYBACK_HEADSET;
-    } else if( device == SND_DEVICE_PLAYBACK_HANDSFREE ) {
-        LOGV("Acoustic profile : PLAYBACK_HANDSFREE");
-        out_path = PLAYBACK_HANDSFREE;
-    } else if( device == SND_DEVICE_REC_INC_MIC ) {
-        LOGV("Acoustic profile : REC_INC_MIC");
-        out_path = REC_INC_MIC;
-    } else if( device == SND_DEVICE_IDLE ) {
-        LOGV("Acoustic profile : EARCUPLE");
-        out_path = EARCUPLE;
-    } else if ( device >= BT_CUSTOM_DEVICES_ID_OFFSET ) {
-        LOGV("Acoustic profile : CUSTOM_BTHEADSET");
+    if ( device >= BT_CUSTOM_DEVICES_ID_OFFSET ) {
         out_path = CUSTOM_BTHEADSET;
+    } else if ( (device >= 0) && (device < MAX_SND_DEVICE_ID) ) {
+        out_path = snd_device_profile[device];
+    } else {
+        out_path = -1;
     }
 
-    // TODO : See UpdateVolumeTable from CE for device = 3
-    switch ( out_path )
-    {
-        case HEADSET:
-        case HANDSFREE:
-        case EARCUPLE:
-            table = &Phone_Acoustic_Table[(out_path*6) + volume];
-        break;
-
-        case BTHEADSET:
-            table = &Phone_Acoustic_Table[18];
-        break;
-
-        case CUSTOM_BTHEADSET:
-            table = &BT_Phone_Acoustic_Table[device - BT_CUSTOM_DEVICES_ID_OFFSET];
-            out_path = BTHEADSET;
-        break;
-
-        case CARKIT:
-            table = &Phone_Acoustic_Table[19];
-        break;
-
-        case TTY_FULL:
-            table = &Phone_Acoustic_Table[20];
-            out_path_method = SND_METHOD_NONE;
-        break;
-
-        case TTY_VCO:
-            table = &Phone_Acoustic_Table[21];
-            out_path_method = SND_METHOD_NONE;
-        break;
-
-        case TTY_HCO:
-            table = &Phone_Acoustic_Table[22];
-            out_path_method = SND_METHOD_NONE;
-        break;
-
-        case REC_INC_MIC:
-            table = &Phone_Acoustic_Table[23];
-            out_path_method = SND_METHOD_AUDIO;
-        break;
-
-        case REC_EXT_MIC:
-            table = &Phone_Acoustic_Table[24];
-            out_path_method = SND_METHOD_AUDIO;
-        break;
-
-        case PLAYBACK_HEADSET:
-            table = &Phone_Acoustic_Table[25];
-            out_path_method = SND_METHOD_AUDIO;
-        break;
-
-        case PLAYBACK_HANDSFREE:
-            table = &Phone_Acoustic_Table[26];
-            out_path_method = SND_METHOD_AUDIO;
-        break;
-
-        default:
-            LOGE("Unknown out_path");
-        break;
+    if ( out_path == CUSTOM_BTHEADSET ) {
+        LOGV("Acoustic profile : CUSTOM_BTHEADSET");
+        table = &BT_Phone_Acoustic_Table[device - BT_CUSTOM_DEVICES_ID_OFFSET];
+        out_path = BTHEADSET;
+    } else if ( out_path >= 0 ) {
+        LOGV("Acoustic profile : %s", acoustic_profile_names[out_path]);
+        table = profile_volume_table[out_path][volume];
+        out_path_method = profile_method[out_path];
+    } else {
+        LOGE("Unknown out_path");
     }
 
     if ( table ) {
-        if (ioctl(acousticfd, ACOUSTIC_UPDATE_VOLUME_TABLE, &(table->array) ) < 0) {
+        if (audiodev_ioctl(AUDIODEV_ACOUSTIC, ACOUSTIC_UPDATE_VOLUME_TABLE, &(table->array) ) < 0) {
             LOGE("ACOUSTIC_UPDATE_VOLUME_TABLE error.");
             return -EIO;
         }
@@ -1528,7 +1810,7 @@ int msm72xx_set_acoustic_table(int device, int volume)
          */
         if ( out_path < SYS ) {
             ce_table = &CE_Acoustic_Table[out_path];
-            if (ioctl(acousticfd, ACOUSTIC_UPDATE_CE_TABLE, &(ce_table->array) ) < 0) {
+            if (audiodev_ioctl(AUDIODEV_ACOUSTIC, ACOUSTIC_UPDATE_CE_TABLE, &(ce_table->array) ) < 0) {
                 LOGE("ACOUSTIC_UPDATE_CE_TABLE error.");
                 return -EIO;
             }
@@ -1548,11 +1830,12 @@ int msm72xx_set_acoustic_table(int device, int volume)
             }
             /* Set volume */
             tpa2016d2_regs[FIXED_GAIN_REG-1] = volume * 6;
-            if (ioctl(TPA2016fd, TPA2016_SET_CONFIG, &tpa2016d2_regs ) < 0) {
+            if (audiodev_ioctl_dedup(AUDIODEV_TPA2016, TPA2016_SET_CONFIG,
+                                     tpa2016d2_regs, sizeof(tpa2016d2_regs)) < 0) {
                 LOGE("TPA2016_SET_CONFIG error.");
                 return -EIO;
-            }  
-        }  
+            }
+        }
 #if 0
         if ( (out_path_method == SND_METHOD_VOICE) ||
                 (out_path_method == SND_METHOD_AUDIO) ) {
@@ -1572,7 +1855,7 @@ int msm72xx_start_acoustic_setting(void)
 {
     LOGV("msm72xx_start_acoustic_setting");
     struct audio_update_req req = {.type = ADIE_FORCE_ADIE_UPDATE_REQ, .value = 1};
-    if ( ioctl(acousticfd, ACOUSTIC_UPDATE_AUDIO_SETTINGS, &req) < 0) {
+    if ( audiodev_ioctl(AUDIODEV_ACOUSTIC, ACOUSTIC_UPDATE_AUDIO_SETTINGS, &req) < 0) {
         LOGE("ACOUSTIC_UPDATE_AUDIO_SETTINGS error.");
         return -EIO;
     }  
@@ -1582,13 +1865,13 @@ int msm72xx_start_acoustic_setting(void)
 int msm72xx_set_acoustic_done(void)
 {
     LOGV("msm72xx_set_acoustic_done");
-    if (ioctl(acousticfd, ACOUSTIC_ARM11_DONE, NULL ) < 0) {
+    if (audiodev_ioctl(AUDIODEV_ACOUSTIC, ACOUSTIC_ARM11_DONE, NULL ) < 0) {
         LOGE("ACOUSTIC_ARM11_DONE error.");
         return -EIO;
     }
 
     struct audio_update_req req = {.type = ADIE_FORCE_ADIE_UPDATE_REQ, .value = 0};
-    if ( ioctl(acousticfd, ACOUSTIC_UPDATE_AUDIO_SETTINGS, &req) < 0) {
+    if ( audiodev_ioctl(AUDIODEV_ACOUSTIC, ACOUSTIC_UPDATE_AUDIO_SETTINGS, &req) < 0) {
         LOGE("ACOUSTIC_UPDATE_AUDIO_SETTINGS error.");
         return -EIO;
     }  
@@ -1624,21 +1907,22 @@ int msm72xx_set_audio_path(bool bEnableMic, bool bEnableDualMic,
 
     UpdateAudioAdieTable(bEnableMic, 0, 0, 0, false);
     
-    if (ioctl(acousticfd, ACOUSTIC_SET_HW_AUDIO_PATH, &audio_path ) < 0) {
+    if (audiodev_ioctl(AUDIODEV_ACOUSTIC, ACOUSTIC_SET_HW_AUDIO_PATH, &audio_path ) < 0) {
         LOGE("ACOUSTIC_SET_HW_AUDIO_PATH error.");
         return -EIO;
     } 
 
     if ( TPA2016fd >= 0 ) {
-        if (ioctl(TPA2016fd, TPA2016_SET_POWER, &audio_path.bEnableSpeaker ) < 0) {
+        if ( set_tpa2016_power(audio_path.bEnableSpeaker) < 0 ) {
             LOGE("TPA2016_SET_POWER error.");
             return -EIO;
-        } 
-        
+        }
+
         if ( bEnableOut ) {
             /* Enable both outputs */
             tpa2016d2_regs[IC_REG-1] |= (SPK_EN_L | SPK_EN_R);
-            if (ioctl(TPA2016fd, TPA2016_SET_CONFIG, &tpa2016d2_regs ) < 0) {
+            if (audiodev_ioctl_dedup(AUDIODEV_TPA2016, TPA2016_SET_CONFIG,
+                                     tpa2016d2_regs, sizeof(tpa2016d2_regs)) < 0) {
                 LOGE("TPA2016_SET_CONFIG error.");
                 return -EIO;
             }        
@@ -1650,20 +1934,41 @@ int msm72xx_set_audio_path(bool bEnableMic, bool bEnableDualMic,
 
 int msm72xx_get_bluetooth_hs_id(const char* BT_Name)
 {
+    uint32_t slot = bt_name_hash_of(BT_Name) & (BT_NAME_HASH_SIZE - 1);
     int i;
-    
-    for (i = 0; i < BTPAT_max_index; i++) {
-        if (!strcasecmp(BT_Name, BT_Phone_Acoustic_Table[i].table.name)) {
+
+    while ( (i = bt_name_hash[slot]) ) {
+        if (!strcasecmp(BT_Name, BT_Phone_Acoustic_Names[i - 1])) {
             LOGI("Found custom acoustic parameters for %s", BT_Name);
-            break;
+            return (i - 1) + BT_CUSTOM_DEVICES_ID_OFFSET;
         }
+        slot = (slot + 1) & (BT_NAME_HASH_SIZE - 1);
     }
 
-    if (i == BTPAT_max_index) {
-        LOGI("Couldn't find custom acoustic parameters for %s, using default", BT_Name);
-        i = 0;
-    }
-
-    return i + BT_CUSTOM_DEVICES_ID_OFFSET;
+    LOGI("Couldn't find custom acoustic parameters for %s, using default", BT_Name);
+    return BT_CUSTOM_DEVICES_ID_OFFSET;
 }
 
+
+static const struct htc_acoustic_ops acoustic_ops = {
+    .version                = HTC_ACOUSTIC_OPS_VERSION,
+    .size                   = sizeof(struct htc_acoustic_ops),
+    .init                   = htc_acoustic_init,
+    .deinit                 = htc_acoustic_deinit,
+    .get_num_endpoints      = snd_get_num_endpoints,
+    .get_endpoint           = snd_get_endpoint,
+    .enable_audpp           = msm72xx_enable_audpp,
+    .set_audpre_params      = msm72xx_set_audpre_params,
+    .enable_audpre          = msm72xx_enable_audpre,
+    .start_acoustic_setting = msm72xx_start_acoustic_setting,
+    .set_acoustic_table     = msm72xx_set_acoustic_table,
+    .set_acoustic_done      = msm72xx_set_acoustic_done,
+    .set_audio_path         = msm72xx_set_audio_path,
+    .update_audio_method    = msm72xx_update_audio_method,
+    .get_bluetooth_hs_id    = msm72xx_get_bluetooth_hs_id,
+};
+
+const struct htc_acoustic_ops* htc_acoustic_get_ops(void)
+{
+    return &acoustic_ops;
+}
@@ -49,14 +49,14 @@ struct htc_voc_cal_table {
     int       size;
 };
 
-enum {
+enum AUDIO_UPDATE_REQ_TYPE {
     PCOM_UPDATE_REQ = 0,
     ADIE_FORCE8K_REQ,
     ADIE_FORCE_ADIE_AWAKE_REQ,
     ADIE_FORCE_ADIE_UPDATE_REQ,
     ADIE_UPDATE_AUDIO_METHOD,
     
-} AUDIO_UPDATE_REQ_TYPE;
+};
 
 struct audio_update_req {
     int type;       /* one of the AUDIO_UPDATE_REQ_TYPE */
@@ -433,6 +433,8 @@ int msm72xx_set_audio_path(bool bEnableMic, bool bEnableDualMic,
 int msm72xx_update_audio_method(int method);
 int msm72xx_get_bluetooth_hs_id(const char* BT_Name);
 
+#include "acoustic_ops.h"
+
 #if __cplusplus
 } // extern "C"
 #endif
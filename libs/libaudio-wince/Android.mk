@@ -44,7 +44,14 @@ ifneq ($(TARGET_SIMULATOR),true)
 LOCAL_SHARED_LIBRARIES += libdl
 endif
 
-LOCAL_SRC_FILES += AudioHardware.cpp
+LOCAL_SRC_FILES += AudioHardware.cpp AudioResampler.cpp pcm_kernels.c
+
+# The ARMv6 SIMD in pcm_kernels.c has no Thumb-1 encoding
+LOCAL_ARM_MODE := arm
+
+# libhtc_acoustic is built with us and linked, not dlopen'ed
+LOCAL_SHARED_LIBRARIES += libhtc_acoustic
+LOCAL_C_INCLUDES += $(LOCAL_PATH)/../libacoustic
 
 LOCAL_CFLAGS += -fno-short-enums
 
@@ -55,5 +62,97 @@ endif
 
 include $(BUILD_SHARED_LIBRARY)
 
+
+# audio_hal_test: the output profiles against a fake /dev/msm_pcm_out.
+# libhtc_acoustic is built in rather than linked so that --wrap keeps it
+# off the real /dev nodes as well.
+include $(CLEAR_VARS)
+
+LOCAL_MODULE_TAGS := tests
+LOCAL_MODULE := audio_hal_test
+
+LOCAL_SRC_FILES := \
+    tests/audio_hal_test.cpp \
+    tests/fake_pcm.cpp \
+    AudioHardware.cpp \
+    AudioResampler.cpp \
+    pcm_kernels.c \
+    ../libacoustic/libacoustic.c \
+    ../libacoustic/audiodev.c
+
+LOCAL_SHARED_LIBRARIES := \
+    libcutils \
+    libutils \
+    libmedia \
+    libhardware_legacy \
+    libdl
+
+LOCAL_STATIC_LIBRARIES := libaudiointerface
+ifeq ($(BOARD_HAVE_BLUETOOTH),true)
+  LOCAL_SHARED_LIBRARIES += liba2dp
+endif
+
+LOCAL_C_INCLUDES += $(LOCAL_PATH) $(LOCAL_PATH)/../libacoustic
+LOCAL_CFLAGS += -fno-short-enums
+LOCAL_ARM_MODE := arm
+LOCAL_LDFLAGS += \
+    -Wl,--wrap=open \
+    -Wl,--wrap=ioctl \
+    -Wl,--wrap=write \
+    -Wl,--wrap=close
+
+include $(BUILD_EXECUTABLE)
+
+
+# audio_resampler_test: a sine through every pair of input rates
+include $(CLEAR_VARS)
+
+LOCAL_MODULE_TAGS := tests
+LOCAL_MODULE := audio_resampler_test
+
+LOCAL_SRC_FILES := \
+    tests/resampler_test.cpp \
+    AudioResampler.cpp \
+    pcm_kernels.c
+
+LOCAL_C_INCLUDES += $(LOCAL_PATH)
+LOCAL_STATIC_LIBRARIES := liblog
+LOCAL_LDLIBS += -lm -lrt -lpthread
+
+include $(BUILD_HOST_EXECUTABLE)
+
+
+# audio_kernels_test: pcm_kernels.c against reference loops, and timed.
+# The host build covers the portable C path, the target one the ARMv6 one.
+include $(CLEAR_VARS)
+
+LOCAL_MODULE_TAGS := tests
+LOCAL_MODULE := audio_kernels_test
+
+LOCAL_SRC_FILES := \
+    tests/pcm_kernels_test.c \
+    pcm_kernels.c
+
+LOCAL_C_INCLUDES += $(LOCAL_PATH)
+LOCAL_LDLIBS += -lm -lrt
+
+include $(BUILD_HOST_EXECUTABLE)
+
+
+include $(CLEAR_VARS)
+
+LOCAL_MODULE_TAGS := tests
+LOCAL_MODULE := audio_kernels_test
+
+LOCAL_SRC_FILES := \
+    tests/pcm_kernels_test.c \
+    pcm_kernels.c
+
+LOCAL_C_INCLUDES += $(LOCAL_PATH)
+LOCAL_SHARED_LIBRARIES := libm
+LOCAL_ARM_MODE := arm
+
+include $(BUILD_EXECUTABLE)
+
 endif # not BUILD_TINY_ANDROID
 endif
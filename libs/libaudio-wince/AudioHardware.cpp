@@ -20,14 +20,16 @@
 #define LOG_TAG "AudioHardwareMSM72XX_wince"
 #include <utils/Log.h>
 #include <utils/String8.h>
+#include <cutils/atomic.h>
+#include <cutils/properties.h>
 
 #include <stdio.h>
 #include <unistd.h>
 #include <sys/ioctl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
-#include <dlfcn.h>
 #include <fcntl.h>
+#include <stddef.h>
 
 // hardware specific functions
 
@@ -36,37 +38,100 @@
 
 extern "C" {
 #include "a1010.h"
+#include "audiodev.h"
+#include "acoustic_ops.h"
 
-#define AUDIENCE_A1010_DEV      "/dev/audience_A1010"
 }
 
 #define LOG_SND_RPC 0  // Set to 1 to log sound RPC's
 
 namespace android {
 static int audpre_index, tx_iir_index;
-static void * acoustic;
+static bool acoustic_loaded = false;
+static TimingStats acousticTableTime;  // set_acoustic_table()
+static TimingStats audpreTableTime;    // set_audpre_params()
 const uint32_t AudioHardware::inputSamplingRates[] = {
         8000, 11025, 12000, 16000, 22050, 24000, 32000, 44100, 48000
 };
 
 /****************************************************************************
- * Function prototypes for external libhtc-acoustic
+ * Entry points of external libhtc-acoustic
  ****************************************************************************/
-int (*htc_acoustic_init)(void);
-int (*htc_acoustic_deinit)(void);
-int (*msm72xx_set_acoustic_table)(int device, int volume);
-int (*msm72xx_start_acoustic_setting)(void);
-int (*msm72xx_set_acoustic_done)(void);
-int (*msm72xx_set_audio_path)(bool bEnableMic, bool bEnableDualMic, int device_out, bool bEnableOut);
-int (*msm72xx_update_audio_method)(int method);
-int (*msm72xx_get_bluetooth_hs_id)(const char* BT_Name);
+/* Resolved once by load_acoustic_ops(). Every entry but the two endpoint
+ * getters is always callable: missing ones point to the fallbacks below.
+ */
+static struct htc_acoustic_ops acoustic_ops;
+
+static int acoustic_init_missing(void)                   { return -1; }
+static int acoustic_nop(void)                            { return 0; }
+static int acoustic_nop_mask(int)                        { return 0; }
+static int acoustic_nop_audpre_params(int, int)          { return 0; }
+static int acoustic_nop_audpre(int, int, int)            { return 0; }
+static int acoustic_no_table(int, int)                   { return SND_METHOD_NONE; }
+static int acoustic_nop_path(bool, bool, int, bool)      { return 0; }
+static int acoustic_nop_method(int)                      { return 0; }
+static int acoustic_no_hs_id(const char*)                { return 0; }
+
+#define ACOUSTIC_FALLBACK(field, fallback) \
+    if ( acoustic_ops.field == NULL ) { \
+        if ( acoustic_loaded ) { \
+            LOGE("Could not link %s()", #field); \
+        } \
+        acoustic_ops.field = fallback; \
+    }
+
+/* Fills acoustic_ops, returns false if libhtc_acoustic is not available */
+static bool load_acoustic_ops(void)
+{
+    const struct htc_acoustic_ops* ops;
+
+    memset(&acoustic_ops, 0, sizeof(acoustic_ops));
+
+    ops = htc_acoustic_get_ops();
+
+    if ( ops != NULL ) {
+        LOGV("libhtc_acoustic ops version %u (HAL built for %u)", ops->version, HTC_ACOUSTIC_OPS_VERSION);
+        /* Fields past the library's table stay NULL and get fallbacks */
+        memcpy(&acoustic_ops, ops,
+               (ops->size < sizeof(acoustic_ops)) ? ops->size : sizeof(acoustic_ops));
+        acoustic_loaded = true;
+    }
+
+    ACOUSTIC_FALLBACK(init,                   acoustic_init_missing);
+    ACOUSTIC_FALLBACK(deinit,                 acoustic_nop);
+    ACOUSTIC_FALLBACK(enable_audpp,           acoustic_nop_mask);
+    ACOUSTIC_FALLBACK(set_audpre_params,      acoustic_nop_audpre_params);
+    ACOUSTIC_FALLBACK(enable_audpre,          acoustic_nop_audpre);
+    ACOUSTIC_FALLBACK(start_acoustic_setting, acoustic_nop);
+    ACOUSTIC_FALLBACK(set_acoustic_table,     acoustic_no_table);
+    ACOUSTIC_FALLBACK(set_acoustic_done,      acoustic_nop);
+    ACOUSTIC_FALLBACK(set_audio_path,         acoustic_nop_path);
+    ACOUSTIC_FALLBACK(update_audio_method,    acoustic_nop_method);
+    ACOUSTIC_FALLBACK(get_bluetooth_hs_id,    acoustic_no_hs_id);
+
+    return acoustic_loaded;
+}
+
+/* If htc_acoustic_init failed, the tuning functions must not be used so
+ * that the rest of the hardware can still work
+ */
+static void drop_acoustic_tuning(void)
+{
+    acoustic_ops.deinit = acoustic_nop;
+    acoustic_ops.start_acoustic_setting = acoustic_nop;
+    acoustic_ops.set_acoustic_table = acoustic_no_table;
+    acoustic_ops.set_acoustic_done = acoustic_nop;
+    acoustic_ops.set_audio_path = acoustic_nop_path;
+    acoustic_ops.update_audio_method = acoustic_nop_method;
+    acoustic_ops.get_bluetooth_hs_id = acoustic_no_hs_id;
+}
 
 /****************************************************************************
  * Local Function prototypes
  ****************************************************************************/
 static int set_initial_audio_volume(void);
 static int get_master_volume(void);
-static int get_current_stream(void);
+static unsigned calculate_audpre_table_index(unsigned index);
 
 /****************************************************************************
  * Sound devices ids
@@ -102,31 +167,75 @@ static int SND_DEVICE_PLAYBACK_HANDSFREE = 253;
 static int SND_DEVICE_PLAYBACK_HEADSET = 254;
 
 static bool mUseAcoustic = false;
+/* Stream type playing, pushed by AudioPolicyManager through setParameters */
 static int bCurrentOutStream = AudioSystem::DEFAULT;
+/* Output started and not in standby, only changed by doOutputRouting */
+static bool bOutputStarted = false;
 
 static int support_a1010 = 0;
-static int a1010_fd = -1;
-static int old_pathid = -1;
-static int new_pathid = -1;
+
+/* Write size must be 32-bit aligned. The msm_pcm_out driver may keep its
+ * own buffer count; AudioStreamOutMSM72xx reads back what it accepted.
+ */
+static const struct output_profile {
+    const char* name;
+    size_t      bufferSize;
+    uint32_t    bufferCount;
+} outputProfiles[OUTPUT_PROFILE_COUNT] = {
+    { "default",      4800, AUDIO_HW_NUM_OUT_BUF },    // driver only seems to like 4800
+    { "low_latency",  1920, 4 },
+    { "deep_buffer", 19200, AUDIO_HW_NUM_OUT_BUF },
+};
+
+static int get_output_profile(const char* name)
+{
+    for (int i = 0; i < OUTPUT_PROFILE_COUNT; i++) {
+        if (!strcmp(name, outputProfiles[i].name)) {
+            return i;
+        }
+    }
+    return -1;
+}
 
 // ----------------------------------------------------------------------------
 
 AudioHardware::AudioHardware() :
     mInit(false), mMicMute(true), mBluetoothNrec(true), mBluetoothId(0),
-    mOutput(0), mSndEndpoints(NULL), mCurSndDevice(-1)
+    mOutput(0), mSndEndpoints(NULL), mCurSndDevice(-1),
+    mOutputProfile(OUTPUT_PROFILE_DEFAULT), mWarmStandbyMs(AUDIO_HW_WARM_STANDBY_MS),
+    mInputNativeRate(0), mPendingSndDevice(-1), mPendingAudProcess(0)
 {
+    char profile[PROPERTY_VALUE_MAX];
+    char warm[PROPERTY_VALUE_MAX];
+    char rate[PROPERTY_VALUE_MAX];
+
+    property_get(AUDIO_HW_OUTPUT_PROFILE_PROPERTY, profile, outputProfiles[OUTPUT_PROFILE_DEFAULT].name);
+    mOutputProfile = get_output_profile(profile);
+    if (mOutputProfile < 0) {
+        LOGW("Unknown output profile %s, using default", profile);
+        mOutputProfile = OUTPUT_PROFILE_DEFAULT;
+    }
+    if (property_get(AUDIO_HW_WARM_STANDBY_PROPERTY, warm, "") > 0) {
+        mWarmStandbyMs = atoi(warm);
+    }
+    if (property_get(AUDIO_HW_IN_NATIVE_RATE_PROPERTY, rate, "") > 0) {
+        mInputNativeRate = atoi(rate);
+        if (calculate_audpre_table_index(mInputNativeRate) == (unsigned)-1) {
+            LOGW("Unsupported input native rate %s, ignored", rate);
+            mInputNativeRate = 0;
+        }
+    }
+
+    mRoutingThread = new RoutingThread(this);
+    mRoutingThread->run("AudioRouting", ANDROID_PRIORITY_AUDIO);
 
-    int (*snd_get_num)() = NULL;
-    int (*snd_get_endpoint)(int, msm_snd_endpoint *) = NULL;
 #if 0 /* See comment bellow */
     int (*set_acoustic_parameters)();
 #endif
 
     struct msm_snd_endpoint *ept;
 
-    acoustic = ::dlopen("/system/lib/libhtc_acoustic.so", RTLD_NOW);
-    if (acoustic == NULL ) {
-        LOGE("Could not open libhtc_acoustic.so");
+    if ( !load_acoustic_ops() ) {
         /* this is not really an error on non-htc devices... */
         mNumSndEndpoints = 0;
         mInit = true;
@@ -156,90 +265,38 @@ AudioHardware::AudioHardware() :
     }
 #endif
 
-	htc_acoustic_init = (int (*)(void))::dlsym(acoustic, "htc_acoustic_init");
-    if ((*htc_acoustic_init) == 0 ) {
-        LOGE("Could not link htc_acoustic_init()");
-    }
-    
-    if ( htc_acoustic_init != 0 ) {
-        /* If acoustic init was ok, then continue linking other functions
-         * otherwise, don't link them so that the rest of the hardware
-         * can still work
-         */
-        if ( htc_acoustic_init() != 0 ) {
-            LOGE("Failed to initialize htc acoutic system. Using basic hardware.");
-        } else {
-            mUseAcoustic = true;
-            htc_acoustic_deinit = (int (*)(void))::dlsym(acoustic, "htc_acoustic_deinit");
-            if ((*htc_acoustic_deinit) == 0 ) {
-                LOGE("Could not link htc_acoustic_deinit()");
-            }
-
-            msm72xx_set_acoustic_table = (int (*)(int, int))::dlsym(acoustic, "msm72xx_set_acoustic_table");
-            if ((*msm72xx_set_acoustic_table) == 0 ) {
-                LOGE("Could not link msm72xx_set_acoustic_table()");
-            }
-
-            msm72xx_start_acoustic_setting = (int (*)(void))::dlsym(acoustic, "msm72xx_start_acoustic_setting");
-            if ((*msm72xx_start_acoustic_setting) == 0 ) {
-                LOGE("Could not link msm72xx_start_acoustic_setting()");
-            }
-
-            msm72xx_set_acoustic_done = (int (*)(void))::dlsym(acoustic, "msm72xx_set_acoustic_done");
-            if ((*msm72xx_set_acoustic_done) == 0 ) {
-                LOGE("Could not link msm72xx_set_acoustic_done()");
-            }
-
-            msm72xx_set_audio_path = (int (*)(bool, bool, int, bool))::dlsym(acoustic, "msm72xx_set_audio_path");
-            if ((*msm72xx_set_audio_path) == 0 ) {
-                LOGE("Could not link msm72xx_set_audio_path()");
-            }
-
-            msm72xx_update_audio_method = (int (*)(int))::dlsym(acoustic, "msm72xx_update_audio_method");
-            if ((*msm72xx_update_audio_method) == 0 ) {
-                LOGE("Could not link msm72xx_update_audio_method()");
-            }
+    if ( acoustic_ops.init() != 0 ) {
+        LOGE("Failed to initialize htc acoutic system. Using basic hardware.");
+        drop_acoustic_tuning();
+    } else {
+        mUseAcoustic = true;
 
-            msm72xx_get_bluetooth_hs_id =(int (*)(const char*))::dlsym(acoustic, "msm72xx_get_bluetooth_hs_id");
-            if ((*msm72xx_get_bluetooth_hs_id) == 0 ) {
-                LOGE("Could not link msm72xx_get_bluetooth_hs_id()");
-            }
-    
-            /* Test for audience a1010 presence (rhodium devices only) */
-            a1010_fd = open(AUDIENCE_A1010_DEV, O_RDWR);
-            if ( a1010_fd < 0 ) {
-                LOGE("Error opening dev %s (fd = %d). Error %s (%d)", AUDIENCE_A1010_DEV, a1010_fd,
-                            strerror(errno), errno);
-                support_a1010 = 0;
-            } else {
-                support_a1010 = 1;
-                close(a1010_fd);
-            }
-    	}
-	}	
+        /* Test for audience a1010 presence (rhodium devices only).
+         * The device stays open for doAudience_A1010_Control.
+         */
+        support_a1010 = audiodev_fd(AUDIODEV_A1010) >= 0;
+    }
 
-    snd_get_num = (int (*)(void))::dlsym(acoustic, "snd_get_num_endpoints");
-    if ((*snd_get_num) == 0 ) {
+    if ( acoustic_ops.get_num_endpoints == NULL ) {
         LOGE("Could not link snd_get_num()");
     }
 
-    snd_get_endpoint = (int (*)(int, msm_snd_endpoint *))::dlsym(acoustic, "snd_get_endpoint");
-    if ((*snd_get_endpoint) == 0 ) {
+    if ( acoustic_ops.get_endpoint == NULL ) {
         LOGE("Could not link snd_get_endpoint()");
         return;
     }
 
-    if ( snd_get_num != NULL ) {
-        mNumSndEndpoints = snd_get_num();
+    if ( acoustic_ops.get_num_endpoints != NULL ) {
+        mNumSndEndpoints = acoustic_ops.get_num_endpoints();
         LOGD("mNumSndEndpoints = %d", mNumSndEndpoints);
         mSndEndpoints = new msm_snd_endpoint[mNumSndEndpoints];
         mInit = true;
         LOGV("constructed %d SND endpoints", mNumSndEndpoints);
         ept = mSndEndpoints;
-        if ( snd_get_endpoint != NULL ) {
+        if ( acoustic_ops.get_endpoint != NULL ) {
             for (int cnt = 0; cnt < mNumSndEndpoints; cnt++, ept++) {
                 ept->id = cnt;
-                snd_get_endpoint(cnt, ept);
+                acoustic_ops.get_endpoint(cnt, ept);
                 LOGV("cnt = %d ept->name = %s ept->id = %d\n", cnt, ept->name, ept->id);
 #define CHECK_FOR(desc) \
                 if (!strcmp(ept->name, #desc)) { \
@@ -282,6 +339,10 @@ AudioHardware::AudioHardware() :
 
 AudioHardware::~AudioHardware()
 {
+    if (mRoutingThread != 0) {
+        mRoutingThread->stop();
+        mRoutingThread.clear();
+    }
     for (size_t index = 0; index < mInputs.size(); index++) {
         closeInputStream((AudioStreamIn*)mInputs[index]);
     }
@@ -290,14 +351,11 @@ AudioHardware::~AudioHardware()
     delete [] mSndEndpoints;
 
     /* In case we could initialize new acoustic library, then deinit to free memory */
-    if ( (htc_acoustic_deinit != NULL) && mUseAcoustic ) {
-        htc_acoustic_deinit();
+    if ( mUseAcoustic ) {
+        acoustic_ops.deinit();
     }
 
-    if (acoustic) {
-        ::dlclose(acoustic);
-        acoustic = 0;
-    }
+    acoustic_loaded = false;
     mInit = false;
 }
 
@@ -395,6 +453,9 @@ status_t AudioHardware::setMode(int mode)
         // make sure that doAudioRouteOrMute() is called by doRouting()
         // even if the new device selected is the same as current one.
         clearCurDevice();
+        // and that snd_set_device reaches the modem, which may have
+        // switched the device on its own for the call.
+        audiodev_forget(AUDIODEV_SND, SND_SET_DEVICE);
     }
     return status;
 }
@@ -438,6 +499,7 @@ status_t AudioHardware::setParameters(const String8& keyValuePairs)
     const char BT_NREC_KEY[] = "bt_headset_nrec";
     const char BT_NAME_KEY[] = "bt_headset_name";
     const char BT_NREC_VALUE_ON[] = "on";
+    int stream;
 
 
     LOGV("setParameters() %s", keyValuePairs.string());
@@ -458,7 +520,7 @@ status_t AudioHardware::setParameters(const String8& keyValuePairs)
     if (param.get(key, value) == NO_ERROR) {
         mBluetoothId = 0;
         if ( mUseAcoustic ) {
-            mBluetoothId = msm72xx_get_bluetooth_hs_id(value.string());
+            mBluetoothId = acoustic_ops.get_bluetooth_hs_id(value.string());
         } else {
             for (int i = 0; i < mNumSndEndpoints; i++) {
                 if (!strcasecmp(value.string(), mSndEndpoints[i].name)) {
@@ -474,15 +536,84 @@ status_t AudioHardware::setParameters(const String8& keyValuePairs)
             doRouting();
         }
     }
+    key = String8(AUDIO_HW_ACTIVE_STREAM_KEY);
+    if (param.getInt(key, stream) == NO_ERROR) {
+        Mutex::Autolock lock(mLock);
+        LOGV("active stream %d -> %d", bCurrentOutStream, stream);
+        /* The policy manager may tell us after the output started, so
+         * apply a newly playing stream type if the output is running.
+         */
+        if ( (stream != bCurrentOutStream) && (stream != AudioSystem::DEFAULT) &&
+             bOutputStarted ) {
+            postOutputRouting(RoutingThread::ROUTE_OUTPUT_STARTED);
+        }
+        bCurrentOutStream = stream;
+    }
+    key = String8(AUDIO_HW_OUTPUT_PROFILE_KEY);
+    if (param.get(key, value) == NO_ERROR) {
+        int profile = get_output_profile(value.string());
+        if (profile < 0) {
+            LOGW("Unknown output profile %s", value.string());
+        } else {
+            Mutex::Autolock lock(mLock);
+            mOutputProfile = profile;
+            LOGI("Output profile %s, applies to the next output opened", value.string());
+        }
+    }
     return NO_ERROR;
 }
 
 String8 AudioHardware::getParameters(const String8& keys)
 {
     AudioParameter param = AudioParameter(keys);
+    String8 key = String8(AUDIO_HW_OUTPUT_PROFILE_KEY);
+    String8 value;
+
+    if (param.get(key, value) == NO_ERROR) {
+        param.add(key, String8(outputProfiles[mOutputProfile].name));
+    }
+    key = String8(AUDIO_HW_TIMING_KEY);
+    if (param.get(key, value) == NO_ERROR) {
+        param.add(key, timingStats());
+    }
     return param.toString();
 }
 
+// "name:count/avg_us/max_us" entries, comma separated so that they fit in
+// one parameter value
+static void append_timing(String8& value, const char* name, const TimingStats& t)
+{
+    char buffer[96];
+    snprintf(buffer, sizeof(buffer), "%s%s:%u/%u/%u", value.length() ? "," : "",
+             name, t.count, t.avgUs(), t.maxUs);
+    value.append(buffer);
+}
+
+static void dump_timing(String8& result, const char* name, const TimingStats& t)
+{
+    char buffer[128];
+    snprintf(buffer, sizeof(buffer), "\t%s: %u, last %u us, avg %u us, max %u us\n",
+             name, t.count, t.lastUs, t.avgUs(), t.maxUs);
+    result.append(buffer);
+}
+
+String8 AudioHardware::timingStats()
+{
+    Mutex::Autolock lock(mLock);
+    String8 value;
+
+    append_timing(value, "routing", mRoutingTime);
+    append_timing(value, "acoustic_table", acousticTableTime);
+    append_timing(value, "audpre_table", audpreTableTime);
+    if (mOutput != NULL) {
+        mOutput->appendTimingStats(value);
+    }
+    for (size_t index = 0; index < mInputs.size(); index++) {
+        mInputs[index]->appendTimingStats(value);
+    }
+    return value;
+}
+
 
 static unsigned calculate_audpre_table_index(unsigned index)
 {
@@ -509,15 +640,32 @@ size_t AudioHardware::getInputBufferSize(uint32_t sampleRate, int format, int ch
         LOGW("getInputBufferSize bad channel count: %d", channelCount);
         return 0;
     }
+    if (sampleRate < inputSamplingRates[0] ||
+        sampleRate > inputSamplingRates[sizeof(inputSamplingRates)/sizeof(uint32_t) - 1]) {
+        LOGW("getInputBufferSize bad sample rate: %u", sampleRate);
+        return 0;
+    }
 
-    return 2048*channelCount;
+    // same duration at any rate, the resampler makes up the difference
+    size_t frames = (sampleRate * AUDIO_HW_IN_BUFFER_MS / 1000) & ~3;
+    return frames * channelCount * sizeof(int16_t);
+}
+
+/* Loads the acoustic tables of device into the DSP, the slow part of a
+ * route or volume change
+ */
+static int set_acoustic_table_timed(int device, int volume)
+{
+    nsecs_t start = systemTime();
+    int method = acoustic_ops.set_acoustic_table(device, volume);
+    acousticTableTime.add(systemTime() - start);
+    return method;
 }
 
 /* This function will be called when volume change is done. It will apply new
  * parameters in tables and manage the method used for audio volume control
  */
-static status_t doAcousticVolumeUpdate(struct msm_snd_volume_config* args,
-                                      uint32_t fd)
+static status_t doAcousticVolumeUpdate(struct msm_snd_volume_config* args)
 {
     int device_method = SND_METHOD_NONE;
     int device = args->device;
@@ -525,9 +673,7 @@ static status_t doAcousticVolumeUpdate(struct msm_snd_volume_config* args,
     LOGV("doAcousticVolumeUpdate %d %d %d", args->device, args->method, args->volume);
 
     if ( device != SND_DEVICE_IDLE ) {
-         if ( msm72xx_set_acoustic_table != NULL ) {
-             device_method = msm72xx_set_acoustic_table(device, args->volume);
-         }
+         device_method = set_acoustic_table_timed(device, args->volume);
 
          /* Some devices do not require/support volume setting */
          if ( device_method != SND_METHOD_NONE ) {
@@ -544,9 +690,8 @@ static status_t doAcousticVolumeUpdate(struct msm_snd_volume_config* args,
 #if LOG_SND_RPC
              LOGD("rpc snd_set_volume(%d, %d, %d)\n", args->device, args->method, args->volume);
 #endif
-             if (ioctl(fd, SND_SET_VOLUME, args) < 0) {
+             if (audiodev_ioctl(AUDIODEV_SND, SND_SET_VOLUME, args) < 0) {
                  LOGE("snd_set_volume error.");
-                 close(fd);
                  return -EIO;
              }
          }
@@ -554,9 +699,8 @@ static status_t doAcousticVolumeUpdate(struct msm_snd_volume_config* args,
 #if LOG_SND_RPC
          LOGD("rpc snd_set_volume(%d, %d, %d)\n", args->device, args->method, args->volume);
 #endif
-         if (ioctl(fd, SND_SET_VOLUME, args) < 0) {
+         if (audiodev_ioctl(AUDIODEV_SND, SND_SET_VOLUME, args) < 0) {
              LOGE("snd_set_volume error.");
-             close(fd);
              return -EIO;
          }
     }
@@ -568,7 +712,6 @@ static status_t set_volume_rpc(uint32_t device,
                                uint32_t method,
                                uint32_t volume)
 {
-    int fd;
 #if LOG_SND_RPC
     /* If acoustic library is used, debug will be done in doAcousticVolumeUpdate */
     if ( !mUseAcoustic ) {
@@ -578,8 +721,7 @@ static status_t set_volume_rpc(uint32_t device,
 
     if (device == -1UL) return NO_ERROR;
 
-    fd = open("/dev/msm_snd", O_RDWR);
-    if (fd < 0) {
+    if (audiodev_fd(AUDIODEV_SND) < 0) {
         LOGE("Can not open snd device");
         return -EPERM;
     }
@@ -598,15 +740,13 @@ static status_t set_volume_rpc(uint32_t device,
      args.volume = volume;
 
      if ( mUseAcoustic ) {
-        doAcousticVolumeUpdate(&args, fd);
+        doAcousticVolumeUpdate(&args);
      } else {
-         if (ioctl(fd, SND_SET_VOLUME, &args) < 0) {
+         if (audiodev_ioctl(AUDIODEV_SND, SND_SET_VOLUME, &args) < 0) {
              LOGE("snd_set_volume error.");
-             close(fd);
              return -EIO;
          }
      }
-     close(fd);
      return NO_ERROR;
 }
 
@@ -657,9 +797,7 @@ status_t AudioHardware::doUpdateVolume(uint32_t inputDevice)
 
     LOGV("AudioHardware::doUpdateVolume %d", mCurSndDevice);
     
-    if ( msm72xx_start_acoustic_setting != NULL ) {
-        msm72xx_start_acoustic_setting();
-    } 
+    acoustic_ops.start_acoustic_setting();
 
 	bool in_call = mMode == AudioSystem::MODE_IN_CALL;
 	bool use_mic = (inputDevice & AudioSystem::DEVICE_IN_BUILTIN_MIC);
@@ -680,9 +818,7 @@ status_t AudioHardware::doUpdateVolume(uint32_t inputDevice)
 	}
 
     /* Tell the audio acoustic controller that we have processed the new settings */
-    if ( msm72xx_set_acoustic_done != NULL ) {
-        msm72xx_set_acoustic_done();
-    }
+    acoustic_ops.set_acoustic_done();
 
     return NO_ERROR;
 }
@@ -690,37 +826,27 @@ status_t AudioHardware::doUpdateVolume(uint32_t inputDevice)
 /* This functions configures the A1010 audience controller to use the correct settings */
 status_t AudioHardware::doAudience_A1010_Control(void)
 {
-    int rc = 0;
-
-    if (a1010_fd < 0) {
-        a1010_fd = open(AUDIENCE_A1010_DEV, O_RDWR);
-        if (a1010_fd < 0) {
-            LOGE("Cannot open audience_A1010 device (%d)\n", a1010_fd);
-            return -1;
-    	}
-    }
+    int pathid;
+    int rc;
 
     if ( mCurSndDevice == SND_DEVICE_SPEAKER_MIC ) {
-        new_pathid = A1010_PATH_SPEAKER;
+        pathid = A1010_PATH_SPEAKER;
     }
     else {
-        new_pathid = A1010_PATH_SUSPEND;
+        pathid = A1010_PATH_SUSPEND;
     }
 
-    if (old_pathid != new_pathid) {
-        LOGI("A1010: do ioctl(A1010_SET_CONFIG) to %d\n", new_pathid);
-	rc = ioctl(a1010_fd, A1010_SET_CONFIG, &new_pathid);
-	if (!rc)
-		old_pathid = new_pathid;
-	else
-	    goto Error;
+    /* Only reaches the driver when the path differs from the last one set */
+    rc = audiodev_ioctl_dedup(AUDIODEV_A1010, A1010_SET_CONFIG, &pathid, sizeof(pathid));
+    if (rc < 0) {
+        LOGE("A1010: ioctl(A1010_SET_CONFIG) to %d failed\n", pathid);
+        return rc;
+    }
+    if (rc != AUDIODEV_SKIPPED) {
+        LOGI("A1010: did ioctl(A1010_SET_CONFIG) to %d\n", pathid);
     }
 
-Error:
-    close(a1010_fd);
-    a1010_fd = -1;
-
-    return rc;
+    return NO_ERROR;
 }
 
 /* This function will be called on device change, so that hardware and software changes
@@ -729,14 +855,11 @@ Error:
  */
 status_t AudioHardware::doAcousticAudioDeviceChange(struct msm_snd_device_config* args)
 {
-    int fd;
     uint32_t inputDevice = 0;
 
     LOGV("AudioHardware::update_device %d %d %d", args->device, args->ear_mute, args->mic_mute);
 
-    if ( msm72xx_start_acoustic_setting != NULL ) {
-        msm72xx_start_acoustic_setting();
-    }
+    acoustic_ops.start_acoustic_setting();
 	
 	bool in_call = mMode == AudioSystem::MODE_IN_CALL;
 
@@ -797,33 +920,29 @@ status_t AudioHardware::doAcousticAudioDeviceChange(struct msm_snd_device_config
         args->device = mCurSndDevice;
     }
 
-    if ( msm72xx_set_audio_path != NULL ) {
-        bool bEnableOut = false;
-        /* XXX: Can't be used. @ boot time, isStreamActive blocks media service.
-        bool bMusic;
-        AudioSystem::isStreamActive(AudioSystem::MUSIC, &bMusic);*/
-        if (in_call || (bCurrentOutStream != AudioSystem::DEFAULT)) {
-            bEnableOut = true;    
-        }
-        /* If recording while speaker is in use, then enable dual mic */
-		bool use_mic = inputDevice & AudioSystem::DEVICE_IN_BUILTIN_MIC;
-		bool rear_mic = inputDevice & AudioSystem::DEVICE_IN_BACK_MIC;
-		bool use_spk = ((int)args->device) == SND_DEVICE_SPEAKER;
-
-		if ((in_call || use_mic || rear_mic) && use_spk) {
-            msm72xx_set_audio_path(!args->mic_mute, 1, args->device, bEnableOut );
-            mCurSndDevice = SND_DEVICE_SPEAKER_MIC;
-			args->device = SND_DEVICE_SPEAKER_MIC;
-			LOGI("mCurSndDevice <- SPEAKER_MIC");
-        } else {
-            msm72xx_set_audio_path(!args->mic_mute, 0, args->device, bEnableOut );
-        }
+    bool bEnableOut = false;
+    /* bCurrentOutStream is pushed by the policy manager, never ask
+     * AudioSystem here: isStreamActive blocks media service at boot time.
+     */
+    if (in_call || (bOutputStarted && (bCurrentOutStream != AudioSystem::DEFAULT))) {
+        bEnableOut = true;    
+    }
+    /* If recording while speaker is in use, then enable dual mic */
+	bool use_mic = inputDevice & AudioSystem::DEVICE_IN_BUILTIN_MIC;
+	bool rear_mic = inputDevice & AudioSystem::DEVICE_IN_BACK_MIC;
+	bool use_spk = ((int)args->device) == SND_DEVICE_SPEAKER;
+
+	if ((in_call || use_mic || rear_mic) && use_spk) {
+        acoustic_ops.set_audio_path(!args->mic_mute, 1, args->device, bEnableOut );
+        mCurSndDevice = SND_DEVICE_SPEAKER_MIC;
+		args->device = SND_DEVICE_SPEAKER_MIC;
+		LOGI("mCurSndDevice <- SPEAKER_MIC");
+    } else {
+        acoustic_ops.set_audio_path(!args->mic_mute, 0, args->device, bEnableOut );
     }
 
     // TODO : switch on/off leds as done in msm_setup_audio() ? 
-    if ( msm72xx_set_acoustic_table != NULL ) {
-        msm72xx_set_acoustic_table(args->device, get_master_volume());
-    }
+    set_acoustic_table_timed(args->device, get_master_volume());
 
 
     /* Currently only used for the SPEAKER_MIC device but might be expanded to other devices
@@ -835,33 +954,18 @@ status_t AudioHardware::doAcousticAudioDeviceChange(struct msm_snd_device_config
 
     LOGV("call snd_set_device %d", args->device);
 
-    /* Open msm_snd to set device */
-    fd = open("/dev/msm_snd", O_RDWR);
-    if (fd < 0) {
-        LOGE("Can not open snd device");
-        if ( msm72xx_set_acoustic_done != NULL ) {
-            msm72xx_set_acoustic_done();
-        }
-        return -EPERM;
-    }
-
 #if LOG_SND_RPC
     LOGD("rpc snd_set_device(%d, %d, %d)\n", args->device, args->ear_mute, args->mic_mute);
 #endif
-    if (ioctl(fd, SND_SET_DEVICE, args) < 0) {
+    /* Skipped when device and mutes are unchanged since the last call */
+    if (audiodev_ioctl_dedup(AUDIODEV_SND, SND_SET_DEVICE, args, sizeof(*args)) < 0) {
         LOGE("snd_set_device error.");
-        close(fd);
-        if ( msm72xx_set_acoustic_done != NULL ) {
-            msm72xx_set_acoustic_done();
-        }
+        acoustic_ops.set_acoustic_done();
         return -EIO;
     }
 
-    if ( msm72xx_set_acoustic_done != NULL ) {
-        msm72xx_set_acoustic_done();
-    }
+    acoustic_ops.set_acoustic_done();
 
-    close(fd);
     return NO_ERROR;
 }
 
@@ -871,19 +975,15 @@ status_t AudioHardware::do_route_audio_rpc(uint32_t device,
     if (device == -1UL)
         return NO_ERROR;
 
-    int fd;
 #if LOG_SND_RPC
     if ( !mUseAcoustic ) {
         LOGD("rpc_snd_set_device(%d, %d, %d)\n", device, ear_mute, mic_mute);
     }
 #endif
 
-    if ( !mUseAcoustic ) {
-        fd = open("/dev/msm_snd", O_RDWR);
-        if (fd < 0) {
-            LOGE("Can not open snd device");
-            return -EPERM;
-        }
+    if ( !mUseAcoustic && (audiodev_fd(AUDIODEV_SND) < 0) ) {
+        LOGE("Can not open snd device");
+        return -EPERM;
     }
     // RPC call to switch audio path
     /* rpc_snd_set_device(
@@ -903,12 +1003,10 @@ status_t AudioHardware::do_route_audio_rpc(uint32_t device,
     if ( mUseAcoustic ) {
        doAcousticAudioDeviceChange(&args);
     } else {
-        if (ioctl(fd, SND_SET_DEVICE, &args) < 0) {
+        if (audiodev_ioctl_dedup(AUDIODEV_SND, SND_SET_DEVICE, &args, sizeof(args)) < 0) {
             LOGE("snd_set_device error.");
-            close(fd);
             return -EIO;
         }
-        close(fd);
     }
 
     mCurSndDevice = args.device;
@@ -934,14 +1032,14 @@ status_t AudioHardware::doAudioRouteOrMute(uint32_t device)
 status_t AudioHardware::doRouting()
 {
     /* currently this code doesn't work without the htc libacoustic */
-    if (!acoustic)
+    if (!acoustic_loaded)
         return 0;
 
     Mutex::Autolock lock(mLock);
+    if (mOutput == NULL)
+        return NO_ERROR;
     uint32_t outputDevices = mOutput->devices();
     status_t ret = NO_ERROR;
-    int (*msm72xx_enable_audpp)(int);
-    msm72xx_enable_audpp = (int (*)(int))::dlsym(acoustic, "msm72xx_enable_audpp");
     int audProcess = (ADRC_DISABLE | EQ_DISABLE | RX_IIR_DISABLE);
     AudioStreamInMSM72xx *input = getActiveInput_l();
     uint32_t inputDevice = (input == NULL) ? 0 : input->devices();
@@ -1032,23 +1130,65 @@ status_t AudioHardware::doRouting()
         }
     }
 
-    if (sndDevice != -1 && sndDevice != mCurSndDevice) {
-        ret = doAudioRouteOrMute(sndDevice);
-        if ((*msm72xx_enable_audpp) == 0 ) {
-            LOGE("Could not open msm72xx_enable_audpp()");
-        } else {
-            msm72xx_enable_audpp(audProcess);
+    if (mPendingSndDevice != -1) {
+        /* A switch already waits for the output to fade out, the latest
+         * device wins when it happens.
+         */
+        if (sndDevice != -1) {
+            mPendingSndDevice = sndDevice;
+            mPendingAudProcess = audProcess;
         }
+        return NO_ERROR;
+    }
 
-        if ( mUseAcoustic ) {
-            /* Update the acoustic hardware with new device settings */
-            doUpdateVolume(mCurSndDevice);
+    if (sndDevice != -1 && sndDevice != mCurSndDevice) {
+        /* This may run on the mixer thread, which is also the one that
+         * writes: never wait here for the fade out, let write() tell the
+         * routing thread when the queue is silent.
+         */
+        nsecs_t due = mOutput->rampOut();
+        if (due && (mRoutingThread != 0)) {
+            mPendingSndDevice = sndDevice;
+            mPendingAudProcess = audProcess;
+            mRoutingThread->scheduleRoute(due);
+        } else {
+            ret = applyRouting_l(sndDevice, audProcess);
+            mOutput->rampIn();
         }
     }
 
     return ret;
 }
 
+// always call with mutex held
+status_t AudioHardware::applyRouting_l(int sndDevice, int audProcess)
+{
+    nsecs_t start = systemTime();
+    status_t ret = doAudioRouteOrMute(sndDevice);
+    acoustic_ops.enable_audpp(audProcess);
+
+    if ( mUseAcoustic ) {
+        /* Update the acoustic hardware with new device settings */
+        doUpdateVolume(mCurSndDevice);
+    }
+    mRoutingTime.add(systemTime() - start);
+    return ret;
+}
+
+// Called on mRoutingThread, once the output faded out or gave up on it
+void AudioHardware::doPendingRouting()
+{
+    Mutex::Autolock lock(mLock);
+    if (mPendingSndDevice == -1) {
+        return;
+    }
+    applyRouting_l(mPendingSndDevice, mPendingAudProcess);
+    mPendingSndDevice = -1;
+    if (mOutput != NULL) {
+        mOutput->rampIn();
+    }
+}
+
 status_t AudioHardware::checkMicMute()
 {
     Mutex::Autolock lock(mLock);
@@ -1059,6 +1199,146 @@ status_t AudioHardware::checkMicMute()
     return NO_ERROR;
 }
 
+void AudioHardware::postOutputRouting(int route)
+{
+    if (mRoutingThread != 0) {
+        mRoutingThread->post(route);
+    }
+}
+
+// Called on mRoutingThread
+void AudioHardware::doOutputRouting(int route)
+{
+    bool reroute = false;
+
+    { // scope for the lock
+        Mutex::Autolock lock(mLock);
+
+        if (route == RoutingThread::ROUTE_OUTPUT_STOPPED) {
+            /* Apply setting to acoustic device with output disabled */
+            bOutputStarted = false;
+            doAudioRouteOrMute(SND_DEVICE_CURRENT);
+            return;
+        }
+
+        bOutputStarted = true;
+        /* Sets up acoustic hardware */
+        if ( mCurSndDevice == SND_DEVICE_SPEAKER ) {
+            doAudioRouteOrMute(SND_DEVICE_PLAYBACK_HANDSFREE);
+        } else if ( mCurSndDevice == SND_DEVICE_HEADSET ) {
+            doAudioRouteOrMute(SND_DEVICE_PLAYBACK_HEADSET);
+        } else {
+            reroute = true;
+        }
+    }
+
+    /* Let the device be choosen by actual settings, doRouting takes the lock */
+    if (reroute) {
+        doRouting();
+    }
+}
+
+// Called on mRoutingThread
+void AudioHardware::closeIdleOutput()
+{
+    Mutex::Autolock lock(mLock);
+    if (mOutput != NULL) {
+        mOutput->closeIfIdle();
+    }
+}
+
+AudioHardware::RoutingThread::RoutingThread(AudioHardware* hw) :
+    Thread(false), mHardware(hw), mPending(ROUTE_NONE), mCloseAt(0), mRouteAt(0)
+{
+}
+
+void AudioHardware::RoutingThread::post(int route)
+{
+    Mutex::Autolock lock(mLock);
+    mPending = route;
+    mCond.signal();
+}
+
+// Keeps the earliest deadline, closeIfIdle() asks again if it was too early
+void AudioHardware::RoutingThread::scheduleClose(nsecs_t when)
+{
+    Mutex::Autolock lock(mLock);
+    if ((mCloseAt == 0) || (when < mCloseAt)) {
+        mCloseAt = when;
+        mCond.signal();
+    }
+}
+
+// Keeps the earliest deadline, doPendingRouting() ignores a switch already made
+void AudioHardware::RoutingThread::scheduleRoute(nsecs_t when)
+{
+    Mutex::Autolock lock(mLock);
+    if ((mRouteAt == 0) || (when < mRouteAt)) {
+        mRouteAt = when;
+        mCond.signal();
+    }
+}
+
+void AudioHardware::RoutingThread::stop()
+{
+    {
+        Mutex::Autolock lock(mLock);
+        requestExit();
+        mCond.signal();
+    }
+    requestExitAndWait();
+}
+
+bool AudioHardware::RoutingThread::threadLoop()
+{
+    int route;
+    bool close = false;
+    bool reroute = false;
+
+    {
+        Mutex::Autolock lock(mLock);
+        while ((mPending == ROUTE_NONE) && !exitPending()) {
+            nsecs_t next = mCloseAt;
+            if ((mRouteAt != 0) && ((next == 0) || (mRouteAt < next))) {
+                next = mRouteAt;
+            }
+            if (next == 0) {
+                mCond.wait(mLock);
+                continue;
+            }
+            nsecs_t now = systemTime();
+            if ((mRouteAt != 0) && (now >= mRouteAt)) {
+                mRouteAt = 0;
+                reroute = true;
+            }
+            if ((mCloseAt != 0) && (now >= mCloseAt)) {
+                mCloseAt = 0;
+                close = true;
+            }
+            if (reroute || close) {
+                break;
+            }
+            mCond.waitRelative(mLock, next - now);
+        }
+        route = mPending;
+        mPending = ROUTE_NONE;
+    }
+
+    if (exitPending()) {
+        return false;
+    }
+    if (reroute) {
+        mHardware->doPendingRouting();
+    }
+    if (close) {
+        mHardware->closeIdleOutput();
+    }
+    if (route != ROUTE_NONE) {
+        mHardware->doOutputRouting(route);
+    }
+    return true;
+}
+
 status_t AudioHardware::dumpInternals(int fd, const Vector<String16>& args)
 {
     const size_t SIZE = 256;
@@ -1073,6 +1353,21 @@ status_t AudioHardware::dumpInternals(int fd, const Vector<String16>& args)
     result.append(buffer);
     snprintf(buffer, SIZE, "\tmBluetoothId: %d\n", mBluetoothId);
     result.append(buffer);
+    dump_timing(result, "route changes", mRoutingTime);
+    dump_timing(result, "acoustic tables", acousticTableTime);
+    dump_timing(result, "audpre tables", audpreTableTime);
+
+    struct audiodev_stats stats[32];
+    int count = audiodev_get_stats(stats, 32);
+    result.append("\tdevice ioctls (calls skipped errors avg_us max_us):\n");
+    for (int i = 0; i < count; i++) {
+        snprintf(buffer, SIZE, "\t  %-8s 0x%08x %u %u %u %llu %u\n",
+                 audiodev_name(stats[i].dev), stats[i].request,
+                 stats[i].calls, stats[i].skipped, stats[i].errors,
+                 (unsigned long long) (stats[i].calls ? stats[i].total_us / stats[i].calls : 0),
+                 stats[i].max_us);
+        result.append(buffer);
+    }
     ::write(fd, result.string(), result.size());
     return NO_ERROR;
 }
@@ -1090,18 +1385,19 @@ status_t AudioHardware::dump(int fd, const Vector<String16>& args)
     return NO_ERROR;
 }
 
+// Returns the rate the DSP captures at for an input at sampleRate
 uint32_t AudioHardware::getInputSampleRate(uint32_t sampleRate)
 {
     uint32_t i;
-    uint32_t prevDelta;
-    uint32_t delta;
 
-    for (i = 0, prevDelta = 0xFFFFFFFF; i < sizeof(inputSamplingRates)/sizeof(uint32_t); i++, prevDelta = delta) {
-        delta = abs(sampleRate - inputSamplingRates[i]);
-        if (delta > prevDelta) break;
+    if (mInputNativeRate) {
+        return mInputNativeRate;
     }
-    // i is always > 0 here
-    return inputSamplingRates[i-1];
+    // don't capture below the client rate, that would lose its upper band
+    for (i = 0; i < sizeof(inputSamplingRates)/sizeof(uint32_t) - 1; i++) {
+        if (inputSamplingRates[i] >= sampleRate) break;
+    }
+    return inputSamplingRates[i];
 }
 
 // getActiveInput_l() must be called with mLock held
@@ -1120,7 +1416,16 @@ AudioHardware::AudioStreamInMSM72xx *AudioHardware::getActiveInput_l()
 // ----------------------------------------------------------------------------
 
 AudioHardware::AudioStreamOutMSM72xx::AudioStreamOutMSM72xx() :
-    mHardware(0), mFd(-1), mStartCount(0), mRetryCount(0), mStandby(true), mDevices(0)
+    mHardware(0), mFd(-1), mStartCount(0), mRetryCount(0), mStandby(true), mDevices(0),
+    mProfile(OUTPUT_PROFILE_DEFAULT),
+    mBufferSize(outputProfiles[OUTPUT_PROFILE_DEFAULT].bufferSize),
+    mBufferCount(outputProfiles[OUTPUT_PROFILE_DEFAULT].bufferCount),
+    mDriverBufferSize(0), mDriverBufferCount(0), mBytesWritten(0), mOutBytesBase(0),
+    mLatencyUs(0), mLatencyPoll(0), mStandbyTime(0), mOpenTime(0), mOpenCount(0), mOpenUs(0), mOpenMaxUs(0),
+    mResumeCount(0), mResumeUs(0), mResumeMaxUs(0), mRampRequest(RAMP_NONE),
+    mRamp(RAMP_NONE), mRampSilent(false), mRampFrames(0), mRampDone(0), mRampDrain(0), mRampBuf(NULL), mRampBufSize(0),
+    mLastWriteTime(0), mRunOutTime(0),
+    mUnderruns(0), mUnderrunMs(0)
 {
 }
 
@@ -1132,6 +1437,11 @@ status_t AudioHardware::AudioStreamOutMSM72xx::set(
     uint32_t lRate = pRate ? *pRate : 0;
 
     mHardware = hw;
+    mProfile = hw->mOutputProfile;
+    mBufferSize = outputProfiles[mProfile].bufferSize;
+    mBufferCount = outputProfiles[mProfile].bufferCount;
+    LOGI("Output profile %s: %u x %u bytes", outputProfiles[mProfile].name,
+         mBufferCount, (unsigned)mBufferSize);
 
     // fix up defaults
     if (lFormat == 0) lFormat = format();
@@ -1160,11 +1470,14 @@ status_t AudioHardware::AudioStreamOutMSM72xx::set(
 AudioHardware::AudioStreamOutMSM72xx::~AudioStreamOutMSM72xx()
 {
     if ( mUseAcoustic ) {
-        /* Reset output stream to default and apply setting to acoustic device */
-        bCurrentOutStream = AudioSystem::DEFAULT;
+        /* Apply setting to acoustic device with output disabled.
+         * Called from closeOutputStream, with the hardware lock held.
+         */
+        bOutputStarted = false;
         mHardware->doAudioRouteOrMute(SND_DEVICE_CURRENT);
     }
     if (mFd >= 0) close(mFd);
+    delete [] mRampBuf;
 }
 
 ssize_t AudioHardware::AudioStreamOutMSM72xx::write(const void* buffer, size_t bytes)
@@ -1173,8 +1486,22 @@ ssize_t AudioHardware::AudioStreamOutMSM72xx::write(const void* buffer, size_t b
     status_t status = NO_INIT;
     size_t count = bytes;
     const uint8_t* p = static_cast<const uint8_t*>(buffer);
+    nsecs_t entry = systemTime();
+    nsecs_t end = entry;
+    nsecs_t blocked = 0;
+    bool started = false;
+    nsecs_t resumeTime = 0;
+    size_t silence = 0;         // bytes written after a fade out
 
     if (mStandby) {
+        Mutex::Autolock lock(mFdLock);
+
+        if (mFd >= 0) {
+            // warm standby: the driver is configured and the route applied
+            resumeTime = entry;
+            mStandby = false;
+            goto Write;
+        }
 
         // open driver
         LOGV("open driver");
@@ -1197,68 +1524,155 @@ ssize_t AudioHardware::AudioStreamOutMSM72xx::write(const void* buffer, size_t b
         LOGV("set config");
         config.channel_count = AudioSystem::popCount(channels());
         config.sample_rate = sampleRate();
-        config.buffer_size = bufferSize();
-        config.buffer_count = AUDIO_HW_NUM_OUT_BUF;
+        config.buffer_size = mBufferSize;
+        config.buffer_count = mBufferCount;
         config.codec_type = CODEC_TYPE_PCM;
         status = ioctl(mFd, AUDIO_SET_CONFIG, &config);
+        if ((status < 0) && (mProfile != OUTPUT_PROFILE_DEFAULT)) {
+            LOGW("Driver refused the %s profile, using default buffers",
+                 outputProfiles[mProfile].name);
+            config.buffer_size = outputProfiles[OUTPUT_PROFILE_DEFAULT].bufferSize;
+            config.buffer_count = outputProfiles[OUTPUT_PROFILE_DEFAULT].bufferCount;
+            status = ioctl(mFd, AUDIO_SET_CONFIG, &config);
+        }
         if (status < 0) {
             LOGE("Cannot set config");
             goto Error;
         }
 
+        // the driver may keep its own buffers, use what it really has
+        if (ioctl(mFd, AUDIO_GET_CONFIG, &config) < 0) {
+            config.buffer_size = mBufferSize;
+            config.buffer_count = mBufferCount;
+        }
+        mDriverBufferSize = config.buffer_size ? config.buffer_size : mBufferSize;
+        mDriverBufferCount = config.buffer_count ? config.buffer_count : mBufferCount;
+
         LOGV("buffer_size: %u", config.buffer_size);
         LOGV("buffer_count: %u", config.buffer_count);
         LOGV("channel_count: %u", config.channel_count);
         LOGV("sample_rate: %u", config.sample_rate);
 
-        // fill 2 buffers before AUDIO_START
-        mStartCount = AUDIO_HW_NUM_OUT_BUF;
+        struct msm_audio_stats stats;
+        mOutBytesBase = (ioctl(mFd, AUDIO_GET_STATS, &stats) == 0) ? stats.out_bytes : 0;
+        mBytesWritten = 0;
+
+        // fill the driver buffers before AUDIO_START
+        mStartCount = mDriverBufferCount;
+        mOpenTime = systemTime();
         mStandby = false;
     }
 
+Write:
+    {
+        Mutex::Autolock lock(mRampLock);
+        if (mRampRequest != RAMP_NONE) {
+            mRamp = mRampRequest;
+            mRampRequest = RAMP_NONE;
+            mRampFrames = sampleRate() * AUDIO_HW_OUT_RAMP_MS / 1000;
+            mRampDone = 0;
+            mRampDrain = mDriverBufferCount * mDriverBufferSize;
+            mRampSilent = false;
+        }
+    }
+    if (mRamp != RAMP_NONE) {
+        // fade a copy, the client buffer is const
+        int ch = AudioSystem::popCount(channels());
+        size_t frames = bytes / frameSize();
+        size_t n = mRampFrames - mRampDone;
+        if (n > frames) n = frames;
+        if (mRampBufSize < bytes) {
+            delete [] mRampBuf;
+            mRampBuf = new int16_t[bytes / sizeof(int16_t)];
+            mRampBufSize = bytes;
+        }
+        if (mRamp == RAMP_IN) {
+            pcm_gain_ramp((const int16_t*)buffer, mRampBuf, n, ch,
+                          PCM_UNITY_GAIN * mRampDone / mRampFrames,
+                          PCM_UNITY_GAIN * (mRampDone + n) / mRampFrames);
+            memcpy(mRampBuf + n * ch, (const int16_t*)buffer + n * ch, bytes - n * frameSize());
+        } else {
+            // silence after the fade, until rampIn()
+            pcm_gain_ramp((const int16_t*)buffer, mRampBuf, n, ch,
+                          PCM_UNITY_GAIN * (mRampFrames - mRampDone) / mRampFrames,
+                          PCM_UNITY_GAIN * (mRampFrames - mRampDone - n) / mRampFrames);
+            memset(mRampBuf + n * ch, 0, bytes - n * frameSize());
+            silence = bytes - n * frameSize();
+        }
+        mRampDone += n;
+        if ((mRamp == RAMP_IN) && (mRampDone == mRampFrames)) {
+            mRamp = RAMP_NONE;
+        }
+        p = (const uint8_t*)mRampBuf;
+    }
+
     while (count) {
-        ssize_t written = ::write(mFd, p, count);
+        size_t chunk = count;
+        // one driver buffer per write until started, so that no write
+        // blocks on a full queue that the DSP will never drain
+        if (mStartCount && (chunk > mDriverBufferSize)) {
+            chunk = mDriverBufferSize;
+        }
+        nsecs_t before = systemTime();
+        ssize_t written = ::write(mFd, p, chunk);
+        end = systemTime();
+        blocked += end - before;
         if (written >= 0) {
             count -= written;
             p += written;
+            mBytesWritten += written;
         } else {
             if (errno != EAGAIN) return written;
             mRetryCount++;
             LOGW("EAGAIN - retry");
+            continue;
         }
-    }
 
-    // start audio after we fill 2 buffers
-    if (mStartCount) {
-        if (--mStartCount == 0) {
+        // start audio after we fill the driver buffers
+        if (mStartCount && (--mStartCount == 0)) {
             ioctl(mFd, AUDIO_START, 0);
-     
+            started = true;
+
+            mOpenUs = (uint32_t)ns2us(systemTime() - mOpenTime);
+            if (mOpenUs > mOpenMaxUs) mOpenMaxUs = mOpenUs;
+            mOpenCount++;
+
             if ( mUseAcoustic ) {
-                /* Get the current output stream type */
-                bCurrentOutStream = get_current_stream();
-                /* Sets up acoustic hardware */
-                if ( mHardware->mCurSndDevice == SND_DEVICE_SPEAKER ) {
-                    mHardware->doAudioRouteOrMute(SND_DEVICE_PLAYBACK_HANDSFREE);
-                } else if ( mHardware->mCurSndDevice == SND_DEVICE_HEADSET ) {
-                    mHardware->doAudioRouteOrMute(SND_DEVICE_PLAYBACK_HEADSET);
-                } else {
-                    /* Let the device be choosen by actual settings */
-                    mHardware->doRouting();
-                }
+                /* Sets up acoustic hardware off the mixer thread */
+                mHardware->postOutputRouting(RoutingThread::ROUTE_OUTPUT_STARTED);
             }
         }
     }
+
+    if ((mRamp == RAMP_OUT) && !mRampSilent) {
+        // a full driver queue of silence behind the fade has pushed it to
+        // the DSP, give its own pipeline a fade's length and switch
+        mRampDrain -= (silence < mRampDrain) ? silence : mRampDrain;
+        if (mRampDrain == 0) {
+            mRampSilent = true;
+            mHardware->mRoutingThread->scheduleRoute(end + ms2ns(AUDIO_HW_OUT_RAMP_MS));
+        }
+    }
+
+    if (resumeTime) {
+        mResumeUs = (uint32_t)ns2us(systemTime() - resumeTime);
+        if (mResumeUs > mResumeMaxUs) mResumeMaxUs = mResumeUs;
+        mResumeCount++;
+    }
+    // the ioctl is cheap but not free, sample the queue every few writes
+    if (!mStartCount && (mLatencyPoll++ % AUDIO_HW_OUT_LATENCY_POLL == 0)) {
+        updateLatency();
+    }
+    mWriteBlocked.add(blocked);
+    updateTiming(entry, end, bytes, started);
     return bytes;
 
 Error:
-    if (mFd >= 0) {
-        if ( mUseAcoustic ) {
-            /* Reset output stream to default and apply setting to acoustic device */
-            bCurrentOutStream = AudioSystem::DEFAULT;
-            mHardware->doAudioRouteOrMute(SND_DEVICE_CURRENT);
+    {
+        Mutex::Autolock lock(mFdLock);
+        if (mFd >= 0) {
+            closeDriver();
         }
-        ::close(mFd);
-        mFd = -1;
     }
     // Simulate audio output timing in case of error
     usleep(bytes * 1000000 / frameSize() / sampleRate());
@@ -1269,19 +1683,93 @@ Error:
 status_t AudioHardware::AudioStreamOutMSM72xx::standby()
 {
     status_t status = NO_ERROR;
+    Mutex::Autolock lock(mFdLock);
     if (!mStandby && mFd >= 0) {
-        if ( mUseAcoustic ) {
-            /* Reset output stream to default and apply setting to acoustic device */
-            bCurrentOutStream = AudioSystem::DEFAULT;
-            mHardware->doAudioRouteOrMute(SND_DEVICE_CURRENT);
+        if (mHardware->mWarmStandbyMs && !mStartCount) {
+            // keep the driver open for a while, see closeIfIdle(). Not
+            // with a queue that never started: it would play at resume.
+            mStandbyTime = systemTime();
+            mHardware->mRoutingThread->scheduleClose(mStandbyTime + ms2ns(mHardware->mWarmStandbyMs));
+        } else {
+            closeDriver();
         }
-        ::close(mFd);
-        mFd = -1;
     }
     mStandby = true;
+    {
+        // nothing more gets written, do not keep a route change waiting
+        Mutex::Autolock rampLock(mRampLock);
+        if ((mRampRequest == RAMP_OUT) || ((mRamp == RAMP_OUT) && !mRampSilent)) {
+            mRampSilent = true;
+            mHardware->mRoutingThread->scheduleRoute(systemTime());
+        }
+    }
+    mLastWriteTime = 0;
+    mRunOutTime = 0;
+    // the queue drains in standby, measure again from the next start
+    mLatencyUs = 0;
+    mLatencyPoll = 0;
     return status;
 }
 
+// Called with the hardware lock held before the output device changes,
+// from any thread, the mixer thread included: it must not wait. The next
+// writes fade out over AUDIO_HW_OUT_RAMP_MS and then write silence until
+// rampIn(). Once that silence has pushed the fade through the driver
+// queue, write() schedules the switch on the routing thread. Returns when
+// the switch is due at the latest, should the client stop writing, or 0
+// if nothing is playing and the device can switch at once.
+nsecs_t AudioHardware::AudioStreamOutMSM72xx::rampOut()
+{
+    {
+        Mutex::Autolock lock(mFdLock);
+        if (mStandby || (mFd < 0) || mStartCount) {
+            return 0;
+        }
+    }
+
+    Mutex::Autolock lock(mRampLock);
+    mRampRequest = RAMP_OUT;
+    // the fade takes a write or two, then the silence a full queue
+    nsecs_t bufferNs = seconds(1) * bufferSize() / (frameSize() * sampleRate());
+    nsecs_t queueNs = seconds(1) * mDriverBufferCount * mDriverBufferSize / (frameSize() * sampleRate());
+    return systemTime() + 2 * ms2ns(AUDIO_HW_OUT_RAMP_MS) + 2 * bufferNs + queueNs;
+}
+
+// Called with the hardware lock held after the output device changed, the
+// next writes fade in over AUDIO_HW_OUT_RAMP_MS
+void AudioHardware::AudioStreamOutMSM72xx::rampIn()
+{
+    Mutex::Autolock lock(mRampLock);
+    mRampRequest = RAMP_IN;
+}
+
+// Called with mFdLock held
+void AudioHardware::AudioStreamOutMSM72xx::closeDriver()
+{
+    if ( mUseAcoustic ) {
+        mHardware->postOutputRouting(RoutingThread::ROUTE_OUTPUT_STOPPED);
+    }
+    ::close(mFd);
+    mFd = -1;
+    mRunOutTime = 0;
+}
+
+// Called on the routing thread with the hardware lock held, when warm standby may have expired
+void AudioHardware::AudioStreamOutMSM72xx::closeIfIdle()
+{
+    Mutex::Autolock lock(mFdLock);
+    if (!mStandby || (mFd < 0)) {
+        return;
+    }
+    nsecs_t expiry = mStandbyTime + ms2ns(mHardware->mWarmStandbyMs);
+    if (systemTime() < expiry) {
+        mHardware->mRoutingThread->scheduleClose(expiry);
+        return;
+    }
+    LOGV("warm standby expired, closing driver");
+    closeDriver();
+}
+
 status_t AudioHardware::AudioStreamOutMSM72xx::dump(int fd, const Vector<String16>& args)
 {
     const size_t SIZE = 256;
@@ -1306,10 +1794,108 @@ status_t AudioHardware::AudioStreamOutMSM72xx::dump(int fd, const Vector<String1
     result.append(buffer);
     snprintf(buffer, SIZE, "\tmStandby: %s\n", mStandby? "true": "false");
     result.append(buffer);
+    snprintf(buffer, SIZE, "\tprofile: %s (%u x %u, driver %u x %u)\n",
+             outputProfiles[mProfile].name, mBufferCount, (unsigned)mBufferSize,
+             mDriverBufferCount, (unsigned)mDriverBufferSize);
+    result.append(buffer);
+    snprintf(buffer, SIZE, "\tlatency: %u ms (%s)\n", latency(), mLatencyUs ? "measured" : "nominal");
+    result.append(buffer);
+    snprintf(buffer, SIZE, "\twarm standby: %u ms%s\n", mHardware->mWarmStandbyMs,
+             (mStandby && (mFd >= 0)) ? ", driver kept open" : "");
+    result.append(buffer);
+    snprintf(buffer, SIZE, "\topen to start: %u opens, last %u us, max %u us\n",
+             mOpenCount, mOpenUs, mOpenMaxUs);
+    result.append(buffer);
+    snprintf(buffer, SIZE, "\tresume: %u resumes, last %u us, max %u us\n",
+             mResumeCount, mResumeUs, mResumeMaxUs);
+    result.append(buffer);
+    dump_timing(result, "write interval", mWriteInterval);
+    dump_timing(result, "blocked in driver", mWriteBlocked);
+    snprintf(buffer, SIZE, "\tunderruns: %u, about %u ms\n", mUnderruns, mUnderrunMs);
+    result.append(buffer);
     ::write(fd, result.string(), result.size());
     return NO_ERROR;
 }
 
+// Measures how much is queued ahead of the DSP right after a write
+void AudioHardware::AudioStreamOutMSM72xx::updateLatency()
+{
+    struct msm_audio_stats stats;
+    uint32_t queued;
+    uint32_t queuedUs;
+
+    if (ioctl(mFd, AUDIO_GET_STATS, &stats) < 0) {
+        return;
+    }
+    // unsigned arithmetic copes with the counters wrapping
+    queued = mBytesWritten - (stats.out_bytes - mOutBytesBase);
+    if (queued > (mDriverBufferCount * mDriverBufferSize) + mBufferSize) {
+        return;     // the driver counts something else, ignore it
+    }
+    queuedUs = (uint32_t)((uint64_t)queued * 1000000 / (frameSize() * sampleRate()));
+    mLatencyUs = mLatencyUs ? ((mLatencyUs * 7) + queuedUs) / 8 : queuedUs;
+}
+
+// Estimates underruns from the wall clock: the audio queued so far plays
+// until mRunOutTime, a write entered later than that left the DSP starved.
+// entry and end bound the write() call, started if it issued AUDIO_START.
+void AudioHardware::AudioStreamOutMSM72xx::updateTiming(nsecs_t entry, nsecs_t end,
+                                                        size_t bytes, bool started)
+{
+    uint32_t bytesPerSec = frameSize() * sampleRate();
+
+    if (mLastWriteTime) {
+        mWriteInterval.add(entry - mLastWriteTime);
+    }
+    mLastWriteTime = entry;
+    if (mStartCount) {
+        return;     // filling the driver buffers, nothing plays yet
+    }
+
+    // the driver never holds more than its buffers after a write
+    nsecs_t queueNs = seconds(1) * mDriverBufferCount * mDriverBufferSize / bytesPerSec;
+    if (started) {
+        mRunOutTime = end + queueNs;
+        return;
+    }
+    if (mRunOutTime && (entry > mRunOutTime + ms2ns(AUDIO_HW_OUT_UNDERRUN_SLACK_MS))) {
+        mUnderruns++;
+        mUnderrunMs += (uint32_t)ns2ms(entry - mRunOutTime);
+        LOGW("output underrun, about %u ms", (uint32_t)ns2ms(entry - mRunOutTime));
+    }
+    if (entry > mRunOutTime) {
+        mRunOutTime = entry;
+    }
+    mRunOutTime += seconds(1) * bytes / bytesPerSec;
+    if (mRunOutTime > end + queueNs) {
+        mRunOutTime = end + queueNs;
+    }
+}
+
+void AudioHardware::AudioStreamOutMSM72xx::appendTimingStats(String8& value)
+{
+    char buffer[64];
+
+    append_timing(value, "out_write_interval", mWriteInterval);
+    append_timing(value, "out_write_blocked", mWriteBlocked);
+    snprintf(buffer, sizeof(buffer), ",out_retries:%d,out_underruns:%u/%u",
+             mRetryCount, mUnderruns, mUnderrunMs);
+    value.append(buffer);
+}
+
+uint32_t AudioHardware::AudioStreamOutMSM72xx::latency() const
+{
+    // the driver may keep its own buffers whatever AUDIO_SET_CONFIG asked
+    uint32_t count = mDriverBufferCount ? mDriverBufferCount : mBufferCount;
+    uint32_t size = mDriverBufferSize ? mDriverBufferSize : mBufferSize;
+
+    if (mLatencyUs) {
+        return (mLatencyUs / 1000) + AUDIO_HW_OUT_LATENCY_MS;
+    }
+    // nominal until write() measured it
+    return (1000*count*(size/frameSize()))/sampleRate()+AUDIO_HW_OUT_LATENCY_MS;
+}
+
 bool AudioHardware::AudioStreamOutMSM72xx::checkStandby()
 {
     return mStandby;
@@ -1364,8 +1950,13 @@ AudioHardware::AudioStreamInMSM72xx::AudioStreamInMSM72xx() :
     mHardware(0), mFd(-1), mState(AUDIO_INPUT_CLOSED), mRetryCount(0),
     mFormat(AUDIO_HW_IN_FORMAT), mChannels(AUDIO_HW_IN_CHANNELS),
     mSampleRate(AUDIO_HW_IN_SAMPLERATE), mBufferSize(AUDIO_HW_IN_BUFFERSIZE),
-    mAcoustics((AudioSystem::audio_in_acoustics)0), mDevices(0)
+    mAcoustics((AudioSystem::audio_in_acoustics)0), mDevices(0),
+    mDriverRate(AUDIO_HW_IN_SAMPLERATE), mDriverChannels(1),
+    mDriverBufferSize(AUDIO_HW_IN_BUFFERSIZE), mDriverBufferCount(2), mResampler(NULL),
+    mRing(NULL), mRingSize(0), mRingChunk(0), mRingHead(0), mRingTail(0), mRingFill(0), mCaptureBuf(NULL),
+    mShortReads(0), mOverruns(0), mLastReadTime(0), mLastClientRead(0)
 {
+    memset(&mLevel, 0, sizeof(mLevel));
 }
 
 status_t AudioHardware::AudioStreamInMSM72xx::set(
@@ -1379,11 +1970,14 @@ status_t AudioHardware::AudioStreamInMSM72xx::set(
     if (pRate == 0) {
         return BAD_VALUE;
     }
-    uint32_t rate = hw->getInputSampleRate(*pRate);
-    if (rate != *pRate) {
-        *pRate = rate;
+    // any rate in the range of the DSP, see getInputSampleRate()
+    const uint32_t minRate = inputSamplingRates[0];
+    const uint32_t maxRate = inputSamplingRates[sizeof(inputSamplingRates)/sizeof(uint32_t) - 1];
+    if (*pRate < minRate || *pRate > maxRate) {
+        *pRate = (*pRate < minRate) ? minRate : maxRate;
         return BAD_VALUE;
     }
+    uint32_t rate = hw->getInputSampleRate(*pRate);
 
     if (pChannels == 0 || (*pChannels != AudioSystem::CHANNEL_IN_MONO &&
         *pChannels != AudioSystem::CHANNEL_IN_STEREO)) {
@@ -1418,11 +2012,16 @@ status_t AudioHardware::AudioStreamInMSM72xx::set(
 
     LOGV("set config");
     config.channel_count = AudioSystem::popCount(*pChannels);
-    config.sample_rate = *pRate;
-    config.buffer_size = bufferSize();
+    config.sample_rate = rate;
+    config.buffer_size = mDriverBufferSize;
     config.buffer_count = 2;
     config.codec_type = CODEC_TYPE_PCM;
     status = ioctl(mFd, AUDIO_SET_CONFIG, &config);
+    if (status < 0) {
+        // the ring converts mono and stereo, try the other channel count
+        config.channel_count = 3 - config.channel_count;
+        status = ioctl(mFd, AUDIO_SET_CONFIG, &config);
+    }
     if (status < 0) {
         LOGE("Cannot set config");
         if (ioctl(mFd, AUDIO_GET_CONFIG, &config) == 0) {
@@ -1450,38 +2049,81 @@ status_t AudioHardware::AudioStreamInMSM72xx::set(
     mDevices = devices;
     mFormat = AUDIO_HW_IN_FORMAT;
     mChannels = *pChannels;
-    mSampleRate = config.sample_rate;
-    mBufferSize = config.buffer_size;
+    mSampleRate = *pRate;
+    mBufferSize = hw->getInputBufferSize(mSampleRate, mFormat, AudioSystem::popCount(mChannels));
+    mDriverRate = config.sample_rate;
+    mDriverChannels = (config.channel_count == 2) ? 2 : 1;
+    mDriverBufferSize = config.buffer_size;
+    mDriverBufferCount = config.buffer_count;
+
+    // a driver buffer takes mRingChunk bytes of the ring while it is read and converted
+    delete [] mRing;
+    delete [] mCaptureBuf;
+    mRingChunk = (mDriverBufferSize / mDriverChannels) * AudioSystem::popCount(mChannels);
+    if (mRingChunk < mDriverBufferSize) {
+        mRingChunk = mDriverBufferSize;
+    }
+    mRingSize = AUDIO_HW_IN_RING_BUFFERS * mRingChunk;
+    mRing = new uint8_t[mRingSize];
+    mCaptureBuf = new int16_t[mDriverBufferSize / sizeof(int16_t)];
+    mRingHead = mRingTail = mRingFill = 0;
+    mLastReadTime = 0;
+
+    // read() reopens with the same rates after standby, keep the filter
+    // then: building it is costly and standby() cleared its history
+    if (mResampler && ((mResampler->inRate() != mDriverRate) ||
+                       (mResampler->outRate() != mSampleRate) ||
+                       (mResampler->channels() != AudioSystem::popCount(mChannels)))) {
+        delete mResampler;
+        mResampler = NULL;
+    }
+    if ((mDriverRate != mSampleRate) && !mResampler) {
+        LOGV("resampling %u to %u Hz", mDriverRate, mSampleRate);
+        mResampler = new PolyphaseResampler();
+        status = mResampler->init(mDriverRate, mSampleRate, AudioSystem::popCount(mChannels));
+        if (status != NO_ERROR) {
+            LOGE("Cannot resample %u to %u Hz", mDriverRate, mSampleRate);
+            delete mResampler;
+            mResampler = NULL;
+            if (status == BAD_VALUE) {
+                // too many phases for this pair, offer the standard rate
+                // above it: every pair of standard rates converts
+                size_t i;
+                for (i = 0; i < sizeof(inputSamplingRates)/sizeof(uint32_t) - 1; i++) {
+                    if (inputSamplingRates[i] >= *pRate) break;
+                }
+                *pRate = inputSamplingRates[i];
+            }
+            goto Error;
+        }
+    }
 
     //mHardware->setMicMute_nosync(false);
     mState = AUDIO_INPUT_OPENED;
 
-    if (!acoustic)
+    if (!acoustic_loaded)
         return NO_ERROR;
 
-    audpre_index = calculate_audpre_table_index(mSampleRate);
+    // the DSP preprocesses at its own rate
+    audpre_index = calculate_audpre_table_index(mDriverRate);
     tx_iir_index = (audpre_index * 2) + (hw->checkOutputStandby() ? 0 : 1);
     LOGD("audpre_index = %d, tx_iir_index = %d\n", audpre_index, tx_iir_index);
 
     /**
      * If audio-preprocessing failed, we should not block record.
      */
-    int (*msm72xx_set_audpre_params)(int, int);
-    msm72xx_set_audpre_params = (int (*)(int, int))::dlsym(acoustic, "msm72xx_set_audpre_params");
-    if ( msm72xx_set_audpre_params != NULL ) {
-        status = msm72xx_set_audpre_params(audpre_index, tx_iir_index);
-        if (status < 0)
-            LOGE("Cannot set audpre parameters");
+    {
+        nsecs_t start = systemTime();
+        status = acoustic_ops.set_audpre_params(audpre_index, tx_iir_index);
+        audpreTableTime.add(systemTime() - start);
     }
+    if (status < 0)
+        LOGE("Cannot set audpre parameters");
 
-    int (*msm72xx_enable_audpre)(int, int, int);
-    msm72xx_enable_audpre = (int (*)(int, int, int))::dlsym(acoustic, "msm72xx_enable_audpre");
     mAcoustics = acoustic_flags;
-    if ( msm72xx_enable_audpre != NULL ) {
-        status = msm72xx_enable_audpre((int)acoustic_flags, audpre_index, tx_iir_index);
-        if (status < 0)
-            LOGE("Cannot enable audpre");
-    }
+    status = acoustic_ops.enable_audpre((int)acoustic_flags, audpre_index, tx_iir_index);
+    if (status < 0)
+        LOGE("Cannot enable audpre");
 
     return NO_ERROR;
 
@@ -1497,6 +2139,9 @@ AudioHardware::AudioStreamInMSM72xx::~AudioStreamInMSM72xx()
 {
     LOGV("AudioStreamInMSM72xx destructor");
     standby();
+    delete mResampler;
+    delete [] mRing;
+    delete [] mCaptureBuf;
 }
 
 ssize_t AudioHardware::AudioStreamInMSM72xx::read( void* buffer, ssize_t bytes)
@@ -1504,6 +2149,12 @@ ssize_t AudioHardware::AudioStreamInMSM72xx::read( void* buffer, ssize_t bytes)
     LOGV("AudioStreamInMSM72xx::read(%p, %ld)", buffer, bytes);
     if (!mHardware) return -1;
 
+    nsecs_t entry = systemTime();
+    if (mLastClientRead) {
+        mReadInterval.add(entry - mLastClientRead);
+    }
+    mLastClientRead = entry;
+
     size_t count = bytes;
     uint8_t* p = static_cast<uint8_t*>(buffer);
 
@@ -1526,18 +2177,131 @@ ssize_t AudioHardware::AudioStreamInMSM72xx::read( void* buffer, ssize_t bytes)
         }
     }
 
-    while (count) {
-        ssize_t bytesRead = ::read(mFd, buffer, count);
-        if (bytesRead >= 0) {
-            count -= bytesRead;
-            p += bytesRead;
+    // whole frames only, the ring never splits one
+    size_t frameSize = AudioSystem::popCount(mChannels) * sizeof(int16_t);
+    count -= count % frameSize;
+    size_t done = 0;
+
+    while (done < count) {
+        size_t avail = mRingFill;
+        // the resampler takes all it is given, give it one more driver buffer once it ran dry
+        size_t want = mResampler ? frameSize : count - done;
+        if (avail < want && mRingSize - avail >= mRingChunk) {
+            ssize_t status = fillRing();
+            if (status < 0) return status;
+            continue;
+        }
+        // up to the end of the ring, the rest on the next pass
+        if (avail > mRingSize - mRingTail) {
+            avail = mRingSize - mRingTail;
+        }
+        size_t n;
+        if (mResampler) {
+            size_t inFrames = avail / frameSize;
+            size_t outFrames = (count - done) / frameSize;
+            mResampler->resample((const int16_t*)(mRing + mRingTail), &inFrames, (int16_t*)(p + done), &outFrames);
+            n = inFrames * frameSize;
+            done += outFrames * frameSize;
         } else {
-            if (errno != EAGAIN) return bytesRead;
-            mRetryCount++;
-            LOGW("EAGAIN - retrying");
+            n = (avail < count - done) ? avail : count - done;
+            memcpy(p + done, mRing + mRingTail, n);
+            done += n;
         }
+        mRingTail += n;
+        if (mRingTail == mRingSize) {
+            mRingTail = 0;
+        }
+        mRingFill -= n;
     }
-    return bytes;
+    return count;
+}
+
+// Converts frames of 16 bit PCM from inChannels to outChannels. Also works in
+// place, with out == in for downmixing and in == out + frames for upmixing.
+static void convert_channels(const int16_t* in, uint32_t inChannels,
+                             int16_t* out, uint32_t outChannels, size_t frames)
+{
+    if (inChannels == outChannels) {
+        if (out != in) {
+            memmove(out, in, frames * inChannels * sizeof(int16_t));
+        }
+    } else if (inChannels == 2) {
+        pcm_stereo_to_mono(in, out, frames);
+    } else {
+        pcm_mono_to_stereo(in, out, frames);
+    }
+}
+
+// Reads one driver buffer into the ring, converted to mChannels.
+// Called with at least mRingChunk bytes free, returns the bytes added.
+ssize_t AudioHardware::AudioStreamInMSM72xx::fillRing()
+{
+    uint32_t channels = AudioSystem::popCount(mChannels);
+    size_t inFrameSize = mDriverChannels * sizeof(int16_t);
+    size_t outFrameSize = channels * sizeof(int16_t);
+    size_t outBytes = mDriverBufferSize / inFrameSize * outFrameSize;
+    ssize_t bytesRead;
+
+    if (mRingFill == 0) {
+        // nothing buffered, start over at the front so the read goes straight in
+        mRingHead = mRingTail = 0;
+    }
+    size_t head = mRingHead;
+    size_t room = mRingSize - head;
+    if (room > mRingSize - mRingFill) {
+        room = mRingSize - mRingFill;
+    }
+    uint8_t* dst = mRing + head;
+
+    // Read in place when the driver buffer and its conversion both fit before
+    // the end, mono to stereo expands from the upper half of the space.
+    // Otherwise go through mCaptureBuf and wrap.
+    bool direct = (room >= mRingChunk);
+    int16_t* in = mCaptureBuf;
+    if (direct) {
+        in = (int16_t*)((outBytes > mDriverBufferSize) ? dst + outBytes - mDriverBufferSize : dst);
+    }
+
+    nsecs_t start = systemTime();
+    if (mLastReadTime) {
+        // the DSP drops what doesn't fit in its buffers while nobody reads
+        nsecs_t capacity = seconds(1) * mDriverBufferCount * (mDriverBufferSize / inFrameSize) / mDriverRate;
+        if (start - mLastReadTime > capacity) {
+            mOverruns++;
+            LOGW("capture overrun, %u ms without reading", (uint32_t)ns2ms(start - mLastReadTime));
+        }
+    }
+
+    for (;;) {
+        bytesRead = ::read(mFd, in, mDriverBufferSize);
+        if (bytesRead >= 0) break;
+        if (errno != EAGAIN) return bytesRead;
+        mRetryCount++;
+        LOGW("EAGAIN - retrying");
+    }
+    mLastReadTime = systemTime();
+    mReadBlocked.add(mLastReadTime - start);
+    if ((size_t)bytesRead < mDriverBufferSize) {
+        mShortReads++;
+    }
+
+    size_t frames = bytesRead / inFrameSize;
+    memset(&mLevel, 0, sizeof(mLevel));
+    if (direct) {
+        convert_channels(in, mDriverChannels, (int16_t*)dst, channels, frames);
+        pcm_meter_update(&mLevel, (int16_t*)dst, frames * channels);
+    } else {
+        size_t first = (mRingSize - head) / outFrameSize;
+        if (first > frames) first = frames;
+        convert_channels(in, mDriverChannels, (int16_t*)dst, channels, first);
+        convert_channels(in + first * mDriverChannels, mDriverChannels, (int16_t*)mRing, channels, frames - first);
+        pcm_meter_update(&mLevel, (int16_t*)dst, first * channels);
+        pcm_meter_update(&mLevel, (int16_t*)mRing, (frames - first) * channels);
+    }
+    // the ring size is no power of two, keep the head below it
+    mRingHead = (head + frames * outFrameSize) % mRingSize;
+    mRingFill += frames * outFrameSize;
+    return frames * outFrameSize;
 }
 
 status_t AudioHardware::AudioStreamInMSM72xx::standby()
@@ -1548,7 +2312,13 @@ status_t AudioHardware::AudioStreamInMSM72xx::standby()
             mFd = -1;
         }
         mState = AUDIO_INPUT_CLOSED;
+        mRingHead = mRingTail = mRingFill = 0;
+        if (mResampler) {
+            // no history from before standby in the next capture
+            mResampler->reset();
+        }
     }
+    mLastClientRead = 0;
     if (!mHardware) return -1;
     // restore output routing if necessary
     mHardware->clearCurDevice();
@@ -1578,10 +2348,38 @@ status_t AudioHardware::AudioStreamInMSM72xx::dump(int fd, const Vector<String16
     result.append(buffer);
     snprintf(buffer, SIZE, "\tmRetryCount: %d\n", mRetryCount);
     result.append(buffer);
+    snprintf(buffer, SIZE, "\tdriver sample rate: %u\n", mDriverRate);
+    result.append(buffer);
+    snprintf(buffer, SIZE, "\tdriver channels: %u\n", mDriverChannels);
+    result.append(buffer);
+    snprintf(buffer, SIZE, "\tring: %u of %u bytes, %u short reads, %u overruns\n",
+             (unsigned)mRingFill, (unsigned)mRingSize, mShortReads, mOverruns);
+    result.append(buffer);
+    snprintf(buffer, SIZE, "\tlevel: peak %.1f dBFS, rms %.1f dBFS\n",
+             pcm_meter_peak_db(&mLevel), pcm_meter_rms_db(&mLevel));
+    result.append(buffer);
+    dump_timing(result, "read interval", mReadInterval);
+    dump_timing(result, "blocked in driver", mReadBlocked);
+    if (mResampler) {
+        snprintf(buffer, SIZE, "\tresampler: %u -> %u Hz, %u phases of %u taps\n",
+                 mResampler->inRate(), mResampler->outRate(), mResampler->phases(), mResampler->taps());
+        result.append(buffer);
+    }
     ::write(fd, result.string(), result.size());
     return NO_ERROR;
 }
 
+void AudioHardware::AudioStreamInMSM72xx::appendTimingStats(String8& value)
+{
+    char buffer[64];
+
+    append_timing(value, "in_read_interval", mReadInterval);
+    append_timing(value, "in_read_blocked", mReadBlocked);
+    snprintf(buffer, sizeof(buffer), ",in_retries:%d,in_overruns:%u,in_short_reads:%u",
+             mRetryCount, mOverruns, mShortReads);
+    value.append(buffer);
+}
+
 status_t AudioHardware::AudioStreamInMSM72xx::setParameters(const String8& keyValuePairs)
 {
     AudioParameter param = AudioParameter(keyValuePairs);
@@ -1652,20 +2450,4 @@ static int get_master_volume(void)
     return volume;
 }
 
-static int get_current_stream(void) 
-{
-    bool bStreamIsActive;
-    int stream;
-    
-    for (stream = AudioSystem::VOICE_CALL; stream<AudioSystem::NUM_STREAM_TYPES; stream++) {
-        AudioSystem::isStreamActive(stream, &bStreamIsActive);
-        //LOGV("Stream %d status : %d", stream, bStreamIsActive);
-        if ( bStreamIsActive ) {
-            return stream;
-        }
-    }
-
-    return AudioSystem::DEFAULT;
-}
-
 }; // namespace android
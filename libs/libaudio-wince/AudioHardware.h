@@ -21,10 +21,15 @@
 #include <sys/types.h>
 
 #include <utils/threads.h>
+#include <utils/Timers.h>
 #include <utils/SortedVector.h>
 
 #include <hardware_legacy/AudioHardwareBase.h>
 
+#include "AudioHardwareKeys.h"
+#include "AudioResampler.h"
+#include "pcm_kernels.h"
+
 extern "C" {
 #include <linux/msm_audio.h>
 
@@ -92,13 +97,64 @@ struct msm_audio_stats {
 #define AUDIO_HW_NUM_OUT_BUF 2  // Number of buffers in audio driver for output
 // TODO: determine actual audio DSP and hardware latency
 #define AUDIO_HW_OUT_LATENCY_MS 0  // Additionnal latency introduced by audio DSP and hardware in ms
+#define AUDIO_HW_OUT_RAMP_MS 20    // Fade out and in around a route change, against pops
+#define AUDIO_HW_OUT_LATENCY_POLL 8 // Writes per AUDIO_GET_STATS latency sample
 
 #define AUDIO_HW_IN_SAMPLERATE 8000                 // Default audio input sample rate
 #define AUDIO_HW_IN_CHANNELS (AudioSystem::CHANNEL_IN_MONO) // Default audio input channel mask
 #define AUDIO_HW_IN_BUFFERSIZE 2048                 // Default audio input buffer size
 #define AUDIO_HW_IN_FORMAT (AudioSystem::PCM_16_BIT)  // Default audio input sample format
+#define AUDIO_HW_IN_BUFFER_MS 128                   // Client buffer duration, AUDIO_HW_IN_BUFFERSIZE at 8 kHz mono
+#define AUDIO_HW_IN_RING_BUFFERS 2                  // Capture ring size, in driver buffers
+
+// Output buffering profiles, see outputProfiles[] in AudioHardware.cpp.
+// Chosen with the property at boot or the parameter before the output opens.
+enum {
+    OUTPUT_PROFILE_DEFAULT = 0,
+    OUTPUT_PROFILE_LOW_LATENCY,     // small writes, for games and UI sounds
+    OUTPUT_PROFILE_DEEP_BUFFER,     // large writes, fewer wakeups for music
+    OUTPUT_PROFILE_COUNT
+};
+#define AUDIO_HW_OUTPUT_PROFILE_KEY      "output_profile"
+#define AUDIO_HW_OUTPUT_PROFILE_PROPERTY "audio.out.profile"
+
+// How long standby() keeps the configured driver open and the route applied,
+// so that sounds in quick succession resume without reopening. 0 disables.
+#define AUDIO_HW_WARM_STANDBY_PROPERTY   "audio.out.warm_standby_ms"
+#define AUDIO_HW_WARM_STANDBY_MS         3000
+
+// Rate the DSP always captures at, e.g. 8000 for voice, inputs at other
+// rates are resampled. Unset, the DSP captures at the closest supported
+// rate not below the client's.
+#define AUDIO_HW_IN_NATIVE_RATE_PROPERTY "audio.in.native_rate"
+
+// Timing statistics of the streams, routing and acoustic tables, as printed
+// by dump(), in one value of getParameters() with this key
+#define AUDIO_HW_TIMING_KEY              "timing_stats"
+// How late past the estimated end of the queued audio a write must come
+// to count as an underrun, allows for scheduling jitter
+#define AUDIO_HW_OUT_UNDERRUN_SLACK_MS   5
 // ----------------------------------------------------------------------------
 
+// Count, last, worst and total of a recurring duration. Updated by one
+// thread only, readers may see it torn.
+struct TimingStats {
+                TimingStats() : count(0), lastUs(0), maxUs(0), totalUs(0) {}
+
+    void        add(nsecs_t ns) {
+                    lastUs = (uint32_t)ns2us(ns);
+                    if (lastUs > maxUs) maxUs = lastUs;
+                    totalUs += lastUs;
+                    count++;
+                }
+    uint32_t    avgUs() const { return count ? (uint32_t)(totalUs / count) : 0; }
+
+    uint32_t    count;
+    uint32_t    lastUs;
+    uint32_t    maxUs;
+    uint64_t    totalUs;
+};
+
 
 class AudioHardware : public  AudioHardwareBase
 {
@@ -149,6 +205,7 @@ public:
 
     virtual    size_t      getInputBufferSize(uint32_t sampleRate, int format, int channelCount);
                void        clearCurDevice() { mCurSndDevice = -1; }
+               String8     timingStats();
 
 protected:
     virtual status_t    dump(int fd, const Vector<String16>& args);
@@ -162,7 +219,41 @@ private:
     uint32_t    getInputSampleRate(uint32_t sampleRate);
     bool        checkOutputStandby();
     status_t    doRouting();
+    status_t    applyRouting_l(int sndDevice, int audProcess);
+    void        doPendingRouting();
     AudioStreamInMSM72xx*   getActiveInput_l();
+    void        postOutputRouting(int route);
+    void        doOutputRouting(int route);
+    void        closeIdleOutput();
+
+    // Applies the acoustic settings for output start and standby, so that
+    // the mixer thread never waits on the routing ioctls, switches the
+    // device once the output faded out for it, and closes the output
+    // driver once warm standby expires
+    class RoutingThread : public Thread {
+    public:
+        enum {
+            ROUTE_NONE,
+            ROUTE_OUTPUT_STARTED,
+            ROUTE_OUTPUT_STOPPED
+        };
+
+                            RoutingThread(AudioHardware* hw);
+                void        post(int route);
+                void        scheduleClose(nsecs_t when);
+                void        scheduleRoute(nsecs_t when);
+                void        stop();
+
+    private:
+        virtual bool        threadLoop();
+
+                AudioHardware* mHardware;
+                Mutex       mLock;
+                Condition   mCond;
+                int         mPending;   // latest request, earlier ones are moot
+                nsecs_t     mCloseAt;   // 0 if no close is due
+                nsecs_t     mRouteAt;   // 0 if no device switch is due
+    };
 
     class AudioStreamOutMSM72xx : public AudioStreamOut {
     public:
@@ -174,28 +265,71 @@ private:
                                 uint32_t *pChannels,
                                 uint32_t *pRate);
         virtual uint32_t    sampleRate() const { return 44100; }
-        // must be 32-bit aligned - driver only seems to like 4800
-        virtual size_t      bufferSize() const { return 4800; }
+        virtual size_t      bufferSize() const { return mBufferSize; }
         virtual uint32_t    channels() const { return AudioSystem::CHANNEL_OUT_STEREO; }
         virtual int         format() const { return AudioSystem::PCM_16_BIT; }
-        virtual uint32_t    latency() const { return (1000*AUDIO_HW_NUM_OUT_BUF*(bufferSize()/frameSize()))/sampleRate()+AUDIO_HW_OUT_LATENCY_MS; }
+        virtual uint32_t    latency() const;
         virtual status_t    setVolume(float left, float right) { return INVALID_OPERATION; }
         virtual ssize_t     write(const void* buffer, size_t bytes);
         virtual status_t    standby();
         virtual status_t    dump(int fd, const Vector<String16>& args);
                 bool        checkStandby();
+                void        closeIfIdle();
+                nsecs_t     rampOut();
+                void        rampIn();
+                void        appendTimingStats(String8& value);
         virtual status_t    setParameters(const String8& keyValuePairs);
         virtual String8     getParameters(const String8& keys);
                 uint32_t    devices() { return mDevices; }
         virtual status_t    getRenderPosition(uint32_t *dspFrames);
 
     private:
+                void        updateLatency();
+                void        updateTiming(nsecs_t entry, nsecs_t end, size_t bytes, bool started);
+                void        closeDriver();
+
                 AudioHardware* mHardware;
                 int         mFd;
                 int         mStartCount;
                 int         mRetryCount;
                 bool        mStandby;
                 uint32_t    mDevices;
+                int         mProfile;
+                size_t      mBufferSize;        // bytes per write, from the profile
+                uint32_t    mBufferCount;       // driver buffers asked by the profile
+                size_t      mDriverBufferSize;  // as read back from the driver
+                uint32_t    mDriverBufferCount;
+                uint32_t    mBytesWritten;      // since the driver was opened
+                uint32_t    mOutBytesBase;      // AUDIO_GET_STATS out_bytes at open
+                uint32_t    mLatencyUs;         // smoothed queue depth, 0 until measured
+                uint32_t    mLatencyPoll;       // writes since the last latency sample
+                // mFd and mStandby against the deferred close of warm standby
+                Mutex       mFdLock;
+                nsecs_t     mStandbyTime;       // when standby() kept the driver open
+                nsecs_t     mOpenTime;          // when the driver was opened
+                uint32_t    mOpenCount;         // cold opens, up to AUDIO_START
+                uint32_t    mOpenUs;
+                uint32_t    mOpenMaxUs;
+                uint32_t    mResumeCount;       // resumes from warm standby
+                uint32_t    mResumeUs;
+                uint32_t    mResumeMaxUs;
+                // route change fades, see rampOut() and rampIn()
+                enum { RAMP_NONE, RAMP_IN, RAMP_OUT };
+                Mutex       mRampLock;          // guards mRampRequest
+                int         mRampRequest;       // set by rampOut() and rampIn(), taken by write()
+                int         mRamp;              // the fade write() applies
+                bool        mRampSilent;        // fade out played, device switch scheduled
+                uint32_t    mRampFrames;        // length of the current fade
+                uint32_t    mRampDone;
+                uint32_t    mRampDrain;         // silence still to write behind the fade out
+                int16_t*    mRampBuf;           // faded copy of the client buffer
+                size_t      mRampBufSize;
+                TimingStats mWriteInterval;     // between write() calls
+                TimingStats mWriteBlocked;      // in the driver, per write()
+                nsecs_t     mLastWriteTime;     // entry of the last write(), 0 after standby
+                nsecs_t     mRunOutTime;        // when the queued audio ends, 0 until started
+                uint32_t    mUnderruns;         // writes that came after mRunOutTime
+                uint32_t    mUnderrunMs;        // estimated silence they left
     };
 
     class AudioStreamInMSM72xx : public AudioStreamIn {
@@ -227,8 +361,11 @@ private:
         virtual unsigned int  getInputFramesLost() const { return 0; }
                 uint32_t    devices() { return mDevices; }
                 int         state() const { return mState; }
+                void        appendTimingStats(String8& value);
 
     private:
+                ssize_t     fillRing();
+
                 AudioHardware* mHardware;
                 int         mFd;
                 int         mState;
@@ -239,6 +376,27 @@ private:
                 size_t      mBufferSize;
                 AudioSystem::audio_in_acoustics mAcoustics;
                 uint32_t    mDevices;
+                uint32_t    mDriverRate;        // DSP capture rate
+                uint32_t    mDriverChannels;    // DSP channel count, may differ from mChannels
+                size_t      mDriverBufferSize;
+                uint32_t    mDriverBufferCount;
+                PolyphaseResampler* mResampler; // NULL if mSampleRate is mDriverRate
+                // Driver reads at mDriverRate converted to mChannels, served
+                // to reads of any size. Head and tail stay below mRingSize.
+                uint8_t*    mRing;
+                size_t      mRingSize;
+                size_t      mRingChunk;         // room a driver read needs
+                size_t      mRingHead;
+                size_t      mRingTail;
+                size_t      mRingFill;          // bytes from tail to head
+                int16_t*    mCaptureBuf;        // one driver buffer, when the ring can't take it whole
+                uint32_t    mShortReads;        // driver reads under mDriverBufferSize
+                uint32_t    mOverruns;          // read gaps longer than the driver buffers
+                nsecs_t     mLastReadTime;      // end of the last driver read, 0 before the first
+                struct pcm_meter mLevel;        // of the last driver read
+                TimingStats mReadInterval;      // between read() calls
+                TimingStats mReadBlocked;       // in the driver, per driver read
+                nsecs_t     mLastClientRead;    // entry of the last read(), 0 after standby
     };
 
             static const uint32_t inputSamplingRates[];
@@ -252,6 +410,13 @@ private:
             msm_snd_endpoint *mSndEndpoints;
             int mNumSndEndpoints;
             int mCurSndDevice;
+            int mOutputProfile;     // for the next output opened
+            uint32_t mWarmStandbyMs;
+            uint32_t mInputNativeRate;  // 0 to follow the client rate
+            TimingStats mRoutingTime;   // device switches
+            int mPendingSndDevice;      // -1 unless a switch waits for the output to fade out
+            int mPendingAudProcess;
+            sp<RoutingThread> mRoutingThread;
 
      friend class AudioStreamInMSM72xx;
             Mutex       mLock;
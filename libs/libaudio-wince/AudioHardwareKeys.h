@@ -0,0 +1,27 @@
+/*
+** Copyright 2008, The Android Open-Source Project
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+// setParameters() keys shared by the HAL and the policy manager, kept
+// apart so that the policy manager doesn't pull in the HAL internals
+
+#ifndef ANDROID_AUDIO_HARDWARE_KEYS_H
+#define ANDROID_AUDIO_HARDWARE_KEYS_H
+
+// Sent by AudioPolicyManager through setParameters() with the stream type
+// playing on the output, or AudioSystem::DEFAULT when none is
+#define AUDIO_HW_ACTIVE_STREAM_KEY "htc_active_stream"
+
+#endif // ANDROID_AUDIO_HARDWARE_KEYS_H
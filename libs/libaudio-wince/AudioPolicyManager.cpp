@@ -18,6 +18,7 @@
 //#define LOG_NDEBUG 0
 #include <utils/Log.h>
 #include "AudioPolicyManager.h"
+#include "AudioHardwareKeys.h"
 #include <media/mediarecorder.h>
 
 namespace android {
@@ -29,6 +30,45 @@ namespace android {
 // Common audio policy manager code is implemented in AudioPolicyManagerBase class
 // ----------------------------------------------------------------------------
 
+status_t AudioPolicyManager::startOutput(audio_io_handle_t output,
+                                         AudioSystem::stream_type stream,
+                                         int session)
+{
+    status_t status = AudioPolicyManagerBase::startOutput(output, stream, session);
+    updateActiveStream();
+    return status;
+}
+
+status_t AudioPolicyManager::stopOutput(audio_io_handle_t output,
+                                        AudioSystem::stream_type stream,
+                                        int session)
+{
+    status_t status = AudioPolicyManagerBase::stopOutput(output, stream, session);
+    updateActiveStream();
+    return status;
+}
+
+void AudioPolicyManager::updateActiveStream()
+{
+    int active = AudioSystem::DEFAULT;
+
+    for (int stream = 0; stream < AudioSystem::NUM_STREAM_TYPES; stream++) {
+        if (isStreamActive(stream)) {
+            active = stream;
+            break;
+        }
+    }
+    if (active == mActiveStream) {
+        return;
+    }
+    mActiveStream = active;
+
+    // queued by the policy service, the HAL gets it without blocking us
+    AudioParameter param;
+    param.addInt(String8(AUDIO_HW_ACTIVE_STREAM_KEY), active);
+    mpClientInterface->setParameters(0, param.toString());
+}
+
 // ---  class factory
 
 
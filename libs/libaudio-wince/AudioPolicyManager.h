@@ -30,10 +30,17 @@ class AudioPolicyManager: public AudioPolicyManagerBase
 
 public:
                 AudioPolicyManager(AudioPolicyClientInterface *clientInterface)
-                : AudioPolicyManagerBase(clientInterface) {}
+                : AudioPolicyManagerBase(clientInterface), mActiveStream(AudioSystem::DEFAULT) {}
 
         virtual ~AudioPolicyManager() {}
 
+        virtual status_t startOutput(audio_io_handle_t output,
+                                     AudioSystem::stream_type stream,
+                                     int session = 0);
+        virtual status_t stopOutput(audio_io_handle_t output,
+                                    AudioSystem::stream_type stream,
+                                    int session = 0);
+
 protected:
         // true is current platform implements a back microphone
         virtual bool hasBackMicrophone() const { return false; }
@@ -42,5 +49,12 @@ protected:
         virtual bool a2dpUsedForSonification() const { return true; }
 #endif
 
+private:
+        // tells the audio HAL which stream type is playing, so that it never
+        // has to ask AudioSystem from its write path
+        void updateActiveStream();
+
+        int mActiveStream;      // last value sent to the HAL
+
 };
 };
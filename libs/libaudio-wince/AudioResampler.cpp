@@ -0,0 +1,242 @@
+/*
+** Copyright 2008, The Android Open-Source Project
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+#include <math.h>
+
+//#define LOG_NDEBUG 0
+#define LOG_TAG "AudioResamplerMSM72XX_wince"
+#include <utils/Log.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "AudioResampler.h"
+#include "pcm_kernels.h"
+
+// Taps per phase when interpolating, scaled up by the ratio when decimating
+// so that the transition band stays the same width at the output rate
+#define RESAMPLER_TAPS          48
+// Passband edge as a fraction of the lower Nyquist frequency
+#define RESAMPLER_ROLLOFF       0.88
+// Kaiser window shape, about 75 dB of stopband attenuation
+#define RESAMPLER_KAISER_BETA   7.5
+// Largest number of phases, 1280 covers 11025 -> 32000, the most any
+// two standard rates need
+#define RESAMPLER_MAX_PHASES    1280
+// Input frames appended to the history at a time
+#define RESAMPLER_CHUNK         256
+
+namespace android {
+
+// ----------------------------------------------------------------------------
+
+static inline int16_t convolve(const int16_t* x, const int16_t* h, uint32_t n)
+{
+    int32_t acc = pcm_dot_q15(x, h, n);
+    if (acc > 32767) return 32767;
+    if (acc < -32768) return -32768;
+    return acc;
+}
+
+static uint32_t gcd(uint32_t a, uint32_t b)
+{
+    while (b) {
+        uint32_t t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+// Modified Bessel function of the first kind, order 0
+static double bessel_i0(double x)
+{
+    double sum = 1.0, term = 1.0;
+
+    for (int k = 1; k < 50; k++) {
+        term *= (x / (2 * k)) * (x / (2 * k));
+        sum += term;
+        if (term < sum * 1e-12) break;
+    }
+    return sum;
+}
+
+PolyphaseResampler::PolyphaseResampler() :
+    mInRate(0), mOutRate(0), mChannels(0), mL(1), mM(1), mTaps(0), mStride(0),
+    mCoefs(NULL), mCoefsOdd(NULL), mHistFrames(0), mFill(0), mPos(0), mPhase(0)
+{
+    mHist[0] = mHist[1] = NULL;
+}
+
+PolyphaseResampler::~PolyphaseResampler()
+{
+    release();
+}
+
+void PolyphaseResampler::release()
+{
+    free(mCoefs);
+    free(mCoefsOdd);
+    free(mHist[0]);
+    free(mHist[1]);
+    mCoefs = mCoefsOdd = NULL;
+    mHist[0] = mHist[1] = NULL;
+    mInRate = mOutRate = 0;
+}
+
+status_t PolyphaseResampler::init(uint32_t inRate, uint32_t outRate, int channels)
+{
+    release();
+    if (!inRate || !outRate || channels < 1 || channels > 2) {
+        return BAD_VALUE;
+    }
+
+    uint32_t g = gcd(inRate, outRate);
+    mL = outRate / g;
+    mM = inRate / g;
+    if (mL > RESAMPLER_MAX_PHASES) {
+        LOGE("Cannot resample %u to %u Hz, %u phases", inRate, outRate, mL);
+        return BAD_VALUE;
+    }
+
+    double taps = RESAMPLER_TAPS;
+    if (inRate > outRate) {
+        taps = taps * inRate / outRate;
+    }
+    mTaps = ((uint32_t)ceil(taps) + 3) & ~3;
+    mStride = mTaps + 2;
+
+    mCoefs = (int16_t*)calloc(mL * mStride, sizeof(int16_t));
+    mCoefsOdd = (int16_t*)calloc(mL * mStride, sizeof(int16_t));
+    double* proto = (double*)malloc(mL * mTaps * sizeof(double));
+    mHistFrames = mTaps + RESAMPLER_CHUNK;
+    mChannels = channels;
+    for (int c = 0; c < channels; c++) {
+        // 2 more for the zero taps that a window may read past mFill
+        mHist[c] = (int16_t*)calloc(mHistFrames + 2, sizeof(int16_t));
+    }
+    if (!mCoefs || !mCoefsOdd || !proto || !mHist[0] || (channels == 2 && !mHist[1])) {
+        free(proto);
+        release();
+        return NO_MEMORY;
+    }
+
+    // Kaiser windowed sinc at mL times the input rate, cut off below the lower Nyquist
+    uint32_t len = mL * mTaps;
+    double fc = 0.5 * RESAMPLER_ROLLOFF * (inRate < outRate ? inRate : outRate) / ((double)mL * inRate);
+    double center = (len - 1) / 2.0;
+    double i0beta = bessel_i0(RESAMPLER_KAISER_BETA);
+    for (uint32_t i = 0; i < len; i++) {
+        double t = i - center;
+        double r = t / center;
+        double sinc = (t == 0) ? 2 * fc : sin(2 * M_PI * fc * t) / (M_PI * t);
+        proto[i] = sinc * bessel_i0(RESAMPLER_KAISER_BETA * sqrt(1 - r * r)) / i0beta;
+    }
+
+    // Phase p filters x[n - j] with proto[j * mL + p]. Rows are stored
+    // reversed to run forward over the window, each scaled to unity DC gain.
+    for (uint32_t p = 0; p < mL; p++) {
+        double sum = 0;
+        for (uint32_t j = 0; j < mTaps; j++) {
+            sum += proto[j * mL + p];
+        }
+        for (uint32_t j = 0; j < mTaps; j++) {
+            double v = floor(proto[(mTaps - 1 - j) * mL + p] / sum * 32768 + 0.5);
+            int16_t q = v > 32767 ? 32767 : (v < -32768 ? -32768 : (int16_t)v);
+            mCoefs[p * mStride + j] = q;
+            mCoefsOdd[p * mStride + j + 1] = q;
+        }
+    }
+    free(proto);
+
+    mInRate = inRate;
+    mOutRate = outRate;
+    reset();
+    LOGV("Resampler %u -> %u Hz: %u phases of %u taps", inRate, outRate, mL, mTaps);
+    return NO_ERROR;
+}
+
+void PolyphaseResampler::reset()
+{
+    for (int c = 0; c < mChannels; c++) {
+        memset(mHist[c], 0, (mHistFrames + 2) * sizeof(int16_t));
+    }
+    // the first window ends on the first input frame
+    mFill = mTaps - 1;
+    mPos = 0;
+    mPhase = 0;
+}
+
+void PolyphaseResampler::resample(const int16_t* in, size_t* inFrames,
+                                  int16_t* out, size_t* outFrames)
+{
+    size_t inLeft = *inFrames;
+    size_t outLeft = *outFrames;
+
+    if (!mInRate) {
+        *inFrames = *outFrames = 0;
+        return;
+    }
+
+    for (;;) {
+        while (outLeft && (mPos + mTaps <= mFill)) {
+            // keep the window word aligned, the odd rows start with a zero tap
+            const int16_t* h = ((mPos & 1) ? mCoefsOdd : mCoefs) + mPhase * mStride;
+            size_t start = mPos & ~1;
+            for (int c = 0; c < mChannels; c++) {
+                *out++ = convolve(mHist[c] + start, h, mStride);
+            }
+            outLeft--;
+            mPhase += mM;
+            mPos += mPhase / mL;
+            mPhase %= mL;
+        }
+        if (!outLeft || !inLeft) {
+            break;
+        }
+
+        // drop the frames no window needs any more
+        if (mPos >= mFill) {
+            mPos -= mFill;
+            mFill = 0;
+        } else if (mPos) {
+            for (int c = 0; c < mChannels; c++) {
+                memmove(mHist[c], mHist[c] + mPos, (mFill - mPos) * sizeof(int16_t));
+            }
+            mFill -= mPos;
+            mPos = 0;
+        }
+
+        size_t n = mHistFrames - mFill;
+        if (n > inLeft) n = inLeft;
+        if (mChannels == 1) {
+            memcpy(mHist[0] + mFill, in, n * sizeof(int16_t));
+            in += n;
+        } else {
+            pcm_deinterleave(in, mHist[0] + mFill, mHist[1] + mFill, n);
+            in += 2 * n;
+        }
+        mFill += n;
+        inLeft -= n;
+    }
+
+    *inFrames -= inLeft;
+    *outFrames -= outLeft;
+}
+
+// ----------------------------------------------------------------------------
+
+}; // namespace android
@@ -0,0 +1,74 @@
+/*
+** Copyright 2008, The Android Open-Source Project
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+#ifndef ANDROID_AUDIO_RESAMPLER_WINCE_H
+#define ANDROID_AUDIO_RESAMPLER_WINCE_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <utils/Errors.h>
+
+namespace android {
+
+// ----------------------------------------------------------------------------
+
+// Polyphase FIR sample rate converter for interleaved 16 bit PCM, mono or
+// stereo. Coefficients are Q15 and every output sample is one pcm_dot_q15()
+// over an aligned window, two taps per SMLAD on ARMv6.
+class PolyphaseResampler {
+public:
+                        PolyphaseResampler();
+                        ~PolyphaseResampler();
+
+            status_t    init(uint32_t inRate, uint32_t outRate, int channels);
+            void        reset();
+
+            // Consumes at most *inFrames frames of in and produces at most
+            // *outFrames frames into out, then sets both to what was used.
+            void        resample(const int16_t* in, size_t* inFrames,
+                                 int16_t* out, size_t* outFrames);
+
+            uint32_t    inRate() const { return mInRate; }
+            uint32_t    outRate() const { return mOutRate; }
+            int         channels() const { return mChannels; }
+            uint32_t    taps() const { return mTaps; }
+            uint32_t    phases() const { return mL; }
+
+private:
+            void        release();
+
+            uint32_t    mInRate;
+            uint32_t    mOutRate;
+            int         mChannels;
+            uint32_t    mL;             // interpolation factor, one phase each
+            uint32_t    mM;             // decimation factor
+            uint32_t    mTaps;          // per phase, even
+            uint32_t    mStride;        // mTaps + 2, a row of mCoefs
+            int16_t*    mCoefs;         // mL rows for a window at an even index
+            int16_t*    mCoefsOdd;      // same, one zero tap in front
+            int16_t*    mHist[2];       // one history per channel
+            size_t      mHistFrames;    // capacity of mHist
+            size_t      mFill;          // frames in mHist
+            size_t      mPos;           // first frame of the next window
+            uint32_t    mPhase;
+};
+
+// ----------------------------------------------------------------------------
+
+}; // namespace android
+
+#endif // ANDROID_AUDIO_RESAMPLER_WINCE_H
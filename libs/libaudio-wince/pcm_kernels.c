@@ -0,0 +1,311 @@
+/*
+** Copyright 2008, The Android Open-Source Project
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+#include <math.h>
+#include <string.h>
+
+#include "pcm_kernels.h"
+
+#if (defined(__ARM_ARCH_6__) || defined(__ARM_ARCH_6J__) || defined(__ARM_ARCH_6K__) || \
+     defined(__ARM_ARCH_6Z__) || defined(__ARM_ARCH_6ZK__) || defined(__ARM_ARCH_7A__)) && \
+    (!defined(__thumb__) || defined(__thumb2__))
+#define PCM_ARMV6 1
+#endif
+
+/* Two samples per word, the first one in the low half */
+static inline uint32_t load2(const int16_t* p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline void store2(int16_t* p, uint32_t v)
+{
+    memcpy(p, &v, sizeof(v));
+}
+
+/* The ARMv6 SIMD instructions used below, and their exact C equivalents */
+#ifdef PCM_ARMV6
+
+static inline int32_t smlad(uint32_t x, uint32_t y, int32_t acc)
+{
+    int32_t out;
+    asm ("smlad %0, %1, %2, %3" : "=r" (out) : "r" (x), "r" (y), "r" (acc));
+    return out;
+}
+
+static inline int32_t smuad(uint32_t x, uint32_t y)
+{
+    int32_t out;
+    asm ("smuad %0, %1, %2" : "=r" (out) : "r" (x), "r" (y));
+    return out;
+}
+
+static inline uint32_t qadd16(uint32_t x, uint32_t y)
+{
+    uint32_t out;
+    asm ("qadd16 %0, %1, %2" : "=r" (out) : "r" (x), "r" (y));
+    return out;
+}
+
+/* low half of x, low half of y on top */
+static inline uint32_t pkhbt(uint32_t x, uint32_t y)
+{
+    uint32_t out;
+    asm ("pkhbt %0, %1, %2, lsl #16" : "=r" (out) : "r" (x), "r" (y));
+    return out;
+}
+
+/* high half of x, high half of y below */
+static inline uint32_t pkhtb(uint32_t x, uint32_t y)
+{
+    uint32_t out;
+    asm ("pkhtb %0, %1, %2, asr #16" : "=r" (out) : "r" (x), "r" (y));
+    return out;
+}
+
+/* (g * low half of x) >> 16 */
+static inline int32_t smulwb(int32_t g, uint32_t x)
+{
+    int32_t out;
+    asm ("smulwb %0, %1, %2" : "=r" (out) : "r" (g), "r" (x));
+    return out;
+}
+
+/* (g * high half of x) >> 16 */
+static inline int32_t smulwt(int32_t g, uint32_t x)
+{
+    int32_t out;
+    asm ("smulwt %0, %1, %2" : "=r" (out) : "r" (g), "r" (x));
+    return out;
+}
+
+#else
+
+static inline int32_t smlad(uint32_t x, uint32_t y, int32_t acc)
+{
+    return acc + (int16_t)x * (int16_t)y + (int16_t)(x >> 16) * (int16_t)(y >> 16);
+}
+
+static inline int32_t smuad(uint32_t x, uint32_t y)
+{
+    return (int32_t)((uint32_t)((int16_t)x * (int16_t)y) +
+                     (uint32_t)((int16_t)(x >> 16) * (int16_t)(y >> 16)));
+}
+
+static inline int16_t sat16(int32_t v)
+{
+    if (v > 32767) return 32767;
+    if (v < -32768) return -32768;
+    return v;
+}
+
+static inline uint32_t qadd16(uint32_t x, uint32_t y)
+{
+    uint16_t lo = sat16((int16_t)x + (int16_t)y);
+    uint16_t hi = sat16((int16_t)(x >> 16) + (int16_t)(y >> 16));
+    return lo | ((uint32_t)hi << 16);
+}
+
+static inline uint32_t pkhbt(uint32_t x, uint32_t y)
+{
+    return (x & 0xffff) | (y << 16);
+}
+
+static inline uint32_t pkhtb(uint32_t x, uint32_t y)
+{
+    return (x & 0xffff0000) | (y >> 16);
+}
+
+static inline int32_t smulwb(int32_t g, uint32_t x)
+{
+    return (int32_t)(((int64_t)g * (int16_t)x) >> 16);
+}
+
+static inline int32_t smulwt(int32_t g, uint32_t x)
+{
+    return (int32_t)(((int64_t)g * (int16_t)(x >> 16)) >> 16);
+}
+
+#endif
+
+void pcm_apply_gain(int16_t* buf, size_t samples, uint32_t gain)
+{
+    size_t i;
+
+    if (gain == PCM_UNITY_GAIN) {
+        return;
+    }
+    for (i = 0; i + 1 < samples; i += 2) {
+        uint32_t x = load2(buf + i);
+        store2(buf + i, pkhbt(smulwb(gain, x), smulwt(gain, x)));
+    }
+    if (i < samples) {
+        buf[i] = smulwb(gain, (uint16_t)buf[i]);
+    }
+}
+
+void pcm_gain_ramp(const int16_t* in, int16_t* out, size_t frames, int channels,
+                   uint32_t from, uint32_t to)
+{
+    /* Q24 so that the step keeps some precision over long ramps */
+    int32_t g = (int32_t)from << 8;
+    int32_t step;
+    size_t i;
+
+    if (!frames) {
+        return;
+    }
+    step = (((int32_t)to - (int32_t)from) << 8) / (int32_t)frames;
+    if (channels == 2) {
+        for (i = 0; i < frames; i++, g += step) {
+            uint32_t x = load2(in + 2 * i);
+            store2(out + 2 * i, pkhbt(smulwb(g >> 8, x), smulwt(g >> 8, x)));
+        }
+    } else {
+        for (i = 0; i < frames; i++, g += step) {
+            out[i] = smulwb(g >> 8, (uint16_t)in[i]);
+        }
+    }
+}
+
+void pcm_stereo_to_mono(const int16_t* in, int16_t* out, size_t frames)
+{
+    size_t i;
+
+    /* L + R of a frame in one SMUAD */
+    for (i = 0; i + 1 < frames; i += 2) {
+        int32_t a = smuad(load2(in + 2 * i), 0x00010001) >> 1;
+        int32_t b = smuad(load2(in + 2 * i + 2), 0x00010001) >> 1;
+        store2(out + i, pkhbt(a, b));
+    }
+    if (i < frames) {
+        out[i] = smuad(load2(in + 2 * i), 0x00010001) >> 1;
+    }
+}
+
+void pcm_mono_to_stereo(const int16_t* in, int16_t* out, size_t frames)
+{
+    size_t i;
+
+    /* Forward, so that in place the stores stay behind the loads */
+    for (i = 0; i + 1 < frames; i += 2) {
+        uint32_t x = load2(in + i);
+        store2(out + 2 * i, pkhbt(x, x));
+        store2(out + 2 * i + 2, pkhtb(x, x));
+    }
+    if (i < frames) {
+        int16_t s = in[i];
+        out[2 * i] = s;
+        out[2 * i + 1] = s;
+    }
+}
+
+void pcm_deinterleave(const int16_t* in, int16_t* left, int16_t* right, size_t frames)
+{
+    size_t i;
+
+    for (i = 0; i + 1 < frames; i += 2) {
+        uint32_t a = load2(in + 2 * i);
+        uint32_t b = load2(in + 2 * i + 2);
+        store2(left + i, pkhbt(a, b));
+        store2(right + i, pkhtb(b, a));
+    }
+    if (i < frames) {
+        left[i] = in[2 * i];
+        right[i] = in[2 * i + 1];
+    }
+}
+
+void pcm_interleave(const int16_t* left, const int16_t* right, int16_t* out, size_t frames)
+{
+    size_t i;
+
+    for (i = 0; i + 1 < frames; i += 2) {
+        uint32_t l = load2(left + i);
+        uint32_t r = load2(right + i);
+        store2(out + 2 * i, pkhbt(l, r));
+        store2(out + 2 * i + 2, pkhtb(r, l));
+    }
+    if (i < frames) {
+        out[2 * i] = left[i];
+        out[2 * i + 1] = right[i];
+    }
+}
+
+void pcm_mix_sat(int16_t* dst, const int16_t* src, size_t samples)
+{
+    size_t i;
+
+    for (i = 0; i + 1 < samples; i += 2) {
+        store2(dst + i, qadd16(load2(dst + i), load2(src + i)));
+    }
+    if (i < samples) {
+        int32_t v = dst[i] + src[i];
+        dst[i] = (v > 32767) ? 32767 : ((v < -32768) ? -32768 : v);
+    }
+}
+
+void pcm_meter_update(struct pcm_meter* meter, const int16_t* buf, size_t samples)
+{
+    uint32_t peak = meter->peak;
+    uint64_t sum = 0;
+    size_t i;
+
+    for (i = 0; i + 1 < samples; i += 2) {
+        uint32_t x = load2(buf + i);
+        /* at most 2^31, fits unsigned */
+        sum += (uint32_t)smuad(x, x);
+    }
+    if (i < samples) {
+        sum += (uint32_t)(buf[i] * buf[i]);
+    }
+    for (i = 0; i < samples; i++) {
+        uint32_t a = (buf[i] < 0) ? -buf[i] : buf[i];
+        if (a > peak) peak = a;
+    }
+    meter->peak = peak;
+    meter->sum_squares += sum;
+    meter->samples += samples;
+}
+
+float pcm_meter_peak_db(const struct pcm_meter* meter)
+{
+    if (!meter->peak) {
+        return -96.0f;
+    }
+    return 20.0f * log10f(meter->peak / 32768.0f);
+}
+
+float pcm_meter_rms_db(const struct pcm_meter* meter)
+{
+    if (!meter->samples || !meter->sum_squares) {
+        return -96.0f;
+    }
+    return 10.0f * log10f((float)meter->sum_squares / meter->samples / (32768.0f * 32768.0f));
+}
+
+int32_t pcm_dot_q15(const int16_t* x, const int16_t* h, size_t n)
+{
+    int32_t acc = 1 << 14;
+    size_t i;
+
+    for (i = 0; i < n; i += 2) {
+        acc = smlad(load2(x + i), load2(h + i), acc);
+    }
+    return acc >> 15;
+}
@@ -0,0 +1,79 @@
+/*
+** Copyright 2008, The Android Open-Source Project
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+#ifndef ANDROID_AUDIO_PCM_KERNELS_WINCE_H
+#define ANDROID_AUDIO_PCM_KERNELS_WINCE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if __cplusplus
+extern "C" {
+#endif
+
+/* Fixed-point kernels on 16 bit PCM. Built with ARMv6 SIMD instructions
+ * when available, in portable C otherwise; both give identical results.
+ * Buffers are expected 4 byte aligned, odd sample counts are handled.
+ */
+
+/* Unity gain, gains are Q16 in [0, PCM_UNITY_GAIN] */
+#define PCM_UNITY_GAIN  0x10000
+
+/* Multiplies samples of buf by gain */
+void pcm_apply_gain(int16_t* buf, size_t samples, uint32_t gain);
+
+/* Copies frames of in to out with a gain going linearly from
+ * from to to over them. in may be out.
+ */
+void pcm_gain_ramp(const int16_t* in, int16_t* out, size_t frames, int channels,
+                   uint32_t from, uint32_t to);
+
+/* Averages the channels of stereo frames. in may be out. */
+void pcm_stereo_to_mono(const int16_t* in, int16_t* out, size_t frames);
+
+/* Duplicates mono frames to both channels. Works in place when
+ * in is out + frames, i.e. the mono data is in the upper half of out.
+ */
+void pcm_mono_to_stereo(const int16_t* in, int16_t* out, size_t frames);
+
+/* Splits stereo frames into two planes, and back */
+void pcm_deinterleave(const int16_t* in, int16_t* left, int16_t* right, size_t frames);
+void pcm_interleave(const int16_t* left, const int16_t* right, int16_t* out, size_t frames);
+
+/* dst += src with saturation */
+void pcm_mix_sat(int16_t* dst, const int16_t* src, size_t samples);
+
+struct pcm_meter {
+    uint32_t peak;          /* largest magnitude, 32768 at most */
+    uint64_t sum_squares;
+    uint32_t samples;
+};
+
+/* Accumulates the level of samples into meter */
+void pcm_meter_update(struct pcm_meter* meter, const int16_t* buf, size_t samples);
+
+/* Level of meter in dBFS, -96 for silence */
+float pcm_meter_peak_db(const struct pcm_meter* meter);
+float pcm_meter_rms_db(const struct pcm_meter* meter);
+
+/* Q15 dot product, rounded but not saturated. n even, x and h 4 byte aligned */
+int32_t pcm_dot_q15(const int16_t* x, const int16_t* h, size_t n);
+
+#if __cplusplus
+} // extern "C"
+#endif
+
+#endif /* ANDROID_AUDIO_PCM_KERNELS_WINCE_H */
@@ -0,0 +1,205 @@
+/*
+** Copyright 2008, The Android Open-Source Project
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+// Opens the output with each profile against each fake driver behaviour,
+// and checks the buffers asked for, that no write blocks before
+// AUDIO_START, that standby drops a queue that never started and that the
+// measured latency stays within what the driver can hold. Then changes the route the way AudioFlinger does, from the
+// thread that writes, and checks that the device switches on silence.
+// Exits non zero if a check failed.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <utils/String8.h>
+#include <utils/Timers.h>
+
+#include "AudioHardware.h"
+#include "audiodev.h"
+#include "fake_pcm.h"
+
+using namespace android;
+
+#define TEST_WRITES 64
+#define TEST_ROUTE_WRITES 100   // at most, before the device must have switched
+#define TEST_LEVEL 0x1000       // of the tone written around a route change
+
+static const struct {
+    const char* name;
+    size_t bufferSize;
+    uint32_t bufferCount;
+} kProfiles[] = {
+    { "default",      4800, 2 },
+    { "low_latency",  1920, 4 },
+    { "deep_buffer", 19200, 2 },
+};
+
+static int sFailures;
+
+static void check(bool ok, const char* profile, int mode, const char* what)
+{
+    if (!ok) {
+        printf("FAIL %s, %s: %s\n", profile, fake_pcm_mode_name(mode), what);
+        sFailures++;
+    }
+}
+
+static void testProfile(int p, int mode)
+{
+    const char* name = kProfiles[p].name;
+    char keyValue[64];
+    status_t status;
+
+    fake_pcm_reset(mode);
+
+    AudioHardware* hw = new AudioHardware();
+    snprintf(keyValue, sizeof(keyValue), "%s=%s", AUDIO_HW_OUTPUT_PROFILE_KEY, name);
+    hw->setParameters(String8(keyValue));
+
+    AudioStreamOut* out = hw->openOutputStream(AudioSystem::DEVICE_OUT_SPEAKER, 0, 0, 0, &status);
+    check(out != NULL && status == NO_ERROR, name, mode, "openOutputStream");
+    if (out == NULL) {
+        delete hw;
+        return;
+    }
+    check(out->bufferSize() == kProfiles[p].bufferSize, name, mode, "bufferSize");
+
+    size_t bytes = out->bufferSize();
+    char* buffer = (char*)calloc(1, bytes);
+
+    // a write shorter than the driver queue does not start it, standby
+    // must not keep it queued to play stale at the next start
+    out->write(buffer, bytes);
+    out->standby();
+    uint32_t held = (mode == FAKE_PCM_OWN_BUFFERS) ? 2 * 4800
+                  : fakePcmOut.configCount * fakePcmOut.configSize;
+    out->write(buffer, bytes);
+    check((held <= bytes) || (fakePcmOut.opens == 2), name, mode, "unstarted queue kept over standby");
+
+    bool writesOk = true;
+    for (int i = 0; i < TEST_WRITES; i++) {
+        writesOk &= (out->write(buffer, bytes) == (ssize_t)bytes);
+    }
+    check(writesOk, name, mode, "write");
+    check(!fakePcmOut.blockedBeforeStart, name, mode, "write blocked before AUDIO_START");
+
+    bool refused = (mode == FAKE_PCM_DEFAULT_ONLY) && (p != 0);
+    check(fakePcmOut.configSize == kProfiles[refused ? 0 : p].bufferSize &&
+          fakePcmOut.configCount == kProfiles[refused ? 0 : p].bufferCount,
+          name, mode, "AUDIO_SET_CONFIG buffers");
+
+    // the driver holds its queue, plus the write that just went in
+    uint32_t bytesPerSec = out->frameSize() * out->sampleRate();
+    uint32_t bound = (uint32_t)((held + bytes) * 1000 / bytesPerSec);
+    uint32_t nominal = (uint32_t)(held * 1000 / bytesPerSec) + AUDIO_HW_OUT_LATENCY_MS;
+    uint32_t measured = out->latency();
+    check(measured > 0 && measured <= bound, name, mode, "measured latency");
+
+    out->standby();
+    check(out->latency() == nominal, name, mode, "latency not back to nominal after standby");
+
+    printf("%-12s %-14s bufferSize %5zu, buffers %5u x %u, latency %3u ms nominal, %3u ms measured\n",
+           name, fake_pcm_mode_name(mode), out->bufferSize(), fakePcmOut.configSize,
+           fakePcmOut.configCount, nominal, measured);
+
+    hw->closeOutputStream(out);
+    delete hw;
+    free(buffer);
+}
+
+// AudioFlinger calls setParameters() and write() from its mixer thread,
+// so does this: a route change that waited there for the fade out would
+// wait for itself.
+static void testRouteChange(int p, int mode)
+{
+    const char* name = kProfiles[p].name;
+    char keyValue[64];
+    status_t status;
+    int i;
+
+    fake_pcm_reset(mode);
+    // or the switch repeats the last case's and is skipped
+    audiodev_close_all();
+
+    AudioHardware* hw = new AudioHardware();
+    snprintf(keyValue, sizeof(keyValue), "%s=%s", AUDIO_HW_OUTPUT_PROFILE_KEY, name);
+    hw->setParameters(String8(keyValue));
+
+    AudioStreamOut* out = hw->openOutputStream(AudioSystem::DEVICE_OUT_SPEAKER, 0, 0, 0, &status);
+    if (out == NULL) {
+        check(false, name, mode, "openOutputStream");
+        delete hw;
+        return;
+    }
+
+    size_t bytes = out->bufferSize();
+    int16_t* buffer = (int16_t*)malloc(bytes);
+    for (i = 0; i < (int)(bytes / sizeof(int16_t)); i++) {
+        buffer[i] = TEST_LEVEL;
+    }
+    useconds_t writeUs = (useconds_t)(1000000ULL * bytes / (out->frameSize() * out->sampleRate()));
+
+    // started, with the tone all through the driver queue
+    for (i = 0; i < 8; i++) {
+        out->write(buffer, bytes);
+    }
+    int routes = fakePcmOut.routes;
+
+    AudioParameter param;
+    param.addInt(String8(AudioParameter::keyRouting), AudioSystem::DEVICE_OUT_WIRED_HEADSET);
+    nsecs_t start = systemTime();
+    out->setParameters(param.toString());
+    nsecs_t elapsed = systemTime() - start;
+    check(elapsed < ms2ns(AUDIO_HW_OUT_RAMP_MS), name, mode, "route change waited for the writer");
+    check(fakePcmOut.routes == routes, name, mode, "switched before the fade out");
+
+    // the writes fade out, then push silence through the queue
+    for (i = 0; (i < TEST_ROUTE_WRITES) && (fakePcmOut.routes == routes); i++) {
+        out->write(buffer, bytes);
+        usleep(writeUs);
+    }
+    check(fakePcmOut.routes != routes, name, mode, "device never switched");
+    check(!fakePcmOut.routeAudible, name, mode, "switched with audio still queued");
+    int silentWrites = i;
+
+    for (i = 0; i < 8; i++) {
+        out->write(buffer, bytes);
+    }
+    check(fakePcmOut.lastWriteAudible, name, mode, "no fade in after the switch");
+
+    printf("%-12s %-14s route change returned in %4u us, switched after %d writes\n",
+           name, fake_pcm_mode_name(mode), (uint32_t)ns2us(elapsed), silentWrites);
+
+    hw->closeOutputStream(out);
+    delete hw;
+    free(buffer);
+}
+
+int main()
+{
+    for (int mode = 0; mode < FAKE_PCM_NUM_MODES; mode++) {
+        for (size_t p = 0; p < sizeof(kProfiles) / sizeof(kProfiles[0]); p++) {
+            testProfile(p, mode);
+        }
+    }
+    for (size_t p = 0; p < sizeof(kProfiles) / sizeof(kProfiles[0]); p++) {
+        testRouteChange(p, FAKE_PCM_HONORS_CONFIG);
+    }
+    printf("%s\n", sFailures ? "FAILED" : "PASSED");
+    return sFailures ? 1 : 0;
+}
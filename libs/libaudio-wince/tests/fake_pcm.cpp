@@ -0,0 +1,247 @@
+/*
+** Copyright 2008, The Android Open-Source Project
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+#include "AudioHardware.h"
+#include "fake_pcm.h"
+
+using namespace android;
+
+#define FAKE_PCM_MAX_BUFFERS    8
+#define FAKE_PCM_OWN_SIZE       4800
+#define FAKE_PCM_OWN_COUNT      2
+
+extern "C" {
+int __real_open(const char* path, int flags, ...);
+int __real_ioctl(int fd, unsigned long request, ...);
+ssize_t __real_write(int fd, const void* buf, size_t count);
+int __real_close(int fd);
+}
+
+struct fake_pcm_out fakePcmOut;
+
+static int sFd = -1;                // stands for /dev/msm_pcm_out
+static int sSndFd = -1;             // stands for /dev/msm_snd
+static bool sStarted;
+static uint32_t sUsed[FAKE_PCM_MAX_BUFFERS];
+static bool sAudible[FAKE_PCM_MAX_BUFFERS];    // has a sample other than 0
+static uint32_t sHead;
+static uint32_t sTail;
+static uint32_t sOutBytes;
+// the routing thread switches devices while the test writes
+static pthread_mutex_t sLock = PTHREAD_MUTEX_INITIALIZER;
+
+const char* fake_pcm_mode_name(int mode)
+{
+    static const char* names[FAKE_PCM_NUM_MODES] = {
+        "own buffers", "honors config", "default only"
+    };
+    return (mode >= 0 && mode < FAKE_PCM_NUM_MODES) ? names[mode] : "?";
+}
+
+void fake_pcm_reset(int mode)
+{
+    pthread_mutex_lock(&sLock);
+    memset(&fakePcmOut, 0, sizeof(fakePcmOut));
+    fakePcmOut.mode = mode;
+    pthread_mutex_unlock(&sLock);
+}
+
+static uint32_t bufferSize()
+{
+    return (fakePcmOut.mode == FAKE_PCM_OWN_BUFFERS) ? FAKE_PCM_OWN_SIZE : fakePcmOut.configSize;
+}
+
+static uint32_t bufferCount()
+{
+    return (fakePcmOut.mode == FAKE_PCM_OWN_BUFFERS) ? FAKE_PCM_OWN_COUNT : fakePcmOut.configCount;
+}
+
+extern "C" int __wrap_open(const char* path, int flags, ...)
+{
+    va_list ap;
+    int mode;
+
+    va_start(ap, flags);
+    mode = va_arg(ap, int);
+    va_end(ap);
+
+    if (!strcmp(path, "/dev/msm_pcm_out")) {
+        if (sFd >= 0) {
+            errno = EBUSY;
+            return -1;
+        }
+        // a real descriptor, so the number cannot clash with another file
+        sFd = __real_open("/dev/null", O_RDWR);
+        if (sFd < 0) {
+            return -1;
+        }
+        fakePcmOut.opens++;
+        fakePcmOut.configSize = FAKE_PCM_OWN_SIZE;
+        fakePcmOut.configCount = FAKE_PCM_OWN_COUNT;
+        sStarted = false;
+        memset(sUsed, 0, sizeof(sUsed));
+        memset(sAudible, 0, sizeof(sAudible));
+        sHead = sTail = 0;
+        sOutBytes = 0;
+        return sFd;
+    }
+    if (!strcmp(path, "/dev/msm_snd")) {
+        if (sSndFd < 0) {
+            sSndFd = __real_open("/dev/null", O_RDWR);
+        }
+        return sSndFd;
+    }
+    if (!strncmp(path, "/dev/", 5)) {
+        errno = ENOENT;
+        return -1;
+    }
+    return __real_open(path, flags, mode);
+}
+
+extern "C" int __wrap_ioctl(int fd, unsigned long request, ...)
+{
+    va_list ap;
+    void* arg;
+
+    va_start(ap, request);
+    arg = va_arg(ap, void*);
+    va_end(ap);
+
+    if (fd >= 0 && fd == sSndFd) {
+        if (request == SND_SET_DEVICE) {
+            // the DSP holds the buffer it took last, the rest is queued
+            pthread_mutex_lock(&sLock);
+            bool audible = false;
+            for (uint32_t i = 0; i < FAKE_PCM_MAX_BUFFERS; i++) {
+                audible |= sAudible[i];
+            }
+            fakePcmOut.routes++;
+            fakePcmOut.routeAudible = audible;
+            pthread_mutex_unlock(&sLock);
+        }
+        return 0;
+    }
+    if (fd < 0 || fd != sFd) {
+        return __real_ioctl(fd, request, arg);
+    }
+
+    switch (request) {
+    case AUDIO_GET_CONFIG: {
+        struct msm_audio_config* config = (struct msm_audio_config*)arg;
+        memset(config, 0, sizeof(*config));
+        config->buffer_size = bufferSize();
+        config->buffer_count = bufferCount();
+        config->channel_count = 2;
+        config->sample_rate = 44100;
+        return 0;
+    }
+    case AUDIO_SET_CONFIG: {
+        struct msm_audio_config* config = (struct msm_audio_config*)arg;
+        if (sStarted || !config->buffer_size || !config->buffer_count ||
+            (config->buffer_count > FAKE_PCM_MAX_BUFFERS)) {
+            errno = EINVAL;
+            return -1;
+        }
+        if ((fakePcmOut.mode == FAKE_PCM_DEFAULT_ONLY) &&
+            ((config->buffer_size != FAKE_PCM_OWN_SIZE) ||
+             (config->buffer_count != FAKE_PCM_OWN_COUNT))) {
+            errno = EINVAL;
+            return -1;
+        }
+        fakePcmOut.configSize = config->buffer_size;
+        fakePcmOut.configCount = config->buffer_count;
+        return 0;
+    }
+    case AUDIO_START:
+        sStarted = true;
+        return 0;
+    case AUDIO_GET_STATS: {
+        struct msm_audio_stats* stats = (struct msm_audio_stats*)arg;
+        memset(stats, 0, sizeof(*stats));
+        stats->out_bytes = sOutBytes;
+        return 0;
+    }
+    default:
+        return 0;
+    }
+}
+
+// Queues one driver buffer per chunk. Once started, the DSP plays the
+// oldest buffer whenever the queue is full, as a blocking write would
+// wait for it to.
+extern "C" ssize_t __wrap_write(int fd, const void* buf, size_t count)
+{
+    size_t done = 0;
+
+    if (fd < 0 || fd != sFd) {
+        return __real_write(fd, buf, count);
+    }
+
+    pthread_mutex_lock(&sLock);
+    while (done < count) {
+        if (sUsed[sHead]) {
+            if (!sStarted) {
+                // the real driver never returns here
+                fprintf(stderr, "fake_pcm: write blocks before AUDIO_START\n");
+                fakePcmOut.blockedBeforeStart = true;
+                pthread_mutex_unlock(&sLock);
+                errno = EIO;
+                return done ? (ssize_t)done : -1;
+            }
+            sOutBytes += sUsed[sTail];
+            sUsed[sTail] = 0;
+            sAudible[sTail] = false;
+            sTail = (sTail + 1) % bufferCount();
+            continue;
+        }
+        size_t chunk = count - done;
+        if (chunk > bufferSize()) {
+            chunk = bufferSize();
+        }
+        const int16_t* samples = (const int16_t*)((const char*)buf + done);
+        bool audible = false;
+        for (size_t i = 0; i < chunk / sizeof(int16_t); i++) {
+            audible |= (samples[i] != 0);
+        }
+        sUsed[sHead] = chunk;
+        sAudible[sHead] = audible;
+        sHead = (sHead + 1) % bufferCount();
+        done += chunk;
+        fakePcmOut.lastWriteAudible = audible;
+    }
+    pthread_mutex_unlock(&sLock);
+    return done;
+}
+
+extern "C" int __wrap_close(int fd)
+{
+    if (fd >= 0 && fd == sFd) {
+        sFd = -1;
+    }
+    if (fd >= 0 && fd == sSndFd) {
+        sSndFd = -1;
+    }
+    return __real_close(fd);
+}
@@ -0,0 +1,53 @@
+/*
+** Copyright 2008, The Android Open-Source Project
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+#ifndef ANDROID_AUDIO_FAKE_PCM_H
+#define ANDROID_AUDIO_FAKE_PCM_H
+
+#include <stdint.h>
+
+// A model of /dev/msm_pcm_out for the HAL tests. The test is linked with
+// -Wl,--wrap for open, ioctl, write and close, so the HAL built into it
+// talks to the model instead of the kernel. /dev/msm_snd records the
+// device switches. Every other /dev node fails to open, which keeps the
+// test off the real audio hardware.
+
+enum {
+    FAKE_PCM_OWN_BUFFERS,       // keeps 2 x 4800 whatever AUDIO_SET_CONFIG asks
+    FAKE_PCM_HONORS_CONFIG,     // uses the buffers AUDIO_SET_CONFIG asks for
+    FAKE_PCM_DEFAULT_ONLY,      // refuses anything but 2 x 4800
+    FAKE_PCM_NUM_MODES
+};
+
+struct fake_pcm_out {
+    int mode;                   // FAKE_PCM_*, set before the output opens
+    int opens;                  // opens of /dev/msm_pcm_out
+    uint32_t configSize;        // last accepted AUDIO_SET_CONFIG
+    uint32_t configCount;
+    bool blockedBeforeStart;    // a write would have blocked forever
+    int routes;                 // SND_SET_DEVICE calls
+    bool routeAudible;          // audio was still queued at the last one
+    bool lastWriteAudible;      // the last write had a sample other than 0
+};
+
+extern struct fake_pcm_out fakePcmOut;
+
+extern const char* fake_pcm_mode_name(int mode);
+
+// Forgets what was observed, and sets the driver behaviour
+extern void fake_pcm_reset(int mode);
+
+#endif // ANDROID_AUDIO_FAKE_PCM_H
@@ -0,0 +1,254 @@
+/*
+** Copyright 2008, The Android Open-Source Project
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+/* Checks every kernel of pcm_kernels.c against a plain reference loop on
+ * random data, odd lengths included, then times both on a long buffer.
+ * Built for the host it covers the portable C path, built for the target
+ * the ARMv6 one. Exits non zero if a kernel differs from its reference.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "pcm_kernels.h"
+
+#define TEST_ITERATIONS     2000
+#define TEST_MAX_FRAMES     64
+#define BENCH_SAMPLES       4096
+#define BENCH_ROUNDS        2000
+
+static int sFailures;
+
+static int16_t random16(void)
+{
+    return (int16_t)(rand() & 0xffff);
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void check(int ok, const char* kernel, size_t n)
+{
+    if (!ok) {
+        printf("FAIL %s, %u samples\n", kernel, (unsigned)n);
+        sFailures++;
+    }
+}
+
+/* The references, one sample at a time */
+
+static void ref_apply_gain(int16_t* buf, size_t samples, uint32_t gain)
+{
+    size_t i;
+    for (i = 0; i < samples; i++) {
+        buf[i] = (int16_t)(((int64_t)gain * buf[i]) >> 16);
+    }
+}
+
+static void ref_gain_ramp(const int16_t* in, int16_t* out, size_t frames, int channels,
+                          uint32_t from, uint32_t to)
+{
+    int32_t step = frames ? (((int32_t)to - (int32_t)from) << 8) / (int32_t)frames : 0;
+    size_t i;
+    int c;
+    for (i = 0; i < frames; i++) {
+        int32_t g = (((int32_t)from << 8) + (int32_t)i * step) >> 8;
+        for (c = 0; c < channels; c++) {
+            out[i * channels + c] = (int16_t)(((int64_t)g * in[i * channels + c]) >> 16);
+        }
+    }
+}
+
+static void ref_stereo_to_mono(const int16_t* in, int16_t* out, size_t frames)
+{
+    size_t i;
+    for (i = 0; i < frames; i++) {
+        out[i] = (int16_t)((in[2 * i] + in[2 * i + 1]) >> 1);
+    }
+}
+
+static void ref_mix_sat(int16_t* dst, const int16_t* src, size_t samples)
+{
+    size_t i;
+    for (i = 0; i < samples; i++) {
+        int32_t v = dst[i] + src[i];
+        dst[i] = (int16_t)(v > 32767 ? 32767 : (v < -32768 ? -32768 : v));
+    }
+}
+
+static int32_t ref_dot_q15(const int16_t* x, const int16_t* h, size_t n)
+{
+    int64_t acc = 1 << 14;
+    size_t i;
+    for (i = 0; i < n; i++) {
+        acc += x[i] * h[i];
+    }
+    return (int32_t)(acc >> 15);
+}
+
+static void ref_meter_update(struct pcm_meter* meter, const int16_t* buf, size_t samples)
+{
+    size_t i;
+    for (i = 0; i < samples; i++) {
+        uint32_t a = (uint32_t)abs(buf[i]);
+        if (a > meter->peak) meter->peak = a;
+        meter->sum_squares += (int64_t)buf[i] * buf[i];
+    }
+    meter->samples += samples;
+}
+
+static void testKernels(void)
+{
+    /* int32_t backing keeps the buffers 4 byte aligned */
+    int32_t aBuf[TEST_MAX_FRAMES], bBuf[TEST_MAX_FRAMES];
+    int32_t outBuf[TEST_MAX_FRAMES], refBuf[TEST_MAX_FRAMES];
+    int32_t leftBuf[TEST_MAX_FRAMES / 2], rightBuf[TEST_MAX_FRAMES / 2];
+    int16_t* a = (int16_t*)aBuf;
+    int16_t* b = (int16_t*)bBuf;
+    int16_t* out = (int16_t*)outBuf;
+    int16_t* ref = (int16_t*)refBuf;
+    int16_t* left = (int16_t*)leftBuf;
+    int16_t* right = (int16_t*)rightBuf;
+    int it;
+
+    for (it = 0; it < TEST_ITERATIONS; it++) {
+        size_t n = 1 + rand() % (TEST_MAX_FRAMES - 1);     /* frames, stereo fits */
+        size_t even = n & ~1;
+        uint32_t gain = rand() % (PCM_UNITY_GAIN + 1);
+        uint32_t to = rand() % (PCM_UNITY_GAIN + 1);
+        struct pcm_meter meter, refMeter;
+        size_t i;
+
+        for (i = 0; i < 2 * n; i++) {
+            a[i] = random16();
+            b[i] = random16();
+        }
+
+        memcpy(out, a, n * 2);
+        memcpy(ref, a, n * 2);
+        pcm_apply_gain(out, n, gain);
+        ref_apply_gain(ref, n, gain);
+        check(!memcmp(out, ref, n * 2), "pcm_apply_gain", n);
+
+        pcm_gain_ramp(a, out, n, 1, gain, to);
+        ref_gain_ramp(a, ref, n, 1, gain, to);
+        check(!memcmp(out, ref, n * 2), "pcm_gain_ramp mono", n);
+        pcm_gain_ramp(a, out, n, 2, gain, to);
+        ref_gain_ramp(a, ref, n, 2, gain, to);
+        check(!memcmp(out, ref, n * 4), "pcm_gain_ramp stereo", n);
+
+        pcm_stereo_to_mono(a, out, n);
+        ref_stereo_to_mono(a, ref, n);
+        check(!memcmp(out, ref, n * 2), "pcm_stereo_to_mono", n);
+
+        /* in place, the mono data in the upper half */
+        memcpy(out + n, a, n * 2);
+        pcm_mono_to_stereo(out + n, out, n);
+        for (i = 0; i < n; i++) {
+            ref[2 * i] = ref[2 * i + 1] = a[i];
+        }
+        check(!memcmp(out, ref, n * 4), "pcm_mono_to_stereo", n);
+
+        pcm_deinterleave(a, left, right, n);
+        for (i = 0; i < n; i++) {
+            check(left[i] == a[2 * i] && right[i] == a[2 * i + 1], "pcm_deinterleave", n);
+        }
+        pcm_interleave(left, right, out, n);
+        check(!memcmp(out, a, n * 4), "pcm_interleave", n);
+
+        memcpy(out, a, n * 2);
+        memcpy(ref, a, n * 2);
+        pcm_mix_sat(out, b, n);
+        ref_mix_sat(ref, b, n);
+        check(!memcmp(out, ref, n * 2), "pcm_mix_sat", n);
+
+        /* taps kept small, as the resampler's are, so nothing overflows */
+        for (i = 0; i < even; i++) {
+            b[i] = random16() / 8;
+        }
+        check(pcm_dot_q15(a, b, even) == ref_dot_q15(a, b, even), "pcm_dot_q15", even);
+
+        memset(&meter, 0, sizeof(meter));
+        memset(&refMeter, 0, sizeof(refMeter));
+        pcm_meter_update(&meter, a, n);
+        ref_meter_update(&refMeter, a, n);
+        check(meter.peak == refMeter.peak && meter.sum_squares == refMeter.sum_squares &&
+              meter.samples == refMeter.samples, "pcm_meter_update", n);
+        check(fabsf(pcm_meter_peak_db(&meter) - 20.0f * log10f(meter.peak / 32768.0f)) < 0.01f ||
+              !meter.peak, "pcm_meter_peak_db", n);
+    }
+}
+
+/* ns per sample of kernel and of its reference, on BENCH_SAMPLES at a time */
+#define BENCH(name, kernel, reference) do {                                 \
+        double t0, t1, t2;                                                  \
+        int r;                                                              \
+        t0 = now();                                                         \
+        for (r = 0; r < BENCH_ROUNDS; r++) { kernel; }                      \
+        t1 = now();                                                         \
+        for (r = 0; r < BENCH_ROUNDS; r++) { reference; }                   \
+        t2 = now();                                                         \
+        printf("%-20s %6.2f ns per sample, reference %6.2f, %4.1fx\n", name, \
+               (t1 - t0) * 1e9 / BENCH_ROUNDS / BENCH_SAMPLES,              \
+               (t2 - t1) * 1e9 / BENCH_ROUNDS / BENCH_SAMPLES,              \
+               (t2 - t1) / (t1 - t0));                                      \
+    } while (0)
+
+static void bench(void)
+{
+    static int32_t aBuf[BENCH_SAMPLES], bBuf[BENCH_SAMPLES], outBuf[BENCH_SAMPLES];
+    int16_t* a = (int16_t*)aBuf;
+    int16_t* b = (int16_t*)bBuf;
+    int16_t* out = (int16_t*)outBuf;
+    struct pcm_meter meter;
+    volatile int32_t sink = 0;
+    size_t i;
+
+    for (i = 0; i < 2 * BENCH_SAMPLES; i++) {
+        a[i] = random16();
+        b[i] = random16() / 8;
+    }
+    memset(&meter, 0, sizeof(meter));
+
+    BENCH("pcm_apply_gain", pcm_apply_gain(out, BENCH_SAMPLES, 0x8000),
+          ref_apply_gain(out, BENCH_SAMPLES, 0x8000));
+    BENCH("pcm_gain_ramp", pcm_gain_ramp(a, out, BENCH_SAMPLES / 2, 2, 0, PCM_UNITY_GAIN),
+          ref_gain_ramp(a, out, BENCH_SAMPLES / 2, 2, 0, PCM_UNITY_GAIN));
+    BENCH("pcm_stereo_to_mono", pcm_stereo_to_mono(a, out, BENCH_SAMPLES / 2),
+          ref_stereo_to_mono(a, out, BENCH_SAMPLES / 2));
+    BENCH("pcm_mix_sat", pcm_mix_sat(out, a, BENCH_SAMPLES),
+          ref_mix_sat(out, a, BENCH_SAMPLES));
+    BENCH("pcm_dot_q15", sink += pcm_dot_q15(a, b, BENCH_SAMPLES),
+          sink += ref_dot_q15(a, b, BENCH_SAMPLES));
+    BENCH("pcm_meter_update", pcm_meter_update(&meter, a, BENCH_SAMPLES),
+          ref_meter_update(&meter, a, BENCH_SAMPLES));
+}
+
+int main(void)
+{
+    srand(1);
+    testKernels();
+    bench();
+    printf("%s\n", sFailures ? "FAILED" : "PASSED");
+    return sFailures ? 1 : 0;
+}
@@ -0,0 +1,161 @@
+/*
+** Copyright 2008, The Android Open-Source Project
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+// Runs a sine through PolyphaseResampler for every pair of input rates the
+// HAL offers, mono and stereo, in odd sized chunks. Checks the gain, the
+// SNR against a fitted sine and the number of frames out, and reports the
+// cost per output frame. Exits non zero if a check failed.
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "AudioResampler.h"
+
+using namespace android;
+
+#define TEST_SECONDS    1
+#define TEST_AMPLITUDE  16000
+#define TEST_MIN_SNR_DB 70.0
+#define TEST_MAX_GAIN_DB 0.1
+
+// AudioHardware::inputSamplingRates
+static const uint32_t kRates[] = {
+    8000, 11025, 12000, 16000, 22050, 24000, 32000, 44100, 48000
+};
+
+static int sFailures;
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Least squares fit of a sine at freq to channel c of out, over the middle
+// half so that the filter's warm up is left out. Returns the SNR in dB and
+// the fitted amplitude in *amplitude.
+static double fitSine(const int16_t* out, size_t frames, int channels, int c,
+                      double freq, uint32_t rate, double* amplitude)
+{
+    size_t k0 = frames / 4;
+    size_t k1 = frames - frames / 4;
+    double ss = 0, sc = 0, cc = 0, ys = 0, yc = 0;
+
+    for (size_t k = k0; k < k1; k++) {
+        double ph = 2 * M_PI * freq * k / rate;
+        double s = sin(ph), co = cos(ph), v = out[k * channels + c];
+        ss += s * s; cc += co * co; sc += s * co;
+        ys += v * s; yc += v * co;
+    }
+    double det = ss * cc - sc * sc;
+    double a = (ys * cc - yc * sc) / det;
+    double b = (yc * ss - ys * sc) / det;
+
+    double signal = 0, noise = 0;
+    for (size_t k = k0; k < k1; k++) {
+        double ph = 2 * M_PI * freq * k / rate;
+        double fit = a * sin(ph) + b * cos(ph);
+        double d = out[k * channels + c] - fit;
+        signal += fit * fit;
+        noise += d * d;
+    }
+    *amplitude = sqrt(a * a + b * b);
+    return noise > 0 ? 10 * log10(signal / noise) : 200;
+}
+
+static void testPair(uint32_t inRate, uint32_t outRate, int channels)
+{
+    PolyphaseResampler resampler;
+
+    if (resampler.init(inRate, outRate, channels) != NO_ERROR) {
+        printf("FAIL %5u -> %5u Hz, %d ch: init\n", inRate, outRate, channels);
+        sFailures++;
+        return;
+    }
+
+    // well inside the passband of the lower rate
+    double freq = 0.3 * (inRate < outRate ? inRate : outRate);
+    size_t inFrames = inRate * TEST_SECONDS;
+    size_t outMax = (size_t)((double)inFrames * outRate / inRate) + 16;
+    int16_t* in = new int16_t[inFrames * channels];
+    int16_t* out = new int16_t[outMax * channels];
+    for (size_t i = 0; i < inFrames; i++) {
+        for (int c = 0; c < channels; c++) {
+            in[i * channels + c] = (int16_t)(TEST_AMPLITUDE * sin(2 * M_PI * freq * i / inRate + c));
+        }
+    }
+
+    // odd chunk sizes on both sides, like a driver short read
+    size_t inPos = 0, outPos = 0;
+    double start = now();
+    for (;;) {
+        size_t inCount = inFrames - inPos;
+        size_t outCount = outMax - outPos;
+        if (inCount > 1021) inCount = 1021;
+        if (outCount > 777) outCount = 777;
+        resampler.resample(in + inPos * channels, &inCount, out + outPos * channels, &outCount);
+        if (!inCount && !outCount) break;
+        inPos += inCount;
+        outPos += outCount;
+    }
+    double nsPerFrame = (now() - start) * 1e9 / (outPos ? outPos : 1);
+
+    bool ok = (inPos == inFrames);
+    // the filter holds back up to a window of input
+    size_t expected = (size_t)((double)inFrames * outRate / inRate);
+    size_t held = (size_t)((double)resampler.taps() * outRate / inRate) + 1;
+    ok &= (outPos <= expected) && (outPos + held >= expected);
+
+    double worstSnr = 200, worstGain = 0;
+    for (int c = 0; c < channels; c++) {
+        double amplitude;
+        double snr = fitSine(out, outPos, channels, c, freq, outRate, &amplitude);
+        double gain = fabs(20 * log10(amplitude / TEST_AMPLITUDE));
+        if (snr < worstSnr) worstSnr = snr;
+        if (gain > worstGain) worstGain = gain;
+    }
+    ok &= (worstSnr >= TEST_MIN_SNR_DB) && (worstGain <= TEST_MAX_GAIN_DB);
+
+    printf("%s %5u -> %5u Hz, %d ch: %3u phases of %3u taps, %6zu/%6zu frames, "
+           "SNR %5.1f dB, gain error %.3f dB, %4.0f ns per frame\n",
+           ok ? "ok  " : "FAIL", inRate, outRate, channels, resampler.phases(), resampler.taps(),
+           outPos, expected, worstSnr, worstGain, nsPerFrame);
+    if (!ok) {
+        sFailures++;
+    }
+
+    delete [] in;
+    delete [] out;
+}
+
+int main()
+{
+    size_t numRates = sizeof(kRates) / sizeof(kRates[0]);
+
+    for (size_t i = 0; i < numRates; i++) {
+        for (size_t j = 0; j < numRates; j++) {
+            if (i == j) continue;
+            for (int channels = 1; channels <= 2; channels++) {
+                testPair(kRates[i], kRates[j], channels);
+            }
+        }
+    }
+    printf("%s\n", sFailures ? "FAILED" : "PASSED");
+    return sFailures ? 1 : 0;
+}